@@ -0,0 +1,757 @@
+#include "Bench.hh"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "Allocators.hpp"
+#include "StlAllocators.hh"
+#include "TaskManagerHelpers.hh"
+#include "VirtualMemoryArena.hh"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	using Utilities::TaskManager::JobContext;
+
+	constexpr const char* Suite = "Allocators";
+	constexpr int Repetitions = 5;
+	constexpr int LiveSlots = 4096;
+	constexpr int TraceOperations = 1'000'000;
+	constexpr size_t PoolSize = 64 * 1024 * 1024;
+	constexpr size_t FixedSize = 64;
+	constexpr int FrameAllocations = 1024; // ~250KB per frame, log-uniform sizes from 16B to 1KB
+	constexpr int Frames = 200;
+	constexpr int FrameVectors = 64; // std::vector<uint32_t> per frame, log-uniform lengths from 16 to 1K, no reserve
+	constexpr size_t FrameBytes = 512 * 1024;
+	constexpr int ParallelLiveSlots = 1024; // per job
+	constexpr int ParallelTraceOperations = 250'000; // per job
+	constexpr int ParallelFrameAllocations = 16 * 1024; // per job, one frame per repetition
+	constexpr int SceneBodies = 100'000;
+	constexpr int ContactsPerBody = 4;
+	constexpr int ScenePasses = 10;
+	constexpr size_t SceneArenaSize = 64 * 1024 * 1024;
+
+	// one step of a trace: frees the slot if it is in use, otherwise allocates "size" bytes in it
+	struct TraceOperation
+	{
+		int slot;
+		uint32_t size;
+	};
+
+	struct Trace
+	{
+		std::vector<TraceOperation> operations;
+		int numSlots;
+	};
+
+	// random slots with log-uniform sizes from 16B to 16KB, so small blocks keep getting stuck between big ones
+	// and the free space ends up split in lots of holes of every size. Half the slots are alive on average (~5MB).
+	Trace GenerateFragmentationTrace()
+	{
+		std::mt19937 rng(1234);
+		std::uniform_int_distribution<int> slotDistribution(0, LiveSlots - 1);
+		std::uniform_real_distribution<double> sizeLog2Distribution(4.0, 14.0);
+
+		Trace trace{ {}, LiveSlots };
+		trace.operations.reserve(TraceOperations);
+		for (int i = 0; i < TraceOperations; ++i)
+			trace.operations.push_back({ slotDistribution(rng), (uint32_t)std::exp2(sizeLog2Distribution(rng)) });
+		return trace;
+	}
+
+	// the same access pattern with objects of FixedSize bytes, what a pool of game objects / contacts sees
+	Trace GenerateFixedTrace(int numSlots, int numOperations, unsigned seed)
+	{
+		std::mt19937 rng(seed);
+		std::uniform_int_distribution<int> slotDistribution(0, numSlots - 1);
+
+		Trace trace{ {}, numSlots };
+		trace.operations.reserve(numOperations);
+		for (int i = 0; i < numOperations; ++i)
+			trace.operations.push_back({ slotDistribution(rng), (uint32_t)FixedSize });
+		return trace;
+	}
+
+	// recorded traces are text files with a "slot size" pair per line, same meaning as TraceOperation
+	// (the first time a slot shows up it is allocated, the next one freed, and so on)
+	bool LoadRecordedTrace(const char* path, Trace& trace)
+	{
+		FILE* file = nullptr;
+		if (fopen_s(&file, path, "r") != 0 || file == nullptr)
+			return false;
+
+		trace.operations.clear();
+		trace.numSlots = 0;
+		int slot;
+		unsigned size;
+		while (fscanf_s(file, "%d %u", &slot, &size) == 2)
+		{
+			if (slot < 0 || size == 0)
+				continue;
+			trace.operations.push_back({ slot, (uint32_t)size });
+			if (slot >= trace.numSlots)
+				trace.numSlots = slot + 1;
+		}
+		fclose(file);
+		return !trace.operations.empty();
+	}
+
+	std::vector<uint32_t> GenerateFrameSizes(int numAllocations, unsigned seed)
+	{
+		std::mt19937 rng(seed);
+		std::uniform_real_distribution<double> sizeLog2Distribution(4.0, 10.0);
+
+		std::vector<uint32_t> sizes;
+		sizes.reserve(numAllocations);
+		for (int i = 0; i < numAllocations; ++i)
+			sizes.push_back((uint32_t)std::exp2(sizeLog2Distribution(rng)));
+		return sizes;
+	}
+
+	// untimed replay for the memory numbers: how far into its buffer the allocator had to go ("base" = start of the buffer,
+	// nullptr for malloc) against the most bytes alive at once. 1 - live / span is the part of it lost to holes and headers.
+	template<typename AllocFunc, typename FreeFunc>
+	double MeasureFragmentation(const Trace& trace, const void* base, const AllocFunc& allocFunc, const FreeFunc& freeFunc)
+	{
+		std::vector<void*> slots(trace.numSlots, nullptr);
+		std::vector<uint32_t> sizes(trace.numSlots, 0);
+		size_t liveBytes = 0, peakLiveBytes = 0;
+		uintptr_t peakEnd = reinterpret_cast<uintptr_t>(base);
+
+		for (const TraceOperation& operation : trace.operations)
+		{
+			void*& ptr = slots[operation.slot];
+			if (ptr != nullptr)
+			{
+				freeFunc(ptr);
+				ptr = nullptr;
+				liveBytes -= sizes[operation.slot];
+			}
+			else
+			{
+				ptr = allocFunc(operation.size);
+				assert(ptr != nullptr);
+				*reinterpret_cast<uint8_t*>(ptr) = 1;
+				sizes[operation.slot] = operation.size;
+				liveBytes += operation.size;
+				peakLiveBytes = liveBytes > peakLiveBytes ? liveBytes : peakLiveBytes;
+
+				uintptr_t end = reinterpret_cast<uintptr_t>(ptr) + operation.size;
+				peakEnd = end > peakEnd ? end : peakEnd;
+			}
+		}
+		for (void* ptr : slots)
+		{
+			if (ptr != nullptr)
+				freeFunc(ptr);
+		}
+
+		if (base == nullptr || peakEnd <= reinterpret_cast<uintptr_t>(base))
+			return -1.0;
+		return 1.0 - (double)peakLiveBytes / (double)(peakEnd - reinterpret_cast<uintptr_t>(base));
+	}
+
+	// replays the trace. Whatever is left alive is freed before the next repetition (not timed),
+	// which leaves the pools as a single free block again.
+	// "residentBefore" is the resident size before the allocator was created, to report how much it made the process grow.
+	// "peakUsedFunc" gives the allocator's own peak of bytes handed out (-1 if it doesn't keep one), read after the fragmentation replay.
+	template<typename AllocFunc, typename FreeFunc, typename PeakUsedFunc>
+	void MeasureTrace(const std::string& name, const Trace& trace, const void* base, int64_t residentBefore, const AllocFunc& allocFunc, const FreeFunc& freeFunc, const PeakUsedFunc& peakUsedFunc)
+	{
+		std::vector<void*> slots(trace.numSlots, nullptr);
+		auto freeAll = [&]
+		{
+			for (void*& ptr : slots)
+			{
+				if (ptr != nullptr)
+					freeFunc(ptr);
+				ptr = nullptr;
+			}
+		};
+
+		auto step = [&](const TraceOperation& operation)
+		{
+			void*& ptr = slots[operation.slot];
+			if (ptr != nullptr)
+			{
+				freeFunc(ptr);
+				ptr = nullptr;
+			}
+			else
+			{
+				ptr = allocFunc(operation.size);
+				assert(ptr != nullptr);
+				*reinterpret_cast<uint8_t*>(ptr) = 1;
+			}
+		};
+
+		const std::vector<TraceOperation>& operations = trace.operations;
+		Bench::LatencyRecorder latency(1, operations.size() / Bench::LatencyRecorder::SampleEvery + 1);
+		Bench::Result result{ Suite, name, 1, (int64_t)operations.size() };
+		result.fragmentation = MeasureFragmentation(trace, base, allocFunc, freeFunc);
+		result.peakUsedBytes = peakUsedFunc();
+		if (residentBefore >= 0)
+			result.residentBytes = Bench::GetResidentBytes() - residentBefore;
+
+		Bench::Measure(result, Repetitions, freeAll, [&]
+		{
+			for (size_t i = 0; i < operations.size(); ++i)
+			{
+				if (i % Bench::LatencyRecorder::SampleEvery == 0)
+				{
+					auto begin = Bench::Clock::now();
+					step(operations[i]);
+					latency.Record(0, begin, Bench::Clock::now());
+				}
+				else
+				{
+					step(operations[i]);
+				}
+			}
+		}, &latency);
+
+		freeAll();
+	}
+
+	template<typename AllocFunc, typename FreeFunc>
+	void MeasureTrace(const std::string& name, const Trace& trace, const void* base, int64_t residentBefore, const AllocFunc& allocFunc, const FreeFunc& freeFunc)
+	{
+		MeasureTrace(name, trace, base, residentBefore, allocFunc, freeFunc, [] { return int64_t(-1); });
+	}
+
+	void MeasureMalloc(const std::string& name, const Trace& trace)
+	{
+		MeasureTrace(name, trace, nullptr, Bench::GetResidentBytes(), [](size_t size) { return ::malloc(size); }, [](void* ptr) { ::free(ptr); });
+	}
+
+	template<typename Pool>
+	void MeasurePool(const std::string& name, const Trace& trace)
+	{
+		int64_t residentBefore = Bench::GetResidentBytes();
+		std::unique_ptr<Pool> pool(new Pool());
+		MeasureTrace(name, trace, pool->buffer, residentBefore, [&](size_t size) { return pool->alloc(size); }, [&](void* ptr) { pool->free(ptr); },
+			[&] { return (int64_t)pool->GetPeakUsedMemory(); });
+	}
+
+	// the size of the objects in the trace is ignored, all of them are FixedSize
+	void MeasureFixedAllocators(const std::string& traceName, const Trace& trace)
+	{
+		{
+			using Allocator = Utilities::FixedAllocator<FixedSize, 16, LiveSlots>;
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::unique_ptr<Allocator> allocator(new Allocator());
+			MeasureTrace("FixedAllocator " + traceName, trace, allocator->data, residentBefore,
+				[&](size_t) { return allocator->alloc(); }, [&](void* ptr) { allocator->free(ptr); });
+		}
+		{
+			// a bit more than LiveSlots, the free objects sitting in the magazines can't be reached by the other thread ids
+			using Allocator = Utilities::ThreadCachingFixedAllocator<FixedSize, 16, LiveSlots + 64, 1>;
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::unique_ptr<Allocator> allocator(new Allocator());
+			MeasureTrace("ThreadCachingFixedAllocator " + traceName, trace, allocator->data, residentBefore,
+				[&](size_t) { return allocator->alloc(0); }, [&](void* ptr) { allocator->free(0, ptr); });
+		}
+	}
+
+	// linear allocators: Frames frames of FrameAllocations allocations, "resetFunc" throws away everything at the end of each one.
+	// The first run is untimed, it touches the memory for the resident size.
+	template<typename AllocFunc, typename ResetFunc>
+	void MeasureFrames(const char* name, const std::vector<uint32_t>& sizes, int64_t residentBefore, const AllocFunc& allocFunc, const ResetFunc& resetFunc)
+	{
+		Bench::LatencyRecorder latency(1, sizes.size() * Frames / Bench::LatencyRecorder::SampleEvery + 1);
+		Bench::Result result{ Suite, name, 1, (int64_t)sizes.size() * Frames };
+
+		auto run = [&]
+		{
+			for (int frame = 0; frame < Frames; ++frame)
+			{
+				for (size_t i = 0; i < sizes.size(); ++i)
+				{
+					uint8_t* ptr;
+					if (i % Bench::LatencyRecorder::SampleEvery == 0)
+					{
+						auto begin = Bench::Clock::now();
+						ptr = reinterpret_cast<uint8_t*>(allocFunc(sizes[i]));
+						latency.Record(0, begin, Bench::Clock::now());
+					}
+					else
+					{
+						ptr = reinterpret_cast<uint8_t*>(allocFunc(sizes[i]));
+					}
+					assert(ptr != nullptr);
+					*ptr = 1;
+				}
+				resetFunc();
+			}
+		};
+
+		run();
+		if (residentBefore >= 0)
+			result.residentBytes = Bench::GetResidentBytes() - residentBefore;
+		Bench::Measure(result, Repetitions, [] {}, run, &latency);
+	}
+
+	void MeasureFrameAllocators()
+	{
+		const std::vector<uint32_t> sizes = GenerateFrameSizes(FrameAllocations, 4321);
+
+		{
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::vector<void*> allocations;
+			allocations.reserve(sizes.size());
+			MeasureFrames("malloc frame", sizes, residentBefore, [&](size_t size) { allocations.push_back(::malloc(size)); return allocations.back(); }, [&]
+			{
+				for (void* ptr : allocations)
+					::free(ptr);
+				allocations.clear();
+			});
+		}
+		{
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::unique_ptr<Utilities::TLSFMemoryPool<PoolSize>> pool(new Utilities::TLSFMemoryPool<PoolSize>());
+			std::vector<void*> allocations;
+			allocations.reserve(sizes.size());
+			MeasureFrames("TLSFMemoryPool frame", sizes, residentBefore, [&](size_t size) { allocations.push_back(pool->alloc(size)); return allocations.back(); }, [&]
+			{
+				for (void* ptr : allocations)
+					pool->free(ptr);
+				allocations.clear();
+			});
+		}
+		{
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::unique_ptr<uint8_t[]> buffer(new uint8_t[FrameBytes]);
+			Utilities::StackAllocator allocator(buffer.get(), FrameBytes);
+			allocator.Push();
+			MeasureFrames("StackAllocator frame", sizes, residentBefore, [&](size_t size) { return allocator.alloc<uint8_t>(size).ptr; }, [&] { allocator.Pop(); allocator.Push(); });
+		}
+		{
+			// really on the stack, this thread has the default 1MB one
+			int64_t residentBefore = Bench::GetResidentBytes();
+			Utilities::OnStackAllocator<FrameBytes> allocator;
+			allocator.Push();
+			MeasureFrames("OnStackAllocator frame", sizes, residentBefore, [&](size_t size) { return allocator.alloc<uint8_t>(size).ptr; }, [&] { allocator.Pop(); allocator.Push(); });
+		}
+		{
+			// never frees, rewinding it by hand is the only way to run more than one frame
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::unique_ptr<uint8_t[]> buffer(new uint8_t[FrameBytes]);
+			Utilities::PermanentMemoryPool pool{ FrameBytes, 0, buffer.get() };
+			MeasureFrames("PermanentMemoryPool frame", sizes, residentBefore, [&](size_t size) { return pool.alloc(size); }, [&] { pool.currentOffset = 0; });
+		}
+		{
+			// each of the two buffers holds a frame plus the chunk left half used
+			const size_t arenaSize = 2 * (FrameBytes + 64 * 1024);
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::unique_ptr<uint8_t[]> buffer(new uint8_t[arenaSize]);
+			std::unique_ptr<Utilities::DefaultFrameArena> arena(new Utilities::DefaultFrameArena(buffer.get(), arenaSize));
+			MeasureFrames("FrameArena frame", sizes, residentBefore, [&](size_t size) { return arena->alloc<uint8_t>(0, size).ptr; }, [&] { arena->NextFrame(); });
+		}
+		{
+			int64_t residentBefore = Bench::GetResidentBytes();
+			Utilities::VirtualMemoryArena memory(PoolSize, Utilities::DefaultAllocator::GetBlockSize(), Utilities::VirtualMemoryArena::HugePages::None);
+			std::unique_ptr<Utilities::DefaultAllocator> allocator(new Utilities::DefaultAllocator(memory.GetBase(), memory.GetSize(), &memory));
+			Utilities::DefaultAllocatorLabel label = allocator->GetUnusedLabel("Frame");
+			MeasureFrames("DefaultAllocator label frame", sizes, residentBefore, [&](size_t size) { return allocator->alloc<uint8_t>(label, 0, size).ptr; }, [&] { allocator->Free(label); });
+		}
+	}
+
+	// std::vector filled with push_back and thrown away with the frame, like the scratch lists of a job.
+	// "makeVector" returns an empty vector over the allocator being measured, "resetFunc" throws away the frame.
+	// Every growth is an allocation, with StlAllocator the old buffers stay in the source until the reset.
+	template<typename MakeVector, typename ResetFunc>
+	void MeasureFrameVectors(const char* name, const std::vector<uint32_t>& lengths, int64_t residentBefore, const MakeVector& makeVector, const ResetFunc& resetFunc)
+	{
+		int64_t elements = 0;
+		for (uint32_t length : lengths)
+			elements += length;
+		Bench::Result result{ Suite, name, 1, elements * Frames };
+
+		auto run = [&]
+		{
+			for (int frame = 0; frame < Frames; ++frame)
+			{
+				for (uint32_t length : lengths)
+				{
+					auto vector = makeVector();
+					for (uint32_t i = 0; i < length; ++i)
+						vector.push_back(i);
+					Bench::Consume(vector.back());
+				}
+				resetFunc();
+			}
+		};
+
+		run();
+		if (residentBefore >= 0)
+			result.residentBytes = Bench::GetResidentBytes() - residentBefore;
+		Bench::Measure(result, Repetitions, [] {}, run);
+	}
+
+	void MeasureFrameContainers()
+	{
+		const std::vector<uint32_t> lengths = GenerateFrameSizes(FrameVectors, 2468);
+		// all the buffers of a 1K element vector take less than 16KB, whatever the growth factor. Each of the two
+		// buffers of the arena holds a frame of them plus the chunk left half used
+		const size_t arenaSize = 2 * (FrameVectors * 16 * 1024 + 64 * 1024);
+
+		{
+			int64_t residentBefore = Bench::GetResidentBytes();
+			MeasureFrameVectors("std::vector frame", lengths, residentBefore, [] { return std::vector<uint32_t>(); }, [] {});
+		}
+		{
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::unique_ptr<uint8_t[]> buffer(new uint8_t[arenaSize]);
+			std::unique_ptr<Utilities::DefaultFrameArena> arena(new Utilities::DefaultFrameArena(buffer.get(), arenaSize));
+			MeasureFrameVectors("FrameVector frame", lengths, residentBefore,
+				[&] { return Utilities::FrameVector<uint32_t>(Utilities::MakeStlAllocator<uint32_t>(arena->GetThreadAllocator(0))); }, [&] { arena->NextFrame(); });
+		}
+		{
+			int64_t residentBefore = Bench::GetResidentBytes();
+			Utilities::VirtualMemoryArena memory(PoolSize, Utilities::DefaultAllocator::GetBlockSize(), Utilities::VirtualMemoryArena::HugePages::None);
+			std::unique_ptr<Utilities::DefaultAllocator> allocator(new Utilities::DefaultAllocator(memory.GetBase(), memory.GetSize(), &memory));
+			Utilities::DefaultAllocatorLabel label = allocator->GetUnusedLabel("Frame");
+			MeasureFrameVectors("LabelVector frame", lengths, residentBefore,
+				[&] { return Utilities::LabelVector<uint32_t>(Utilities::MakeStlAllocator<uint32_t>(allocator->GetThreadAllocator(label, 0))); }, [&] { allocator->Free(label); });
+		}
+#if defined(UTILITIES_HAS_MEMORY_RESOURCE)
+		{
+			// the same arena behind the virtual calls of std::pmr
+			int64_t residentBefore = Bench::GetResidentBytes();
+			std::unique_ptr<uint8_t[]> buffer(new uint8_t[arenaSize]);
+			std::unique_ptr<Utilities::DefaultFrameArena> arena(new Utilities::DefaultFrameArena(buffer.get(), arenaSize));
+			Utilities::FrameMemoryResource resource(arena->GetThreadAllocator(0));
+			MeasureFrameVectors("FrameMemoryResource frame", lengths, residentBefore,
+				[&] { return std::pmr::vector<uint32_t>(&resource); }, [&] { arena->NextFrame(); });
+		}
+#endif
+	}
+
+	// every job replays its own trace at the same time, with the index of the thread it runs on for the allocators that want one
+	template<typename AllocFunc, typename FreeFunc>
+	void MeasureParallelTrace(const JobContext& context, const char* name, const std::vector<Trace>& traces, const AllocFunc& allocFunc, const FreeFunc& freeFunc)
+	{
+		const int numJobs = (int)traces.size();
+		std::vector<std::vector<void*>> slots(numJobs, std::vector<void*>(ParallelLiveSlots, nullptr));
+		Bench::LatencyRecorder latency(numJobs, ParallelTraceOperations / Bench::LatencyRecorder::SampleEvery + 1);
+		Bench::Result result{ Suite, name, numJobs, (int64_t)numJobs * ParallelTraceOperations };
+
+		auto runJobs = [&](bool freeAll)
+		{
+			auto job = Utilities::TaskManager::CreateLambdaJob([&](int jobIndex, const JobContext& jobContext)
+			{
+				const int threadId = jobContext.threadIndex;
+				std::vector<void*>& jobSlots = slots[jobIndex];
+				if (freeAll)
+				{
+					for (void*& ptr : jobSlots)
+					{
+						if (ptr != nullptr)
+							freeFunc(threadId, ptr);
+						ptr = nullptr;
+					}
+					return;
+				}
+
+				const std::vector<TraceOperation>& operations = traces[jobIndex].operations;
+				for (size_t i = 0; i < operations.size(); ++i)
+				{
+					const bool sample = i % Bench::LatencyRecorder::SampleEvery == 0;
+					auto begin = sample ? Bench::Clock::now() : Bench::Clock::time_point();
+
+					void*& ptr = jobSlots[operations[i].slot];
+					if (ptr != nullptr)
+					{
+						freeFunc(threadId, ptr);
+						ptr = nullptr;
+					}
+					else
+					{
+						ptr = allocFunc(threadId, operations[i].size);
+						assert(ptr != nullptr);
+						*reinterpret_cast<uint8_t*>(ptr) = 1;
+					}
+
+					if (sample)
+						latency.Record(jobIndex, begin, Bench::Clock::now());
+				}
+			}, "Allocators", (short)numJobs);
+			context.DoAndWait(&job);
+		};
+
+		Bench::Measure(result, Repetitions, [&] { runJobs(true); }, [&] { runJobs(false); }, &latency);
+		runJobs(true);
+	}
+
+	// one frame per repetition: every job makes ParallelFrameAllocations allocations, "resetFunc" (untimed) throws them away
+	template<typename AllocFunc, typename ResetFunc>
+	void MeasureParallelFrame(const JobContext& context, const char* name, int numJobs, const std::vector<uint32_t>& sizes, const AllocFunc& allocFunc, const ResetFunc& resetFunc)
+	{
+		Bench::LatencyRecorder latency(numJobs, sizes.size() / Bench::LatencyRecorder::SampleEvery + 1);
+		Bench::Result result{ Suite, name, numJobs, (int64_t)numJobs * (int64_t)sizes.size() };
+
+		Bench::Measure(result, Repetitions, resetFunc, [&]
+		{
+			auto job = Utilities::TaskManager::CreateLambdaJob([&](int jobIndex, const JobContext& jobContext)
+			{
+				const int threadId = jobContext.threadIndex;
+				for (size_t i = 0; i < sizes.size(); ++i)
+				{
+					uint8_t* ptr;
+					if (i % Bench::LatencyRecorder::SampleEvery == 0)
+					{
+						auto begin = Bench::Clock::now();
+						ptr = reinterpret_cast<uint8_t*>(allocFunc(jobIndex, threadId, sizes[i]));
+						latency.Record(jobIndex, begin, Bench::Clock::now());
+					}
+					else
+					{
+						ptr = reinterpret_cast<uint8_t*>(allocFunc(jobIndex, threadId, sizes[i]));
+					}
+					assert(ptr != nullptr);
+					*ptr = 1;
+				}
+			}, "Allocators", (short)numJobs);
+			context.DoAndWait(&job);
+		}, &latency);
+		resetFunc();
+	}
+
+	// the thread safe allocators, one job per worker thread
+	void MeasureParallelAllocators(const JobContext& context, int numThreads)
+	{
+		using Utilities::Profiler;
+		const int numJobs = numThreads;
+
+		std::vector<Trace> traces;
+		for (int i = 0; i < numJobs; ++i)
+			traces.push_back(GenerateFixedTrace(ParallelLiveSlots, ParallelTraceOperations, 100 + i));
+
+		MeasureParallelTrace(context, "malloc fixed", traces, [](int, size_t size) { return ::malloc(size); }, [](int, void* ptr) { ::free(ptr); });
+		{
+			using Allocator = Utilities::ThreadCachingFixedAllocator<FixedSize, 16, Profiler::MaxNumThreads * (ParallelLiveSlots + 64), Profiler::MaxNumThreads>;
+			std::unique_ptr<Allocator> allocator(new Allocator());
+			MeasureParallelTrace(context, "ThreadCachingFixedAllocator fixed", traces,
+				[&](int threadId, size_t) { return allocator->alloc(threadId); }, [&](int threadId, void* ptr) { allocator->free(threadId, ptr); });
+		}
+
+		const std::vector<uint32_t> sizes = GenerateFrameSizes(ParallelFrameAllocations, 8765);
+		{
+			std::vector<std::vector<void*>> allocations(numJobs);
+			for (auto& jobAllocations : allocations)
+				jobAllocations.reserve(sizes.size());
+			MeasureParallelFrame(context, "malloc frame", numJobs, sizes, [&](int jobIndex, int, size_t size) { allocations[jobIndex].push_back(::malloc(size)); return allocations[jobIndex].back(); }, [&]
+			{
+				for (auto& jobAllocations : allocations)
+				{
+					for (void* ptr : jobAllocations)
+						::free(ptr);
+					jobAllocations.clear();
+				}
+			});
+		}
+		{
+			// a frame is ~4MB per job, plus the chunks left half used
+			const size_t arenaSize = 2 * (size_t)numJobs * 5 * 1024 * 1024;
+			std::unique_ptr<uint8_t[]> buffer(new uint8_t[arenaSize]);
+			std::unique_ptr<Utilities::DefaultFrameArena> arena(new Utilities::DefaultFrameArena(buffer.get(), arenaSize));
+			MeasureParallelFrame(context, "FrameArena frame", numJobs, sizes, [&](int, int threadId, size_t size) { return arena->alloc<uint8_t>(threadId, size).ptr; }, [&] { arena->NextFrame(); });
+		}
+		{
+			Utilities::VirtualMemoryArena memory(4 * PoolSize, Utilities::DefaultAllocator::GetBlockSize(), Utilities::VirtualMemoryArena::HugePages::None);
+			std::unique_ptr<Utilities::DefaultAllocator> allocator(new Utilities::DefaultAllocator(memory.GetBase(), memory.GetSize(), &memory));
+			Utilities::DefaultAllocatorLabel label = allocator->GetUnusedLabel("Frame");
+			MeasureParallelFrame(context, "DefaultAllocator label frame", numJobs, sizes, [&](int, int threadId, size_t size) { return allocator->alloc<uint8_t>(label, threadId, size).ptr; }, [&] { allocator->Free(label); });
+		}
+	}
+
+	// dTLB load misses of the calling thread, user space only. Not available outside Linux
+	// or when perf_event_paranoid doesn't allow it, then Count returns -1.
+	class DtlbMissCounter
+	{
+	public:
+		DtlbMissCounter()
+		{
+#if defined(__linux__)
+			perf_event_attr attributes = {};
+			attributes.size = sizeof(attributes);
+			attributes.type = PERF_TYPE_HW_CACHE;
+			attributes.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			attributes.disabled = 1;
+			attributes.exclude_kernel = 1;
+			attributes.exclude_hv = 1;
+			fd = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#endif
+		}
+
+		~DtlbMissCounter()
+		{
+#if defined(__linux__)
+			if (fd >= 0)
+				close(fd);
+#endif
+		}
+
+		template<typename Body>
+		int64_t Count(const Body& body)
+		{
+#if defined(__linux__)
+			if (fd >= 0)
+			{
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+				body();
+				ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+				int64_t misses;
+				if (read(fd, &misses, sizeof(misses)) == sizeof(misses))
+					return misses;
+			}
+#endif
+			return -1;
+		}
+
+	private:
+		int fd = -1;
+	};
+
+	// what a physics step reads of a body: the hot state and, next to it, collision data the contact pass never looks at.
+	// 256 bytes per body, so the 100k bodies are spread over ~25MB (6250 4KB pages, 13 2MB ones).
+	struct SceneBody
+	{
+		float position[2];
+		float velocity[2];
+		float inverseMass;
+		float restitution;
+		float padding[2];
+		uint8_t shape[224];
+	};
+	static_assert(sizeof(SceneBody) == 256, "a body is 4 cache lines");
+
+	struct SceneContact
+	{
+		int a, b;
+	};
+
+	// a 100k body scene allocated from a DefaultAllocator over a VirtualMemoryArena, so it gets the arena's page size.
+	// Each pass resolves contacts between random pairs (what the broadphase gives, no locality at all) and integrates.
+	void MeasureScene(Utilities::VirtualMemoryArena::HugePages hugePages)
+	{
+		using Utilities::VirtualMemoryArena;
+
+		VirtualMemoryArena arena(SceneArenaSize, Utilities::DefaultAllocator::GetBlockSize(), hugePages);
+		if (arena.GetHugePages() != hugePages)
+		{
+			return; // not available here, the mode it fell back to is measured on its own
+		}
+		std::unique_ptr<Utilities::DefaultAllocator> allocator(new Utilities::DefaultAllocator(arena.GetBase(), arena.GetSize(), &arena));
+
+		Utilities::DefaultAllocatorLabel label = allocator->GetUnusedLabel("Scene");
+		SceneBody* bodies = allocator->alloc<SceneBody>(label, 0, SceneBodies).ptr;
+		SceneContact* contacts = allocator->alloc<SceneContact>(label, 0, SceneBodies * ContactsPerBody).ptr;
+
+		std::mt19937 rng(1234);
+		std::uniform_int_distribution<int> bodyDistribution(0, SceneBodies - 1);
+		std::uniform_real_distribution<float> positionDistribution(-1000.0f, 1000.0f);
+		for (int i = 0; i < SceneBodies; ++i)
+		{
+			bodies[i] = {};
+			bodies[i].position[0] = positionDistribution(rng);
+			bodies[i].position[1] = positionDistribution(rng);
+			bodies[i].inverseMass = 1.0f;
+			bodies[i].restitution = 0.9f;
+		}
+		for (int i = 0; i < SceneBodies * ContactsPerBody; ++i)
+		{
+			contacts[i] = { bodyDistribution(rng), bodyDistribution(rng) };
+		}
+
+		auto step = [&]
+		{
+			for (int pass = 0; pass < ScenePasses; ++pass)
+			{
+				for (int i = 0; i < SceneBodies * ContactsPerBody; ++i)
+				{
+					SceneBody& a = bodies[contacts[i].a];
+					SceneBody& b = bodies[contacts[i].b];
+					float impulse[2] = { (b.position[0] - a.position[0]) * 1e-6f, (b.position[1] - a.position[1]) * 1e-6f };
+					a.velocity[0] += impulse[0] * a.inverseMass;
+					a.velocity[1] += impulse[1] * a.inverseMass;
+					b.velocity[0] -= impulse[0] * b.inverseMass;
+					b.velocity[1] -= impulse[1] * b.inverseMass;
+				}
+				for (int i = 0; i < SceneBodies; ++i)
+				{
+					bodies[i].position[0] += bodies[i].velocity[0] * (1.0f / 60.0f);
+					bodies[i].position[1] += bodies[i].velocity[1] * (1.0f / 60.0f);
+				}
+			}
+		};
+
+		std::string name = "Scene100k hugepages=";
+		name += VirtualMemoryArena::GetHugePagesName(arena.GetHugePages());
+		Bench::Result result{ Suite, name, 1, (int64_t)SceneBodies * ContactsPerBody * ScenePasses };
+
+		DtlbMissCounter dtlbMisses;
+		result.dtlbMisses = dtlbMisses.Count(step);
+
+		Bench::Measure(result, Repetitions, [] {}, step);
+		Bench::Consume(bodies[0].position[0]);
+
+		allocator->Free(label);
+	}
+}
+
+// Every allocator in Allocators.hpp against malloc, single thread:
+//  - alloc/free traces: variable sizes (fragmentation), fixed size objects and a recorded trace if BENCH_ALLOCATOR_TRACE has its path
+//  - frames of linear allocations thrown away at once, and of std::vectors over them (StlAllocators.hh)
+//  - the same 100k body scene over arenas with and without huge pages, to see what the TLB misses cost
+// Besides throughput and latency the results have the resident size the allocator added and, for the ones with a buffer, the fragmentation.
+// Then the thread safe ones from one job per worker thread.
+// The single thread part runs on its own thread: MemoryPool::free searches the previous free node recursively, too deep for a fiber stack.
+void Bench::RunAllocators(const Utilities::TaskManager::JobContext& context, int numThreads)
+{
+	std::thread thread([]
+	{
+		Trace trace = GenerateFragmentationTrace();
+		MeasureMalloc("malloc", trace);
+		MeasurePool<Utilities::MemoryPool<PoolSize>>("MemoryPool", trace);
+		MeasurePool<Utilities::TLSFMemoryPool<PoolSize>>("TLSFMemoryPool", trace);
+
+		Trace fixedTrace = GenerateFixedTrace(LiveSlots, TraceOperations, 1234);
+		MeasureMalloc("malloc fixed", fixedTrace);
+		MeasurePool<Utilities::MemoryPool<PoolSize>>("MemoryPool fixed", fixedTrace);
+		MeasurePool<Utilities::TLSFMemoryPool<PoolSize>>("TLSFMemoryPool fixed", fixedTrace);
+		MeasureFixedAllocators("fixed", fixedTrace);
+
+		const char* recordedTracePath = getenv("BENCH_ALLOCATOR_TRACE");
+		Trace recordedTrace;
+		if (recordedTracePath != nullptr && LoadRecordedTrace(recordedTracePath, recordedTrace))
+		{
+			MeasureMalloc("malloc recorded", recordedTrace);
+			MeasurePool<Utilities::MemoryPool<PoolSize>>("MemoryPool recorded", recordedTrace);
+			MeasurePool<Utilities::TLSFMemoryPool<PoolSize>>("TLSFMemoryPool recorded", recordedTrace);
+		}
+
+		MeasureFrameAllocators();
+		MeasureFrameContainers();
+
+		MeasureScene(Utilities::VirtualMemoryArena::HugePages::None);
+		MeasureScene(Utilities::VirtualMemoryArena::HugePages::Transparent);
+		MeasureScene(Utilities::VirtualMemoryArena::HugePages::Explicit);
+	});
+	thread.join();
+
+	MeasureParallelAllocators(context, numThreads);
+}
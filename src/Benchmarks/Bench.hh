@@ -0,0 +1,165 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "TaskManager.hh"
+
+namespace Bench
+{
+	// same fiber backend as the game's Win32::WinJobScheduler, without the window/GL dependencies
+	class BenchJobScheduler : public Utilities::TaskManager::JobScheduler
+	{
+	public:
+		virtual ~BenchJobScheduler() = default;
+
+		void SwitchToFiber(void* fiber) override
+		{
+			::SwitchToFiber(fiber);
+		}
+
+		void* CreateFiber(size_t stackSize, void(__stdcall*call) (void*), void* parameter) override
+		{
+			return ::CreateFiber(stackSize, call, parameter);
+		}
+
+		void* GetFiberData() const override
+		{
+			return ::GetFiberData();
+		}
+	};
+
+	// latency percentiles, in nanoseconds
+	struct Latency
+	{
+		double p50, p90, p99, p999, max;
+	};
+
+	struct Result
+	{
+		const char* suite;
+		std::string name;
+		int threads;
+		int64_t elements; // operations done per repetition. ops/sec = elements / median time
+
+		// optional description of the workload. 0 = not applicable
+		int producers = 0, consumers = 0;
+		int payloadBytes = 0;
+
+		// hardware counters read by the suite on an extra, untimed repetition. -1 = not measured / not available
+		int64_t dtlbMisses = -1;
+
+		// memory, also from an untimed run: how much the process grew and the part of the allocator's used range lost to holes and headers (0..1)
+		int64_t residentBytes = -1;
+		double fragmentation = -1;
+		// allocators that count it themselves: the most bytes they had handed out at once, headers and rounding included
+		int64_t peakUsedBytes = -1;
+
+		// filled by Measure
+		double minMs = 0, medianMs = 0, maxMs = 0;
+		bool hasLatency = false;
+		Latency latency = {};
+	};
+
+	// writes one result as a JSON line to stdout and to the results file (if any)
+	void Report(const Result& result);
+
+	// resident set (working set) of the process, in bytes
+	int64_t GetResidentBytes();
+
+	// keeps the optimizer from throwing away the work being measured
+	template<typename T>
+	inline void Consume(const T& value)
+	{
+		static volatile uint8_t sink;
+		sink = *reinterpret_cast<const volatile uint8_t*>(&value);
+	}
+
+	using Clock = std::chrono::high_resolution_clock;
+
+	// per thread latency samples. Each thread only writes its own vector, so recording doesn't need synchronization.
+	// Timing every operation would measure the clock instead of the operation, so callers sample 1 of every "SampleEvery".
+	class LatencyRecorder
+	{
+	public:
+		static constexpr int SampleEvery = 16;
+
+		LatencyRecorder(int numThreads, size_t samplesPerThread)
+			: samples(numThreads)
+		{
+			for (auto& threadSamples : samples)
+				threadSamples.reserve(samplesPerThread);
+		}
+
+		void Record(int thread, Clock::time_point begin, Clock::time_point end)
+		{
+			samples[thread].push_back((float)std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - begin).count());
+		}
+
+		void Clear()
+		{
+			for (auto& threadSamples : samples)
+				threadSamples.clear();
+		}
+
+		Latency Compute() const
+		{
+			std::vector<float> all;
+			for (auto& threadSamples : samples)
+				all.insert(all.end(), threadSamples.begin(), threadSamples.end());
+			if (all.empty())
+				return Latency{};
+
+			std::sort(all.begin(), all.end());
+			auto percentile = [&all](double p) { return (double)all[std::min(all.size() - 1, (size_t)(p * all.size()))]; };
+			return Latency{ percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), (double)all.back() };
+		}
+
+	private:
+		std::vector<std::vector<float>> samples;
+	};
+
+	// runs "setup" + "body" "repetitions" times, timing only "body", and reports min/median/max.
+	// If "latency" is given its samples are cleared before each repetition and the percentiles of the median repetition are reported.
+	template<typename Setup, typename Body>
+	Result Measure(Result result, int repetitions, const Setup& setup, const Body& body, LatencyRecorder* latency = nullptr)
+	{
+		struct Repetition { double ms; Latency latency; };
+		std::vector<Repetition> repetitionResults;
+		repetitionResults.reserve(repetitions);
+		for (int r = 0; r < repetitions; ++r)
+		{
+			setup();
+			if (latency != nullptr)
+				latency->Clear();
+
+			auto begin = Clock::now();
+			body();
+			auto end = Clock::now();
+
+			repetitionResults.push_back({ std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(end - begin).count(), latency != nullptr ? latency->Compute() : Latency{} });
+		}
+		std::sort(repetitionResults.begin(), repetitionResults.end(), [](const Repetition& a, const Repetition& b) { return a.ms < b.ms; });
+
+		const Repetition& median = repetitionResults[repetitionResults.size() / 2];
+		result.minMs = repetitionResults.front().ms;
+		result.medianMs = median.ms;
+		result.maxMs = repetitionResults.back().ms;
+		result.hasLatency = latency != nullptr;
+		result.latency = median.latency;
+		Report(result);
+		return result;
+	}
+
+	// suites
+	void RunParallelAlgorithms(const Utilities::TaskManager::JobContext& context, int numThreads);
+	void RunThreadsafeStructures(const Utilities::TaskManager::JobContext& context, int numThreads);
+	void RunScheduler(const Utilities::TaskManager::JobContext& context, int numThreads);
+	void RunAllocators(const Utilities::TaskManager::JobContext& context, int numThreads);
+	void RunProfiler(const Utilities::TaskManager::JobContext& context, int numThreads);
+}
@@ -0,0 +1,143 @@
+#include "Bench.hh"
+
+#include <Psapi.h>
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "Allocators.hpp"
+#include "TaskManagerHelpers.hh"
+
+static Bench::BenchJobScheduler s_JobScheduler;
+static Utilities::Profiler s_Profiler;
+static FILE* s_ResultsFile = nullptr;
+
+static const struct
+{
+	const char* name;
+	void(*run)(const Utilities::TaskManager::JobContext& context, int numThreads);
+} s_Suites[] =
+{
+	{ "ParallelAlgorithms", Bench::RunParallelAlgorithms },
+	{ "ThreadsafeStructures", Bench::RunThreadsafeStructures },
+	{ "Scheduler", Bench::RunScheduler },
+	{ "Allocators", Bench::RunAllocators },
+	{ "Profiler", Bench::RunProfiler },
+};
+
+void Bench::Report(const Result& result)
+{
+	char line[1024];
+	int length = sprintf_s(line, "{\"suite\":\"%s\",\"name\":\"%s\",\"threads\":%d,\"elements\":%lld,\"min_ms\":%.4f,\"median_ms\":%.4f,\"max_ms\":%.4f,\"ops_per_sec\":%.1f",
+		result.suite, result.name.c_str(), result.threads, (long long)result.elements, result.minMs, result.medianMs, result.maxMs,
+		result.medianMs > 0 ? result.elements * 1000.0 / result.medianMs : 0.0);
+
+	if (result.producers > 0 || result.consumers > 0)
+		length += sprintf_s(line + length, sizeof(line) - length, ",\"producers\":%d,\"consumers\":%d", result.producers, result.consumers);
+	if (result.payloadBytes > 0)
+		length += sprintf_s(line + length, sizeof(line) - length, ",\"payload_bytes\":%d", result.payloadBytes);
+	if (result.dtlbMisses >= 0)
+		length += sprintf_s(line + length, sizeof(line) - length, ",\"dtlb_misses\":%lld", (long long)result.dtlbMisses);
+	if (result.residentBytes >= 0)
+		length += sprintf_s(line + length, sizeof(line) - length, ",\"resident_bytes\":%lld", (long long)result.residentBytes);
+	if (result.fragmentation >= 0)
+		length += sprintf_s(line + length, sizeof(line) - length, ",\"fragmentation\":%.4f", result.fragmentation);
+	if (result.peakUsedBytes >= 0)
+		length += sprintf_s(line + length, sizeof(line) - length, ",\"peak_used_bytes\":%lld", (long long)result.peakUsedBytes);
+	if (result.hasLatency)
+		length += sprintf_s(line + length, sizeof(line) - length, ",\"latency_ns\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+			result.latency.p50, result.latency.p90, result.latency.p99, result.latency.p999, result.latency.max);
+	sprintf_s(line + length, sizeof(line) - length, "}\n");
+
+	fputs(line, stdout);
+	if (s_ResultsFile != nullptr)
+		fputs(line, s_ResultsFile);
+}
+
+int64_t Bench::GetResidentBytes()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return -1;
+	return (int64_t)counters.WorkingSetSize;
+}
+
+static void __stdcall WorkerThread(int idx)
+{
+	s_JobScheduler.SetRootFiber(ConvertThreadToFiber(nullptr), idx);
+	s_JobScheduler.RunScheduler(idx, s_Profiler);
+}
+
+// usage: Benchmarks [results.jsonl] [suite...]
+// every result is one JSON object per line. Without suite names all suites run.
+int main(int argc, char** argv)
+{
+	if (argc > 1)
+	{
+		fopen_s(&s_ResultsFile, argv[1], "w");
+	}
+
+	unsigned int numHardwareCores = std::thread::hardware_concurrency();
+	numHardwareCores = numHardwareCores > 1 ? numHardwareCores - 1 : 1;
+	int numThreads = (numHardwareCores < Utilities::Profiler::MaxNumThreads - 1) ? numHardwareCores : Utilities::Profiler::MaxNumThreads - 1;
+
+	// the block allocator wants its buffer aligned to the block size
+	static constexpr size_t BlockSize = 2 * 1024 * 1024;
+	size_t totalMemory = 256 * 1024 * 1024;
+	uint8_t* memory = reinterpret_cast<uint8_t*>(VirtualAlloc(nullptr, totalMemory + BlockSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+	uint8_t* alignedMemory = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(memory) + BlockSize - 1) & ~(BlockSize - 1));
+	Utilities::DefaultAllocator blockAllocator(alignedMemory, totalMemory);
+
+	s_JobScheduler.Init(numThreads, &s_Profiler, &blockAllocator);
+
+	std::vector<std::thread> workerThreads;
+	for (int i = 0; i < numThreads; ++i)
+		workerThreads.emplace_back(WorkerThread, i);
+
+	std::mutex doneMutex;
+	std::condition_variable doneConditionVariable;
+	bool done = false;
+
+	auto rootJob = Utilities::TaskManager::CreateLambdaJob([&](int, const Utilities::TaskManager::JobContext& context)
+	{
+		for (auto& suite : s_Suites)
+		{
+			bool selected = argc <= 2;
+			for (int i = 2; i < argc; ++i)
+				selected = selected || strcmp(argv[i], suite.name) == 0;
+
+			if (selected)
+				suite.run(context, numThreads);
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(doneMutex);
+			done = true;
+		}
+		doneConditionVariable.notify_all();
+	}, "Benchmarks", 1, 0, Utilities::TaskManager::Job::Priority::HIGH, true);
+
+	s_JobScheduler.Do(&rootJob, nullptr);
+
+	{
+		std::unique_lock<std::mutex> lock(doneMutex);
+		while (!done)
+			doneConditionVariable.wait(lock);
+	}
+
+	s_JobScheduler.FinishTasks();
+	for (auto& thread : workerThreads)
+	{
+		s_JobScheduler.NotifyWaitingThreads();
+		thread.join();
+	}
+
+	if (s_ResultsFile != nullptr)
+		fclose(s_ResultsFile);
+
+	VirtualFree(memory, 0, MEM_RELEASE);
+	return 0;
+}
@@ -0,0 +1,82 @@
+#include "Bench.hh"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+
+#include "ParallelAlgorithms.hh"
+
+// Utilities::TaskManager parallel algorithms against their serial std:: counterparts, 10k to 10M elements.
+void Bench::RunParallelAlgorithms(const Utilities::TaskManager::JobContext& context, int numThreads)
+{
+	using namespace Utilities::TaskManager;
+	static const char* Suite = "ParallelAlgorithms";
+
+	std::mt19937 rng(1234);
+
+	for (int n : { 10'000, 100'000, 1'000'000, 10'000'000 })
+	{
+		const int repetitions = n >= 10'000'000 ? 3 : 7;
+
+		std::vector<uint32_t> source(n), data(n), scratch(n), output(n);
+		for (auto& value : source)
+			value = rng();
+
+		auto reset = [&] { std::copy(source.begin(), source.end(), data.begin()); };
+		auto nothing = [] {};
+
+		// SORT
+		Measure({ Suite, "std::sort", 1, n }, repetitions, reset, [&] { std::sort(data.begin(), data.end()); });
+		Measure({ Suite, "ParallelSort", numThreads, n }, repetitions, reset, [&] { ParallelSort(context, data.data(), data.data() + n, scratch.data()); });
+
+		// MERGE (two sorted halves)
+		std::vector<uint32_t> sortedHalves(source);
+		std::sort(sortedHalves.begin(), sortedHalves.begin() + n / 2);
+		std::sort(sortedHalves.begin() + n / 2, sortedHalves.end());
+		Measure({ Suite, "std::merge", 1, n }, repetitions, nothing, [&] {
+			std::merge(sortedHalves.begin(), sortedHalves.begin() + n / 2, sortedHalves.begin() + n / 2, sortedHalves.end(), output.begin());
+		});
+		Measure({ Suite, "ParallelMerge", numThreads, n }, repetitions, nothing, [&] {
+			ParallelMerge(context, sortedHalves.begin(), sortedHalves.begin() + n / 2, sortedHalves.begin() + n / 2, sortedHalves.end(), output.begin());
+		});
+
+		// SCAN
+		Measure({ Suite, "std::partial_sum", 1, n }, repetitions, nothing, [&] { std::partial_sum(source.begin(), source.end(), output.begin()); });
+		Measure({ Suite, "ParallelInclusiveScan", numThreads, n }, repetitions, nothing, [&] {
+			ParallelInclusiveScan(context, n, 0u, [&](int i) { return source[i]; }, [](uint32_t a, uint32_t b) { return a + b; }, [&](int i, uint32_t value) { output[i] = value; });
+		});
+		Measure({ Suite, "serial exclusive scan", 1, n }, repetitions, nothing, [&] {
+			uint32_t sum = 0;
+			for (int i = 0; i < n; ++i)
+			{
+				output[i] = sum;
+				sum += source[i];
+			}
+		});
+		Measure({ Suite, "ParallelExclusiveScan", numThreads, n }, repetitions, nothing, [&] {
+			ParallelExclusiveScan(context, n, 0u, [&](int i) { return source[i]; }, [](uint32_t a, uint32_t b) { return a + b; }, [&](int i, uint32_t value) { output[i] = value; });
+		});
+
+		// REDUCE
+		Measure({ Suite, "std::accumulate", 1, n }, repetitions, nothing, [&] { Consume(std::accumulate(source.begin(), source.end(), uint64_t(0))); });
+		Measure({ Suite, "ParallelReduce", numThreads, n }, repetitions, nothing, [&] {
+			Consume(ParallelReduce(context, n, uint64_t(0), [&](int i) { return uint64_t(source[i]); }, [](uint64_t a, uint64_t b) { return a + b; }));
+		});
+
+		// PARTITION (half the elements go to each side)
+		Measure({ Suite, "std::partition_copy", 1, n }, repetitions, nothing, [&] {
+			std::partition_copy(source.begin(), source.end(), output.begin(), scratch.begin(), [](uint32_t value) { return (value & 1) != 0; });
+		});
+		Measure({ Suite, "ParallelPartition", numThreads, n }, repetitions, nothing, [&] {
+			ParallelPartition(context, n, [&](int i) { return (source[i] & 1) != 0; }, [&](int i, int outIndex) { output[outIndex] = source[i]; });
+		});
+
+		// COMPACT (keeps 1 of every 8)
+		Measure({ Suite, "std::copy_if", 1, n }, repetitions, nothing, [&] {
+			std::copy_if(source.begin(), source.end(), output.begin(), [](uint32_t value) { return (value & 7) == 0; });
+		});
+		Measure({ Suite, "ParallelCompact", numThreads, n }, repetitions, nothing, [&] {
+			ParallelCompact(context, n, [&](int i) { return (source[i] & 7) == 0; }, [&](int i, int outIndex) { output[outIndex] = source[i]; });
+		});
+	}
+}
@@ -0,0 +1,133 @@
+#include "Bench.hh"
+
+#include "TaskManagerHelpers.hh"
+
+namespace
+{
+	using namespace Utilities::TaskManager;
+	using Utilities::Profiler;
+
+	constexpr const char* Suite = "Profiler";
+	constexpr int Repetitions = 5;
+	constexpr int FrameRepetitions = 64; // the mark cases time one frame per repetition, the drain in between is the untimed setup
+	constexpr int MarksPerFrame = Profiler::ProfilerMarkerBufferSize / 2; // the rings are drained every frame, so nothing is dropped
+	constexpr int ClockReads = 4'000'000;
+
+	// its own profiler, so the marks the scheduler adds to the main one don't mix with the measured ones
+	Profiler s_MeasuredProfiler;
+	const Profiler::ZoneId s_MarkZone = Profiler::InternZone("Mark");
+
+	void AddMarks(int threadIndex, int marks)
+	{
+		for (int i = 0; i < marks; i += 2)
+		{
+			s_MeasuredProfiler.AddProfileMark(Profiler::MarkerType::BEGIN_FUNCTION, nullptr, s_MarkZone, threadIndex);
+			s_MeasuredProfiler.AddProfileMark(Profiler::MarkerType::END_FUNCTION, nullptr, s_MarkZone, threadIndex);
+		}
+	}
+
+	// the consumer reads every ring like the game does at the end of a frame. Outside the timed body of the producer cases,
+	// so they only measure AddProfileMark; MeasureEndFrame reports its cost.
+	void DrainRings(int numThreads)
+	{
+		s_MeasuredProfiler.EndFrame(numThreads);
+	}
+
+	// cost of one AddProfileMark from one thread
+	void MeasureMarks()
+	{
+		Bench::Result result{ Suite, "AddProfileMark", 1, MarksPerFrame };
+		Bench::Measure(result, FrameRepetitions, [] { DrainRings(1); }, []
+		{
+			AddMarks(0, MarksPerFrame);
+		});
+		DrainRings(1);
+	}
+
+	// the same passing the name, which is looked up in the zone table at every mark
+	void MeasureMarksByName()
+	{
+		Bench::Result result{ Suite, "AddProfileMark by name", 1, MarksPerFrame };
+		Bench::Measure(result, FrameRepetitions, [] { DrainRings(1); }, []
+		{
+			for (int i = 0; i < MarksPerFrame; i += 2)
+			{
+				s_MeasuredProfiler.AddProfileMark(Profiler::MarkerType::BEGIN_FUNCTION, nullptr, "Mark", 0);
+				s_MeasuredProfiler.AddProfileMark(Profiler::MarkerType::END_FUNCTION, nullptr, "Mark", 0);
+			}
+		});
+		DrainRings(1);
+	}
+
+	// the same with hardware counters read at every mark: one group read() per mark on Linux, QueryThreadCycleTime on Windows
+	void MeasureMarksWithCounters()
+	{
+		s_MeasuredProfiler.EnableHardwareCounters(true);
+		Bench::Result result{ Suite, "AddProfileMark counters", 1, MarksPerFrame };
+		Bench::Measure(result, FrameRepetitions, [] { DrainRings(1); }, []
+		{
+			AddMarks(0, MarksPerFrame);
+		});
+		DrainRings(1);
+		s_MeasuredProfiler.EnableHardwareCounters(false);
+	}
+
+	// the same from every worker thread at once, each one writing its own ring
+	void MeasureParallelMarks(const JobContext& context, int numThreads)
+	{
+		const int marksPerTask = MarksPerFrame / numThreads; // even if every task ends up on the same thread its ring doesn't fill
+
+		Bench::Result result{ Suite, "AddProfileMark parallel", numThreads, int64_t(numThreads) * marksPerTask };
+		result.producers = numThreads;
+		result.consumers = 1;
+		Bench::Measure(result, FrameRepetitions, [] { DrainRings(Profiler::MaxNumThreads); }, [&]
+		{
+			auto markJob = CreateLambdaJob([marksPerTask](int, const JobContext& jobContext)
+			{
+				AddMarks(jobContext.threadIndex, marksPerTask);
+			}, "Marks", (short)numThreads);
+			context.DoAndWait(&markJob);
+		});
+		DrainRings(Profiler::MaxNumThreads);
+	}
+
+	// the consumer side: EndFrame reading a frame of marks from one ring into the timeline and the statistics
+	void MeasureEndFrame()
+	{
+		Bench::Result result{ Suite, "Profiler::EndFrame", 1, MarksPerFrame };
+		result.producers = 1;
+		result.consumers = 1;
+		Bench::Measure(result, FrameRepetitions, [] { AddMarks(0, MarksPerFrame); }, []
+		{
+			DrainRings(1);
+		});
+	}
+
+	// what reading the time costs alone: the profiler clock (TSC when invariant) against the std::chrono one it replaced
+	void MeasureClocks()
+	{
+		Bench::Result result{ Suite, "Profiler::ReadClock", 1, ClockReads };
+		Bench::Measure(result, Repetitions, [] {}, []
+		{
+			for (int i = 0; i < ClockReads; ++i)
+				Bench::Consume(s_MeasuredProfiler.ReadClock());
+		});
+
+		result.name = "high_resolution_clock::now";
+		Bench::Measure(result, Repetitions, [] {}, []
+		{
+			for (int i = 0; i < ClockReads; ++i)
+				Bench::Consume(std::chrono::high_resolution_clock::now());
+		});
+	}
+}
+
+void Bench::RunProfiler(const Utilities::TaskManager::JobContext& context, int numThreads)
+{
+	MeasureClocks();
+	MeasureMarks();
+	MeasureMarksByName();
+	MeasureMarksWithCounters();
+	MeasureParallelMarks(context, numThreads);
+	MeasureEndFrame();
+}
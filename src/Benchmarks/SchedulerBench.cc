@@ -0,0 +1,99 @@
+#include "Bench.hh"
+
+#include "TaskManagerHelpers.hh"
+
+namespace
+{
+	using namespace Utilities::TaskManager;
+
+	constexpr const char* Suite = "Scheduler";
+	constexpr int Repetitions = 5;
+	constexpr int MaxWaitsPerSubmitter = 2'000;
+	constexpr int TasksPerSubmitter = 64 * 1024;
+	constexpr int FiberRoundTrips = 1'000'000;
+
+	// "submitters" tasks running at the same time, each one doing DoAndWait of a job with "tasks" empty tasks (~TasksPerSubmitter tasks in total).
+	// with 1 task DoAndWait runs it inline, so that measures the inline path. Latency is per DoAndWait.
+	void MeasureDoAndWait(const JobContext& context, const char* name, int numThreads, int submitters, short tasks)
+	{
+		const int waits = std::min(MaxWaitsPerSubmitter, std::max(16, TasksPerSubmitter / tasks));
+
+		Bench::LatencyRecorder latency(submitters, waits);
+		Bench::Result result{ Suite, name, submitters, int64_t(submitters) * waits * tasks };
+		result.producers = submitters;
+		result.consumers = numThreads;
+
+		Bench::Measure(result, Repetitions, [] {}, [&]
+		{
+			auto submitterJob = CreateLambdaJob([&](int submitter, const JobContext& submitterContext)
+			{
+				for (int i = 0; i < waits; ++i)
+				{
+					auto emptyJob = CreateLambdaJob([](int, const JobContext&) {}, "Empty", tasks);
+
+					auto begin = Bench::Clock::now();
+					submitterContext.DoAndWait(&emptyJob);
+					latency.Record(submitter, begin, Bench::Clock::now());
+				}
+			}, "Submitter", (short)submitters);
+			context.DoAndWait(&submitterJob);
+		}, &latency);
+	}
+
+	struct PingPong
+	{
+		void* caller;
+	};
+
+	void __stdcall PingPongFiber(void* param)
+	{
+		PingPong* pingPong = reinterpret_cast<PingPong*>(param);
+		for (;;)
+			::SwitchToFiber(pingPong->caller);
+	}
+
+	// cost of the raw fiber switch the scheduler is built on: caller -> partner -> caller.
+	// runs inside a task, which never yields while measuring, so it stays on the same thread.
+	void MeasureFiberSwitch()
+	{
+		PingPong pingPong = { ::GetCurrentFiber() };
+		void* partner = ::CreateFiber(64 * 1024, PingPongFiber, &pingPong);
+
+		Bench::LatencyRecorder latency(1, FiberRoundTrips / Bench::LatencyRecorder::SampleEvery + 1);
+		Bench::Result result{ Suite, "SwitchToFiber round trip", 1, int64_t(FiberRoundTrips) * 2 };
+
+		Bench::Measure(result, Repetitions, [] {}, [&]
+		{
+			for (int i = 0; i < FiberRoundTrips; ++i)
+			{
+				if (i % Bench::LatencyRecorder::SampleEvery == 0)
+				{
+					auto begin = Bench::Clock::now();
+					::SwitchToFiber(partner);
+					latency.Record(0, begin, Bench::Clock::now());
+				}
+				else
+				{
+					::SwitchToFiber(partner);
+				}
+			}
+		}, &latency);
+
+		::DeleteFiber(partner);
+	}
+}
+
+// job enqueue/dequeue, DoAndWait on empty jobs and fiber switches, with 1 to N tasks submitting work at the same time.
+// "elements" is the number of tasks executed (switches for the fiber test), "consumers" the number of worker threads.
+void Bench::RunScheduler(const JobContext& context, int numThreads)
+{
+	MeasureFiberSwitch();
+
+	for (int submitters = 1; submitters <= numThreads; ++submitters)
+	{
+		MeasureDoAndWait(context, "DoAndWait inline (1 task)", numThreads, submitters, 1);
+		MeasureDoAndWait(context, "DoAndWait empty job (2 tasks)", numThreads, submitters, 2);
+		MeasureDoAndWait(context, "DoAndWait empty job (64 tasks)", numThreads, submitters, 64);
+		MeasureDoAndWait(context, "DoAndWait empty job (1024 tasks)", numThreads, submitters, 1024);
+	}
+}
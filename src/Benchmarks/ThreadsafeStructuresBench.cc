@@ -0,0 +1,231 @@
+#include "Bench.hh"
+
+#include <memory>
+#include <thread>
+
+#include "ThreadsafeStructures.hh"
+
+namespace
+{
+	constexpr const char* Suite = "ThreadsafeStructures";
+	constexpr int Capacity = 1024;
+	constexpr int Repetitions = 3;
+	constexpr int OperationsPerThread = 500'000; // stacks and queue "pairs" mode
+	constexpr int ItemsPerRepetition = 1'000'000; // queue producer/consumer mode
+
+	template<int Bytes>
+	struct Payload
+	{
+		uint8_t data[Bytes];
+	};
+
+	// every thread waits for the rest before starting so all of them contend from the first operation
+	template<typename Body>
+	void RunOnThreads(int numThreads, const Body& body)
+	{
+		std::atomic_int ready(0);
+		std::vector<std::thread> threads;
+		threads.reserve(numThreads);
+		for (int i = 0; i < numThreads; ++i)
+		{
+			threads.emplace_back([&, i]
+			{
+				ready.fetch_add(1);
+				while (ready.load() < numThreads);
+				body(i);
+			});
+		}
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	// pop + push pairs on a half-full stack, so it is never empty nor full
+	template<typename Stack, typename T>
+	void MeasureStack(const char* name, int numThreads)
+	{
+		std::unique_ptr<Stack> stack(new Stack());
+		for (int i = 0; i < Capacity / 2; ++i)
+			stack->Push(T{});
+
+		Bench::LatencyRecorder latency(numThreads, 2 * OperationsPerThread / Bench::LatencyRecorder::SampleEvery + 1);
+		Bench::Result result{ Suite, name, numThreads, int64_t(numThreads) * OperationsPerThread * 2 };
+		result.producers = result.consumers = numThreads;
+		result.payloadBytes = sizeof(T);
+
+		Bench::Measure(result, Repetitions, [] {}, [&]
+		{
+			RunOnThreads(numThreads, [&](int thread)
+			{
+				for (int i = 0; i < OperationsPerThread; ++i)
+				{
+					if (i % Bench::LatencyRecorder::SampleEvery == 0)
+					{
+						auto begin = Bench::Clock::now();
+						T value = stack->Pop();
+						auto end = Bench::Clock::now();
+						latency.Record(thread, begin, end);
+
+						begin = Bench::Clock::now();
+						stack->Push(value);
+						end = Bench::Clock::now();
+						latency.Record(thread, begin, end);
+					}
+					else
+					{
+						stack->Push(stack->Pop());
+					}
+				}
+			});
+		}, &latency);
+	}
+
+	// remove + add pairs on a half-full queue, every thread is both producer and consumer
+	template<typename Queue, typename T>
+	void MeasureQueuePairs(const char* name, int numThreads)
+	{
+		std::unique_ptr<Queue> queue(new Queue());
+		for (int i = 0; i < Capacity / 2; ++i)
+			queue->Add(T{});
+
+		Bench::LatencyRecorder latency(numThreads, 2 * OperationsPerThread / Bench::LatencyRecorder::SampleEvery + 1);
+		Bench::Result result{ Suite, name, numThreads, int64_t(numThreads) * OperationsPerThread * 2 };
+		result.producers = result.consumers = numThreads;
+		result.payloadBytes = sizeof(T);
+
+		Bench::Measure(result, Repetitions, [] {}, [&]
+		{
+			RunOnThreads(numThreads, [&](int thread)
+			{
+				T value;
+				for (int i = 0; i < OperationsPerThread; ++i)
+				{
+					if (i % Bench::LatencyRecorder::SampleEvery == 0)
+					{
+						auto begin = Bench::Clock::now();
+						while (!queue->Remove(value));
+						auto end = Bench::Clock::now();
+						latency.Record(thread, begin, end);
+
+						begin = Bench::Clock::now();
+						while (!queue->Add(value));
+						end = Bench::Clock::now();
+						latency.Record(thread, begin, end);
+					}
+					else
+					{
+						while (!queue->Remove(value));
+						while (!queue->Add(value));
+					}
+				}
+			});
+		}, &latency);
+	}
+
+	// "producers" threads add ItemsPerRepetition items in total while "consumers" threads remove them.
+	// latency samples time a single Add/Remove call, failed ones (queue full/empty) included.
+	template<typename Queue, typename T>
+	void MeasureQueueProducerConsumer(const char* name, int producers, int consumers)
+	{
+		std::unique_ptr<Queue> queue(new Queue());
+		const int numThreads = producers + consumers;
+		const int itemsPerProducer = ItemsPerRepetition / producers;
+		const int totalItems = itemsPerProducer * producers;
+
+		Bench::LatencyRecorder latency(numThreads, 4 * totalItems / Bench::LatencyRecorder::SampleEvery / numThreads + 1);
+		Bench::Result result{ Suite, name, numThreads, int64_t(totalItems) * 2 };
+		result.producers = producers;
+		result.consumers = consumers;
+		result.payloadBytes = sizeof(T);
+
+		std::atomic_int consumed(0);
+
+		Bench::Measure(result, Repetitions, [&] { consumed.store(0); }, [&]
+		{
+			RunOnThreads(numThreads, [&](int thread)
+			{
+				T value = {};
+				int calls = 0;
+				if (thread < producers)
+				{
+					for (int i = 0; i < itemsPerProducer; )
+					{
+						bool added;
+						if (++calls % Bench::LatencyRecorder::SampleEvery == 0)
+						{
+							auto begin = Bench::Clock::now();
+							added = queue->Add(value);
+							latency.Record(thread, begin, Bench::Clock::now());
+						}
+						else
+						{
+							added = queue->Add(value);
+						}
+						if (added)
+							++i;
+						else
+							std::this_thread::yield(); // full, let the consumers run if we share a core
+					}
+				}
+				else
+				{
+					while (consumed.load(std::memory_order_relaxed) < totalItems)
+					{
+						bool removed;
+						if (++calls % Bench::LatencyRecorder::SampleEvery == 0)
+						{
+							auto begin = Bench::Clock::now();
+							removed = queue->Remove(value);
+							latency.Record(thread, begin, Bench::Clock::now());
+						}
+						else
+						{
+							removed = queue->Remove(value);
+						}
+						if (removed)
+							consumed.fetch_add(1, std::memory_order_relaxed);
+						else
+							std::this_thread::yield(); // empty, let the producers run if we share a core
+					}
+				}
+			});
+		}, &latency);
+	}
+
+	template<typename T>
+	void RunPayload(int maxThreads)
+	{
+		using namespace ThreadsafeStructures;
+
+		for (int threads = 1; threads <= maxThreads; ++threads)
+		{
+			MeasureStack<LockfreeStack<T, Capacity>, T>("LockfreeStack", threads);
+			MeasureStack<PaddedLockfreeStack<T, Capacity>, T>("PaddedLockfreeStack", threads);
+			MeasureQueuePairs<SpinlockQueue<T, Capacity>, T>("SpinlockQueue", threads);
+			MeasureQueuePairs<MPMCQueue<T, Capacity>, T>("MPMCQueue", threads);
+		}
+
+		// 1:N-1, N/2:N/2 and N-1:1 producer/consumer ratios
+		for (int threads = 2; threads <= maxThreads; ++threads)
+		{
+			int ratios[][2] = { { 1, threads - 1 }, { threads / 2, threads - threads / 2 }, { threads - 1, 1 } };
+			for (int r = 0; r < 3; ++r)
+			{
+				if (r > 0 && ratios[r][0] == ratios[r - 1][0])
+					continue; // with 2 or 3 threads some ratios are the same
+				MeasureQueueProducerConsumer<SpinlockQueue<T, Capacity>, T>("SpinlockQueue", ratios[r][0], ratios[r][1]);
+				MeasureQueueProducerConsumer<MPMCQueue<T, Capacity>, T>("MPMCQueue", ratios[r][0], ratios[r][1]);
+			}
+		}
+	}
+}
+
+// LockfreeStack vs PaddedLockfreeStack and SpinlockQueue vs MPMCQueue, 1 to N threads (N = hardware threads),
+// different producer/consumer ratios and payload sizes. Runs on its own threads, outside the scheduler.
+void Bench::RunThreadsafeStructures(const Utilities::TaskManager::JobContext& context, int numThreads)
+{
+	const int maxThreads = numThreads + 1;
+
+	RunPayload<Payload<8>>(maxThreads);
+	RunPayload<Payload<64>>(maxThreads);
+	RunPayload<Payload<256>>(maxThreads);
+}
@@ -0,0 +1,117 @@
+#include "AllocatorTelemetry.hh"
+
+#include <cstdio>
+
+#include "imgui/imgui.h"
+
+namespace Utilities
+{
+	static constexpr double BytesPerMB = 1024.0 * 1024.0;
+
+	void DrawAllocatorTelemetryToImGUI(DefaultAllocator& allocator, int numThreads)
+	{
+		if (ImGui::Begin("Allocators"))
+		{
+			const double blockMB = DefaultAllocator::GetBlockSize() / BytesPerMB;
+			ImGui::Text("Blocks: %d in use (%.0f MB), %d peak (%.0f MB), %d total (%.0f MB)",
+				allocator.GetBlocksInUse(), allocator.GetBlocksInUse() * blockMB,
+				allocator.GetPeakBlocksInUse(), allocator.GetPeakBlocksInUse() * blockMB,
+				allocator.GetNumBlocks(), allocator.GetNumBlocks() * blockMB);
+
+			AllocatorStats lastFrame = allocator.GetLastFrameStats();
+			AllocatorStats peakFrame = allocator.GetPeakFrameStats();
+			ImGui::Text("Last frame: %.2f MB allocated, %llu refills, %llu large, %.2f MB wasted",
+				lastFrame.bytesAllocated / BytesPerMB, (unsigned long long)lastFrame.blockRefills, (unsigned long long)lastFrame.largeAllocations, lastFrame.wastedTailBytes / BytesPerMB);
+			ImGui::Text("Peak frame: %.2f MB allocated, %llu refills, %llu large, %.2f MB wasted",
+				peakFrame.bytesAllocated / BytesPerMB, (unsigned long long)peakFrame.blockRefills, (unsigned long long)peakFrame.largeAllocations, peakFrame.wastedTailBytes / BytesPerMB);
+
+			if (ImGui::CollapsingHeader("Threads"))
+			{
+				ImGui::Columns(5, "threads");
+				ImGui::Text("Thread"); ImGui::NextColumn();
+				ImGui::Text("Allocated MB"); ImGui::NextColumn();
+				ImGui::Text("Refills"); ImGui::NextColumn();
+				ImGui::Text("Large"); ImGui::NextColumn();
+				ImGui::Text("Wasted MB"); ImGui::NextColumn();
+				ImGui::Separator();
+				// the main thread uses the index after the workers
+				for (int t = 0; t <= numThreads && t < Profiler::MaxNumThreads; ++t)
+				{
+					AllocatorStats stats = allocator.GetThreadStats(t);
+					ImGui::Text("%d", t); ImGui::NextColumn();
+					ImGui::Text("%.2f", stats.bytesAllocated / BytesPerMB); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)stats.blockRefills); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)stats.largeAllocations); ImGui::NextColumn();
+					ImGui::Text("%.2f", stats.wastedTailBytes / BytesPerMB); ImGui::NextColumn();
+				}
+				ImGui::Columns(1);
+			}
+
+			if (ImGui::CollapsingHeader("Labels"))
+			{
+				ImGui::Columns(6, "labels");
+				ImGui::Text("System"); ImGui::NextColumn();
+				ImGui::Text("Allocated MB"); ImGui::NextColumn();
+				ImGui::Text("Blocks (peak)"); ImGui::NextColumn();
+				ImGui::Text("Refills"); ImGui::NextColumn();
+				ImGui::Text("Large"); ImGui::NextColumn();
+				ImGui::Text("Wasted MB"); ImGui::NextColumn();
+				ImGui::Separator();
+				allocator.ForEachLabelStats([](const LabelStats& label)
+				{
+					ImGui::Text("%s (%llu)", label.systemName != nullptr ? label.systemName : "?", (unsigned long long)label.label); ImGui::NextColumn();
+					ImGui::Text("%.2f", label.stats.bytesAllocated / BytesPerMB); ImGui::NextColumn();
+					ImGui::Text("%d (%d)", label.blocksInUse, label.peakBlocksInUse); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)label.stats.blockRefills); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)label.stats.largeAllocations); ImGui::NextColumn();
+					ImGui::Text("%.2f", label.stats.wastedTailBytes / BytesPerMB); ImGui::NextColumn();
+				});
+				ImGui::Columns(1);
+			}
+		}
+		ImGui::End();
+	}
+
+	bool DumpAllocatorTelemetry(DefaultAllocator& allocator, const DefaultFrameArena& frameArena, int numThreads, const char* path)
+	{
+		FILE* file = nullptr;
+		if (fopen_s(&file, path, "w") != 0 || file == nullptr)
+		{
+			return false;
+		}
+
+		fprintf(file, "block size: %llu bytes\n", (unsigned long long)DefaultAllocator::GetBlockSize());
+		fprintf(file, "blocks: %d total, %d in use, %d peak in use\n", allocator.GetNumBlocks(), allocator.GetBlocksInUse(), allocator.GetPeakBlocksInUse());
+		fprintf(file, "frame arena: %llu bytes per frame, %llu used last frame, %llu peak\n", (unsigned long long)frameArena.GetCapacity(),
+			(unsigned long long)frameArena.GetLastFrameUsedBytes(), (unsigned long long)frameArena.GetPeakUsedBytes());
+
+		auto printStats = [file](const char* name, const AllocatorStats& stats)
+		{
+			fprintf(file, "%-24s allocated %14llu B, refills %8llu, large %6llu, wasted %12llu B\n", name,
+				(unsigned long long)stats.bytesAllocated, (unsigned long long)stats.blockRefills, (unsigned long long)stats.largeAllocations, (unsigned long long)stats.wastedTailBytes);
+		};
+
+		fprintf(file, "\nframes\n");
+		printStats("last frame", allocator.GetLastFrameStats());
+		printStats("peak frame", allocator.GetPeakFrameStats());
+		printStats("total", allocator.GetTotalStats());
+
+		fprintf(file, "\nthreads\n");
+		for (int t = 0; t <= numThreads && t < Profiler::MaxNumThreads; ++t)
+		{
+			char name[32];
+			sprintf_s(name, "thread %d", t);
+			printStats(name, allocator.GetThreadStats(t));
+		}
+
+		fprintf(file, "\nlabels (still handed out)\n");
+		allocator.ForEachLabelStats([&](const LabelStats& label)
+		{
+			fprintf(file, "%s (%llu): %d blocks in use, %d peak\n", label.systemName != nullptr ? label.systemName : "?", (unsigned long long)label.label, label.blocksInUse, label.peakBlocksInUse);
+			printStats("", label.stats);
+		});
+
+		fclose(file);
+		return true;
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "Allocators.hpp"
+
+namespace Utilities
+{
+	// ImGui window with the block allocator counters: blocks in use, last/peak frame, per thread and per label
+	void DrawAllocatorTelemetryToImGUI(DefaultAllocator& allocator, int numThreads);
+
+	// writes the same counters and the frame arena usage (the "Memory" window) to a text file,
+	// meant to be called at shutdown to size both from real data
+	bool DumpAllocatorTelemetry(DefaultAllocator& allocator, const DefaultFrameArena& frameArena, int numThreads, const char* path);
+}
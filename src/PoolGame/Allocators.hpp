@@ -4,22 +4,54 @@
 #include <atomic>
 #include <mutex>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 #include "SOA.hpp"
 #include "Profiler.hh"
 
 namespace Utilities
 {
+	// index of the lowest / highest set bit. "value" can't be 0
+	inline int FindFirstSet(uint64_t value)
+	{
+		assert(value != 0);
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward64(&index, value);
+		return (int)index;
+#else
+		return __builtin_ctzll(value);
+#endif
+	}
+
+	inline int FindLastSet(uint64_t value)
+	{
+		assert(value != 0);
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return (int)index;
+#else
+		return 63 - __builtin_clzll(value);
+#endif
+	}
+
 	template<size_t size, size_t align = 16, size_t buckets = 256>
 	struct FixedAllocator
 	{
 		struct alignas(align)Data {
 			uint8_t d[size];
 		} data[buckets];
-		uint8_t freeBuckets[buckets];
-		uint16_t next = 0;
+		using BucketIndex = typename std::conditional<buckets <= 256, uint8_t, uint32_t>::type;
+		BucketIndex freeBuckets[buckets];
+		uint32_t next = 0;
 
 		static_assert(sizeof(Data) == size, "Data must have a size of size... :-/");
-		static_assert(buckets <= 256, "can only support 256 buckets");
 
 		FixedAllocator()
 		{
@@ -49,7 +81,7 @@ namespace Utilities
 				assert(ptr == data[index].d);
 				assert(next > 0);
 				--next;
-				freeBuckets[next] = (uint8_t)index;
+				freeBuckets[next] = (BucketIndex)index;
 				return true;
 			}
 			assert(false);
@@ -57,6 +89,148 @@ namespace Utilities
 		}
 	};
 
+	// FixedAllocator that many threads can use at once. Every thread caches free objects in two "magazines" (small stacks of
+	// object indices) and only goes to the shared depot, two lock free stacks of full and empty magazines, once every
+	// MagazineSize allocations. Objects can be freed from any thread, they just end up in that thread's magazines.
+	// Not used by the game yet: the physics objects only live for a frame and come from the FrameArena. It's for objects
+	// created and destroyed one by one from many jobs; Benchmarks/AllocatorsBench.cc measures it.
+	template<size_t size, size_t align, size_t capacity, size_t MaxNumThreads, size_t MagazineSize = 32>
+	struct ThreadCachingFixedAllocator
+	{
+		struct alignas(align)Data {
+			uint8_t d[size];
+		} data[capacity];
+
+		static_assert(sizeof(Data) == size, "Data must have a size of size... :-/");
+		static_assert(capacity < 0xFFFFFFFF, "indices are 32 bits");
+
+		ThreadCachingFixedAllocator()
+		{
+			// all the objects start in full magazines in the depot, every thread with two empty ones
+			int magazine = 0;
+			for (size_t first = 0; first < capacity; first += MagazineSize, ++magazine)
+			{
+				magazines[magazine].count = (uint32_t)(capacity - first < MagazineSize ? capacity - first : MagazineSize);
+				for (uint32_t i = 0; i < magazines[magazine].count; ++i)
+					magazines[magazine].objects[i] = (uint32_t)(first + i);
+				Push(fullMagazines, &magazines[magazine]);
+			}
+			for (size_t t = 0; t < MaxNumThreads; ++t)
+			{
+				perThreadData[t].loaded = &magazines[magazine++];
+				perThreadData[t].previous = &magazines[magazine++];
+			}
+			for (; magazine < NumMagazines; ++magazine)
+				Push(emptyMagazines, &magazines[magazine]);
+		}
+
+		void* alloc(int threadId)
+		{
+			assert(threadId >= 0 && threadId < (int)MaxNumThreads);
+			PerThreadData& threadData = perThreadData[threadId];
+
+			if (threadData.loaded->count == 0)
+			{
+				if (threadData.previous->count > 0)
+				{
+					std::swap(threadData.loaded, threadData.previous);
+				}
+				else
+				{
+					Magazine* full = Pop(fullMagazines);
+					if (full == nullptr)
+					{
+						return nullptr; // whatever is left is in other threads' magazines
+					}
+					Push(emptyMagazines, threadData.previous);
+					threadData.previous = threadData.loaded;
+					threadData.loaded = full;
+				}
+			}
+
+			uint32_t index = threadData.loaded->objects[--threadData.loaded->count];
+			return data[index].d;
+		}
+
+		bool free(int threadId, void* ptr)
+		{
+			assert(threadId >= 0 && threadId < (int)MaxNumThreads);
+			intptr_t index = (reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(data)) / sizeof(Data);
+			if (index < 0 || index >= (intptr_t)capacity)
+			{
+				assert(false);
+				return false;
+			}
+			assert(ptr == data[index].d);
+
+			PerThreadData& threadData = perThreadData[threadId];
+			if (threadData.loaded->count == MagazineSize)
+			{
+				if (threadData.previous->count < MagazineSize)
+				{
+					std::swap(threadData.loaded, threadData.previous);
+				}
+				else
+				{
+					Magazine* empty = Pop(emptyMagazines);
+					assert(empty != nullptr); // there are enough magazines to hold every object, the empty ones can't run out
+					Push(fullMagazines, threadData.previous);
+					threadData.previous = threadData.loaded;
+					threadData.loaded = empty;
+				}
+			}
+
+			threadData.loaded->objects[threadData.loaded->count++] = (uint32_t)index;
+			return true;
+		}
+
+	private:
+		struct Magazine
+		{
+			uint32_t count = 0;
+			std::atomic<uint32_t> next{ EmptyIndex }; // only while in the depot
+			uint32_t objects[MagazineSize];
+		};
+
+		// enough for all the objects in full magazines plus two per thread and a spare one
+		static constexpr int NumMagazines = (int)((capacity + MagazineSize - 1) / MagazineSize + 2 * MaxNumThreads + 1);
+		static constexpr uint32_t EmptyIndex = 0xFFFFFFFF;
+
+		// magazine index in the low 32 bits, ABA counter in the high ones
+		void Push(std::atomic<uint64_t>& stack, Magazine* magazine)
+		{
+			uint64_t orig = stack.load(std::memory_order_relaxed), next;
+			do
+			{
+				magazine->next.store((uint32_t)orig, std::memory_order_relaxed);
+				next = ((orig >> 32) + 1) << 32 | (uint64_t)(magazine - magazines);
+			} while (!stack.compare_exchange_weak(orig, next, std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		Magazine* Pop(std::atomic<uint64_t>& stack)
+		{
+			uint64_t orig = stack.load(std::memory_order_acquire), next;
+			do
+			{
+				if ((uint32_t)orig == EmptyIndex)
+					return nullptr;
+				next = ((orig >> 32) + 1) << 32 | magazines[(uint32_t)orig].next.load(std::memory_order_relaxed);
+			} while (!stack.compare_exchange_weak(orig, next, std::memory_order_acquire, std::memory_order_acquire));
+			return &magazines[(uint32_t)orig];
+		}
+
+		Magazine magazines[NumMagazines];
+
+		alignas(64) std::atomic<uint64_t> fullMagazines{ EmptyIndex };
+		alignas(64) std::atomic<uint64_t> emptyMagazines{ EmptyIndex };
+
+		struct alignas(64) PerThreadData
+		{
+			Magazine* loaded;
+			Magazine* previous;
+		} perThreadData[MaxNumThreads];
+	};
+
 	template<size_t poolSize, size_t align = 16, size_t partitionSize = 256>
 	struct MemoryPool
 	{
@@ -94,7 +268,7 @@ namespace Utilities
 		};
 
 		FreeNode root;
-		size_t usedMemory = 0;
+		size_t usedMemory = 0, peakUsedMemory = 0;
 
 		MemoryPool()
 		{
@@ -170,6 +344,8 @@ namespace Utilities
 			assert(result + size < buffer + poolSize);
 
 			usedMemory += minSize;
+			if (usedMemory > peakUsedMemory)
+				peakUsedMemory = usedMemory;
 			return result;
 		}
 
@@ -230,6 +406,10 @@ namespace Utilities
 
 		}
 
+		// bytes handed out now and the most at once since the pool was created, headers and rounding to the block size included
+		size_t GetUsedMemory() const { return usedMemory; }
+		size_t GetPeakUsedMemory() const { return peakUsedMemory; }
+
 	private:
 		FreeNode* GetAdjacentPreviousFreeNode(Node* node)
 		{
@@ -275,6 +455,243 @@ namespace Utilities
 		}
 	};
 
+	// Two-Level Segregated Fit version of MemoryPool, same interface.
+	// Free blocks are kept in FirstLevelCount x SecondLevelCount lists: the first level is the power of 2 of the size and
+	// the second level splits that range in SecondLevelCount equal parts. Two bitmaps tell which lists are not empty,
+	// so finding a block is a couple of bit scans instead of walking the free list, and coalescing uses the
+	// physical neighbours (header of the next block, "prevPhysical" pointer for the previous one). alloc and free are O(1).
+	// Requests are rounded up to the next list size, so any block found fits and the waste is at most 1/SecondLevelCount.
+	template<size_t poolSize, size_t align = 16>
+	struct TLSFMemoryPool
+	{
+		constexpr static int Log2(size_t value)
+		{
+			return value <= 1 ? 0 : 1 + Log2(value / 2);
+		}
+
+		constexpr static size_t ResizeToMultiple(size_t size, size_t multiple)
+		{
+			return (((size - 1) / multiple) + 1) * multiple;
+		}
+
+		static_assert((align & (align - 1)) == 0 && align >= 16, "align must be a power of 2, at least 16");
+		static_assert(poolSize % align == 0, "poolSize must be divisible by align");
+
+		static constexpr int AlignLog2 = Log2(align);
+		static constexpr int SecondLevelBits = 5;
+		static constexpr int SecondLevelCount = 1 << SecondLevelBits;
+		// sizes below SmallBlockSize all go to the first level 0, in steps of "align"
+		static constexpr int FirstLevelShift = SecondLevelBits + AlignLog2;
+		static constexpr size_t SmallBlockSize = size_t(1) << FirstLevelShift;
+		static constexpr int FirstLevelCount = Log2(poolSize) - FirstLevelShift + 2;
+
+		static_assert(poolSize >= SmallBlockSize, "pool too small");
+		static_assert(FirstLevelCount < 64, "pool too big for the first level bitmap");
+
+		alignas(align) uint8_t buffer[poolSize];
+
+		struct Block
+		{
+			Block* prevPhysical; // nullptr for the first block of the buffer
+			size_t sizeAndFlags; // size of the whole block (header included), lowest bit set if free
+
+			size_t getSize() const { return sizeAndFlags & ~size_t(1); }
+			bool isFree() const { return (sizeAndFlags & 1) != 0; }
+			void set(size_t size, bool free) { sizeAndFlags = size | (free ? 1 : 0); }
+		};
+
+		// the links live in the memory given to the user, only valid while the block is free
+		struct FreeBlock : Block
+		{
+			FreeBlock *next, *prev;
+		};
+
+		static constexpr size_t HeaderSize = ResizeToMultiple(sizeof(Block), align);
+		static constexpr size_t MinBlockSize = HeaderSize + align;
+		static_assert(MinBlockSize >= sizeof(FreeBlock), "free blocks must fit the links");
+
+		uint64_t firstLevelBitmap = 0;
+		uint32_t secondLevelBitmap[FirstLevelCount] = {};
+		FreeBlock* freeLists[FirstLevelCount][SecondLevelCount] = {};
+		size_t usedMemory = 0, peakUsedMemory = 0;
+
+		TLSFMemoryPool()
+		{
+			FreeBlock* firstBlock = (FreeBlock*)buffer;
+			firstBlock->prevPhysical = nullptr;
+			firstBlock->set(poolSize, true);
+			InsertFreeBlock(firstBlock);
+		}
+
+		void* alloc(size_t size)
+		{
+			size_t blockSize = ResizeToMultiple(size + HeaderSize, align);
+			if (blockSize < MinBlockSize)
+				blockSize = MinBlockSize;
+
+			// round up to the next list, every block there is big enough
+			size_t searchSize = blockSize;
+			if (searchSize >= SmallBlockSize)
+				searchSize += (size_t(1) << (FindLastSet(searchSize) - SecondLevelBits)) - 1;
+
+			int firstLevel, secondLevel;
+			Mapping(searchSize, firstLevel, secondLevel);
+			if (firstLevel >= FirstLevelCount)
+				return nullptr; // not enought space
+
+			FreeBlock* block = FindSuitableBlock(firstLevel, secondLevel);
+			if (block == nullptr)
+				return nullptr; // not enought space
+
+			RemoveFreeBlock(block, firstLevel, secondLevel);
+
+			size_t remainingSize = block->getSize() - blockSize;
+			if (remainingSize >= MinBlockSize)
+			{
+				FreeBlock* rest = (FreeBlock*)((uint8_t*)block + blockSize);
+				rest->prevPhysical = block;
+				rest->set(remainingSize, true);
+
+				Block* next = GetNextPhysical(rest);
+				if (next != nullptr)
+					next->prevPhysical = rest;
+
+				InsertFreeBlock(rest);
+			}
+			else
+			{
+				blockSize = block->getSize();
+			}
+
+			block->set(blockSize, false);
+
+			uint8_t* result = (uint8_t*)block + HeaderSize;
+
+			assert(result > buffer);
+			assert(result + size <= buffer + poolSize);
+
+			usedMemory += blockSize;
+			if (usedMemory > peakUsedMemory)
+				peakUsedMemory = usedMemory;
+			return result;
+		}
+
+		void free(void* ptr)
+		{
+			Block* block = (Block*)((uint8_t*)ptr - HeaderSize);
+			assert(!block->isFree());
+
+			usedMemory -= block->getSize();
+
+			Block* prev = block->prevPhysical;
+			if (prev != nullptr && prev->isFree())
+			{
+				// merge with prev
+				RemoveFreeBlock((FreeBlock*)prev);
+				prev->set(prev->getSize() + block->getSize(), true);
+				block = prev;
+			}
+
+			Block* next = GetNextPhysical(block);
+			if (next != nullptr && next->isFree())
+			{
+				// merge with next
+				RemoveFreeBlock((FreeBlock*)next);
+				block->set(block->getSize() + next->getSize(), true);
+				next = GetNextPhysical(block);
+			}
+
+			if (next != nullptr)
+				next->prevPhysical = block;
+
+			block->set(block->getSize(), true);
+			InsertFreeBlock((FreeBlock*)block);
+		}
+
+		// bytes handed out now and the most at once since the pool was created, headers and rounding to the block size included
+		size_t GetUsedMemory() const { return usedMemory; }
+		size_t GetPeakUsedMemory() const { return peakUsedMemory; }
+
+	private:
+		static void Mapping(size_t size, int& firstLevel, int& secondLevel)
+		{
+			if (size < SmallBlockSize)
+			{
+				firstLevel = 0;
+				secondLevel = (int)(size >> AlignLog2);
+			}
+			else
+			{
+				int lastBit = FindLastSet(size);
+				secondLevel = (int)(size >> (lastBit - SecondLevelBits)) ^ SecondLevelCount;
+				firstLevel = lastBit - (FirstLevelShift - 1);
+			}
+		}
+
+		FreeBlock* FindSuitableBlock(int& firstLevel, int& secondLevel)
+		{
+			uint32_t secondLevelMap = secondLevelBitmap[firstLevel] & (~0u << secondLevel);
+			if (secondLevelMap == 0)
+			{
+				// nothing left in this first level, take the smallest non empty one above it
+				uint64_t firstLevelMap = firstLevelBitmap & (~uint64_t(0) << (firstLevel + 1));
+				if (firstLevelMap == 0)
+					return nullptr;
+
+				firstLevel = FindFirstSet(firstLevelMap);
+				secondLevelMap = secondLevelBitmap[firstLevel];
+			}
+			secondLevel = FindFirstSet(secondLevelMap);
+			return freeLists[firstLevel][secondLevel];
+		}
+
+		Block* GetNextPhysical(Block* block)
+		{
+			uint8_t* next = (uint8_t*)block + block->getSize();
+			return next < buffer + poolSize ? (Block*)next : nullptr;
+		}
+
+		void InsertFreeBlock(FreeBlock* block)
+		{
+			int firstLevel, secondLevel;
+			Mapping(block->getSize(), firstLevel, secondLevel);
+
+			FreeBlock* head = freeLists[firstLevel][secondLevel];
+			block->prev = nullptr;
+			block->next = head;
+			if (head != nullptr)
+				head->prev = block;
+			freeLists[firstLevel][secondLevel] = block;
+
+			firstLevelBitmap |= uint64_t(1) << firstLevel;
+			secondLevelBitmap[firstLevel] |= 1u << secondLevel;
+		}
+
+		void RemoveFreeBlock(FreeBlock* block)
+		{
+			int firstLevel, secondLevel;
+			Mapping(block->getSize(), firstLevel, secondLevel);
+			RemoveFreeBlock(block, firstLevel, secondLevel);
+		}
+
+		void RemoveFreeBlock(FreeBlock* block, int firstLevel, int secondLevel)
+		{
+			if (block->prev != nullptr)
+				block->prev->next = block->next;
+			else
+				freeLists[firstLevel][secondLevel] = block->next;
+			if (block->next != nullptr)
+				block->next->prev = block->prev;
+
+			if (freeLists[firstLevel][secondLevel] == nullptr)
+			{
+				secondLevelBitmap[firstLevel] &= ~(1u << secondLevel);
+				if (secondLevelBitmap[firstLevel] == 0)
+					firstLevelBitmap &= ~(uint64_t(1) << firstLevel);
+			}
+		}
+	};
+
 	struct PermanentMemoryPool
 	{
 		size_t size, currentOffset = 0;
@@ -315,6 +732,22 @@ namespace Utilities
 		}
 	};
 
+	// Lets the block allocator work on memory that is only reserved: Commit is called on the control data and on
+	// every block range before it is handed out. May be called more than once for the same range and from any thread.
+	class MemoryCommitter
+	{
+	public:
+		virtual ~MemoryCommitter() = default;
+		virtual void Commit(void* ptr, size_t size) = 0;
+	};
+
+	// Hands out BlockSize blocks tagged with a label, so everything allocated for a label can be freed at once.
+	// Free blocks are a bitmap (bit set = free): single blocks are a find-first-set and consecutive blocks a scan over the free runs.
+	// The blocks of each label are linked in a chain found through a small open addressing table, so Free(label) only visits that label's blocks.
+	// All the bookkeeping lives in the buffer, after the last block.
+	//
+	// The bitmap is atomic: GetBlock(blockChain) / FreeBlockChain are lock free and can be called from any thread at any time.
+	// The labeled functions (GetBlock(label), GetConsecutiveBlocks and Free(label)) touch the label table, so the caller must serialize them.
 	template<typename BlockLabelType, size_t BlockSize>
 	struct LabeledBlockAllocator
 	{
@@ -322,188 +755,322 @@ namespace Utilities
 		LabeledBlockAllocator(const LabeledBlockAllocator& original) = delete;
 		LabeledBlockAllocator& operator=(const LabeledBlockAllocator& original) = delete;
 
-		LabeledBlockAllocator(uint8_t *buffer, size_t size, bool isBufferAlignedToBlockSize = true)
+		LabeledBlockAllocator(uint8_t *buffer, size_t size, bool isBufferAlignedToBlockSize = true, MemoryCommitter* committer = nullptr)
 			: memoryBlocks(reinterpret_cast<Block*>(buffer))
-			, firstBlock(nullptr)
+			, committer(committer)
 		{
 			assert(!isBufferAlignedToBlockSize || (reinterpret_cast<uintptr_t>(buffer) == ((reinterpret_cast<uintptr_t>(buffer) + BlockSize - 1) & ~(BlockSize - 1))));
 
-			int numBlocks = (int)(size / BlockSize);
-
-			MemoryControlBlock *lastFreeBlock = reinterpret_cast<MemoryControlBlock*>((reinterpret_cast<uintptr_t>(buffer) + size + alignof(MemoryControlBlock)-1) & ~(alignof(MemoryControlBlock)-1));
-			if (reinterpret_cast<uint8_t*>(lastFreeBlock) > buffer + size)
-				--lastFreeBlock;
-
-			firstFreeBlock = lastFreeBlock - numBlocks;
-			while (&buffer[numBlocks * BlockSize] > reinterpret_cast<uint8_t*>(firstFreeBlock))
+			numBlocks = (int)(size / BlockSize);
+			while (numBlocks > 0 && GetControlDataOffset(buffer, numBlocks) + GetControlDataSize(numBlocks) > size)
 			{
 				--numBlocks;
-				firstFreeBlock = lastFreeBlock - numBlocks;
 			}
 			assert(numBlocks > 0);
 			freeBlocks = numBlocks;
 
-			for (int i = 0; i < numBlocks; ++i)
+			labelTableMask = 1;
+			while (labelTableMask + 1 < 2 * numBlocks)
+				labelTableMask = labelTableMask * 2 + 1;
+
+			uint8_t* controlData = buffer + GetControlDataOffset(buffer, numBlocks);
+			if (committer != nullptr)
 			{
-				firstFreeBlock[i].index = i;
-				firstFreeBlock[i].next = &firstFreeBlock[i + 1];
+				committer->Commit(controlData, GetControlDataSize(numBlocks));
 			}
-			firstFreeBlock[numBlocks - 1].next = nullptr;
+			freeBitmap = reinterpret_cast<std::atomic<uint64_t>*>(controlData);
+			labelTable = reinterpret_cast<LabelEntry*>(freeBitmap + GetNumBitmapWords(numBlocks));
+			nextBlockInChain = reinterpret_cast<int*>(labelTable + labelTableMask + 1);
+
+			// bits past the last block stay 0 (not free) so the scans never return them
+			for (int i = 0; i < GetNumBitmapWords(numBlocks); ++i)
+				new(&freeBitmap[i]) std::atomic<uint64_t>(0);
+			MarkFree(0, numBlocks);
+
+			for (int i = 0; i <= labelTableMask; ++i)
+				labelTable[i].firstBlock = -1;
 		}
 
-		uint8_t* GetBlock(const BlockLabelType& blockLabel)
+		// lock free. Adds a block to "blockChain" (-1 = empty chain), a chain only used by the caller that must be given back with FreeBlockChain
+		uint8_t* GetBlock(int& blockChain)
 		{
-			if (firstFreeBlock == nullptr)
+			int index = TakeFreeBlock();
+			if (index < 0)
 			{
 				return nullptr;
 			}
-			--freeBlocks;
 
-			MemoryControlBlock *controlBlock = firstFreeBlock;
-			firstFreeBlock = controlBlock->next;
+			nextBlockInChain[index] = blockChain;
+			blockChain = index;
+			if (committer != nullptr)
+			{
+				committer->Commit(&memoryBlocks[index], BlockSize);
+			}
+			return reinterpret_cast<uint8_t*>(&memoryBlocks[index]);
+		}
 
-			controlBlock->next = firstBlock;
-			firstBlock = controlBlock;
-			controlBlock->name = blockLabel;
-			return reinterpret_cast<uint8_t*>(&memoryBlocks[controlBlock->index]);
+		// lock free
+		void FreeBlockChain(int& blockChain)
+		{
+			while (blockChain >= 0)
+			{
+				int index = blockChain;
+				blockChain = nextBlockInChain[index]; // before the block is free, someone else may take it right after
+				MarkFree(index, 1);
+				++freeBlocks;
+				LowerFirstFreeWord(index / 64);
+			}
+		}
+
+		uint8_t* GetBlock(const BlockLabelType& blockLabel)
+		{
+			LabelEntry& entry = labelTable[FindLabelEntry(blockLabel)];
+			entry.name = blockLabel;
+			return GetBlock(entry.firstBlock);
 		}
 
 		uint8_t* GetConsecutiveBlocks(const BlockLabelType& blockLabel, int n)
 		{
-			if (firstFreeBlock == nullptr)
+			if (freeBlocks.load(std::memory_order_relaxed) < n)
 			{
 				return nullptr;
 			}
 
-			// memory block will go from "firstCandidate" to "lastCandidate"
-			MemoryControlBlock *firstCandidate = firstFreeBlock, *lastCandidate = firstFreeBlock, *firstFailedCandidate = nullptr, *lastFailedCandidate = nullptr;
-
-			firstFreeBlock = firstCandidate->next;
-			firstCandidate->next = nullptr;
-			firstCandidate->name = blockLabel;
-
-			size_t firstBlockIndex = firstCandidate->index, lastBlockIndex = firstCandidate->index;
-			do
+			// jump from free run to free run until one is long enough
+			for (int first = FindNext(0, true); first >= 0; )
 			{
-				MemoryControlBlock *lastCandidateFound = FindNeightbourBlock(firstBlockIndex, lastBlockIndex);
-				if (lastCandidateFound == nullptr)
+				int end = FindNext(first, false);
+				if (end - first < n)
 				{
-					assert(firstFreeBlock != nullptr);
-					// RESET
-					lastCandidate->next = firstFailedCandidate;
-					firstFailedCandidate = firstCandidate;
-					if(lastFailedCandidate == nullptr)
-						lastFailedCandidate = lastCandidate;
-
-					firstCandidate = firstFreeBlock;
-					lastCandidate = firstFreeBlock;
-
-					firstFreeBlock = firstCandidate->next;
-					firstCandidate->next = nullptr;
-					firstCandidate->name = blockLabel;
-
-					firstBlockIndex = firstCandidate->index;
-					lastBlockIndex = firstCandidate->index;
-					continue;
+					first = FindNext(end, true);
 				}
-				else if (lastCandidateFound->index == firstBlockIndex - 1)
+				else if (TryMarkUsed(first, n))
 				{
-					firstBlockIndex = lastCandidateFound->index;
+					UpdatePeakUsedBlocks(numBlocks - (freeBlocks -= n));
 
-					lastCandidateFound->next = firstCandidate;
-					firstCandidate = lastCandidateFound;
+					LabelEntry& entry = labelTable[FindLabelEntry(blockLabel)];
+					entry.name = blockLabel;
+					for (int index = first; index < first + n; ++index)
+					{
+						nextBlockInChain[index] = entry.firstBlock;
+						entry.firstBlock = index;
+					}
+					if (committer != nullptr)
+					{
+						committer->Commit(&memoryBlocks[first], n * BlockSize);
+					}
+					return reinterpret_cast<uint8_t*>(&memoryBlocks[first]);
 				}
 				else
 				{
-					assert(lastCandidateFound->index == lastBlockIndex + 1);
-					assert(lastCandidate->next == nullptr);
-
-					lastBlockIndex = lastCandidateFound->index;
-
-					lastCandidate->next = lastCandidateFound;
-					lastCandidate = lastCandidateFound;
+					first = FindNext(first, true); // a lock free GetBlock took part of the run, look again from here
 				}
-				lastCandidateFound->name = blockLabel;
-			} while ((lastBlockIndex + 1) - firstBlockIndex < n);
-
-			if (firstFailedCandidate != nullptr)
-			{
-				assert(lastFailedCandidate->next == nullptr);
-				lastFailedCandidate->next = firstFreeBlock;
-				firstFreeBlock = firstFailedCandidate;
 			}
-			else
+			return nullptr;
+		}
+
+		int GetNumBlocks() const { return numBlocks; }
+		int GetNumFreeBlocks() const { return freeBlocks.load(std::memory_order_relaxed); }
+		int GetPeakUsedBlocks() const { return peakUsedBlocks.load(std::memory_order_relaxed); }
+
+		void Free(const BlockLabelType& blockLabel)
+		{
+			int entry = FindLabelEntry(blockLabel);
+			if (labelTable[entry].firstBlock < 0)
 			{
-				assert(lastFailedCandidate == nullptr);
+				return; // nothing allocated with this label
 			}
 
-			lastCandidate->next = firstBlock;
-			firstBlock = firstCandidate;
+			FreeBlockChain(labelTable[entry].firstBlock);
+			RemoveLabelEntry(entry);
+		}
+
+	private:
+
+		struct Block {
+			uint8_t block[BlockSize];
+		} *memoryBlocks;
+
+		MemoryCommitter* committer;
+
+		struct LabelEntry
+		{
+			BlockLabelType name;
+			int firstBlock; // -1 if the entry is empty
+		};
+
+		int numBlocks;
+		std::atomic_int freeBlocks;
+		std::atomic_int firstFreeWord{ 0 }; // hint, there are probably no free blocks before this word of the bitmap
+		std::atomic_int peakUsedBlocks{ 0 };
+		int labelTableMask;
+		std::atomic<uint64_t> *freeBitmap;
+		LabelEntry *labelTable;
+		int *nextBlockInChain;
 
-			freeBlocks -= n;
-			return reinterpret_cast<uint8_t*>(&memoryBlocks[firstCandidate->index]);
+		static int GetNumBitmapWords(int numBlocks)
+		{
+			return (numBlocks + 63) / 64;
 		}
 
-		void Free(const BlockLabelType& blockLabel)
+		static size_t GetControlDataOffset(uint8_t *buffer, int numBlocks)
 		{
-			MemoryControlBlock **ptrToNext = &firstBlock;
-			while (*ptrToNext != nullptr)
-			{
-				if ((*ptrToNext)->name == blockLabel) // remove next if it has the name we are searching for
-				{
-					MemoryControlBlock *controlBlock = *ptrToNext;
-					*ptrToNext = controlBlock->next;
+			uintptr_t end = reinterpret_cast<uintptr_t>(buffer) + numBlocks * BlockSize;
+			return ((end + alignof(uint64_t) - 1) & ~(alignof(uint64_t) - 1)) - reinterpret_cast<uintptr_t>(buffer);
+		}
+
+		static size_t GetControlDataSize(int numBlocks)
+		{
+			size_t labelTableSize = 2;
+			while (labelTableSize < 2 * (size_t)numBlocks)
+				labelTableSize *= 2;
+			static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "the bitmap is an array of 64 bit words");
+			static_assert(alignof(LabelEntry) <= alignof(uint64_t), "label table goes right after the bitmap");
+			return GetNumBitmapWords(numBlocks) * sizeof(uint64_t) + labelTableSize * sizeof(LabelEntry) + numBlocks * sizeof(int);
+		}
 
-					controlBlock->next = firstFreeBlock;
-					firstFreeBlock = controlBlock;
+		static uint64_t GetWordMask(int first, int count)
+		{
+			return (count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1)) << (first % 64);
+		}
 
-					++freeBlocks;
+		// claims the lowest free block with a CAS on its word
+		int TakeFreeBlock()
+		{
+			// the hint can be too high if a block was freed while someone else moved it forward, so if nothing is found look again from the start
+			int hint = firstFreeWord.load(std::memory_order_relaxed);
+			for (int startWord = hint; ; startWord = 0)
+			{
+				for (int word = startWord; word < GetNumBitmapWords(numBlocks); ++word)
+				{
+					uint64_t bits = freeBitmap[word].load(std::memory_order_relaxed);
+					while (bits != 0)
+					{
+						int bit = FindFirstSet(bits);
+						if (freeBitmap[word].compare_exchange_weak(bits, bits & ~(uint64_t(1) << bit), std::memory_order_acquire, std::memory_order_relaxed))
+						{
+							UpdatePeakUsedBlocks(numBlocks - --freeBlocks);
+							if (word > hint)
+								firstFreeWord.compare_exchange_strong(hint, word, std::memory_order_relaxed);
+							return word * 64 + bit;
+						}
+					}
 				}
-				else
+				if (startWord == 0)
 				{
-					ptrToNext = &(*ptrToNext)->next; // move to the next
+					return -1;
 				}
 			}
 		}
 
-	private:
+		void UpdatePeakUsedBlocks(int usedBlocks)
+		{
+			int peak = peakUsedBlocks.load(std::memory_order_relaxed);
+			while (usedBlocks > peak && !peakUsedBlocks.compare_exchange_weak(peak, usedBlocks, std::memory_order_relaxed));
+		}
 
-		struct Block {
-			uint8_t block[BlockSize];
-		} *memoryBlocks;
+		void LowerFirstFreeWord(int word)
+		{
+			int hint = firstFreeWord.load(std::memory_order_relaxed);
+			while (word < hint && !firstFreeWord.compare_exchange_weak(hint, word, std::memory_order_relaxed));
+		}
 
-		struct MemoryControlBlock
+		// first block at or after "from" that is free (or used if "free" is false), as seen right now.
+		// Returns -1 if there are no more free blocks, numBlocks if there are no more used ones.
+		int FindNext(int from, bool free) const
 		{
-			BlockLabelType name;
-			size_t index;
-			MemoryControlBlock* next;
-		};
+			for (int word = from / 64; word < GetNumBitmapWords(numBlocks); ++word)
+			{
+				uint64_t bits = freeBitmap[word].load(std::memory_order_relaxed);
+				if (!free)
+					bits = ~bits;
+				if (word == from / 64)
+					bits &= ~uint64_t(0) << (from % 64);
+				if (bits != 0)
+				{
+					int index = word * 64 + FindFirstSet(bits);
+					return index < numBlocks ? index : (free ? -1 : numBlocks);
+				}
+			}
+			return free ? -1 : numBlocks;
+		}
+
+		void MarkFree(int first, int count)
+		{
+			while (count > 0)
+			{
+				int bitsInWord = (64 - first % 64 < count) ? 64 - first % 64 : count;
+				freeBitmap[first / 64].fetch_or(GetWordMask(first, bitsInWord), std::memory_order_release);
+				first += bitsInWord;
+				count -= bitsInWord;
+			}
+		}
 
-		MemoryControlBlock *firstFreeBlock;
-		MemoryControlBlock *firstBlock;
-		int freeBlocks;
+		// claims all the blocks or none of them
+		bool TryMarkUsed(int first, int count)
+		{
+			for (int taken = 0; taken < count; )
+			{
+				int index = first + taken;
+				int bitsInWord = (64 - index % 64 < count - taken) ? 64 - index % 64 : count - taken;
+				uint64_t mask = GetWordMask(index, bitsInWord);
 
+				uint64_t bits = freeBitmap[index / 64].load(std::memory_order_relaxed);
+				do
+				{
+					if ((bits & mask) != mask)
+					{
+						MarkFree(first, taken);
+						return false;
+					}
+				} while (!freeBitmap[index / 64].compare_exchange_weak(bits, bits & ~mask, std::memory_order_acquire, std::memory_order_relaxed));
 
-		MemoryControlBlock* FindNeightbourBlock(size_t firstIndex, size_t lastIndex)
+				taken += bitsInWord;
+			}
+			return true;
+		}
+
+		int GetLabelHomeIndex(const BlockLabelType& blockLabel) const
+		{
+			return (int)((((uint64_t)blockLabel) * 0x9E3779B97F4A7C15ull) >> 32) & labelTableMask;
+		}
+
+		// entry of the label, or the empty entry where it should go
+		int FindLabelEntry(const BlockLabelType& blockLabel) const
 		{
-			if (firstFreeBlock->index == firstIndex - 1 || firstFreeBlock->index == lastIndex + 1)
+			int index = GetLabelHomeIndex(blockLabel);
+			while (labelTable[index].firstBlock >= 0 && !(labelTable[index].name == blockLabel))
 			{
-				MemoryControlBlock* block = firstFreeBlock;
-				firstFreeBlock = block->next;
-				block->next = nullptr;
-				return block;
+				index = (index + 1) & labelTableMask;
 			}
+			return index;
+		}
 
-			for (MemoryControlBlock* block = firstFreeBlock->next, *prevBlock = firstFreeBlock; block != nullptr; prevBlock = block, block = block->next)
+		// backward shift deletion, so the table never fills with tombstones
+		void RemoveLabelEntry(int hole)
+		{
+			int index = hole;
+			for (;;)
 			{
-				if (block->index == firstIndex - 1 || block->index == lastIndex + 1)
+				labelTable[hole].firstBlock = -1;
+				for (;;)
 				{
-					prevBlock->next = block->next;
-					block->next = nullptr;
-					return block;
+					index = (index + 1) & labelTableMask;
+					if (labelTable[index].firstBlock < 0)
+					{
+						return;
+					}
+
+					// can the entry be moved to the hole without moving it before its home?
+					int home = GetLabelHomeIndex(labelTable[index].name);
+					if (index > hole ? (home <= hole || home > index) : (home <= hole && home > index))
+					{
+						break;
+					}
 				}
+				labelTable[hole] = labelTable[index];
+				hole = index;
 			}
-			return nullptr;
 		}
 	};
 
@@ -628,6 +1195,215 @@ namespace Utilities
 	};
 
 
+	// Double buffered linear allocator for data that only lives during a frame.
+	// Each thread takes "ChunkSize" pieces of the current buffer with an atomic add and bump allocates inside them
+	// without any synchronization. NextFrame() switches buffers and resets the new one in O(1) (offsets go back to 0,
+	// nothing is freed), so memory allocated during frame N stays valid until the end of frame N+1.
+	template<size_t MaxNumThreads, size_t ChunkSize = 64 * 1024>
+	struct FrameArena
+	{
+		FrameArena() = delete;
+		FrameArena(const FrameArena& original) = delete;
+		FrameArena& operator=(const FrameArena& original) = delete;
+
+		FrameArena(uint8_t *buffer, size_t size)
+			: bufferSize(size / 2)
+			, currentBuffer(0)
+			, frame(0)
+			, lastFrameUsedBytes(0)
+			, peakUsedBytes(0)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				buffers[i].memory = buffer + i * bufferSize;
+				buffers[i].offset.store(0);
+			}
+			for (auto& chunk : threadChunks)
+			{
+				chunk.current = chunk.end = nullptr;
+				chunk.frame = frame;
+			}
+		}
+
+		template<typename T>
+		MemoryBlock<T> alloc(int threadId, size_t N = 1)
+		{
+			assert(threadId >= 0);
+			assert(threadId < MaxNumThreads);
+
+			ThreadChunk& chunk = threadChunks[threadId];
+			if (chunk.frame != frame)
+			{
+				chunk.current = chunk.end = nullptr;
+				chunk.frame = frame;
+			}
+
+			const size_t bytes = sizeof(T) * N;
+			uintptr_t ptr = (reinterpret_cast<uintptr_t>(chunk.current) + alignof(T) - 1) & ~(alignof(T) - 1);
+			if (chunk.current == nullptr || ptr + bytes > reinterpret_cast<uintptr_t>(chunk.end))
+			{
+				if (bytes + alignof(T) > ChunkSize / 4)
+				{
+					// big allocations get their own piece, so we don't throw away what's left of the chunk
+					uint8_t* piece = TakeFromBuffer(bytes + alignof(T) - 1);
+					if (piece == nullptr)
+						return MemoryBlock<T>{ nullptr, 0 };
+					ptr = (reinterpret_cast<uintptr_t>(piece) + alignof(T) - 1) & ~(alignof(T) - 1);
+					return MemoryBlock<T>{ reinterpret_cast<T*>(ptr), bytes };
+				}
+
+				uint8_t* piece = TakeFromBuffer(ChunkSize);
+				if (piece == nullptr)
+					return MemoryBlock<T>{ nullptr, 0 };
+				chunk.current = piece;
+				chunk.end = piece + ChunkSize;
+				ptr = (reinterpret_cast<uintptr_t>(chunk.current) + alignof(T) - 1) & ~(alignof(T) - 1);
+			}
+
+			chunk.current = reinterpret_cast<uint8_t*>(ptr + bytes);
+			return MemoryBlock<T>{ reinterpret_cast<T*>(ptr), bytes };
+		}
+
+		// like alloc, for callers that can't go on without the memory: running out stops the program with a message that says
+		// how much was asked for and how much of the buffer this frame had used, so the capacity can be fixed.
+		template<typename T>
+		MemoryBlock<T> allocOrAbort(int threadId, size_t N = 1)
+		{
+			MemoryBlock<T> block = alloc<T>(threadId, N);
+			if (block.ptr == nullptr && N > 0)
+			{
+				size_t usedBytes = buffers[currentBuffer].offset.load();
+				fprintf(stderr, "FrameArena: out of memory, %zu bytes requested by thread %d with %zu of %zu bytes used this frame (peak %zu)\n",
+					sizeof(T) * N, threadId, usedBytes < bufferSize ? usedBytes : bufferSize, bufferSize, peakUsedBytes);
+				fflush(stderr);
+				assert(false);
+				std::abort();
+			}
+			return block;
+		}
+
+		// must be called when no thread is allocating (p.e. at the end of the frame, after all its jobs have finished)
+		void NextFrame()
+		{
+			size_t usedBytes = buffers[currentBuffer].offset.load(); // can go past the end when an allocation fails
+			lastFrameUsedBytes = usedBytes < bufferSize ? usedBytes : bufferSize;
+			if (lastFrameUsedBytes > peakUsedBytes)
+				peakUsedBytes = lastFrameUsedBytes;
+
+			currentBuffer ^= 1;
+			buffers[currentBuffer].offset.store(0);
+			++frame; // invalidates the chunks of every thread
+		}
+
+		size_t GetCapacity() const { return bufferSize; }
+		size_t GetLastFrameUsedBytes() const { return lastFrameUsedBytes; }
+		size_t GetPeakUsedBytes() const { return peakUsedBytes; }
+
+		// view to pass the arena to code that expects an allocator with "alloc<T>(N)" (p.e. ResizableArray).
+		// none of them can do anything without the memory, so it uses allocOrAbort.
+		struct ThreadAllocator
+		{
+			FrameArena *arena;
+			int threadId;
+
+			template<typename T>
+			MemoryBlock<T> alloc(size_t N = 1) { return arena->template allocOrAbort<T>(threadId, N); }
+
+			bool operator==(const ThreadAllocator& other) const { return arena == other.arena && threadId == other.threadId; }
+			bool operator!=(const ThreadAllocator& other) const { return !(*this == other); }
+		};
+
+		ThreadAllocator GetThreadAllocator(int threadId) { return ThreadAllocator{ this, threadId }; }
+
+	private:
+
+		uint8_t* TakeFromBuffer(size_t bytes)
+		{
+			Buffer& buffer = buffers[currentBuffer];
+			size_t offset = buffer.offset.fetch_add(bytes);
+			if (offset + bytes > bufferSize)
+				return nullptr;
+			return buffer.memory + offset;
+		}
+
+		struct Buffer
+		{
+			uint8_t *memory;
+			alignas(64) std::atomic<size_t> offset;
+		} buffers[2];
+
+		struct alignas(64) ThreadChunk
+		{
+			uint8_t *current, *end;
+			uint32_t frame;
+		} threadChunks[MaxNumThreads];
+
+		const size_t bufferSize;
+		int currentBuffer;
+		uint32_t frame;
+		size_t lastFrameUsedBytes, peakUsedBytes;
+	};
+
+
+	// "bytesAllocated" are the bytes asked for. "wastedTailBytes" is what was left unused at the end of a block
+	// when a stack allocator had to move to a new one.
+	struct AllocatorStats
+	{
+		uint64_t bytesAllocated = 0;
+		uint64_t blockRefills = 0;
+		uint64_t largeAllocations = 0;
+		uint64_t wastedTailBytes = 0;
+
+		AllocatorStats& operator+=(const AllocatorStats& other)
+		{
+			bytesAllocated += other.bytesAllocated;
+			blockRefills += other.blockRefills;
+			largeAllocations += other.largeAllocations;
+			wastedTailBytes += other.wastedTailBytes;
+			return *this;
+		}
+
+		AllocatorStats operator-(const AllocatorStats& other) const
+		{
+			return { bytesAllocated - other.bytesAllocated, blockRefills - other.blockRefills, largeAllocations - other.largeAllocations, wastedTailBytes - other.wastedTailBytes };
+		}
+	};
+
+	// usage of a label since it was handed out by GetUnusedLabel
+	struct LabelStats
+	{
+		const char* systemName;
+		uint64_t label;
+		AllocatorStats stats;
+		int blocksInUse, peakBlocksInUse;
+	};
+
+	// each counter is only written by one thread and read by anyone, so a relaxed load + store is enough (no locked add)
+	struct TelemetryCounters
+	{
+		std::atomic<uint64_t> bytesAllocated{ 0 }, blockRefills{ 0 }, largeAllocations{ 0 }, wastedTailBytes{ 0 };
+
+		static void Add(std::atomic<uint64_t>& counter, uint64_t value)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		AllocatorStats Get() const
+		{
+			return { bytesAllocated.load(std::memory_order_relaxed), blockRefills.load(std::memory_order_relaxed), largeAllocations.load(std::memory_order_relaxed), wastedTailBytes.load(std::memory_order_relaxed) };
+		}
+
+		void Reset()
+		{
+			bytesAllocated.store(0, std::memory_order_relaxed);
+			blockRefills.store(0, std::memory_order_relaxed);
+			largeAllocations.store(0, std::memory_order_relaxed);
+			wastedTailBytes.store(0, std::memory_order_relaxed);
+		}
+	};
+
+	// Each thread allocates from its own stack allocator per label, refilled with blocks taken lock free from "base".
+	// The mutex is only for the label bookkeeping: large allocations, Free(label) and getting/returning labels.
 	template<typename BlockLabelType, size_t BlockSize, size_t MaxNumThreads>
 	struct ThreadedLabeledBlockAllocator
 	{
@@ -637,8 +1413,9 @@ namespace Utilities
 		ThreadedLabeledBlockAllocator(const ThreadedLabeledBlockAllocator& original) = delete;
 		ThreadedLabeledBlockAllocator& operator=(const ThreadedLabeledBlockAllocator& original) = delete;
 
-		ThreadedLabeledBlockAllocator(uint8_t *buffer, size_t size)
-			: base(buffer, size)
+		// "committer" is optional, for buffers that are only reserved (see MemoryCommitter)
+		ThreadedLabeledBlockAllocator(uint8_t *buffer, size_t size, MemoryCommitter* committer = nullptr)
+			: base(buffer, size, true, committer)
 			, internalMemoryAllocator(base.GetBlock(InternalDataLabel), BlockSize)
 		{
 
@@ -654,7 +1431,7 @@ namespace Utilities
 			else
 			{
 				std::unique_lock<std::mutex> lock(mutex);
-				return LargeAlloc<T>(label, N);
+				return LargeAlloc<T>(label, threadId, N);
 			}
 		}
 
@@ -681,7 +1458,7 @@ namespace Utilities
 				{
 					// TODO can be MUCH smarter
 					std::unique_lock<std::mutex> lock(mutex);
-					MemoryBlock<T> result = LargeAlloc<T>(label, N);
+					MemoryBlock<T> result = LargeAlloc<T>(label, threadId, N);
 
 					for (int i = 0; i < N && i * sizeof(T) < oldBlock.size; ++i)
 					{
@@ -697,26 +1474,27 @@ namespace Utilities
 		{
 			assert(blockLabel != InternalDataLabel);
 			std::unique_lock<std::mutex> lock(mutex);
-			base.Free(blockLabel);
 
-			for (int t = 0; t < MaxNumThreads; ++t)
+			FreeLabel* usedLabel = FindUsedLabel(blockLabel);
+			if (usedLabel != nullptr)
 			{
-				PerThreadInfo* threadInfo = perThreadInfo[t];
-				while (threadInfo != nullptr)
-				{
-					auto allocator = threadInfo->memoryAllocators.Get(blockLabel);
-					if (allocator != nullptr)
-					{
-						// Trust me, I'm an engineer (-:
-						StackAllocator* newAllocator = new(*allocator.data)StackAllocator(nullptr, 0);
-						assert(newAllocator == *allocator.data);
-						break;
-					}
-
-					threadInfo = threadInfo->next;
-				}
+				int blocksInUse = GetLabelBlocksInUse(usedLabel);
+				if (blocksInUse > usedLabel->peakBlocks)
+					usedLabel->peakBlocks = blocksInUse;
+				usedLabel->largeBlocks = 0;
 			}
 
+			base.Free(blockLabel);
+
+			ForEachLabelAllocator(blockLabel, [this](LabelAllocator* labelAllocator)
+			{
+				base.FreeBlockChain(labelAllocator->blockChain);
+				labelAllocator->blocks.store(0, std::memory_order_relaxed);
+
+				// Trust me, I'm an engineer (-:
+				StackAllocator* newAllocator = new(&labelAllocator->allocator)StackAllocator(nullptr, 0);
+				assert(newAllocator == &labelAllocator->allocator);
+			});
 		}
 
 		BlockLabelType GetUnusedLabel(const char* systemName)
@@ -746,6 +1524,8 @@ namespace Utilities
 			}
 
 			freeLabel->systemName = systemName;
+			freeLabel->largeStats = {};
+			freeLabel->largeBlocks = freeLabel->peakBlocks = 0;
 			return freeLabel->label;
 		}
 
@@ -755,13 +1535,72 @@ namespace Utilities
 
 			// TODO this can be lockless all the time
 			std::unique_lock<std::mutex> lock(mutex);
-			FreeLabel* freeLabel = firstUsedLabel;
-			firstUsedLabel = freeLabel->nextLabel;
-
+			FreeLabel** ptrToNext = &firstUsedLabel;
+			while ((*ptrToNext)->label != label)
+			{
+				ptrToNext = &(*ptrToNext)->nextLabel;
+				assert(*ptrToNext != nullptr); // not a used label
+			}
+			FreeLabel* freeLabel = *ptrToNext;
+			*ptrToNext = freeLabel->nextLabel;
 
-			freeLabel->label = label;
 			freeLabel->nextLabel = firstFreeLabel;
 			firstFreeLabel = freeLabel;
+
+			// the next system that gets this label starts counting from 0
+			ForEachLabelAllocator(label, [](LabelAllocator* labelAllocator) { labelAllocator->counters.Reset(); });
+		}
+
+		// TELEMETRY
+
+		AllocatorStats GetThreadStats(int threadId) const
+		{
+			return perThreadData[threadId].counters.Get();
+		}
+
+		AllocatorStats GetTotalStats() const
+		{
+			AllocatorStats result;
+			for (int t = 0; t < MaxNumThreads; ++t)
+				result += GetThreadStats(t);
+			return result;
+		}
+
+		// counters of the frame that ended with the last NextFrame, and the highest value of each counter in a frame
+		AllocatorStats GetLastFrameStats() const { return lastFrameStats; }
+		AllocatorStats GetPeakFrameStats() const { return peakFrameStats; }
+
+		int GetNumBlocks() const { return base.GetNumBlocks(); }
+		int GetBlocksInUse() const { return base.GetNumBlocks() - base.GetNumFreeBlocks(); }
+		int GetPeakBlocksInUse() const { return base.GetPeakUsedBlocks(); }
+		static constexpr size_t GetBlockSize() { return BlockSize; }
+
+		// calls "func(const LabelStats&)" for every label that has been handed out and not returned
+		template<typename Func>
+		void ForEachLabelStats(const Func& func)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (FreeLabel* usedLabel = firstUsedLabel; usedLabel != nullptr; usedLabel = usedLabel->nextLabel)
+			{
+				LabelStats labelStats = { usedLabel->systemName, (uint64_t)usedLabel->label, usedLabel->largeStats, GetLabelBlocksInUse(usedLabel), usedLabel->peakBlocks };
+				ForEachLabelAllocator(usedLabel->label, [&labelStats](LabelAllocator* labelAllocator) { labelStats.stats += labelAllocator->counters.Get(); });
+				if (labelStats.blocksInUse > labelStats.peakBlocksInUse)
+					labelStats.peakBlocksInUse = labelStats.blocksInUse;
+				func(labelStats);
+			}
+		}
+
+		// call once per frame, when no job is allocating
+		void NextFrame()
+		{
+			AllocatorStats total = GetTotalStats();
+			lastFrameStats = total - frameStartStats;
+			frameStartStats = total;
+
+			peakFrameStats.bytesAllocated = lastFrameStats.bytesAllocated > peakFrameStats.bytesAllocated ? lastFrameStats.bytesAllocated : peakFrameStats.bytesAllocated;
+			peakFrameStats.blockRefills = lastFrameStats.blockRefills > peakFrameStats.blockRefills ? lastFrameStats.blockRefills : peakFrameStats.blockRefills;
+			peakFrameStats.largeAllocations = lastFrameStats.largeAllocations > peakFrameStats.largeAllocations ? lastFrameStats.largeAllocations : peakFrameStats.largeAllocations;
+			peakFrameStats.wastedTailBytes = lastFrameStats.wastedTailBytes > peakFrameStats.wastedTailBytes ? lastFrameStats.wastedTailBytes : peakFrameStats.wastedTailBytes;
 		}
 
 		struct LabelGuard
@@ -786,8 +1625,44 @@ namespace Utilities
 			return result;
 		}
 
+		// view to pass a label to code that expects an allocator with "alloc<T>(N)" (p.e. ResizableArray, StlAllocator).
+		// Everything allocated through it lives until Free(label).
+		struct ThreadAllocator
+		{
+			ThreadedLabeledBlockAllocator *allocator;
+			BlockLabelType label;
+			int threadId;
+
+			template<typename T>
+			MemoryBlock<T> alloc(size_t N = 1) { return allocator->template alloc<T>(label, threadId, N); }
+
+			bool operator==(const ThreadAllocator& other) const { return allocator == other.allocator && label == other.label && threadId == other.threadId; }
+			bool operator!=(const ThreadAllocator& other) const { return !(*this == other); }
+		};
+
+		ThreadAllocator GetThreadAllocator(BlockLabelType label, int threadId) { return ThreadAllocator{ this, label, threadId }; }
+
 	private:
 
+		// what a thread uses to allocate from a label: a stack allocator over the last block plus the chain of all its blocks for the label
+		struct LabelAllocator
+		{
+			StackAllocator allocator{ nullptr, 0 };
+			int blockChain = -1;
+			std::atomic_int blocks{ 0 }; // in "blockChain"
+			TelemetryCounters counters;
+		};
+
+		struct FreeLabel
+		{
+			BlockLabelType label;
+			const char* systemName;
+			FreeLabel *nextLabel;
+
+			// only touched with the mutex
+			AllocatorStats largeStats;
+			int largeBlocks, peakBlocks;
+		};
 
 		template<typename T, typename AllocFunc>
 		MemoryBlock<T> InnerAlloc(BlockLabelType label, int threadId, const AllocFunc& allocFunc, MemoryBlock<T> oldBlock = {})
@@ -795,87 +1670,102 @@ namespace Utilities
 			assert(label != InternalDataLabel);
 			assert(threadId >= 0);
 			assert(threadId < MaxNumThreads);
-			StackAllocator* allocator = GetStackAllocator(label, threadId);
+			LabelAllocator* labelAllocator = GetLabelAllocator(label, threadId);
 
-			MemoryBlock<T> p = allocFunc(allocator);
+			MemoryBlock<T> p = allocFunc(&labelAllocator->allocator);
 			if (p.ptr == nullptr)
 			{
 				assert(oldBlock.ptr == nullptr); // TODO realloc here
 
-				RefillAllocator(allocator, label);
-				MemoryBlock<T> p2 = allocFunc(allocator);
-				assert(p2.ptr != nullptr);
-				return p2;
-			}
-			else
-			{
-				return p;
+				RefillAllocator(labelAllocator, threadId);
+				p = allocFunc(&labelAllocator->allocator);
+				assert(p.ptr != nullptr);
 			}
+
+			TelemetryCounters::Add(labelAllocator->counters.bytesAllocated, p.size);
+			TelemetryCounters::Add(perThreadData[threadId].counters.bytesAllocated, p.size);
+			return p;
 		}
 
 		template<typename T>
-		MemoryBlock<T> LargeAlloc(BlockLabelType label, size_t num = 1)
+		MemoryBlock<T> LargeAlloc(BlockLabelType label, int threadId, size_t num = 1)
 		{
-			assert(BlockSize < sizeof(T) * num);
+			assert(BlockSize <= sizeof(T) * num); // exactly one block also ends here (p.e. a std::vector doubling up to BlockSize)
 			size_t requestedSize = sizeof(T) * num;
 			int numBlocks = (int)((requestedSize - 1) / BlockSize) + 1;
-			assert(numBlocks > 1);
+			assert(numBlocks >= 1);
 			assert(BlockSize * numBlocks >= sizeof(T) * num);
 			assert(BlockSize * (numBlocks - 1) < sizeof(T) * num);
 			uint8_t *ptr = base.GetConsecutiveBlocks(label, numBlocks);
+
+			TelemetryCounters& counters = perThreadData[threadId].counters;
+			TelemetryCounters::Add(counters.largeAllocations, 1);
+			TelemetryCounters::Add(counters.bytesAllocated, requestedSize);
+			FreeLabel* usedLabel = FindUsedLabel(label);
+			if (usedLabel != nullptr && ptr != nullptr)
+			{
+				usedLabel->largeStats.largeAllocations += 1;
+				usedLabel->largeStats.bytesAllocated += requestedSize;
+				usedLabel->largeBlocks += numBlocks;
+			}
+
 			return MemoryBlock<T>{ reinterpret_cast<T*>(ptr), BlockSize * numBlocks };
 		}
 
-		StackAllocator* GetStackAllocator(BlockLabelType label, int threadId)
+		LabelAllocator* GetLabelAllocator(BlockLabelType label, int threadId)
 		{
 			assert(label != InternalDataLabel);
 			assert(threadId >= 0);
 			assert(threadId < MaxNumThreads);
 
-			PerThreadInfo* threadInfo = perThreadInfo[threadId], *lastThreadInfo = nullptr;
+			PerThreadInfo** threadInfoPtr = &perThreadData[threadId].firstInfo;
 			for(;;)
 			{
-				if (threadInfo == nullptr)
+				if (*threadInfoPtr == nullptr)
 				{
-					threadInfo = InternalAlloc<PerThreadInfo>();
+					PerThreadInfo* threadInfo = InternalAlloc<PerThreadInfo>(threadId);
 					PerThreadInfo* newThreadInfo = new(threadInfo)PerThreadInfo();
 					assert(newThreadInfo == threadInfo);
-					if (lastThreadInfo == nullptr)
-						perThreadInfo[threadId] = threadInfo;
-					else
-						lastThreadInfo->next = threadInfo;
+					*threadInfoPtr = threadInfo;
 				}
 
-				auto allocator = threadInfo->memoryAllocators.Get(label);
-				if (allocator != nullptr)
+				PerThreadInfo* threadInfo = *threadInfoPtr;
+				auto labelAllocator = threadInfo->memoryAllocators.Get(label);
+				if (labelAllocator != nullptr)
 				{
-					return *allocator.data;
+					return *labelAllocator.data;
 				}
 				else if (threadInfo->memoryAllocators.Occupancy() < 0.66f)
 				{
-					StackAllocator *allocator = InternalAlloc<StackAllocator>();
-					*threadInfo->memoryAllocators.Reserve(label).data = allocator;
-					RefillAllocator(allocator, label);
-					return allocator;
+					LabelAllocator *newLabelAllocator = new(InternalAlloc<LabelAllocator>(threadId))LabelAllocator();
+					*threadInfo->memoryAllocators.Reserve(label).data = newLabelAllocator;
+					RefillAllocator(newLabelAllocator, threadId);
+					return newLabelAllocator;
 				}
-				else if (threadInfo->next == nullptr)
-				{
-					threadInfo->next = InternalAlloc<PerThreadInfo>();
-				}
-				
-				lastThreadInfo = threadInfo;
-				threadInfo = threadInfo->next;
+
+				threadInfoPtr = &threadInfo->next;
 			}
 		}
 
-		void RefillAllocator(StackAllocator* allocator, BlockLabelType label)
+		// lock free, the chain of blocks of a label allocator only belongs to its thread
+		void RefillAllocator(LabelAllocator* labelAllocator, int threadId)
 		{
-			assert(label != InternalDataLabel);
-			std::unique_lock<std::mutex> lock(mutex);
+			uint8_t* block = base.GetBlock(labelAllocator->blockChain);
+			assert(block != nullptr); // out of memory
+
+			const StackAllocator& oldAllocator = labelAllocator->allocator;
+			uint64_t wastedTailBytes = oldAllocator.buffer != nullptr ? oldAllocator.size - oldAllocator.currentOffset : 0;
+			TelemetryCounters* counters[] = { &labelAllocator->counters, &perThreadData[threadId].counters };
+			for (TelemetryCounters* c : counters)
+			{
+				TelemetryCounters::Add(c->blockRefills, 1);
+				TelemetryCounters::Add(c->wastedTailBytes, wastedTailBytes);
+			}
+			labelAllocator->blocks.store(labelAllocator->blocks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
 
 			// Trust me, I'm an engineer (-:
-			StackAllocator* newAllocator = new(allocator)StackAllocator(base.GetBlock(label), BlockSize);
-			assert(newAllocator == allocator);
+			StackAllocator* newAllocator = new(&labelAllocator->allocator)StackAllocator(block, BlockSize);
+			assert(newAllocator == &labelAllocator->allocator);
 		}
 
 		template<typename T>
@@ -896,6 +1786,57 @@ namespace Utilities
 			return p;
 		}
 
+		// lock free version for the per thread data, never freed (like InternalDataLabel)
+		template<typename T>
+		T* InternalAlloc(int threadId)
+		{
+			PerThreadData& threadData = perThreadData[threadId];
+
+			T* p = threadData.internalMemoryAllocator.template alloc<T>();
+			while (p == nullptr)
+			{
+				// Trust me, I'm an engineer (-:
+				StackAllocator* newAllocator = new(&threadData.internalMemoryAllocator)StackAllocator(base.GetBlock(threadData.internalBlockChain), BlockSize);
+				assert(newAllocator == &threadData.internalMemoryAllocator);
+
+				p = threadData.internalMemoryAllocator.template alloc<T>();
+			}
+
+			return p;
+		}
+
+		template<typename Func>
+		void ForEachLabelAllocator(BlockLabelType label, const Func& func)
+		{
+			for (int t = 0; t < MaxNumThreads; ++t)
+			{
+				for (PerThreadInfo* threadInfo = perThreadData[t].firstInfo; threadInfo != nullptr; threadInfo = threadInfo->next)
+				{
+					auto labelAllocator = threadInfo->memoryAllocators.Get(label);
+					if (labelAllocator != nullptr)
+					{
+						func(*labelAllocator.data);
+						break;
+					}
+				}
+			}
+		}
+
+		FreeLabel* FindUsedLabel(BlockLabelType label)
+		{
+			FreeLabel* usedLabel = firstUsedLabel;
+			while (usedLabel != nullptr && usedLabel->label != label)
+				usedLabel = usedLabel->nextLabel;
+			return usedLabel;
+		}
+
+		int GetLabelBlocksInUse(FreeLabel* usedLabel)
+		{
+			int blocks = usedLabel->largeBlocks;
+			ForEachLabelAllocator(usedLabel->label, [&blocks](LabelAllocator* labelAllocator) { blocks += labelAllocator->blocks.load(std::memory_order_relaxed); });
+			return blocks;
+		}
+
 		struct PassThroughHasher
 		{
 			uint64_t operator()(const BlockLabelType& t) { return ((uint64_t)t) * 17; } // a prime number to mix it up
@@ -906,20 +1847,24 @@ namespace Utilities
 		StackAllocator internalMemoryAllocator;
 		struct PerThreadInfo
 		{
-			HashMap<BlockLabelType, StackAllocator*, 63, PassThroughHasher> memoryAllocators;
+			HashMap<BlockLabelType, LabelAllocator*, 63, PassThroughHasher> memoryAllocators;
 			PerThreadInfo* next;
-		} *perThreadInfo[MaxNumThreads] = {};
+		};
 
-		struct FreeLabel
+		// only used by its own thread (and by Free, with the mutex). Aligned so the threads don't share cache lines
+		struct alignas(64) PerThreadData
 		{
-			BlockLabelType label;
-			const char* systemName;
-			FreeLabel *nextLabel;
-		};
+			PerThreadInfo* firstInfo = nullptr;
+			StackAllocator internalMemoryAllocator{ nullptr, 0 };
+			int internalBlockChain = -1;
+			TelemetryCounters counters;
+		} perThreadData[MaxNumThreads];
 
 		FreeLabel* firstFreeLabel = nullptr, *firstUsedLabel = nullptr;
 		BlockLabelType lastUsedLabel = InternalDataLabel;
 
+		AllocatorStats frameStartStats, lastFrameStats, peakFrameStats;
+
 
 
 		// Ideas:
@@ -976,5 +1921,10 @@ namespace Utilities
 
 
 	using DefaultAllocator = ThreadedLabeledBlockAllocator<DefaultAllocatorLabel, 2 * 1024 * 1024, Profiler::MaxNumThreads>;
+	using DefaultFrameArena = FrameArena<Profiler::MaxNumThreads>;
+
+	// number of calls to the global operator new, every overload (plain, array, nothrow, aligned). The counting operators are in
+	// the platform layer, they let us check that systems don't touch the heap once they are warmed up. Direct malloc isn't counted.
+	uint64_t GetHeapAllocationCount();
 	
 }
@@ -6,6 +6,7 @@
 
 #include "Profiler.hh"
 #include "TaskManagerHelpers.hh"
+#include "ParallelAlgorithms.hh"
 
 namespace Game
 {
@@ -52,14 +53,17 @@ namespace Game
 			//float restitution, friction;
 		};
 
+		// contact groups live in the frame arena, they are rebuilt every frame
 		struct ContactGroup
 		{
-			std::vector<unsigned> objectIndexes;
-			std::vector<ContactData> contacts;
+			Utilities::ResizableArray<unsigned> objectIndexes;
+			Utilities::ResizableArray<ContactData> contacts;
 		};
 
-		std::vector<ContactGroup> contactGroups[Utilities::Profiler::MaxNumThreads-1];
-		unsigned contactGroupsSizes[Utilities::Profiler::MaxNumThreads-1];
+		Utilities::ResizableArray<ContactGroup> contactGroups[Utilities::Profiler::MaxNumThreads-1];
+
+		// operator new calls (any overload) during the last physics update. Should stay at 0. malloc isn't counted.
+		uint64_t physicsHeapAllocations = 0;
 	};
 
 	GameData* InitGamedata(const InputData & input)
@@ -104,6 +108,11 @@ namespace Game
 		return gameData;
 	}
 
+	uint64_t GetPhysicsHeapAllocations(const GameData * gameData)
+	{
+		return gameData->physicsHeapAllocations;
+	}
+
 	void FinalizeGameData(GameData *& gameData)
 	{
 		if (gameData != nullptr)
@@ -198,7 +207,6 @@ namespace Game
 			//}
 			},
 			"Update Positions",
-			MaxGameObjects / (Utilities::Profiler::MaxNumThreads - 1),
 			MaxGameObjects);
 
 		context.DoAndWait(&job);
@@ -231,46 +239,39 @@ namespace Game
 	inline void GenerateContactGroups(GameData *& gameData, int createdGroups[Utilities::Profiler::MaxNumThreads-1][MaxGameObjects],
 									  const GameData::ContactData & contact, const Utilities::TaskManager::JobContext & context)
 	{
+		auto frameAllocator = context.GetFrameAllocator();
+
 		auto it = createdGroups[context.threadIndex][contact.a]; // busquem si ja tenim alguna colisi amb l'objecte "a"
 		if (it == -1)
 		{
 			it = createdGroups[context.threadIndex][contact.b]; // busquem si ja tenim alguna colisi amb l'objecte "b"
 			if (it == -1)
 			{
-				if (gameData->contactGroupsSizes[context.threadIndex] < gameData->contactGroups[context.threadIndex].size())
-				{
-					gameData->contactGroups[context.threadIndex][gameData->contactGroupsSizes[context.threadIndex]++] = std::move(GameData::ContactGroup{
-						{ contact.a , contact.b }, // game object indexes
-						{ contact } // ContactData
-					}); // creem la llista de colisions nova
-				}
-				else
-				{
-					gameData->contactGroups[context.threadIndex].emplace_back(GameData::ContactGroup{
-						{ contact.a , contact.b }, // game object indexes
-						{ contact } // ContactData
-					}); // creem la llista de colisions nova
-				}
-
-				createdGroups[context.threadIndex][contact.a] = gameData->contactGroups[context.threadIndex].size() - 1; // guardem referncia a aquesta llista
-				createdGroups[context.threadIndex][contact.b] = gameData->contactGroups[context.threadIndex].size() - 1; // per cada objecte per trobarla
+				GameData::ContactGroup group;
+				group.objectIndexes.Push(contact.a, frameAllocator); // game object indexes
+				group.objectIndexes.Push(contact.b, frameAllocator);
+				group.contacts.Push(contact, frameAllocator); // ContactData
+				gameData->contactGroups[context.threadIndex].Push(group, frameAllocator); // creem la llista de colisions nova
+
+				createdGroups[context.threadIndex][contact.a] = (int)gameData->contactGroups[context.threadIndex].size - 1; // guardem referncia a aquesta llista
+				createdGroups[context.threadIndex][contact.b] = (int)gameData->contactGroups[context.threadIndex].size - 1; // per cada objecte per trobarla
 			}
 			else
 			{
-				gameData->contactGroups[context.threadIndex][it].contacts.push_back(contact); // afegim la colisi a la llista
-				gameData->contactGroups[context.threadIndex][it].objectIndexes.push_back(contact.a);
+				gameData->contactGroups[context.threadIndex][it].contacts.Push(contact, frameAllocator); // afegim la colisi a la llista
+				gameData->contactGroups[context.threadIndex][it].objectIndexes.Push(contact.a, frameAllocator);
 				createdGroups[context.threadIndex][contact.a] = it; // guardem referncia de l'objecte que no hem trobat abans
 			}
 		}
 		else
 		{
 			auto &groupA = it;
-			gameData->contactGroups[context.threadIndex][groupA].contacts.push_back(contact);
+			gameData->contactGroups[context.threadIndex][groupA].contacts.Push(contact, frameAllocator);
 
 			auto itB = createdGroups[context.threadIndex][contact.b];
 			if (itB == -1)
 			{
-				gameData->contactGroups[context.threadIndex][groupA].objectIndexes.push_back(contact.b);
+				gameData->contactGroups[context.threadIndex][groupA].objectIndexes.Push(contact.b, frameAllocator);
 				createdGroups[context.threadIndex][contact.b] = groupA;
 			}
 			else
@@ -283,19 +284,19 @@ namespace Game
 
 					// 1 - copiem tot el grup anterior
 					for (auto &cnt : gameData->contactGroups[context.threadIndex][groupB].contacts)
-						gameData->contactGroups[context.threadIndex][groupA].contacts.push_back(cnt);
+						gameData->contactGroups[context.threadIndex][groupA].contacts.Push(cnt, frameAllocator);
 
 					// 2 - copiem els elements del segon grup i actualitzem el mapa de grups
 					for (auto &index : gameData->contactGroups[context.threadIndex][groupB].objectIndexes)
 					{
 						if (index != contact.a)
-							gameData->contactGroups[context.threadIndex][groupA].objectIndexes.push_back(index);
+							gameData->contactGroups[context.threadIndex][groupA].objectIndexes.Push(index, frameAllocator);
 						createdGroups[context.threadIndex][index] = groupA;
 					}
 
 					// 3 - marquem el grup com a buit
-					gameData->contactGroups[context.threadIndex][groupB].objectIndexes.clear();
-					gameData->contactGroups[context.threadIndex][groupB].contacts.clear();
+					gameData->contactGroups[context.threadIndex][groupB].objectIndexes.Clear();
+					gameData->contactGroups[context.threadIndex][groupB].contacts.Clear();
 				}
 			}
 		}
@@ -315,65 +316,26 @@ namespace Game
 				gameData->extremes[i * 2 + 1] = { gameData->gameObjects.getMaxX(i), i, false };
 			},
 			"Generate Extremes",
-			MaxGameObjects / (Utilities::Profiler::MaxNumThreads - 1),
 			MaxGameObjects);
 		context.DoAndWait(&jobExtremes);
 
-		static constexpr auto NumMergeGroups = 8u; // NOTE: Only power of 2
-		std::atomic_int groupCounter = 0;
-		auto sortJob = Utilities::TaskManager::CreateLambdaJob(
-			[&gameData, &groupCounter](int i, const Utilities::TaskManager::JobContext& context)
-		{
-			const int index = groupCounter++;
-			const int first = GameData::ExtremesSize * (float(index) / float(NumMergeGroups));
-			const int last = GameData::ExtremesSize * (float(index + 1) / float(NumMergeGroups));
-			std::sort(gameData->extremes + first, gameData->extremes + last);
-		},
-			"Divide & Sort Extremes",
-			NumMergeGroups
-		);
-		context.DoAndWait(&sortJob);
-
-		auto mergeDivisions = NumMergeGroups;
-		GameData::Extreme copiedExtremes[GameData::ExtremesSize];
-		while (mergeDivisions > 1)
-		{
-			mergeDivisions /= 2;
-			groupCounter = 0;
-			std::copy(gameData->extremes, gameData->extremes + GameData::ExtremesSize, copiedExtremes);
-			auto mergeJob = Utilities::TaskManager::CreateLambdaJob(
-				[&gameData, &groupCounter, &mergeDivisions, &copiedExtremes](int i, const Utilities::TaskManager::JobContext& context)
-			{
-				const int index = groupCounter++;
-				const int first = GameData::ExtremesSize * (float(index) / float(mergeDivisions));
-				const int middle = first + float(GameData::ExtremesSize / mergeDivisions) / 2.0;
-				const int last = GameData::ExtremesSize * (float(index + 1) / float(mergeDivisions));
-				std::merge(copiedExtremes + first,
-						   copiedExtremes + middle,
-						   copiedExtremes + middle,
-						   copiedExtremes + last,
-						   gameData->extremes + first);
-			},
-				"Merge Extremes",
-				mergeDivisions
-				);
-			context.DoAndWait(&mergeJob);
-		}
+		auto copiedExtremes = context.frameAlloc<GameData::Extreme>(GameData::ExtremesSize);
+		Utilities::TaskManager::ParallelSort(context, gameData->extremes, gameData->extremes + GameData::ExtremesSize, copiedExtremes.ptr);
 		/*context.AddProfileMark(Utilities::Profiler::MarkerType::BEGIN_FUNCTION, nullptr, "Sort");
 		std::sort(gameData.extremes, gameData.extremes + GameData::ExtremesSize,
 				   [](const GameData::Extreme & lhs, const GameData::Extreme & rhs) { return (lhs.val < rhs.val); });
 		context.AddProfileMark(Utilities::Profiler::MarkerType::END_FUNCTION, nullptr, "Sort");*/
 
 		context.AddProfileMark(Utilities::Profiler::MarkerType::BEGIN_FUNCTION, nullptr, "Declarate Groups");
-		int createdGroups[Utilities::Profiler::MaxNumThreads-1][MaxGameObjects];
-		for (auto &group : createdGroups)
-			for (auto &x : group)
-				x = -1;
-		std::fill(gameData->contactGroupsSizes, gameData->contactGroupsSizes + Utilities::Profiler::MaxNumThreads-1, 0);
+		auto createdGroupsBlock = context.frameAlloc<int>((Utilities::Profiler::MaxNumThreads-1) * MaxGameObjects);
+		std::fill(createdGroupsBlock.ptr, createdGroupsBlock.ptr + (Utilities::Profiler::MaxNumThreads-1) * MaxGameObjects, -1);
+		int (*createdGroups)[MaxGameObjects] = reinterpret_cast<int(*)[MaxGameObjects]>(createdGroupsBlock.ptr);
+		for (auto &contactGroups : gameData->contactGroups)
+			contactGroups = Utilities::ResizableArray<GameData::ContactGroup>(); // els grups del frame anterior es queden a l'arena
 		context.AddProfileMark(Utilities::Profiler::MarkerType::END_FUNCTION, nullptr, "Declarate Groups");
 
 		auto jobSFG = Utilities::TaskManager::CreateLambdaBatchedJob(
-			[&gameData, &renderData, &createdGroups](int i, const Utilities::TaskManager::JobContext& context)
+			[&gameData, &renderData, createdGroups](int i, const Utilities::TaskManager::JobContext& context)
 			{
 				if (gameData->extremes[i].min)
 				{
@@ -392,7 +354,6 @@ namespace Game
 				}
 			},
 			"Sweep + Fine-Grained + Collision Groups",
-			GameData::ExtremesSize / (GameData::ExtremesSize < Utilities::Profiler::MaxNumThreads-1 ? 1 : Utilities::Profiler::MaxNumThreads-1) / 5,
 			GameData::ExtremesSize
 		);
 		context.DoAndWait(&jobSFG);
@@ -447,26 +408,30 @@ namespace Game
 	void SolveCollisionGroups(GameData *& gameData, const Utilities::TaskManager::JobContext &context)
 	{
 		context.AddProfileMark(Utilities::Profiler::MarkerType::BEGIN_FUNCTION, nullptr, "Merge Contact Groups");
-		std::vector<GameData::ContactGroup> mergedContactGroups;
-		for (int i = 0; i < Utilities::Profiler::MaxNumThreads-1; ++i)
-			if (gameData->contactGroupsSizes[i])
-				mergedContactGroups.insert(mergedContactGroups.end(), 
-										   gameData->contactGroups[i].begin(), 
-										   gameData->contactGroups[i].begin() + gameData->contactGroupsSizes[i]);
+		int numMergedContactGroups = 0;
+		for (auto &contactGroups : gameData->contactGroups)
+			numMergedContactGroups += (int)contactGroups.size;
+
+		GameData::ContactGroup* mergedContactGroups = context.frameAlloc<GameData::ContactGroup>(numMergedContactGroups).ptr;
+		int mergedIndex = 0;
+		for (auto &contactGroups : gameData->contactGroups)
+			for (auto &group : contactGroups)
+				mergedContactGroups[mergedIndex++] = group;
 		context.AddProfileMark(Utilities::Profiler::MarkerType::END_FUNCTION, nullptr, "Merge Contact Groups");
 
-		if (mergedContactGroups.size())
+		if (numMergedContactGroups)
 		{
 			auto jobA = Utilities::TaskManager::CreateLambdaBatchedJob(
-				[&gameData, &mergedContactGroups](int i, const Utilities::TaskManager::JobContext& context)
+				[&gameData, mergedContactGroups](int i, const Utilities::TaskManager::JobContext& context)
 			{
-				std::vector<GameData::ContactData> &contacts{ mergedContactGroups[i].contacts };
+				auto frameAllocator = context.GetFrameAllocator();
+				Utilities::ResizableArray<GameData::ContactData> &contacts{ mergedContactGroups[i].contacts };
 				int iterations = 0;
-				while (contacts.size() > 0 && iterations < mergedContactGroups[i].contacts.size() * 3)
+				while (contacts.size > 0 && iterations < mergedContactGroups[i].contacts.size * 3)
 				{
 					// busquem la penetraci ms gran
 					int maxPenetrationIndex{ 0 };
-					for (int j = 0; j < contacts.size(); ++j)
+					for (int j = 0; j < contacts.size; ++j)
 						if (contacts[j].penetatrion >= contacts[maxPenetrationIndex].penetatrion)
 							maxPenetrationIndex = j;
 
@@ -487,16 +452,16 @@ namespace Game
 					contacts = FindCollissions(contactGroup.contacts);
 					#else
 					// tornem a generar contactes per al grup
-					contacts.clear();
-					for (int j = 0; j < mergedContactGroups[i].objectIndexes.size(); ++j)
+					contacts.Clear();
+					for (int j = 0; j < mergedContactGroups[i].objectIndexes.size; ++j)
 					{
-						for (int k = j + 1; k < mergedContactGroups[i].objectIndexes.size(); ++k)
+						for (int k = j + 1; k < mergedContactGroups[i].objectIndexes.size; ++k)
 						{
 							if (HasCollision(gameData->gameObjects, mergedContactGroups[i].objectIndexes[j], mergedContactGroups[i].objectIndexes[k]))
 							{
-								contacts.push_back(GenerateContactData(gameData->gameObjects,
+								contacts.Push(GenerateContactData(gameData->gameObjects,
 												   mergedContactGroups[i].objectIndexes[k],
-												   mergedContactGroups[i].objectIndexes[j]));
+												   mergedContactGroups[i].objectIndexes[j]), frameAllocator);
 							}
 						}
 					}
@@ -526,8 +491,7 @@ namespace Game
 				}
 			},
 				"Group Solver",
-				(mergedContactGroups.size() / (mergedContactGroups.size() < Utilities::Profiler::MaxNumThreads-1 ? 1 : Utilities::Profiler::MaxNumThreads-1)),
-				mergedContactGroups.size());
+				numMergedContactGroups);
 
 			context.DoAndWait(&jobA);
 		}
@@ -546,7 +510,6 @@ namespace Game
 				);
 		},
 			"Fill Render Data",
-			MaxGameObjects / (MaxGameObjects < Utilities::Profiler::MaxNumThreads-1 ? 1 : Utilities::Profiler::MaxNumThreads - 1),
 			MaxGameObjects);
 		context.DoAndWait(&job);
 	}
@@ -556,6 +519,7 @@ namespace Game
 		// UPDATE PHYSICS
 		{
 			auto guard = context.CreateProfileMarkGuard("Update Physics");
+			const uint64_t heapAllocationsBefore = Utilities::GetHeapAllocationCount();
 
 			// 1 - Update posicions / velocitats
 			UpdateGameObjects(gameData->gameObjects, renderData_, inputData, context);
@@ -565,6 +529,8 @@ namespace Game
 
 			// 3 - Resoluci de colisions
 			SolveCollisionGroups(gameData, context);
+
+			gameData->physicsHeapAllocations = Utilities::GetHeapAllocationCount() - heapAllocationsBefore;
 		}
 
 		// FILL RENDER
@@ -53,5 +53,6 @@ namespace Game
 				 GameData *& gameData,
 				 const InputData & inputData, 
 				 const Utilities::TaskManager::JobContext &context);
+	uint64_t GetPhysicsHeapAllocations (const GameData * gameData);
 	void FinalizeGameData (GameData *& gameData);
 }
@@ -0,0 +1,165 @@
+#include "HardwareCounters.hh"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+#endif
+
+namespace Utilities
+{
+	HardwareCounters::~HardwareCounters()
+	{
+		Close();
+	}
+
+	const char* HardwareCounters::GetName(Counter counter)
+	{
+		switch (counter)
+		{
+		case Cycles:
+			return "cycles";
+		case Instructions:
+			return "instructions";
+		case LastLevelCacheMisses:
+			return "llc_misses";
+		case BranchMisses:
+			return "branch_misses";
+		default:
+			return "?";
+		}
+	}
+
+#if defined(__linux__)
+
+	static int OpenEvent(uint64_t config, int groupFd)
+	{
+		perf_event_attr attributes = {};
+		attributes.size = sizeof(attributes);
+		attributes.type = PERF_TYPE_HARDWARE;
+		attributes.config = config;
+		attributes.disabled = (groupFd == -1) ? 1 : 0; // el grup s'engega sencer amb el primer
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		attributes.read_format = PERF_FORMAT_GROUP;
+		return (int)syscall(SYS_perf_event_open, &attributes, 0, -1, groupFd, 0);
+	}
+
+	bool HardwareCounters::Open()
+	{
+		Close();
+
+		static const uint64_t configs[NumCounters] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+		for (int counter = 0; counter < NumCounters; ++counter)
+		{
+			int fd = OpenEvent(configs[counter], groupFd);
+			if (fd < 0)
+			{
+				continue; // aquesta CPU no el té, els altres poden funcionar
+			}
+			if (groupFd == -1)
+			{
+				groupFd = fd;
+			}
+			fds[counter] = fd;
+			groupIndex[counter] = numOpen++;
+			availableMask |= 1u << counter;
+		}
+
+		if (groupFd == -1)
+		{
+			return false;
+		}
+		ioctl(groupFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(groupFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		return true;
+	}
+
+	void HardwareCounters::Close()
+	{
+		for (int& fd : fds)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+		groupFd = -1;
+		numOpen = 0;
+		availableMask = 0;
+	}
+
+	void HardwareCounters::Read(Values& values) const
+	{
+		// PERF_FORMAT_GROUP: { nombre de comptadors, valor de cada un en ordre d'obertura }
+		uint64_t buffer[1 + NumCounters] = {};
+		if (groupFd < 0 || read(groupFd, buffer, sizeof(uint64_t) * (1 + numOpen)) <= 0)
+		{
+			values = Values{};
+			return;
+		}
+		for (int counter = 0; counter < NumCounters; ++counter)
+		{
+			values.counts[counter] = IsAvailable((Counter)counter) ? buffer[1 + groupIndex[counter]] : 0;
+		}
+	}
+
+#elif defined(_WIN32)
+
+	bool HardwareCounters::Open()
+	{
+		Close();
+
+		// un handle real, GetCurrentThread és un pseudo handle que val per a qualsevol thread
+		HANDLE handle;
+		if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &handle, THREAD_QUERY_LIMITED_INFORMATION, FALSE, 0))
+		{
+			return false;
+		}
+		thread = handle;
+		availableMask = 1u << Cycles;
+		return true;
+	}
+
+	void HardwareCounters::Close()
+	{
+		if (thread != nullptr)
+		{
+			CloseHandle(thread);
+			thread = nullptr;
+		}
+		availableMask = 0;
+	}
+
+	void HardwareCounters::Read(Values& values) const
+	{
+		values = Values{};
+		ULONG64 cycles;
+		if (thread != nullptr && QueryThreadCycleTime(thread, &cycles))
+		{
+			values.counts[Cycles] = cycles;
+		}
+	}
+
+#else
+
+	bool HardwareCounters::Open()
+	{
+		return false;
+	}
+
+	void HardwareCounters::Close()
+	{
+	}
+
+	void HardwareCounters::Read(Values& values) const
+	{
+		values = Values{};
+	}
+
+#endif
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Utilities
+{
+	// Comptadors de hardware del thread que els obre: cicles, instruccions, fallades de la darrera cache i errors de predicció de salts.
+	//  - Linux: un grup de perf_event_open (només espai d'usuari) que es llegeix d'un cop. Cal perf_event_paranoid <= 2 i una PMU
+	//    (moltes màquines virtuals no en tenen).
+	//  - Windows: només els cicles, amb QueryThreadCycleTime. La resta necessita ETW o un driver.
+	// Els comptadors que no es poden obrir valen sempre 0 i IsAvailable ho diu.
+	class HardwareCounters
+	{
+	public:
+		enum Counter { Cycles, Instructions, LastLevelCacheMisses, BranchMisses, NumCounters };
+
+		struct Values
+		{
+			uint64_t counts[NumCounters];
+		};
+
+		HardwareCounters() = default;
+		HardwareCounters(const HardwareCounters&) = delete;
+		HardwareCounters& operator=(const HardwareCounters&) = delete;
+		~HardwareCounters();
+
+		// s'ha de cridar des del thread que es vol mesurar. false si no hi ha cap comptador
+		bool Open();
+		void Close();
+		bool IsOpen() const { return availableMask != 0; }
+		bool IsAvailable(Counter counter) const { return (availableMask & (1u << counter)) != 0; }
+
+		// valors acumulats des de l'Open, només des del mateix thread
+		void Read(Values& values) const;
+
+		static const char* GetName(Counter counter);
+
+	private:
+		unsigned int availableMask = 0;
+#if defined(__linux__)
+		int groupFd = -1;
+		int fds[NumCounters] = { -1, -1, -1, -1 };
+		int groupIndex[NumCounters] = {}; // posició de cada comptador obert dins de la lectura del grup
+		int numOpen = 0;
+#elif defined(_WIN32)
+		void* thread = nullptr;
+#endif
+	};
+}
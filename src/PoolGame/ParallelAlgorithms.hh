@@ -0,0 +1,354 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+#include "TaskManager.hh"
+#include "TaskManagerHelpers.hh"
+
+namespace Utilities
+{
+	namespace TaskManager
+	{
+		// Algorismes paral·lels sobre el sistema de tasques.
+		// Tots reben el JobContext de la tasca que els crida i no tornen fins que han acabat (com DoAndWait).
+		//
+		// Per a suportar dades SoA, reduce/scan/partition/compact treballen amb índexs:
+		//   - "map(i)" llegeix el valor de l'element i (de les arrays que faci falta)
+		//   - "write(i, value)" / "emit(i, outIndex)" escriuen el resultat (a les arrays que faci falta)
+		// Sort i merge treballen amb iteradors d'accés aleatori; per ordenar SoA, ordeneu una array d'índexs
+		// amb un comparador que llegeixi les claus i després reordeneu les arrays.
+
+		namespace ParallelAlgorithmsDetail
+		{
+			static constexpr int NumWorkers = Profiler::MaxNumThreads - 1;
+			static constexpr int BlocksPerWorker = 4;
+			static constexpr int MaxBlocks = NumWorkers * BlocksPerWorker;
+			// per sota d'aquesta mida no val la pena repartir la feina
+			static constexpr int SerialCutoff = 8 * 1024;
+
+			inline int ComputeNumBlocks(int n)
+			{
+				int blocks = n / (SerialCutoff / BlocksPerWorker);
+				if (blocks < 1)
+					blocks = 1;
+				return blocks < MaxBlocks ? blocks : MaxBlocks;
+			}
+
+			inline int BlockBegin(int n, int numBlocks, int block) { return int((int64_t(n) * block) / numBlocks); }
+
+			// nombre d'elements de "a" que hi ha entre els "k" primers elements del merge estable de "a" i "b"
+			template<typename It1, typename It2, typename Compare>
+			size_t CoRank(size_t k, It1 a, size_t m, It2 b, size_t n, const Compare& comp)
+			{
+				size_t low = k > n ? k - n : 0;
+				size_t high = k < m ? k : m;
+				while (low < high)
+				{
+					size_t i = low + (high - low) / 2;
+					size_t j = k - i;
+					// en cas d'empat "a" va primer, així que si a[i] <= b[j - 1] en necessitem més de "a"
+					if (j > 0 && i < m && !comp(b[j - 1], a[i]))
+						low = i + 1;
+					else
+						high = i;
+				}
+				return low;
+			}
+
+			// Fa el merge de "a" i "b" a "out" partint la sortida en "numParts" trossos independents.
+			template<typename It1, typename It2, typename OutIt, typename Compare>
+			void MergePart(int part, int numParts, It1 a, size_t m, It2 b, size_t n, OutIt out, const Compare& comp)
+			{
+				size_t k0 = ((m + n) * part) / numParts;
+				size_t k1 = ((m + n) * (part + 1)) / numParts;
+				size_t i0 = CoRank(k0, a, m, b, n, comp);
+				size_t i1 = CoRank(k1, a, m, b, n, comp);
+				std::merge(a + i0, a + i1, b + (k0 - i0), b + (k1 - i1), out + k0, comp);
+			}
+
+			// Compta per blocs, fa el scan dels comptadors i crida "emit" amb la posició final de cada element.
+			// Els elements que compleixen "pred" van primer i, si "emitRejected", la resta van a continuació.
+			template<typename Predicate, typename Emit>
+			int PartitionImpl(const JobContext& context, int n, const Predicate& pred, const Emit& emit, bool emitRejected, const char* jobName)
+			{
+				if (n < SerialCutoff)
+				{
+					int accepted = 0;
+					for (int i = 0; i < n; ++i)
+						if (pred(i))
+							emit(i, accepted++);
+					if (emitRejected)
+					{
+						int rejected = accepted;
+						for (int i = 0; i < n; ++i)
+							if (!pred(i))
+								emit(i, rejected++);
+					}
+					return accepted;
+				}
+
+				const int numBlocks = ComputeNumBlocks(n);
+				int blockCounts[MaxBlocks];
+
+				auto countJob = CreateLambdaJob([&](int block)
+				{
+					int count = 0;
+					for (int i = BlockBegin(n, numBlocks, block), end = BlockBegin(n, numBlocks, block + 1); i < end; ++i)
+						if (pred(i))
+							++count;
+					blockCounts[block] = count;
+				}, jobName, short(numBlocks));
+				context.DoAndWait(&countJob);
+
+				int blockOffsets[MaxBlocks];
+				int accepted = 0;
+				for (int block = 0; block < numBlocks; ++block)
+				{
+					blockOffsets[block] = accepted;
+					accepted += blockCounts[block];
+				}
+
+				auto emitJob = CreateLambdaJob([&](int block)
+				{
+					int begin = BlockBegin(n, numBlocks, block), end = BlockBegin(n, numBlocks, block + 1);
+					int acceptedIndex = blockOffsets[block];
+					int rejectedIndex = accepted + (begin - blockOffsets[block]);
+					for (int i = begin; i < end; ++i)
+					{
+						if (pred(i))
+							emit(i, acceptedIndex++);
+						else if (emitRejected)
+							emit(i, rejectedIndex++);
+					}
+				}, jobName, short(numBlocks));
+				context.DoAndWait(&emitJob);
+
+				return accepted;
+			}
+
+			template<typename T, typename Map, typename Combine, typename Write>
+			T ScanImpl(const JobContext& context, int n, const T& identity, const Map& map, const Combine& combine, const Write& write, bool inclusive)
+			{
+				if (n < SerialCutoff)
+				{
+					T total = identity;
+					for (int i = 0; i < n; ++i)
+					{
+						T value = map(i);
+						if (inclusive)
+						{
+							total = combine(total, value);
+							write(i, total);
+						}
+						else
+						{
+							write(i, total);
+							total = combine(total, value);
+						}
+					}
+					return total;
+				}
+
+				const int numBlocks = ComputeNumBlocks(n);
+				T blockSums[MaxBlocks];
+
+				// 1 - reduce de cada bloc
+				auto reduceJob = CreateLambdaJob([&](int block)
+				{
+					T sum = identity;
+					for (int i = BlockBegin(n, numBlocks, block), end = BlockBegin(n, numBlocks, block + 1); i < end; ++i)
+						sum = combine(sum, map(i));
+					blockSums[block] = sum;
+				}, "Parallel Scan", short(numBlocks));
+				context.DoAndWait(&reduceJob);
+
+				// 2 - scan exclusiu dels blocs (n'hi ha pocs)
+				T total = identity;
+				for (int block = 0; block < numBlocks; ++block)
+				{
+					T blockSum = blockSums[block];
+					blockSums[block] = total;
+					total = combine(total, blockSum);
+				}
+
+				// 3 - scan de cada bloc començant pel seu offset
+				auto scanJob = CreateLambdaJob([&](int block)
+				{
+					T sum = blockSums[block];
+					for (int i = BlockBegin(n, numBlocks, block), end = BlockBegin(n, numBlocks, block + 1); i < end; ++i)
+					{
+						T value = map(i);
+						if (inclusive)
+						{
+							sum = combine(sum, value);
+							write(i, sum);
+						}
+						else
+						{
+							write(i, sum);
+							sum = combine(sum, value);
+						}
+					}
+				}, "Parallel Scan", short(numBlocks));
+				context.DoAndWait(&scanJob);
+
+				return total;
+			}
+		}
+
+		// Redueix "map(i)" per a i en [0, n) amb "combine", que ha de ser associativa.
+		//   T map(int i);   T combine(const T&, const T&);
+		template<typename T, typename Map, typename Combine>
+		T ParallelReduce(const JobContext& context, int n, const T& identity, const Map& map, const Combine& combine)
+		{
+			using namespace ParallelAlgorithmsDetail;
+
+			if (n < SerialCutoff)
+			{
+				T result = identity;
+				for (int i = 0; i < n; ++i)
+					result = combine(result, map(i));
+				return result;
+			}
+
+			const int numBlocks = ComputeNumBlocks(n);
+			T blockResults[MaxBlocks];
+
+			auto job = CreateLambdaJob([&](int block)
+			{
+				T result = identity;
+				for (int i = BlockBegin(n, numBlocks, block), end = BlockBegin(n, numBlocks, block + 1); i < end; ++i)
+					result = combine(result, map(i));
+				blockResults[block] = result;
+			}, "Parallel Reduce", short(numBlocks));
+			context.DoAndWait(&job);
+
+			T result = identity;
+			for (int block = 0; block < numBlocks; ++block)
+				result = combine(result, blockResults[block]);
+			return result;
+		}
+
+		// Scan inclusiu: write(i, map(0) + ... + map(i)). Retorna el total.
+		//   T map(int i);   T combine(const T&, const T&);   void write(int i, const T&);
+		template<typename T, typename Map, typename Combine, typename Write>
+		T ParallelInclusiveScan(const JobContext& context, int n, const T& identity, const Map& map, const Combine& combine, const Write& write)
+		{
+			return ParallelAlgorithmsDetail::ScanImpl(context, n, identity, map, combine, write, true);
+		}
+
+		// Scan exclusiu: write(i, identity + map(0) + ... + map(i - 1)). Retorna el total.
+		template<typename T, typename Map, typename Combine, typename Write>
+		T ParallelExclusiveScan(const JobContext& context, int n, const T& identity, const Map& map, const Combine& combine, const Write& write)
+		{
+			return ParallelAlgorithmsDetail::ScanImpl(context, n, identity, map, combine, write, false);
+		}
+
+		// Partició estable: crida emit(i, outIndex) per a cada element, amb els que compleixen "pred" a [0, result)
+		// i la resta a [result, n), mantenint l'ordre original dins de cada grup.
+		// "pred" s'avalua dos cops per element, així que ha de ser barat i sense efectes secundaris.
+		//   bool pred(int i);   void emit(int i, int outIndex);
+		template<typename Predicate, typename Emit>
+		int ParallelPartition(const JobContext& context, int n, const Predicate& pred, const Emit& emit)
+		{
+			return ParallelAlgorithmsDetail::PartitionImpl(context, n, pred, emit, true, "Parallel Partition");
+		}
+
+		// Stream compaction: crida emit(i, outIndex) només per als elements que compleixen "pred", amb
+		// outIndex consecutius i en ordre. Retorna quants n'hi ha.
+		template<typename Predicate, typename Emit>
+		int ParallelCompact(const JobContext& context, int n, const Predicate& pred, const Emit& emit)
+		{
+			return ParallelAlgorithmsDetail::PartitionImpl(context, n, pred, emit, false, "Parallel Compact");
+		}
+
+		// Merge estable de [first1, last1) i [first2, last2) a "out". La sortida es parteix amb "merge path"
+		// perquè tots els workers facin la mateixa quantitat de feina.
+		template<typename It1, typename It2, typename OutIt, typename Compare = std::less<>>
+		void ParallelMerge(const JobContext& context, It1 first1, It1 last1, It2 first2, It2 last2, OutIt out, const Compare& comp = Compare())
+		{
+			using namespace ParallelAlgorithmsDetail;
+
+			size_t m = size_t(last1 - first1), n = size_t(last2 - first2);
+			if (m + n < (size_t)SerialCutoff)
+			{
+				std::merge(first1, last1, first2, last2, out, comp);
+				return;
+			}
+
+			const int numParts = ComputeNumBlocks(int(m + n));
+			auto job = CreateLambdaJob([&](int part)
+			{
+				MergePart(part, numParts, first1, m, first2, n, out, comp);
+			}, "Parallel Merge", short(numParts));
+			context.DoAndWait(&job);
+		}
+
+		// Ordena [first, last). "scratch" ha d'apuntar a un buffer d'almenys (last - first) elements.
+		// No és estable: cada tros s'ordena amb std::sort i després es fan merges per nivells, on cada
+		// nivell reparteix entre tots els workers els merges de parelles de trossos.
+		template<typename RandomIt, typename ScratchIt, typename Compare = std::less<>>
+		void ParallelSort(const JobContext& context, RandomIt first, RandomIt last, ScratchIt scratch, const Compare& comp = Compare())
+		{
+			using namespace ParallelAlgorithmsDetail;
+
+			const int n = int(last - first);
+			if (n < SerialCutoff)
+			{
+				std::sort(first, last, comp);
+				return;
+			}
+
+			int numRuns = NumWorkers < ComputeNumBlocks(n) ? NumWorkers : ComputeNumBlocks(n);
+			int bounds[MaxBlocks + 1];
+			for (int run = 0; run <= numRuns; ++run)
+				bounds[run] = BlockBegin(n, numRuns, run);
+
+			// 1 - ordenem cada tros
+			auto sortJob = CreateLambdaJob([&](int run)
+			{
+				std::sort(first + bounds[run], first + bounds[run + 1], comp);
+			}, "Parallel Sort", short(numRuns));
+			context.DoAndWait(&sortJob);
+
+			// 2 - merges per nivells, alternant entre les dades i el buffer
+			bool resultInScratch = false;
+			for (int stride = 1; stride < numRuns; stride *= 2)
+			{
+				const int numPairs = (numRuns + 2 * stride - 1) / (2 * stride);
+				const int partsPerPair = (MaxBlocks / numPairs) > 1 ? (MaxBlocks / numPairs) : 1;
+
+				auto mergeLevel = [&](auto src, auto dst)
+				{
+					auto mergeJob = CreateLambdaJob([&](int task)
+					{
+						int pair = task / partsPerPair, part = task % partsPerPair;
+						int begin = bounds[pair * 2 * stride];
+						int middle = bounds[std::min(pair * 2 * stride + stride, numRuns)];
+						int end = bounds[std::min(pair * 2 * stride + 2 * stride, numRuns)];
+						MergePart(part, partsPerPair, src + begin, size_t(middle - begin), src + middle, size_t(end - middle), dst + begin, comp);
+					}, "Parallel Sort Merge", short(numPairs * partsPerPair));
+					context.DoAndWait(&mergeJob);
+				};
+
+				if (resultInScratch)
+					mergeLevel(scratch, first);
+				else
+					mergeLevel(first, scratch);
+				resultInScratch = !resultInScratch;
+			}
+
+			// 3 - si el resultat ha quedat al buffer el tornem a copiar
+			if (resultInScratch)
+			{
+				auto copyJob = CreateLambdaJob([&](int block)
+				{
+					std::copy(scratch + BlockBegin(n, MaxBlocks, block), scratch + BlockBegin(n, MaxBlocks, block + 1), first + BlockBegin(n, MaxBlocks, block));
+				}, "Parallel Sort Copy", short(MaxBlocks));
+				context.DoAndWait(&copyJob);
+			}
+		}
+	}
+}
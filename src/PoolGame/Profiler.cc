@@ -1,323 +1,1872 @@
 #include "Profiler.hh"
+#include "ProfilerStream.hh"
 #include <atomic>
 #include "imgui/imgui.h"
 #include "imgui/imconfig.h"
 #include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+#include <unordered_map>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
 
 namespace Utilities
 {
-	// Cridar aquesta funci cada cop que volguem registrar una marca al profiler.
-	// emparellar cada BEGIN_* amb un END_* i cada PAUSE_* amb un RESUME_*. Els BEGIN_FUNCTION/END_FUNCTION han d'anar aniuats i dins de begin/end
-	inline void Profiler::AddProfileMark(MarkerType reason, const void* identifier, const char* functionName, int threadId, int systemID)
+	Profiler::Snapshot Profiler::TakeSnapshot(int numThreads) const
 	{
-		if (recordNewFrame)
+		Snapshot snapshot = {};
+		for (int l = 0; l < numThreads; l++)
 		{
-			ProfileMarker mark { std::chrono::high_resolution_clock::now(), identifier, functionName, systemID, reason };
+			snapshot.written[l] = markerRings[l].written.load(std::memory_order_acquire);
+			snapshot.begin[l] = markerRings[l].read.load(std::memory_order_relaxed) % ProfilerMarkerBufferSize;
+			snapshot.end[l] = snapshot.written[l] % ProfilerMarkerBufferSize;
+		}
+		snapshot.ticks = (ReadClock() - calibrationTicks) & ProfileMarker::TicksMask;
+		return snapshot;
+	}
+
+	void Profiler::ReleaseSnapshot(const Snapshot& snapshot, int numThreads)
+	{
+		for (int l = 0; l < numThreads; l++)
+		{
+			markerRings[l].read.store(snapshot.written[l], std::memory_order_release);
+		}
+	}
+
+	// Taula de noms: hash obert amb el doble de posicions que zones. Les cerques no agafen cap lock: una posici es publica
+	// (amb "release" al nom) quan ja t el hash i l'ndex, i no canvia mai ms. Afegir-ne agafa el mutex.
+	static constexpr int ZoneSlotCount = 2 * Profiler::MaxZones;
+	struct ZoneSlot
+	{
+		std::atomic<const char*> name{ nullptr };
+		uint32_t hash;
+		uint16_t index;
+	};
+	static ZoneSlot s_ZoneSlots[ZoneSlotCount];
+	static const char* s_ZoneNames[Profiler::MaxZones] = { "?" };
+	static std::atomic<int> s_NumZones{ 1 }; // "release" quan el nom ja s a s_ZoneNames
+	static std::mutex s_ZoneMutex;
+
+	static bool FindZone(const char* name, uint32_t hash, int& slot, Profiler::ZoneId& zone)
+	{
+		for (slot = hash % ZoneSlotCount; ; slot = (slot + 1) % ZoneSlotCount)
+		{
+			const char* slotName = s_ZoneSlots[slot].name.load(std::memory_order_acquire);
+			if (slotName == nullptr)
+			{
+				return false;
+			}
+			if (s_ZoneSlots[slot].hash == hash && (slotName == name || strcmp(slotName, name) == 0))
+			{
+				zone.index = s_ZoneSlots[slot].index;
+				return true;
+			}
+		}
+	}
+
+	Profiler::ZoneId Profiler::InternZone(const char* name, uint32_t hash)
+	{
+		ZoneId zone = { 0 };
+		int slot;
+		if (name == nullptr || FindZone(name, hash, slot, zone))
+		{
+			return zone;
+		}
 
-			profilerData[threadId][profilerNextWriteIndex[threadId]] = mark;
-			profilerNextWriteIndex[threadId] = (profilerNextWriteIndex[threadId] + 1) % ProfilerMarkerBufferSize;
+		std::lock_guard<std::mutex> lock(s_ZoneMutex);
+		int numZones = s_NumZones.load(std::memory_order_relaxed);
+		if (FindZone(name, hash, slot, zone) || numZones == MaxZones)
+		{
+			return zone;
 		}
+		zone.index = (uint16_t)numZones;
+		s_ZoneNames[zone.index] = name;
+		s_ZoneSlots[slot].hash = hash;
+		s_ZoneSlots[slot].index = zone.index;
+		s_ZoneSlots[slot].name.store(name, std::memory_order_release);
+		s_NumZones.store(numZones + 1, std::memory_order_release);
+		return zone;
+	}
+
+	// qui t un ZoneId l'ha tret de la taula (o d'un marcador escrit per qui l'hi ha tret), aix que ja veu el nom
+	const char* Profiler::GetZoneName(ZoneId zone)
+	{
+		return s_ZoneNames[zone.index];
 	}
 
 	// crea un "BEGIN_FUNCTION" i quan l'objecte creat es destrueix, un "END_FUNCTION"
-	Profiler::MarkGuard Profiler::CreateProfileMarkGuard(const char* functionName, int threadId, int systemID)
+	Profiler::MarkGuard Profiler::CreateProfileMarkGuard(ZoneId zone, int threadId, int systemID)
 	{
 		static std::atomic<uintptr_t> identifierSequence = 0;
 		void* id = reinterpret_cast<void*>(++identifierSequence);
 
-		AddProfileMark(MarkerType::BEGIN_FUNCTION, id, functionName, threadId, systemID);
+		AddProfileMark(MarkerType::BEGIN_FUNCTION, id, zone, threadId, systemID);
 		return MarkGuard(this, threadId, id);
 	}
 
-	// dibuixa una finestra ImGUI amb la info del darrer frame
-	void Profiler::DrawProfilerToImGUI(int numThreads)
+	Profiler::MarkGuard Profiler::CreateProfileMarkGuard(const char* functionName, int threadId, int systemID)
 	{
-		if (ImGui::Begin("Profiler"))
+		return CreateProfileMarkGuard(InternZone(functionName), threadId, systemID);
+	}
+
+	// Segueix les tasques, pauses i funcions obertes entre frames: una tasca pot comenar en un frame i acabar en el segent, o continuar en
+	// un altre thread. Rep els marcadors de tots els threads ordenats per temps i avisa els "Listener" de cada tram que es tanca.
+	struct Profiler::Timeline
+	{
+		enum class SliceKind { Job, Function, Idle };
+		enum class FiberEvent { Begin, Pause, Resume, End };
+		// per qu s'acaba el tram d'una tasca (i el de les funcions que s'hi tallen): el marcador que el tanca. None a les funcions acabades
+		// amb END_FUNCTION i a l'idle. Running noms el fa servir qui dibuixa el que encara s'executa
+		enum class SliceEnd { None, Finished, PausedWaitingDependencies, PausedAddingJobs, Running };
+
+		static const char* GetSliceEndName(SliceEnd end)
 		{
-			ImGui::Checkbox("Record", &recordNewFrame);
-			ImGui::SliderFloat("Scale", &millisecondLength, 20, 10000, "%.3f", 5);
+			switch (end)
+			{
+			case SliceEnd::Finished: return "finished";
+			case SliceEnd::PausedWaitingDependencies: return "paused waiting dependencies";
+			case SliceEnd::PausedAddingJobs: return "paused adding jobs";
+			case SliceEnd::Running: return "running";
+			default: return nullptr;
+			}
+		}
 
-			ImGui::BeginChild("scrolling", ImVec2(0, 0), false, ImGuiWindowFlags_HorizontalScrollbar);
+		struct Listener
+		{
+			virtual ~Listener() = default;
 
-			ImDrawList* draw_list = ImGui::GetWindowDrawList();
+			// un tram executant-se seguit en un thread: una tasca o funci fins a la pausa o el final, o un idle.
+			// "counters" s el que han comptat els comptadors de hardware durant el tram, o nullptr si no n'hi ha
+			virtual void OnSlice(SliceKind /*kind*/, int /*threadId*/, const char* /*name*/, uint64_t /*begin*/, uint64_t /*end*/, const void* /*fiber*/, int /*systemID*/, SliceEnd /*sliceEnd*/, const HardwareCounters::Values* /*counters*/) {}
+			// canvis d'estat de les fibres, encara que continun en un altre thread
+			virtual void OnFiber(FiberEvent /*event*/, const void* /*fiber*/, const char* /*name*/, uint64_t /*ticks*/) {}
+			// una tasca o funci acabada de la qual hem vist el principi. "inclusive" va del BEGIN a l'END, pauses incloses,
+			// "exclusive" s el que s'ha executat ella mateixa: sense les pauses ni les funcions aniuades. "counters" suma els trams
+			// (sense pauses, amb les funcions aniuades), nullptr si algun no tenia comptadors
+			virtual void OnZone(SliceKind /*kind*/, const char* /*name*/, uint64_t /*inclusive*/, uint64_t /*exclusive*/, const HardwareCounters::Values* /*counters*/) {}
+		};
 
-			std::chrono::high_resolution_clock::time_point earliestTimePoint;
-			std::chrono::high_resolution_clock::time_point latestTimePoint;
-			bool earliestInitialized = false;
-			bool latestInitialized = false;
-			for (int l = 0; l < numThreads; l++)
+		struct OpenZone
+		{
+			const char* name;
+			uint64_t begin;
+			uint64_t segmentBegin; // darrer BEGIN/RESUME
+			uint64_t running; // tics executant-se dels trams ja tancats
+			uint64_t children; // tics executant-se de les funcions aniuades
+			bool hasCounters; // tots els trams han tingut comptadors al principi i al final
+			HardwareCounters::Values segmentCounters; // al darrer BEGIN/RESUME
+			HardwareCounters::Values runningCounters; // dels trams ja tancats
+
+			static OpenZone Begin(const char* name, uint64_t now, const HardwareCounters::Values* counters)
+			{
+				OpenZone zone = {};
+				zone.name = name;
+				zone.begin = now;
+				zone.hasCounters = true;
+				zone.BeginSegment(now, counters);
+				return zone;
+			}
+
+			void BeginSegment(uint64_t now, const HardwareCounters::Values* counters)
+			{
+				segmentBegin = now;
+				if (counters != nullptr)
+					segmentCounters = *counters;
+				else
+					hasCounters = false;
+			}
+
+			// torna el que han comptat els comptadors durant el tram a "segment", o nullptr
+			const HardwareCounters::Values* EndSegment(uint64_t now, const HardwareCounters::Values* counters, HardwareCounters::Values& segment)
+			{
+				running += now - segmentBegin;
+				if (counters == nullptr || !hasCounters)
+				{
+					hasCounters = false;
+					return nullptr;
+				}
+				for (int c = 0; c < HardwareCounters::NumCounters; ++c)
+				{
+					segment.counts[c] = counters->counts[c] - segmentCounters.counts[c];
+					runningCounters.counts[c] += segment.counts[c];
+				}
+				return &segment;
+			}
+
+			const HardwareCounters::Values* GetRunningCounters() const { return hasCounters ? &runningCounters : nullptr; }
+		};
+
+		struct Fiber
+		{
+			OpenZone job;
+			bool hasJob = false; // false si la tasca va comenar abans que la segussim
+			int systemID = -1;
+			std::vector<OpenZone> functions; // funcions obertes de la tasca, es tallen a cada pausa
+		};
+
+		struct Thread
+		{
+			bool running = false;
+			const void* fiber = nullptr;
+			bool idle = false;
+			uint64_t idleBegin;
+			std::vector<OpenZone> functions; // funcions fora de qualsevol tasca
+		};
+
+		std::unordered_map<const void*, Fiber> fibers;
+		Thread threads[MaxNumThreads];
+
+		// quan hi ha hagut marcadors que no hem vist (s'ha aturat la gravaci) el que tenem obert ja no es pot tancar b
+		void Reset()
+		{
+			fibers.clear();
+			for (Thread& thread : threads)
 			{
+				thread = Thread();
+			}
+		}
+
+		// el que encara s'executa a cada thread, per tancar un frame sense esperar els marcadors: f(kind, threadId, name, begin, fiber)
+		template<typename F>
+		void ForEachOpenSlice(F&& f) const
+		{
+			for (int threadId = 0; threadId < MaxNumThreads; ++threadId)
+			{
+				const Thread& thread = threads[threadId];
+				auto fiber = thread.running ? fibers.find(thread.fiber) : fibers.end();
+				if (fiber != fibers.end())
+				{
+					f(SliceKind::Job, threadId, fiber->second.job.name, fiber->second.job.segmentBegin, thread.fiber);
+				}
+				if (thread.idle)
+				{
+					f(SliceKind::Idle, threadId, "Idle", thread.idleBegin, nullptr);
+				}
+			}
+		}
+
+		template<typename F>
+		static void ForEach(Listener* const* listeners, int numListeners, F&& f)
+		{
+			for (int i = 0; i < numListeners; ++i)
+			{
+				f(*listeners[i]);
+			}
+		}
 
-				if (profilerNextReadIndex[l] != profilerNextWriteIndex[l])
+		void AddMarker(int threadId, const ProfileMarker& marker, const HardwareCounters::Values* counters, Listener* const* listeners, int numListeners)
+		{
+			Thread& thread = threads[threadId];
+			const uint64_t now = marker.GetTicks();
+			HardwareCounters::Values segment;
+			switch (marker.type)
+			{
+			case MarkerType::BEGIN:
+			case MarkerType::RESUME_FROM_PAUSE:
+			{
+				Fiber& fiber = fibers[marker.GetIdentifier()];
+				if (marker.type == MarkerType::BEGIN)
+				{
+					fiber = Fiber();
+					fiber.job = OpenZone::Begin(marker.GetName(), now, counters);
+					fiber.hasJob = true;
+				}
+				fiber.systemID = marker.systemID;
+				fiber.job.name = marker.GetName();
+				fiber.job.BeginSegment(now, counters);
+				for (OpenZone& function : fiber.functions)
 				{
-					int index = (profilerNextWriteIndex[l] - 1 + ProfilerMarkerBufferSize) % ProfilerMarkerBufferSize;
-					const ProfileMarker &marker = profilerData[l][index];
+					function.BeginSegment(now, counters);
+				}
+				ForEach(listeners, numListeners, [&](Listener& listener) { listener.OnFiber(marker.type == MarkerType::BEGIN ? FiberEvent::Begin : FiberEvent::Resume, marker.GetIdentifier(), marker.GetName(), now); });
+
+				thread.running = true;
+				thread.fiber = marker.GetIdentifier();
+				break;
+			}
+			case MarkerType::END:
+			case MarkerType::PAUSE_WAIT_FOR_JOB:
+			case MarkerType::PAUSE_WAIT_FOR_QUEUE_SPACE:
+			{
+				const SliceEnd sliceEnd = (marker.type == MarkerType::PAUSE_WAIT_FOR_JOB) ? SliceEnd::PausedWaitingDependencies
+					: (marker.type == MarkerType::PAUSE_WAIT_FOR_QUEUE_SPACE) ? SliceEnd::PausedAddingJobs
+					: SliceEnd::Finished;
 
-					if (latestTimePoint < marker.timePoint || !latestInitialized)
+				Fiber& fiber = fibers[marker.GetIdentifier()];
+				if (thread.running && thread.fiber == marker.GetIdentifier())
+				{
+					for (OpenZone& function : fiber.functions)
 					{
-						latestTimePoint = marker.timePoint;
-						latestInitialized = true;
+						const HardwareCounters::Values* segmentCounters = function.EndSegment(now, counters, segment);
+						ForEach(listeners, numListeners, [&](Listener& listener) { listener.OnSlice(SliceKind::Function, threadId, function.name, function.segmentBegin, now, marker.GetIdentifier(), fiber.systemID, sliceEnd, segmentCounters); });
 					}
+					const HardwareCounters::Values* segmentCounters = fiber.job.EndSegment(now, counters, segment);
+					ForEach(listeners, numListeners, [&](Listener& listener) { listener.OnSlice(SliceKind::Job, threadId, fiber.job.name, fiber.job.segmentBegin, now, marker.GetIdentifier(), fiber.systemID, sliceEnd, segmentCounters); });
 				}
-				for (int i = profilerNextReadIndex[l]; i != profilerNextWriteIndex[l]; i = (i + 1) % ProfilerMarkerBufferSize)
+				thread.running = false;
+
+				if (marker.type == MarkerType::END)
 				{
-					const ProfileMarker &marker = profilerData[l][i];
-					if (marker.IsBeginMark() && !marker.IsIdleMark())
+					if (fiber.hasJob)
 					{
-						if (earliestTimePoint > marker.timePoint || !earliestInitialized)
-						{
-							earliestTimePoint = marker.timePoint;
-							earliestInitialized = true;
-						}
-						break;
+						ForEach(listeners, numListeners, [&](Listener& listener) { listener.OnZone(SliceKind::Job, fiber.job.name, now - fiber.job.begin, fiber.job.running - fiber.job.children, fiber.job.GetRunningCounters()); });
 					}
+					ForEach(listeners, numListeners, [&](Listener& listener) { listener.OnFiber(FiberEvent::End, marker.GetIdentifier(), fiber.job.name, now); });
+					fibers.erase(marker.GetIdentifier());
+				}
+				else
+				{
+					ForEach(listeners, numListeners, [&](Listener& listener) { listener.OnFiber(FiberEvent::Pause, marker.GetIdentifier(), fiber.job.name, now); });
 				}
+				break;
 			}
+			case MarkerType::BEGIN_IDLE:
+				thread.idle = true;
+				thread.idleBegin = now;
+				break;
+			case MarkerType::END_IDLE:
+				if (thread.idle)
+				{
+					ForEach(listeners, numListeners, [&](Listener& listener) { listener.OnSlice(SliceKind::Idle, threadId, "Idle", thread.idleBegin, now, nullptr, -1, SliceEnd::None, nullptr); });
+				}
+				thread.idle = false;
+				break;
+			case MarkerType::BEGIN_FUNCTION:
+			case MarkerType::END_FUNCTION:
+			{
+				Fiber* fiber = thread.running ? &fibers[thread.fiber] : nullptr;
+				std::vector<OpenZone>& functions = (fiber != nullptr) ? fiber->functions : thread.functions;
+				if (marker.type == MarkerType::BEGIN_FUNCTION)
+				{
+					functions.push_back(OpenZone::Begin(marker.GetName(), now, counters));
+				}
+				else if (!functions.empty()) // si no, el BEGIN_FUNCTION s d'abans que el segussim
+				{
+					OpenZone function = functions.back();
+					functions.pop_back();
+					const HardwareCounters::Values* segmentCounters = function.EndSegment(now, counters, segment);
 
-			auto maxMs = std::chrono::duration_cast<std::chrono::milliseconds>(latestTimePoint - earliestTimePoint).count() + 2;
+					if (!functions.empty())
+						functions.back().children += function.running;
+					else if (fiber != nullptr)
+						fiber->job.children += function.running;
 
-			if (maxMs > 1000)
-			{
-				maxMs = 1000;
+					const void* fiberIdentifier = (fiber != nullptr) ? thread.fiber : nullptr;
+					int systemID = (fiber != nullptr) ? fiber->systemID : -1;
+					ForEach(listeners, numListeners, [&](Listener& listener)
+					{
+						listener.OnSlice(SliceKind::Function, threadId, function.name, function.segmentBegin, now, fiberIdentifier, systemID, SliceEnd::None, segmentCounters);
+						listener.OnZone(SliceKind::Function, function.name, now - function.begin, function.running - function.children, function.GetRunningCounters());
+					});
+				}
+				break;
+			}
+			default:
+				break;
 			}
+		}
+	};
+
+	// escriu els trams a un fitxer "trace event" JSON de Chrome
+	struct Profiler::TraceCapture : public Profiler::Timeline::Listener
+	{
+		FILE* file = nullptr;
+		bool firstEvent = true;
+		bool hasTimeBase = false;
+		uint64_t timeBase; // tics de ReadClock
+		double microsecondsPerTick = 0;
+		int numFrames = 0;
+
+		// per tancar noms els esdeveniments asncrons que hem obert
+		std::unordered_set<const void*> begunFibers, pausedFibers;
 
-			float offset = 50;
-			ImVec2 cursor = ImGui::GetCursorScreenPos();
-			for (int n = 0; n < maxMs; n++)
+		bool Open(const char* path, double ticksPerSecond)
+		{
+			if (fopen_s(&file, path, "w") != 0 || file == nullptr)
 			{
-				if (n > 0) ImGui::SameLine();
-				cursor.x = offset + n * millisecondLength;
-				float hue = (n < 16) ? 0.33f - n * 0.08f / 15.0f : (n < 33) ? 0.16f - (n - 16) * 0.08f / 15.0f : 0;
-				draw_list->AddLine(cursor, ImVec2(cursor.x, cursor.y + 400), ImColor::HSV(hue, 1, 1), 1.0f);
-				ImGui::SetCursorPosX(cursor.x);
-				ImGui::LabelText("", "%dms", n);
+				file = nullptr;
+				return false;
 			}
+			microsecondsPerTick = 1e6 / ticksPerSecond;
+			fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
 
+			BeginEvent("M", "process_name", "__metadata");
+			fputs(",\"tid\":0,\"args\":{\"name\":\"PoolGame\"}}", file);
+			for (int l = 0; l < MaxNumThreads; l++)
 			{
-				auto fmaxMs = std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(latestTimePoint - earliestTimePoint).count();
-				float hue = (fmaxMs < 16) ? 0.33f - fmaxMs * 0.08f / 15.0f : (fmaxMs < 33) ? 0.16f - (fmaxMs - 16) * 0.08f / 15.0f : 0;
+				BeginEvent("M", "thread_name", "__metadata");
+				fprintf(file, ",\"tid\":%d,\"args\":{\"name\":\"core %d\"}}", l, l);
+			}
+			return true;
+		}
+
+		// les franges que encara estan obertes es perden
+		void Close()
+		{
+			fputs("\n]}\n", file);
+			fclose(file);
+			file = nullptr;
+		}
 
-				cursor.x = offset + fmaxMs * millisecondLength;
-				draw_list->AddLine(cursor, ImVec2(cursor.x, cursor.y + 400), ImColor::HSV(hue, 1, 1), 1.0f);
+		double Microseconds(uint64_t ticks) const
+		{
+			return (int64_t)(ticks - timeBase) * microsecondsPerTick;
+		}
+
+		void WriteString(const char* text)
+		{
+			fputc('"', file);
+			for (const char* c = (text != nullptr) ? text : "?"; *c != '\0'; ++c)
+			{
+				if (*c == '"' || *c == '\\')
+					fputc('\\', file);
+				if ((unsigned char)*c >= ' ')
+					fputc(*c, file);
 			}
+			fputc('"', file);
+		}
+
+		void BeginEvent(const char* phase, const char* name, const char* category)
+		{
+			fputs(firstEvent ? "\n" : ",\n", file);
+			firstEvent = false;
+			fprintf(file, "{\"ph\":\"%s\",\"pid\":0,\"name\":", phase);
+			WriteString(name);
+			fprintf(file, ",\"cat\":\"%s\"", category);
+		}
 
-			auto DrawPeriod = [this, earliestTimePoint, offset](int index, const ProfileMarker &dataMarker, const ProfileMarker &beginMarker, const ProfileMarker &endMarker, std::chrono::high_resolution_clock::duration excTime = std::chrono::high_resolution_clock::duration())
+		// marca de frame a totes les pistes
+		void BeginFrame(uint64_t ticks)
+		{
+			if (!hasTimeBase)
 			{
-				std::chrono::high_resolution_clock::duration fromFrameStart = beginMarker.timePoint - earliestTimePoint;
-				std::chrono::high_resolution_clock::duration fromFrameEnd = endMarker.timePoint - earliestTimePoint;
-				std::chrono::high_resolution_clock::duration markDuration = endMarker.timePoint - beginMarker.timePoint;
-				std::chrono::high_resolution_clock::duration inclusiveDuration = endMarker.timePoint - dataMarker.timePoint;
-				// show
+				timeBase = ticks;
+				hasTimeBase = true;
+			}
 
-				auto fromFrameStartMs = std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(fromFrameStart);
-				auto fromFrameEndMs = std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(fromFrameEnd);
-				auto markDurationMs = std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(markDuration);
-				auto exclusiveDurationMs = std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(excTime);
-				auto inclusiveDurationMs = std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(inclusiveDuration);
+			char frameName[32];
+			snprintf(frameName, sizeof(frameName), "Frame %d", numFrames);
+			BeginEvent("i", frameName, "frame");
+			fprintf(file, ",\"tid\":0,\"s\":\"g\",\"ts\":%.3f}", Microseconds(ticks));
+			++numFrames;
+		}
 
-				float beginPosition = fromFrameStartMs.count() > 0 ? fromFrameStartMs.count() * millisecondLength : 0;
-				float length = (fromFrameStartMs.count() > 0 ? markDurationMs.count() : fromFrameEndMs.count()) * millisecondLength;
+		// franja d'un thread ("complete event")
+		void OnSlice(Timeline::SliceKind kind, int threadId, const char* name, uint64_t begin, uint64_t end, const void* fiber, int systemID, Timeline::SliceEnd sliceEnd, const HardwareCounters::Values* counters) override
+		{
+			if (begin < timeBase)
+			{
+				return; // ha comenat abans de la captura
+			}
 
-				// cap things at 1 second
-				if (beginPosition > 1000 * millisecondLength)
-					beginPosition = 1000 * millisecondLength;
-				if (length > 1000 * millisecondLength)
-					length = 1000 * millisecondLength;
-				// cap things at 1 second
+			const char* category = (kind == Timeline::SliceKind::Job) ? "job" : (kind == Timeline::SliceKind::Function) ? "function" : "idle";
+			BeginEvent("X", name, category);
+			fprintf(file, ",\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"fiber\":%llu,\"system\":%d", threadId, Microseconds(begin), Microseconds(end) - Microseconds(begin), (unsigned long long)reinterpret_cast<uintptr_t>(fiber), systemID);
+			if (sliceEnd != Timeline::SliceEnd::None)
+				fprintf(file, ",\"end\":\"%s\"", Timeline::GetSliceEndName(sliceEnd));
+			if (counters != nullptr)
+			{
+				for (int c = 0; c < HardwareCounters::NumCounters; ++c)
+					fprintf(file, ",\"%s\":%llu", HardwareCounters::GetName((HardwareCounters::Counter)c), (unsigned long long)counters->counts[c]);
+			}
+			fputs("}}", file);
+		}
 
-				beginPosition += offset;
+		// pista de la fibra: "b" i "e" amb el mateix id s'aniuen
+		void OnFiber(Timeline::FiberEvent event, const void* fiber, const char* name, uint64_t ticks) override
+		{
+			switch (event)
+			{
+			case Timeline::FiberEvent::Begin:
+				begunFibers.insert(fiber);
+				WriteFiberEvent("b", fiber, name, ticks);
+				break;
+			case Timeline::FiberEvent::Pause:
+				pausedFibers.insert(fiber);
+				WriteFiberEvent("b", fiber, "paused", ticks);
+				break;
+			case Timeline::FiberEvent::Resume:
+				if (pausedFibers.erase(fiber) > 0)
+					WriteFiberEvent("e", fiber, "paused", ticks);
+				break;
+			case Timeline::FiberEvent::End:
+				if (begunFibers.erase(fiber) > 0)
+					WriteFiberEvent("e", fiber, name, ticks);
+				break;
+			}
+		}
 
-				if (length < 5.0f)
-					length = 5.0f;
+		void WriteFiberEvent(const char* phase, const void* fiber, const char* name, uint64_t ticks)
+		{
+			BeginEvent(phase, name, "fiber");
+			fprintf(file, ",\"tid\":0,\"id\":\"fiber%llu\",\"ts\":%.3f}", (unsigned long long)reinterpret_cast<uintptr_t>(fiber), Microseconds(ticks));
+		}
+	};
 
-				ImGui::SameLine();
+	// Durades de cada tasca i funci (per nom) dels darrers StatisticsWindowFrames frames, en histogrames logartmics:
+	// 16 cubetes per potncia de 2, l'error dels percentils s de menys del 3%. Cada frame guarda a quines cubetes van anar
+	// les seves mostres per treure-les de la finestra quan es fa vell, aix afegir i treure s O(1) per mostra.
+	struct Profiler::Statistics : public Profiler::Timeline::Listener
+	{
+		static constexpr int SubBuckets = 16;
+		static constexpr int MaxExponent = 40; // 2^41ns, uns 36 minuts
+		static constexpr int NumBuckets = (MaxExponent - 2) * SubBuckets;
 
-				ImGui::PushID(index);
-				float hue = dataMarker.IsIdleMark() ? 0 : ((reinterpret_cast<uintptr_t>(dataMarker.identifier) * 19) % 97) / 97.f; //((beginIndex - profilerNextReadIndex[l] + ProfilerMarkerBufferSize) % ProfilerMarkerBufferSize) * 0.05f; // TODO from job type
-				ImGui::PushStyleColor(ImGuiCol_Button, ImColor::HSV(hue, 0.6f, 0.6f));
-				ImGui::PushStyleColor(ImGuiCol_ButtonHovered, ImColor::HSV(hue, 0.7f, 0.7f));
-				ImGui::PushStyleColor(ImGuiCol_ButtonActive, ImColor::HSV(hue, 0.8f, 0.8f));
+		struct Frame
+		{
+			uint32_t count = 0;
+			double inclusiveSum = 0, exclusiveSum = 0;
+			uint64_t inclusiveMax = 0, exclusiveMax = 0;
+			std::vector<uint16_t> buckets; // parelles inclusiu, exclusiu
+			uint32_t countersCount = 0;
+			double counterSums[HardwareCounters::NumCounters] = {};
+			double criticalSum = 0;
+		};
 
-				ImGui::SetCursorPosX(beginPosition);
-				ImGui::Button(dataMarker.jobName, ImVec2(length, 0.0f));
-				if (ImGui::IsItemHovered())
-				{
-					const char* additionalInfo =
-						(endMarker.type == MarkerType::PAUSE_WAIT_FOR_JOB) ? "\nPAUSED waiting dependencies"
-						: (endMarker.type == MarkerType::PAUSE_WAIT_FOR_QUEUE_SPACE) ? "\nPAUSED adding jobs"
-						: "";
+		struct Zone
+		{
+			uint32_t count = 0;
+			double inclusiveSum = 0, exclusiveSum = 0;
+			uint32_t inclusiveHistogram[NumBuckets] = {};
+			uint32_t exclusiveHistogram[NumBuckets] = {};
+			uint32_t countersCount = 0; // mostres amb comptadors, poden ser menys que "count"
+			double counterSums[HardwareCounters::NumCounters] = {};
+			double criticalSum = 0; // ns al cam crtic
+			Frame frames[StatisticsWindowFrames];
+		};
 
-					std::string fullTime = exclusiveDurationMs.count() <= 0 ? "" :
-						std::string("\nExclusive Time: ") + std::to_string(exclusiveDurationMs.count()) + "ms"
-						+ "\nInclusive Time: " + std::to_string(inclusiveDurationMs.count()) + "ms";
+		// els noms sn literals, es comparen per punter
+		std::unordered_map<const char*, std::unique_ptr<Zone>> jobs, functions;
+		double nanosecondsPerTick;
+		int frame = 0;
 
-					ImGui::SetTooltip("%s\nbegins: %fms\nends: %fms\nduration: %fms%s%s", dataMarker.jobName, fromFrameStartMs.count(), fromFrameEndMs.count(), markDurationMs.count(), fullTime.c_str(), additionalInfo);
+		static int Log2(uint64_t value)
+		{
+			int log = 0;
+			for (int shift = 32; shift > 0; shift >>= 1)
+			{
+				if ((value >> shift) != 0)
+				{
+					value >>= shift;
+					log += shift;
 				}
-				ImGui::PopStyleColor(3);
+			}
+			return log;
+		}
 
-				ImGui::PopID();
-			};
+		// els valors de menys de 16ns tenen cubeta prpia, els altres es divideixen en 16 per potncia de 2
+		static int Bucket(uint64_t nanoseconds)
+		{
+			if (nanoseconds < SubBuckets)
+			{
+				return (int)nanoseconds;
+			}
+			int exponent = Log2(nanoseconds);
+			if (exponent > MaxExponent)
+			{
+				return NumBuckets - 1;
+			}
+			int mantissa = (int)(nanoseconds >> (exponent - 4)) - SubBuckets;
+			return (exponent - 3) * SubBuckets + mantissa;
+		}
 
-			for (int l = 0; l < numThreads; l++)
+		// el centre de la cubeta
+		static double BucketValue(int bucket)
+		{
+			if (bucket < SubBuckets)
 			{
-				ImGui::PushID(l);
+				return bucket;
+			}
+			int exponent = bucket / SubBuckets + 3;
+			uint64_t width = uint64_t(1) << (exponent - 4);
+			return (double)((SubBuckets + bucket % SubBuckets) * width) + width * 0.5;
+		}
 
-				ImGui::LabelText("", "core %d", l);
+		static double Percentile(const uint32_t(&histogram)[NumBuckets], uint32_t count, double percentile)
+		{
+			uint32_t target = (uint32_t)(percentile * count);
+			if (target >= count)
+			{
+				target = count - 1;
+			}
+			uint32_t accumulated = 0;
+			for (int bucket = 0; bucket < NumBuckets; ++bucket)
+			{
+				accumulated += histogram[bucket];
+				if (accumulated > target)
+				{
+					return BucketValue(bucket);
+				}
+			}
+			return BucketValue(NumBuckets - 1);
+		}
 
-				for (int beginIndex = profilerNextReadIndex[l]; beginIndex != profilerNextWriteIndex[l]; beginIndex = (beginIndex + 1) % ProfilerMarkerBufferSize)
+		// treu de la finestra el frame que fa StatisticsWindowFrames
+		void BeginFrame()
+		{
+			++frame;
+			int slot = frame % StatisticsWindowFrames;
+			for (auto* zones : { &jobs, &functions })
+			{
+				for (auto& zone : *zones)
 				{
-					const ProfileMarker &beginMarker = profilerData[l][beginIndex];
-					if (beginMarker.IsBeginMark())
+					Zone& z = *zone.second;
+					Frame& old = z.frames[slot];
+					z.count -= old.count;
+					z.inclusiveSum -= old.inclusiveSum;
+					z.exclusiveSum -= old.exclusiveSum;
+					for (size_t i = 0; i < old.buckets.size(); i += 2)
 					{
-						for (int endIndex = beginIndex + 1; endIndex != profilerNextWriteIndex[l]; endIndex = (endIndex + 1) % ProfilerMarkerBufferSize)
-						{
-							const ProfileMarker &endMarker = profilerData[l][endIndex];
-							if (beginMarker.identifier == endMarker.identifier && endMarker.IsEndMark())
-							{
-								DrawPeriod(beginIndex, beginMarker, beginMarker, endMarker);
-
-								beginIndex = endIndex;
-								break;
-							}
-						}
+						--z.inclusiveHistogram[old.buckets[i]];
+						--z.exclusiveHistogram[old.buckets[i + 1]];
+					}
+					z.countersCount -= old.countersCount;
+					for (int c = 0; c < HardwareCounters::NumCounters; ++c)
+					{
+						z.counterSums[c] -= old.counterSums[c];
+						old.counterSums[c] = 0;
 					}
+					z.criticalSum -= old.criticalSum;
+					old.criticalSum = 0;
+					old.count = 0;
+					old.countersCount = 0;
+					old.inclusiveSum = old.exclusiveSum = 0;
+					old.inclusiveMax = old.exclusiveMax = 0;
+					old.buckets.clear();
+				}
+			}
+		}
+
+		Zone& GetZone(Timeline::SliceKind kind, const char* name)
+		{
+			std::unique_ptr<Zone>& zone = (kind == Timeline::SliceKind::Job ? jobs : functions)[name];
+			if (zone == nullptr)
+			{
+				zone.reset(new Zone());
+			}
+			return *zone;
+		}
+
+		// el FrameAnalyzer, per a cada pas del cam crtic del frame actual
+		void AddCriticalPath(const char* name, uint64_t ticks)
+		{
+			double nanoseconds = ticks * nanosecondsPerTick;
+			Zone& z = GetZone(Timeline::SliceKind::Job, name);
+			z.criticalSum += nanoseconds;
+			z.frames[frame % StatisticsWindowFrames].criticalSum += nanoseconds;
+		}
+
+		void OnZone(Timeline::SliceKind kind, const char* name, uint64_t inclusive, uint64_t exclusive, const HardwareCounters::Values* counters) override
+		{
+
+			uint64_t inclusiveNanoseconds = (uint64_t)(inclusive * nanosecondsPerTick);
+			uint64_t exclusiveNanoseconds = (uint64_t)(exclusive * nanosecondsPerTick);
+			int inclusiveBucket = Bucket(inclusiveNanoseconds);
+			int exclusiveBucket = Bucket(exclusiveNanoseconds);
+
+			Zone& z = GetZone(kind, name);
+			Frame& current = z.frames[frame % StatisticsWindowFrames];
+			++z.count;
+			++current.count;
+			z.inclusiveSum += inclusiveNanoseconds;
+			z.exclusiveSum += exclusiveNanoseconds;
+			current.inclusiveSum += inclusiveNanoseconds;
+			current.exclusiveSum += exclusiveNanoseconds;
+			if (current.inclusiveMax < inclusiveNanoseconds)
+				current.inclusiveMax = inclusiveNanoseconds;
+			if (current.exclusiveMax < exclusiveNanoseconds)
+				current.exclusiveMax = exclusiveNanoseconds;
+			++z.inclusiveHistogram[inclusiveBucket];
+			++z.exclusiveHistogram[exclusiveBucket];
+			current.buckets.push_back((uint16_t)inclusiveBucket);
+			current.buckets.push_back((uint16_t)exclusiveBucket);
+
+			if (counters != nullptr)
+			{
+				++z.countersCount;
+				++current.countersCount;
+				for (int c = 0; c < HardwareCounters::NumCounters; ++c)
+				{
+					z.counterSums[c] += (double)counters->counts[c];
+					current.counterSums[c] += (double)counters->counts[c];
 				}
+			}
+		}
 
-				int depth = 0;
-				bool functionFound;
-				do
+		void Get(std::vector<ZoneStatistics>& result) const
+		{
+			int windowFrames = (frame < StatisticsWindowFrames) ? frame : StatisticsWindowFrames;
+			for (auto* zones : { &jobs, &functions })
+			{
+				for (const auto& zone : *zones)
 				{
-					functionFound = false;
+					const Zone& z = *zone.second;
+					if (z.count == 0)
+					{
+						continue;
+					}
+
+					uint64_t inclusiveMax = 0, exclusiveMax = 0;
+					for (const Frame& f : z.frames)
+					{
+						if (inclusiveMax < f.inclusiveMax)
+							inclusiveMax = f.inclusiveMax;
+						if (exclusiveMax < f.exclusiveMax)
+							exclusiveMax = f.exclusiveMax;
+					}
 
-					for (int beginIndex = profilerNextReadIndex[l]; beginIndex != profilerNextWriteIndex[l]; beginIndex = (beginIndex + 1) % ProfilerMarkerBufferSize)
+					// el centre de la cubeta pot passar del mxim
+					auto ToPercentiles = [&z](const uint32_t(&histogram)[NumBuckets], double sum, uint64_t max)
 					{
-						const ProfileMarker &beginMarker = profilerData[l][beginIndex];
-						if (beginMarker.type == MarkerType::BEGIN_FUNCTION)
+						constexpr double MsPerNs = 1e-6;
+						auto percentile = [&](double p)
 						{
-							int currentDepth = 0;
-							bool inRelevantFiber = true;
-							const ProfileMarker *lastInterruption = nullptr;
-							for (
-								int backIndex = (beginIndex == 0) ? ProfilerMarkerBufferSize : (beginIndex - 1);
-								((backIndex == 0) ? ProfilerMarkerBufferSize : (backIndex - 1)) != profilerNextReadIndex[l];
-								backIndex = (backIndex == 0) ? ProfilerMarkerBufferSize : (backIndex - 1)
-								)
-							{
-								const ProfileMarker &backMarker = profilerData[l][backIndex];
-								if (inRelevantFiber)
-								{
-									if (backMarker.type == MarkerType::BEGIN_FUNCTION)
-									{
-										++currentDepth;
-									}
-									else if (backMarker.type == MarkerType::END_FUNCTION)
-									{
-										--currentDepth;
-									}
-									else if (backMarker.type == MarkerType::BEGIN)
-									{
-										//assert(currentDepth >= 0);
-										break;
-									}
-									else if (backMarker.IsBeginMark())
-									{
-										inRelevantFiber = false;
-										lastInterruption = &backMarker;
-									}
-								}
-								else if (backMarker.IsEndMark() && backMarker.identifier == lastInterruption->identifier)
-								{
-									inRelevantFiber = true;
-									lastInterruption = nullptr;
-								}
-							}
-
-							if (currentDepth == depth)
-							{
-								long long exclusiveTime = 0;
-
-								if (!functionFound)
-								{
-									ImGui::LabelText("", "stack %d", depth);
-									functionFound = true;
-								}
-								const ProfileMarker *lastInterruptionBegin = nullptr, *lastInterruptionEnd = nullptr, *firstInterruptionBegin = nullptr;
-								for (int endIndex = (beginIndex + 1) % ProfilerMarkerBufferSize; endIndex != profilerNextWriteIndex[l]; endIndex = (endIndex + 1) % ProfilerMarkerBufferSize)
-								{
-									const ProfileMarker &endMarker = profilerData[l][endIndex];
-									int idDisc = ProfilerMarkerBufferSize;
-									if (endMarker.type == MarkerType::END_FUNCTION && beginMarker.identifier == endMarker.identifier)
-									{
-										if (lastInterruptionBegin == nullptr)
-										{
-											DrawPeriod(beginIndex, beginMarker, beginMarker, endMarker);
-										}
-										else
-										{
-											assert(lastInterruptionEnd != nullptr);
-											assert(firstInterruptionBegin != nullptr);
-
-											exclusiveTime += (endMarker.timePoint - lastInterruptionEnd->timePoint).count();
-
-											DrawPeriod(beginIndex, beginMarker, beginMarker, *firstInterruptionBegin, std::chrono::high_resolution_clock::duration(exclusiveTime));
-											ImGui::PushID(idDisc);
-											DrawPeriod(endIndex, beginMarker, *lastInterruptionEnd, endMarker, std::chrono::high_resolution_clock::duration(exclusiveTime));
-											ImGui::PopID();
-										}
-										break;
-									}
-									else if (endMarker.IsBeginMark() && endMarker.identifier == lastInterruptionBegin->identifier)
-									{
-										lastInterruptionEnd = &endMarker;
-									}
-									else if (endMarker.IsEndMark() && (lastInterruptionBegin == nullptr || endMarker.identifier == lastInterruptionBegin->identifier))
-									{
-										if (lastInterruptionBegin != nullptr)
-										{
-											exclusiveTime += (endMarker.timePoint - lastInterruptionEnd->timePoint).count();
-
-											assert(firstInterruptionBegin != nullptr);
-											ImGui::PushID(idDisc);
-											DrawPeriod(endIndex, beginMarker, *lastInterruptionEnd, endMarker, std::chrono::high_resolution_clock::duration(exclusiveTime));
-											ImGui::PopID();
-											++idDisc;
-										}
-										else
-										{
-											assert(exclusiveTime == 0);
-											exclusiveTime = (endMarker.timePoint - beginMarker.timePoint).count();
-
-											assert(firstInterruptionBegin == nullptr);
-											firstInterruptionBegin = &endMarker;
-										}
-										lastInterruptionBegin = &endMarker;
-									}
-								}
-							}
-						}
+							double value = Percentile(histogram, z.count, p);
+							return (value < max ? value : max) * MsPerNs;
+						};
+						return Percentiles{ sum / z.count * MsPerNs, percentile(0.5), percentile(0.95), percentile(0.99), max * MsPerNs };
+					};
+
+					ZoneStatistics statistics;
+					statistics.name = zone.first;
+					statistics.isJob = (zones == &jobs);
+					statistics.count = z.count;
+					statistics.inclusive = ToPercentiles(z.inclusiveHistogram, z.inclusiveSum, inclusiveMax);
+					statistics.exclusive = ToPercentiles(z.exclusiveHistogram, z.exclusiveSum, exclusiveMax);
+					statistics.hasCounters = z.countersCount > 0;
+					for (int c = 0; c < HardwareCounters::NumCounters; ++c)
+					{
+						statistics.counters[c] = statistics.hasCounters ? z.counterSums[c] / z.countersCount : 0;
 					}
+					statistics.criticalPath = (windowFrames > 0) ? z.criticalSum / windowFrames * 1e-6 : 0;
+					result.push_back(statistics);
+				}
+			}
+		}
+	};
 
-					++depth;
-				} while (functionFound);
+	// Cam crtic i temps de cada thread del frame, veure FrameAnalysis. Recull els trams de tasques i d'idle que es tanquen durant
+	// el frame i en acabar hi afegeix els que encara s'executen, retallats al frame.
+	struct Profiler::FrameAnalyzer : public Profiler::Timeline::Listener
+	{
+		struct Segment
+		{
+			int threadId;
+			const char* name;
+			uint64_t begin, end;
+			bool resumed; // comena amb RESUME_FROM_PAUSE, si no amb BEGIN
+			bool finished; // acaba amb END
+			bool paused; // acaba amb PAUSE_*. Si no s ni una cosa ni l'altra encara s'executa
+		};
 
+		std::vector<Segment> segments;
+		uint64_t idle[MaxNumThreads] = {};
+		std::unordered_map<const void*, bool> resumedFibers; // com ha comenat el tram actual de cada fibra
+		std::vector<uint32_t> threadSegments[MaxNumThreads], finishedSegments, pausedSegments; // veure Index
+		bool hasFrameBegin = false;
+		uint64_t frameBegin = 0;
+
+		void Reset()
+		{
+			resumedFibers.clear();
+			hasFrameBegin = false;
+		}
 
-				if (recordNewFrame)
-					profilerNextReadIndex[l] = profilerNextWriteIndex[l];
+		void BeginFrame()
+		{
+			segments.clear();
+			for (uint64_t& ticks : idle)
+			{
+				ticks = 0;
+			}
+		}
 
-				ImGui::PopID();
+		uint64_t Clip(uint64_t begin, uint64_t end) const
+		{
+			return (end > frameBegin) ? end - (begin > frameBegin ? begin : frameBegin) : 0;
+		}
 
-				ImGui::LabelText("", "-", l);
+		void OnFiber(Timeline::FiberEvent event, const void* fiber, const char*, uint64_t) override
+		{
+			if (event == Timeline::FiberEvent::Begin || event == Timeline::FiberEvent::Resume)
+			{
+				resumedFibers[fiber] = (event == Timeline::FiberEvent::Resume);
+			}
+			else if (event == Timeline::FiberEvent::End)
+			{
+				resumedFibers.erase(fiber);
 			}
-			ImGui::EndChild();
 		}
-		else if (recordNewFrame)
+
+		void OnSlice(Timeline::SliceKind kind, int threadId, const char* name, uint64_t begin, uint64_t end, const void* fiber, int, Timeline::SliceEnd sliceEnd, const HardwareCounters::Values*) override
 		{
+			if (kind == Timeline::SliceKind::Idle)
+			{
+				idle[threadId] += Clip(begin, end);
+			}
+			else if (kind == Timeline::SliceKind::Job)
+			{
+				bool finished = sliceEnd == Timeline::SliceEnd::Finished;
+				AddSegment(threadId, name, begin, end, fiber, finished, !finished);
+			}
+		}
 
-			for (int l = 0; l < numThreads; l++)
+		void AddSegment(int threadId, const char* name, uint64_t begin, uint64_t end, const void* fiber, bool finished, bool paused)
+		{
+			auto resumed = resumedFibers.find(fiber);
+			segments.push_back(Segment{ threadId, name, begin, end, resumed != resumedFibers.end() && resumed->second, finished, paused });
+		}
+
+		// ndexs a "segments" ordenats pel final, per trobar cada predecessor sense recrrer tots els trams: en un thread els trams
+		// no es creuen, aix que tamb estan ordenats pel principi
+		void Index()
+		{
+			for (std::vector<uint32_t>& sorted : threadSegments)
+			{
+				sorted.clear();
+			}
+			finishedSegments.clear();
+			pausedSegments.clear();
+			for (uint32_t s = 0; s < (uint32_t)segments.size(); ++s)
+			{
+				threadSegments[segments[s].threadId].push_back(s);
+				if (segments[s].finished)
+					finishedSegments.push_back(s);
+				else if (segments[s].paused)
+					pausedSegments.push_back(s);
+			}
+			auto ByEnd = [this](uint32_t a, uint32_t b) { return segments[a].end < segments[b].end; };
+			for (std::vector<uint32_t>& sorted : threadSegments)
 			{
-				profilerNextReadIndex[l] = profilerNextWriteIndex[l];
+				std::sort(sorted.begin(), sorted.end(), ByEnd);
 			}
+			std::sort(finishedSegments.begin(), finishedSegments.end(), ByEnd);
+			std::sort(pausedSegments.begin(), pausedSegments.end(), ByEnd);
 		}
-		ImGui::End();
+
+		// de "sorted", el que acaba ms tard sense passar de "ticks" i ha comenat abans
+		const Segment* LatestEndedBefore(const std::vector<uint32_t>& sorted, uint64_t ticks) const
+		{
+			auto s = std::upper_bound(sorted.begin(), sorted.end(), ticks, [this](uint64_t t, uint32_t segment) { return t < segments[segment].end; });
+			while (s != sorted.begin())
+			{
+				const Segment& segment = segments[*--s];
+				if (segment.begin < ticks)
+				{
+					return &segment;
+				}
+			}
+			return nullptr;
+		}
+
+		// el tram que ha deixat comenar "next" i quan: el que ha arribat l'ltim
+		const Segment* FindPredecessor(const Segment& next, uint64_t& handover) const
+		{
+			if (!next.resumed)
+			{
+				// s'executava en un altre thread quan "next" ha comenat i desprs s'ha pausat: l'ha afegida i l'espera
+				const Segment* spawner = nullptr;
+				for (int l = 0; l < MaxNumThreads; l++)
+				{
+					const std::vector<uint32_t>& sorted = threadSegments[l];
+					auto s = std::upper_bound(sorted.begin(), sorted.end(), next.begin, [this](uint64_t t, uint32_t segment) { return t < segments[segment].end; });
+					if (l != next.threadId && s != sorted.end())
+					{
+						const Segment& segment = segments[*s];
+						if (segment.paused && segment.begin < next.begin && (spawner == nullptr || segment.begin > spawner->begin))
+						{
+							spawner = &segment;
+						}
+					}
+				}
+				if (spawner != nullptr)
+				{
+					handover = next.begin;
+					return spawner;
+				}
+			}
+
+			// el thread de "next" en quedar lliure, un END que desbloqueja un RESUME o una tasca que ha afegit "next" i s'ha pausat
+			const Segment* previous = LatestEndedBefore(threadSegments[next.threadId], next.begin);
+			const Segment* enabler = LatestEndedBefore(next.resumed ? finishedSegments : pausedSegments, next.begin);
+			const Segment* best = (enabler != nullptr && (previous == nullptr || enabler->end > previous->end)) ? enabler : previous;
+			if (best != nullptr)
+			{
+				handover = best->end;
+			}
+			return best;
+		}
+
+		void EndFrame(const Timeline& timeline, uint64_t frameEnd, int numThreads, double millisecondsPerTick, Statistics& statistics, FrameAnalysis& analysis)
+		{
+			timeline.ForEachOpenSlice([&](Timeline::SliceKind kind, int threadId, const char* name, uint64_t begin, const void* fiber)
+			{
+				if (kind == Timeline::SliceKind::Idle)
+					idle[threadId] += Clip(begin, frameEnd);
+				else
+					AddSegment(threadId, name, begin, frameEnd, fiber, false, false);
+			});
+			// el primer frame no sap on comena
+			if (hasFrameBegin)
+			{
+				Index();
+				Analyze(frameEnd, numThreads, millisecondsPerTick, statistics, analysis);
+			}
+			frameBegin = frameEnd;
+			hasFrameBegin = true;
+		}
+
+		void Analyze(uint64_t frameEnd, int numThreads, double millisecondsPerTick, Statistics& statistics, FrameAnalysis& analysis) const
+		{
+			analysis = FrameAnalysis();
+			analysis.numThreads = numThreads;
+			analysis.frameTime = (frameEnd - frameBegin) * millisecondsPerTick;
+			double busy = 0;
+			for (const Segment& segment : segments)
+			{
+				if (segment.threadId < numThreads)
+				{
+					analysis.busy[segment.threadId] += Clip(segment.begin, segment.end) * millisecondsPerTick;
+				}
+			}
+			for (int l = 0; l < numThreads; l++)
+			{
+				analysis.idle[l] = idle[l] * millisecondsPerTick;
+				busy += analysis.busy[l];
+			}
+			analysis.parallelEfficiency = (analysis.frameTime > 0 && numThreads > 0) ? busy / (numThreads * analysis.frameTime) : 0;
+
+			// cap enrere des del tram que acaba ms tard
+			const Segment* step = nullptr;
+			for (const Segment& segment : segments)
+			{
+				if (segment.end > frameBegin && (step == nullptr || segment.end > step->end))
+				{
+					step = &segment;
+				}
+			}
+			if (step == nullptr)
+			{
+				return;
+			}
+			const uint64_t pathEnd = step->end;
+			uint64_t stepEnd = pathEnd, pathBegin = pathEnd, wait = 0;
+			while (step != nullptr)
+			{
+				pathBegin = (step->begin > frameBegin) ? step->begin : frameBegin;
+				analysis.criticalSteps.push_back(FrameAnalysis::Step{ step->name, step->threadId, (pathBegin - frameBegin) * millisecondsPerTick, (stepEnd - frameBegin) * millisecondsPerTick });
+				statistics.AddCriticalPath(step->name, stepEnd - pathBegin);
+				if (step->begin <= frameBegin)
+				{
+					break;
+				}
+
+				uint64_t handover = 0;
+				step = FindPredecessor(*step, handover);
+				if (step != nullptr)
+				{
+					// si ve del frame anterior, el cam d'aquest comena esperant-lo
+					handover = (handover > frameBegin) ? handover : frameBegin;
+					wait += pathBegin - handover;
+					pathBegin = handover;
+					if (handover == frameBegin)
+					{
+						break;
+					}
+				}
+				stepEnd = handover;
+			}
+			std::reverse(analysis.criticalSteps.begin(), analysis.criticalSteps.end());
+			analysis.criticalPath = (pathEnd - pathBegin) * millisecondsPerTick;
+			analysis.criticalPathWait = wait * millisecondsPerTick;
+		}
+	};
+
+	// Els trams del darrer frame de la finestra, en files: a cada thread una amb les tasques i l'idle i una per cada nivell de funcions
+	// aniuades. Es dibuixen amb ImDrawList i noms els visibles; els que fan menys de MinSliceWidth pxels s'ajunten amb els vens en
+	// un bloc gris, aix el que es dibuixa depn de l'amplada de la finestra i no de quants marcadors t el frame.
+	struct Profiler::TimelineView : public Profiler::Timeline::Listener
+	{
+		static constexpr float MinSliceWidth = 3.0f; // pxels
+		static constexpr float Offset = 50.0f; // pxels abans del primer millisegon
+
+		struct Slice
+		{
+			uint64_t begin, end;
+			const char* name;
+			Timeline::SliceEnd sliceEnd; // de les tasques, Running si encara s'executen. None a les funcions acabades i l'idle
+			int counters; // ndex a "counters", -1 si el tram no en t
+			bool idle;
+		};
+
+		// les files que no fan servir es queden buides per reaprofitar la memria el frame segent
+		std::vector<std::vector<Slice>> rows[MaxNumThreads];
+		int numRows[MaxNumThreads] = {};
+		std::vector<Slice> functions[MaxNumThreads]; // es reparteixen per files a EndFrame
+		std::vector<HardwareCounters::Values> counters;
+		uint64_t frameBegin = 0, frameEnd = 0;
+
+		void BeginFrame()
+		{
+			for (int l = 0; l < MaxNumThreads; l++)
+			{
+				for (std::vector<Slice>& row : rows[l])
+				{
+					row.clear();
+				}
+				numRows[l] = 0;
+				functions[l].clear();
+			}
+			counters.clear();
+			frameBegin = frameEnd = 0;
+		}
+
+		std::vector<Slice>& Row(int threadId, int row)
+		{
+			if ((int)rows[threadId].size() <= row)
+			{
+				rows[threadId].resize(row + 1);
+			}
+			if (numRows[threadId] <= row)
+			{
+				numRows[threadId] = row + 1;
+			}
+			return rows[threadId][row];
+		}
+
+		void AddSlice(Timeline::SliceKind kind, int threadId, const char* name, uint64_t begin, uint64_t end, Timeline::SliceEnd sliceEnd, const HardwareCounters::Values* sliceCounters)
+		{
+			Slice slice = { begin, end, name, sliceEnd, -1, kind == Timeline::SliceKind::Idle };
+			if (sliceCounters != nullptr)
+			{
+				slice.counters = (int)counters.size();
+				counters.push_back(*sliceCounters);
+			}
+			if (kind == Timeline::SliceKind::Function)
+				functions[threadId].push_back(slice);
+			else
+				Row(threadId, 0).push_back(slice);
+		}
+
+		void OnSlice(Timeline::SliceKind kind, int threadId, const char* name, uint64_t begin, uint64_t end, const void*, int, Timeline::SliceEnd sliceEnd, const HardwareCounters::Values* sliceCounters) override
+		{
+			AddSlice(kind, threadId, name, begin, end, sliceEnd, sliceCounters);
+		}
+
+		// hi afegeix el que encara s'executa, ordena les files i hi colloca les funcions segons com estan aniuades
+		void EndFrame(const Timeline& timeline, uint64_t snapshotTicks)
+		{
+			timeline.ForEachOpenSlice([&](Timeline::SliceKind kind, int threadId, const char* name, uint64_t begin, const void*)
+			{
+				AddSlice(kind, threadId, name, begin, snapshotTicks, (kind == Timeline::SliceKind::Job) ? Timeline::SliceEnd::Running : Timeline::SliceEnd::None, nullptr);
+			});
+
+			auto ByBegin = [](const Slice& a, const Slice& b) { return a.begin < b.begin || (a.begin == b.begin && a.end > b.end); };
+			bool hasBegin = false;
+			std::vector<uint64_t> open;
+			for (int l = 0; l < MaxNumThreads; l++)
+			{
+				if (numRows[l] > 0)
+				{
+					std::sort(rows[l][0].begin(), rows[l][0].end(), ByBegin);
+				}
+				// en un thread les funcions no es creuen: cadascuna va a la fila de les que encara sn obertes quan comena
+				std::sort(functions[l].begin(), functions[l].end(), ByBegin);
+				open.clear();
+				for (const Slice& function : functions[l])
+				{
+					while (!open.empty() && open.back() <= function.begin)
+					{
+						open.pop_back();
+					}
+					Row(l, (int)open.size() + 1).push_back(function);
+					open.push_back(function.end);
+				}
+
+				// el frame comena amb la primera tasca o funci, com abans; l'idle d'abans no compta
+				for (int r = 0; r < numRows[l]; r++)
+				{
+					for (const Slice& slice : rows[l][r])
+					{
+						if (!slice.idle && (!hasBegin || slice.begin < frameBegin))
+						{
+							frameBegin = slice.begin;
+							hasBegin = true;
+						}
+						frameEnd = (slice.end > frameEnd) ? slice.end : frameEnd;
+					}
+				}
+			}
+			if (!hasBegin)
+			{
+				frameBegin = frameEnd;
+			}
+		}
+
+		static float Hue(double milliseconds)
+		{
+			return (milliseconds < 16) ? 0.33f - (float)milliseconds * 0.08f / 15.0f : (milliseconds < 33) ? 0.16f - ((float)milliseconds - 16) * 0.08f / 15.0f : 0;
+		}
+
+		// dins del child de scroll de la finestra del profiler
+		void Draw(int numThreads, float millisecondLength, double millisecondsPerTick) const
+		{
+			const ImGuiStyle& style = ImGui::GetStyle();
+			const float rowHeight = ImGui::GetTextLineHeight() + 2 * style.FramePadding.y;
+			const float rowStep = rowHeight + style.ItemSpacing.y;
+
+			// com abans, no ms d'un segon
+			const double frameMs = std::min((frameEnd - frameBegin) * millisecondsPerTick, 1000.0);
+			const int maxMs = (int)frameMs + 2;
+			auto ToX = [&](uint64_t ticks) -> float
+			{
+				double ms = (ticks > frameBegin) ? (ticks - frameBegin) * millisecondsPerTick : 0;
+				return Offset + (float)std::min(ms, 1000.0) * millisecondLength;
+			};
+
+			int totalRows = 1;
+			for (int l = 0; l < numThreads; l++)
+			{
+				totalRows += 1 + numRows[l];
+			}
+
+			ImDrawList* drawList = ImGui::GetWindowDrawList();
+			const ImVec2 origin = ImGui::GetCursorScreenPos();
+			const float height = totalRows * rowStep;
+			// la part visible, en coordenades del contingut (0 a origin.x)
+			const float visibleLeft = ImGui::GetWindowPos().x - origin.x;
+			const float visibleRight = visibleLeft + ImGui::GetWindowWidth();
+
+			// millisegons: una lnia per cada un si hi ha lloc, i una etiqueta cada ~40 pxels
+			const int labelStep = (int)(40.0f / millisecondLength) + 1;
+			const int firstMs = std::max(0, (int)((visibleLeft - Offset) / millisecondLength));
+			const int lastMs = std::min(maxMs - 1, (int)((visibleRight - Offset) / millisecondLength) + 1);
+			for (int n = firstMs; n <= lastMs; n++)
+			{
+				if (millisecondLength < 4.0f && n % labelStep != 0)
+				{
+					continue;
+				}
+				float x = origin.x + Offset + n * millisecondLength;
+				drawList->AddLine(ImVec2(x, origin.y), ImVec2(x, origin.y + height), ImColor::HSV(Hue(n), 1, 1), 1.0f);
+				if (n % labelStep == 0)
+				{
+					char label[16];
+					snprintf(label, sizeof(label), "%dms", n);
+					drawList->AddText(ImVec2(x + 2, origin.y + style.FramePadding.y), ImGui::GetColorU32(ImGuiCol_Text), label);
+				}
+			}
+			{
+				float x = origin.x + ToX(frameEnd);
+				drawList->AddLine(ImVec2(x, origin.y), ImVec2(x, origin.y + height), ImColor::HSV(Hue(frameMs), 1, 1), 1.0f);
+			}
+
+			// el tram o bloc sota el ratol, per al tooltip
+			const bool hoverable = ImGui::IsWindowHovered();
+			const Slice* hoveredSlice = nullptr;
+			int hoveredCount = 0;
+			uint64_t hoveredBegin = 0, hoveredEnd = 0, hoveredBusy = 0;
+
+			// un tram sol, o "count" trams ajuntats
+			struct Block
+			{
+				float x0, x1;
+				int count;
+				uint64_t begin, end, busy;
+				const Slice* slice;
+			};
+			auto DrawBlock = [&](const Block& block, float y)
+			{
+				ImVec2 min(origin.x + block.x0, y), max(origin.x + std::max(block.x1, block.x0 + MinSliceWidth), y + rowHeight);
+				bool hovered = hoverable && ImGui::IsMouseHoveringRect(min, max);
+				if (block.count == 1)
+				{
+					const Slice& slice = *block.slice;
+					float hue = slice.idle ? 0 : ((((uintptr_t)slice.name >> 3) * 19) % 97) / 97.f;
+					drawList->AddRectFilled(min, max, hovered ? ImColor::HSV(hue, 0.7f, 0.7f) : ImColor::HSV(hue, 0.6f, 0.6f));
+					if (max.x - min.x > 2 * style.FramePadding.x + 8 && slice.name != nullptr)
+					{
+						ImVec4 clip(min.x, min.y, max.x - style.FramePadding.x, max.y);
+						drawList->AddText(ImGui::GetFont(), ImGui::GetFontSize(), ImVec2(min.x + style.FramePadding.x, min.y + style.FramePadding.y), ImGui::GetColorU32(ImGuiCol_Text), slice.name, nullptr, 0.0f, &clip);
+					}
+				}
+				else
+				{
+					drawList->AddRectFilled(min, max, hovered ? ImColor::HSV(0, 0, 0.55f) : ImColor::HSV(0, 0, 0.4f));
+				}
+				if (hovered)
+				{
+					hoveredSlice = block.slice;
+					hoveredCount = block.count;
+					hoveredBegin = block.begin;
+					hoveredEnd = block.end;
+					hoveredBusy = block.busy;
+				}
+			};
+
+			float y = origin.y + rowStep;
+			for (int l = 0; l < numThreads; l++)
+			{
+				char label[16];
+				snprintf(label, sizeof(label), "core %d", l);
+				drawList->AddText(ImVec2(origin.x + std::max(visibleLeft, 0.0f) + style.FramePadding.x, y + style.FramePadding.y), ImGui::GetColorU32(ImGuiCol_Text), label);
+				y += rowStep;
+
+				for (int r = 0; r < numRows[l]; r++, y += rowStep)
+				{
+					const std::vector<Slice>& row = rows[l][r];
+					if (y + rowHeight < ImGui::GetWindowPos().y || y > ImGui::GetWindowPos().y + ImGui::GetWindowHeight())
+					{
+						continue;
+					}
+					// en una fila els trams no es creuen: els finals tamb estan ordenats
+					auto slice = std::lower_bound(row.begin(), row.end(), visibleLeft, [&](const Slice& s, float x) { return ToX(s.end) < x; });
+					Block pending = {};
+					for (; slice != row.end(); ++slice)
+					{
+						float x0 = ToX(slice->begin), x1 = ToX(slice->end);
+						if (x0 > visibleRight)
+						{
+							break;
+						}
+						if (pending.count > 0 && (x1 - x0 >= MinSliceWidth || x0 > pending.x1 + MinSliceWidth))
+						{
+							DrawBlock(pending, y);
+							pending.count = 0;
+						}
+						if (x1 - x0 >= MinSliceWidth)
+						{
+							DrawBlock(Block{ x0, x1, 1, slice->begin, slice->end, slice->end - slice->begin, &*slice }, y);
+						}
+						else if (pending.count == 0)
+						{
+							pending = Block{ x0, x1, 1, slice->begin, slice->end, slice->end - slice->begin, &*slice };
+						}
+						else
+						{
+							pending.x1 = std::max(pending.x1, x1);
+							pending.end = std::max(pending.end, slice->end);
+							pending.busy += slice->end - slice->begin;
+							++pending.count;
+						}
+					}
+					if (pending.count > 0)
+					{
+						DrawBlock(pending, y);
+					}
+				}
+			}
+
+			// l'espai que ocupa, perqu hi hagi scroll
+			ImGui::Dummy(ImVec2(Offset + maxMs * millisecondLength, height));
+
+			if (hoveredCount == 1)
+			{
+				const Slice& slice = *hoveredSlice;
+				const char* endName = Timeline::GetSliceEndName(slice.sliceEnd);
+				char info[192] = "";
+				if (slice.counters >= 0)
+				{
+					const HardwareCounters::Values& values = counters[slice.counters];
+					uint64_t cycles = values.counts[HardwareCounters::Cycles];
+					snprintf(info, sizeof(info), "\ncycles: %llu\nIPC: %.2f\nLLC misses: %llu\nbranch misses: %llu", (unsigned long long)cycles, cycles > 0 ? (double)values.counts[HardwareCounters::Instructions] / cycles : 0.0,
+						(unsigned long long)values.counts[HardwareCounters::LastLevelCacheMisses], (unsigned long long)values.counts[HardwareCounters::BranchMisses]);
+				}
+				ImGui::SetTooltip("%s\nbegins: %fms\nends: %fms\nduration: %fms%s%s%s", slice.name != nullptr ? slice.name : "?",
+					(ToX(slice.begin) - Offset) / millisecondLength, (ToX(slice.end) - Offset) / millisecondLength, (slice.end - slice.begin) * millisecondsPerTick,
+					endName != nullptr ? "\n" : "", endName != nullptr ? endName : "", info);
+			}
+			else if (hoveredCount > 1)
+			{
+				ImGui::SetTooltip("%d slices under %.0f pixels\nbegins: %fms\nends: %fms\nrunning: %fms\nzoom in with Scale to see them", hoveredCount, MinSliceWidth,
+					(ToX(hoveredBegin) - Offset) / millisecondLength, (ToX(hoveredEnd) - Offset) / millisecondLength, hoveredBusy * millisecondsPerTick);
+			}
+		}
+	};
+
+	// el TSC s invariant si va a freqncia constant independentment de l'estat del nucli (CPUID 0x80000007, EDX bit 8). Sense aquest bit
+	// (CPUs antigues, algunes mquines virtuals) pot canviar amb la freqncia o aturar-se, i fem servir std::chrono
+	static bool IsCycleCounterInvariant()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		int registers[4];
+		__cpuid(registers, 0x80000000);
+		if ((unsigned int)registers[0] < 0x80000007)
+		{
+			return false;
+		}
+		__cpuid(registers, 0x80000007);
+		return (registers[3] & (1 << 8)) != 0;
+#elif defined(__x86_64__) || defined(__i386__)
+		unsigned int eax, ebx, ecx, edx;
+		return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8)) != 0;
+#elif defined(__aarch64__)
+		return true; // el comptador virtual de l'arquitectura t freqncia fixa
+#else
+		return false;
+#endif
+	}
+
+	Profiler::Profiler()
+		: useCycleCounter(IsCycleCounterInvariant())
+	{
+		calibrationTimePoint = std::chrono::high_resolution_clock::now();
+		calibrationTicks = ReadClock();
+		if (useCycleCounter)
+		{
+			// calibrem contra el rellotge del sistema durant 10ms, un cop en comenar
+			std::chrono::high_resolution_clock::time_point end;
+			do
+			{
+				end = std::chrono::high_resolution_clock::now();
+			} while (end - calibrationTimePoint < std::chrono::milliseconds(10));
+			uint64_t endTicks = ReadClock();
+
+			ticksPerSecond = (endTicks - calibrationTicks) / std::chrono::duration_cast<std::chrono::duration<double>>(end - calibrationTimePoint).count();
+		}
+		else
+		{
+			ticksPerSecond = 1e9;
+		}
+
+		timeline.reset(new Timeline());
+		statistics.reset(new Statistics());
+		statistics->nanosecondsPerTick = 1e9 / ticksPerSecond;
+		frameAnalyzer.reset(new FrameAnalyzer());
+		timelineView.reset(new TimelineView());
+	}
+
+	std::chrono::high_resolution_clock::time_point Profiler::ToTimePoint(uint64_t ticks) const
+	{
+		double seconds = (int64_t)(ticks - calibrationTicks) / ticksPerSecond;
+		return calibrationTimePoint + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::duration<double>(seconds));
+	}
+
+	Profiler::~Profiler()
+	{
+		StopTraceCapture();
+		StopStreamCapture();
+		StopSampling(nullptr);
+	}
+
+	bool Profiler::StartTraceCapture(const char* path)
+	{
+		StopTraceCapture();
+
+		std::unique_ptr<TraceCapture> capture(new TraceCapture());
+		if (!capture->Open(path, ticksPerSecond))
+		{
+			return false;
+		}
+		traceCapture = std::move(capture);
+		return true;
+	}
+
+	void Profiler::StopTraceCapture()
+	{
+		if (traceCapture != nullptr)
+		{
+			traceCapture->Close();
+			traceCapture.reset();
+		}
+	}
+
+	bool Profiler::StartStreamCapture(const char* path, size_t maxPendingBytes)
+	{
+		StopStreamCapture();
+
+		FILE* file = nullptr;
+		if (fopen_s(&file, path, "wb") != 0 || file == nullptr)
+		{
+			return false;
+		}
+		streamWriter.reset(new ProfilerStream::Writer(file, ticksPerSecond, maxPendingBytes));
+		streamFrames = 0;
+		streamZones = 0;
+		return true;
+	}
+
+	void Profiler::StopStreamCapture()
+	{
+		streamWriter.reset();
+	}
+
+	void Profiler::WriteFrameToStream(const Snapshot& snapshot, int numThreads)
+	{
+		static_assert(sizeof(ProfileMarker) == ProfilerStream::MarkerSize, "the stream format stores the markers as they are");
+		std::vector<uint8_t>& buffer = streamWriter->GetBuffer();
+
+		// les zones noves, abans del primer frame que les fa servir
+		int numZones = s_NumZones.load(std::memory_order_acquire);
+		for (; streamZones < numZones; ++streamZones)
+		{
+			const char* name = s_ZoneNames[streamZones];
+			uint16_t index = (uint16_t)streamZones;
+			uint32_t length = (uint32_t)strlen(name);
+			uint8_t* data = ProfilerStream::AppendRecord(buffer, ProfilerStream::RecordType::Zone, sizeof(index) + length);
+			memcpy(data, &index, sizeof(index));
+			memcpy(data + sizeof(index), name, length);
+		}
+
+		ProfilerStream::FrameHeader header = {};
+		header.frame = streamFrames++;
+		header.ticks = (ReadClock() - calibrationTicks) & ProfileMarker::TicksMask;
+		header.numThreads = numThreads;
+		uint32_t counts[MaxNumThreads];
+		uint32_t totalMarkers = 0;
+		for (int l = 0; l < numThreads; l++)
+		{
+			counts[l] = (snapshot.end[l] - snapshot.begin[l] + ProfilerMarkerBufferSize) % ProfilerMarkerBufferSize;
+			totalMarkers += counts[l];
+			header.droppedMarkers += markerRings[l].dropped.load(std::memory_order_relaxed);
+		}
+
+		size_t frameBegin = buffer.size();
+		uint8_t* data = ProfilerStream::AppendRecord(buffer, ProfilerStream::RecordType::Frame, uint32_t(sizeof(header) + numThreads * sizeof(uint32_t) + totalMarkers * sizeof(ProfileMarker)));
+		memcpy(data, &header, sizeof(header));
+		data += sizeof(header);
+		memcpy(data, counts, numThreads * sizeof(uint32_t));
+		data += numThreads * sizeof(uint32_t);
+		for (int l = 0; l < numThreads; l++)
+		{
+			// el tros de buffer pot donar la volta
+			int firstPart = (snapshot.begin[l] <= snapshot.end[l]) ? (int)counts[l] : ProfilerMarkerBufferSize - snapshot.begin[l];
+			memcpy(data, &profilerData[l][snapshot.begin[l]], firstPart * sizeof(ProfileMarker));
+			memcpy(data + firstPart * sizeof(ProfileMarker), &profilerData[l][0], (counts[l] - firstPart) * sizeof(ProfileMarker));
+			data += counts[l] * sizeof(ProfileMarker);
+		}
+		streamWriter->Submit(frameBegin);
+	}
+
+	bool Profiler::ConvertStreamToTrace(const char* streamPath, const char* tracePath, uint64_t firstFrame, uint64_t lastFrame)
+	{
+		ProfilerStream::Reader reader;
+		TraceCapture capture;
+		if (!reader.Open(streamPath) || !capture.Open(tracePath, reader.GetHeader().ticksPerSecond))
+		{
+			return false;
+		}
+
+		std::unique_ptr<Timeline> timeline(new Timeline());
+		Timeline::Listener* listener = &capture;
+		std::vector<uint16_t> zones; // dels ndexs del procs que va escriure el fitxer als d'aquest
+		std::vector<ProfileMarker> frameMarkers;
+		std::vector<std::pair<int, const ProfileMarker*>> markers;
+		ProfilerStream::RecordHeader record;
+		std::vector<uint8_t> data;
+		while (reader.Next(record, data))
+		{
+			if (record.type == ProfilerStream::RecordType::Zone && record.bytes >= sizeof(uint16_t))
+			{
+				uint16_t index;
+				memcpy(&index, data.data(), sizeof(index));
+				// la taula de zones s per a tot el programa i es queda el punter: el nom no s'allibera
+				size_t length = record.bytes - sizeof(index);
+				char* name = new char[length + 1];
+				memcpy(name, data.data() + sizeof(index), length);
+				name[length] = '\0';
+				if (zones.size() <= index)
+					zones.resize(index + 1, 0);
+				zones[index] = InternZone(name).index;
+			}
+			else if (record.type == ProfilerStream::RecordType::Frame && record.bytes >= sizeof(ProfilerStream::FrameHeader))
+			{
+				ProfilerStream::FrameHeader header;
+				memcpy(&header, data.data(), sizeof(header));
+				if (header.frame > lastFrame)
+				{
+					break;
+				}
+				size_t countsSize = header.numThreads * sizeof(uint32_t);
+				if (header.numThreads > MaxNumThreads || record.bytes < sizeof(header) + countsSize)
+				{
+					continue;
+				}
+				uint32_t counts[MaxNumThreads];
+				memcpy(counts, data.data() + sizeof(header), countsSize);
+				size_t totalMarkers = 0;
+				for (uint32_t l = 0; l < header.numThreads; l++)
+				{
+					totalMarkers += counts[l];
+				}
+				if (record.bytes != sizeof(header) + countsSize + totalMarkers * sizeof(ProfileMarker))
+				{
+					continue;
+				}
+
+				frameMarkers.resize(totalMarkers);
+				memcpy(frameMarkers.data(), data.data() + sizeof(header) + countsSize, totalMarkers * sizeof(ProfileMarker));
+				markers.clear();
+				size_t next = 0;
+				for (uint32_t l = 0; l < header.numThreads; l++)
+				{
+					for (uint32_t i = 0; i < counts[l]; i++, next++)
+					{
+						ProfileMarker& marker = frameMarkers[next];
+						uint16_t zone = (uint16_t)(marker.ticksAndZone >> 48);
+						zone = (zone < zones.size()) ? zones[zone] : 0;
+						marker.ticksAndZone = marker.GetTicks() | (uint64_t(zone) << 48);
+						markers.emplace_back((int)l, &marker);
+					}
+				}
+				std::stable_sort(markers.begin(), markers.end(), [](const std::pair<int, const ProfileMarker*>& a, const std::pair<int, const ProfileMarker*>& b)
+				{
+					return a.second->GetTicks() < b.second->GetTicks();
+				});
+
+				bool inRange = header.frame >= firstFrame;
+				if (inRange && !markers.empty())
+				{
+					capture.BeginFrame(markers.front().second->GetTicks());
+				}
+				for (const std::pair<int, const ProfileMarker*>& marker : markers)
+				{
+					timeline->AddMarker(marker.first, *marker.second, nullptr, &listener, inRange ? 1 : 0);
+				}
+			}
+		}
+		capture.Close();
+		return true;
+	}
+
+
+	void Profiler::ConsumeSnapshot(const Snapshot& snapshot, int numThreads, bool draw)
+	{
+		// ajuntem els marcadors de tots els threads per ordre de temps, perqu una tasca pot pausar-se en un thread i continuar en un altre.
+		// l'ordenaci s estable: dins de cada thread ja estan ordenats
+		std::vector<std::pair<int, const ProfileMarker*>> markers;
+		for (int l = 0; l < numThreads; l++)
+		{
+			for (int i = snapshot.begin[l]; i != snapshot.end[l]; i = (i + 1) % ProfilerMarkerBufferSize)
+			{
+				markers.emplace_back(l, &profilerData[l][i]);
+			}
+		}
+		std::stable_sort(markers.begin(), markers.end(), [](const std::pair<int, const ProfileMarker*>& a, const std::pair<int, const ProfileMarker*>& b)
+		{
+			return a.second->GetTicks() < b.second->GetTicks();
+		});
+
+		Timeline::Listener* listeners[4] = { statistics.get(), frameAnalyzer.get() };
+		int numListeners = 2;
+		statistics->BeginFrame();
+		frameAnalyzer->BeginFrame();
+		if (draw)
+		{
+			timelineView->BeginFrame();
+			listeners[numListeners++] = timelineView.get();
+		}
+		if (traceCapture != nullptr && !markers.empty())
+		{
+			traceCapture->BeginFrame(markers.front().second->GetTicks());
+			listeners[numListeners++] = traceCapture.get();
+		}
+		if (streamWriter != nullptr)
+		{
+			WriteFrameToStream(snapshot, numThreads);
+		}
+
+		for (const std::pair<int, const ProfileMarker*>& marker : markers)
+		{
+			timeline->AddMarker(marker.first, *marker.second, GetCounters(*marker.second), listeners, numListeners);
+		}
+		frameAnalyzer->EndFrame(*timeline, snapshot.ticks, numThreads, 1000.0 / ticksPerSecond, *statistics, lastFrameAnalysis);
+		if (draw)
+		{
+			timelineView->EndFrame(*timeline, snapshot.ticks);
+		}
+	}
+
+	void Profiler::EndFrame(int numThreads)
+	{
+		if (recordNewFrame.load(std::memory_order_relaxed))
+		{
+			Snapshot snapshot = TakeSnapshot(numThreads);
+			ConsumeSnapshot(snapshot, numThreads, false);
+			ReleaseSnapshot(snapshot, numThreads);
+		}
+	}
+
+	void Profiler::SetRecording(bool record)
+	{
+		if (record && !recordNewFrame.load(std::memory_order_relaxed))
+		{
+			// no hem vist el que ha passat mentre estava aturat
+			timeline->Reset();
+			frameAnalyzer->Reset();
+		}
+		recordNewFrame.store(record, std::memory_order_relaxed);
+	}
+
+	void Profiler::EnableHardwareCounters(bool enable)
+	{
+		if (enable && counterData == nullptr)
+		{
+			counterData.reset(new HardwareCounters::Values[MaxNumThreads * ProfilerMarkerBufferSize]);
+			threadCounters.reset(new ThreadCounters[MaxNumThreads]);
+		}
+		countersEnabled.store(enable, std::memory_order_release);
+	}
+
+	bool Profiler::StartSampling(const StackSampler::Settings& settings)
+	{
+		if (sampler == nullptr)
+		{
+			sampler.reset(new StackSampler(MaxNumThreads));
+		}
+		samplingEnabled.store(false, std::memory_order_relaxed);
+		if (!sampler->Start(settings))
+		{
+			return false;
+		}
+		samplingEnabled.store(true, std::memory_order_release);
+		return true;
+	}
+
+	bool Profiler::StopSampling(const char* foldedPath)
+	{
+		if (sampler == nullptr || !sampler->IsRunning())
+		{
+			return false;
+		}
+		samplingEnabled.store(false, std::memory_order_relaxed);
+		sampler->Stop();
+		return foldedPath == nullptr || sampler->WriteFoldedStacks(foldedPath);
+	}
+
+	// fora de lnia perqu AddProfileMark quedi petit: amb els comptadors desactivats no s'hi entra mai
+	bool Profiler::ReadCounters(int threadId, uint32_t index)
+	{
+		ThreadCounters& thread = threadCounters[threadId];
+		if (!thread.opened)
+		{
+			thread.counters.Open();
+			thread.opened = true;
+		}
+		if (!thread.counters.IsOpen())
+		{
+			return false;
+		}
+		thread.counters.Read(counterData[threadId * ProfilerMarkerBufferSize + index]);
+		return true;
+	}
+
+	const HardwareCounters::Values* Profiler::GetCounters(const ProfileMarker& marker) const
+	{
+		return marker.hasCounters ? &counterData[&marker - &profilerData[0][0]] : nullptr;
+	}
+
+	std::vector<Profiler::ZoneStatistics> Profiler::GetStatistics() const
+	{
+		std::vector<ZoneStatistics> result;
+		statistics->Get(result);
+		return result;
+	}
+
+	void Profiler::ResetStatistics()
+	{
+		double nanosecondsPerTick = statistics->nanosecondsPerTick;
+		statistics.reset(new Statistics());
+		statistics->nanosecondsPerTick = nanosecondsPerTick;
+	}
+
+	// taula amb les estadstiques, les ms lentes (p99 inclusiu) a dalt
+	void Profiler::DrawStatisticsToImGUI()
+	{
+		if (ImGui::Begin("Profiler Statistics"))
+		{
+			ImGui::Text("Last %d frames", StatisticsWindowFrames);
+			ImGui::SameLine();
+			if (ImGui::Button("Reset"))
+				ResetStatistics();
+
+			std::vector<ZoneStatistics> zones = GetStatistics();
+			std::sort(zones.begin(), zones.end(), [](const ZoneStatistics& a, const ZoneStatistics& b) { return a.inclusive.p99 > b.inclusive.p99; });
+			bool showCounters = std::any_of(zones.begin(), zones.end(), [](const ZoneStatistics& zone) { return zone.hasCounters; });
+
+			ImGui::Columns(showCounters ? 14 : 10, "statistics");
+			ImGui::Text("Name"); ImGui::NextColumn();
+			ImGui::Text("Count"); ImGui::NextColumn();
+			ImGui::Text("Mean ms"); ImGui::NextColumn();
+			ImGui::Text("p50 ms"); ImGui::NextColumn();
+			ImGui::Text("p95 ms"); ImGui::NextColumn();
+			ImGui::Text("p99 ms"); ImGui::NextColumn();
+			ImGui::Text("Max ms"); ImGui::NextColumn();
+			ImGui::Text("Excl. mean ms"); ImGui::NextColumn();
+			ImGui::Text("Excl. p99 ms"); ImGui::NextColumn();
+			ImGui::Text("Crit. ms/frame"); ImGui::NextColumn();
+			if (showCounters)
+			{
+				ImGui::Text("Kcycles"); ImGui::NextColumn();
+				ImGui::Text("IPC"); ImGui::NextColumn();
+				ImGui::Text("LLC misses"); ImGui::NextColumn();
+				ImGui::Text("Branch misses"); ImGui::NextColumn();
+			}
+			ImGui::Separator();
+			for (const ZoneStatistics& zone : zones)
+			{
+				ImGui::Text("%s%s", zone.isJob ? "" : "  ", zone.name != nullptr ? zone.name : "?"); ImGui::NextColumn();
+				ImGui::Text("%u", zone.count); ImGui::NextColumn();
+				ImGui::Text("%.3f", zone.inclusive.mean); ImGui::NextColumn();
+				ImGui::Text("%.3f", zone.inclusive.p50); ImGui::NextColumn();
+				ImGui::Text("%.3f", zone.inclusive.p95); ImGui::NextColumn();
+				ImGui::Text("%.3f", zone.inclusive.p99); ImGui::NextColumn();
+				ImGui::Text("%.3f", zone.inclusive.max); ImGui::NextColumn();
+				ImGui::Text("%.3f", zone.exclusive.mean); ImGui::NextColumn();
+				ImGui::Text("%.3f", zone.exclusive.p99); ImGui::NextColumn();
+				if (zone.isJob)
+					ImGui::Text("%.3f", zone.criticalPath);
+				else
+					ImGui::Text("-");
+				ImGui::NextColumn();
+				if (showCounters)
+				{
+					// mitjanes per crida
+					if (zone.hasCounters)
+					{
+						double cycles = zone.counters[HardwareCounters::Cycles];
+						ImGui::Text("%.1f", cycles * 1e-3); ImGui::NextColumn();
+						ImGui::Text("%.2f", cycles > 0 ? zone.counters[HardwareCounters::Instructions] / cycles : 0.0); ImGui::NextColumn();
+						ImGui::Text("%.0f", zone.counters[HardwareCounters::LastLevelCacheMisses]); ImGui::NextColumn();
+						ImGui::Text("%.0f", zone.counters[HardwareCounters::BranchMisses]); ImGui::NextColumn();
+					}
+					else
+					{
+						for (int c = 0; c < HardwareCounters::NumCounters; ++c)
+						{
+							ImGui::Text("-"); ImGui::NextColumn();
+						}
+					}
+				}
+			}
+			ImGui::Columns(1);
+		}
+		ImGui::End();
+	}
+
+	// dibuixa una finestra ImGUI amb la info del darrer frame
+	void Profiler::DrawProfilerToImGUI(int numThreads)
+	{
+		// tot el que es dibuixa, s'exporta i es compta aquest frame surt de la mateixa snapshot, encara que els workers continun escrivint
+		Snapshot snapshot = TakeSnapshot(numThreads);
+		// la casella de sota pot canviar "record": s'allibera el que s'ha consumit, no el que diu la casella
+		const bool consumed = recordNewFrame.load(std::memory_order_relaxed);
+		bool record = consumed;
+
+		if (consumed)
+		{
+			ConsumeSnapshot(snapshot, numThreads, true);
+		}
+
+		if (ImGui::Begin("Profiler"))
+		{
+			if (ImGui::Checkbox("Record", &record))
+				SetRecording(record);
+			ImGui::SameLine();
+			if (traceCapture == nullptr)
+			{
+				if (ImGui::Button("Capture trace"))
+					StartTraceCapture("profile.trace.json");
+			}
+			else
+			{
+				char label[64];
+				snprintf(label, sizeof(label), "Stop capture (%d frames)", traceCapture->numFrames);
+				if (ImGui::Button(label))
+					StopTraceCapture();
+			}
+
+			ImGui::SameLine();
+			bool counters = AreHardwareCountersEnabled();
+			if (ImGui::Checkbox("HW counters", &counters))
+				EnableHardwareCounters(counters);
+
+			ImGui::SameLine();
+			if (streamWriter == nullptr)
+			{
+				if (ImGui::Button("Stream to disk"))
+					StartStreamCapture("profile.pgprof");
+			}
+			else
+			{
+				char label[128];
+				snprintf(label, sizeof(label), "Stop stream (%llu frames, %.1f MB, %llu dropped%s)", (unsigned long long)streamFrames, streamWriter->GetWrittenBytes() / (1024.0 * 1024.0),
+					(unsigned long long)streamWriter->GetDroppedFrames(), streamWriter->HasFailed() ? ", WRITE FAILED" : "");
+				if (ImGui::Button(label))
+					StopStreamCapture();
+			}
+
+			ImGui::SameLine();
+			if (!IsSampling())
+			{
+				if (ImGui::Button("Sample stacks"))
+					StartSampling(samplingSettings);
+				ImGui::SameLine();
+				ImGui::PushItemWidth(100.0f);
+				ImGui::SliderInt("Hz", &samplingSettings.samplesPerSecond, 100, 10000);
+				ImGui::SameLine();
+				ImGui::SliderInt("Depth", &samplingSettings.maxDepth, 4, StackSampler::MaxDepth);
+				ImGui::PopItemWidth();
+			}
+			else
+			{
+				char label[128];
+				snprintf(label, sizeof(label), "Stop sampling (%llu samples, %llu lost, %.1f us each)", (unsigned long long)sampler->GetNumSamples(),
+					(unsigned long long)sampler->GetDroppedSamples(), sampler->GetMeanSampleCost());
+				if (ImGui::Button(label))
+					StopSampling("profile.folded");
+			}
+
+			uint32_t droppedMarkers = 0;
+			for (int l = 0; l < numThreads; l++)
+			{
+				droppedMarkers += markerRings[l].dropped.load(std::memory_order_relaxed);
+			}
+			if (droppedMarkers > 0)
+			{
+				ImGui::SameLine();
+				ImGui::Text("%u markers lost, buffer full", droppedMarkers);
+			}
+
+			const FrameAnalysis& analysis = lastFrameAnalysis;
+			if (analysis.numThreads > 0)
+			{
+				ImGui::Text("Frame %.3f ms, critical path %.3f ms (%.3f ms waiting for a thread), parallel efficiency %.0f%%",
+					analysis.frameTime, analysis.criticalPath, analysis.criticalPathWait, analysis.parallelEfficiency * 100.0);
+				if (ImGui::CollapsingHeader("Threads and critical path"))
+				{
+					for (int l = 0; l < analysis.numThreads; l++)
+					{
+						ImGui::Text("core %d: jobs %.3f ms, idle %.3f ms, scheduler %.3f ms", l, analysis.busy[l], analysis.idle[l],
+							analysis.frameTime - analysis.busy[l] - analysis.idle[l]);
+					}
+					ImGui::Separator();
+					for (const FrameAnalysis::Step& step : analysis.criticalSteps)
+					{
+						ImGui::Text("%8.3f - %8.3f ms  core %d  %s", step.begin, step.end, step.threadId, step.name != nullptr ? step.name : "?");
+					}
+				}
+			}
+
+			ImGui::SliderFloat("Scale", &millisecondLength, 20, 10000, "%.3f", 5);
+
+			ImGui::BeginChild("scrolling", ImVec2(0, 0), false, ImGuiWindowFlags_HorizontalScrollbar);
+			// sense gravar es continua veient el darrer frame
+			timelineView->Draw(numThreads, millisecondLength, 1000.0 / ticksPerSecond);
+			ImGui::EndChild();
+		}
+
+		if (consumed)
+		{
+			ReleaseSnapshot(snapshot, numThreads);
+		}
+		ImGui::End();
+
+		DrawStatisticsToImGUI();
 	}
 }
\ No newline at end of file
@@ -1,9 +1,28 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "HardwareCounters.hh"
+#include "StackSampler.hh"
+#include "ThreadsafeStructures.hh"
 
 namespace Utilities
 {
+	namespace ProfilerStream
+	{
+		class Writer;
+	}
+
 	class Profiler
 	{
 	public:
@@ -17,17 +36,118 @@ namespace Utilities
 			BEGIN_FUNCTION, END_FUNCTION,
 		};
 
+		// Noms de les tasques i funcions ("zones"), internats a una taula global compartida per tots els profilers: els marcadors noms
+		// en guarden l'ndex. Es poden declarar un cop (static) i passar el ZoneId; la versi amb const char* busca el nom a cada marca.
+		// Els noms han de viure tot el programa, com els literals. Amb la taula plena els nous surten com la zona 0, "?".
+		struct ZoneId
+		{
+			uint16_t index;
+		};
+		static constexpr int MaxZones = 4096;
+		// FNV-1a, amb un literal el compilador el calcula en compilar
+		static constexpr uint32_t HashZoneName(const char* name, uint32_t hash = 2166136261u)
+		{
+			return (*name == '\0') ? hash : HashZoneName(name + 1, (hash ^ (uint8_t)*name) * 16777619u);
+		}
+		static ZoneId InternZone(const char* name, uint32_t hash);
+		static ZoneId InternZone(const char* name) { return InternZone(name, (name != nullptr) ? HashZoneName(name) : 0); }
+		static const char* GetZoneName(ZoneId zone);
+
 		// Cridar aquesta funci cada cop que volguem registrar una marca al profiler.
-		// emparellar cada BEGIN_* amb un END_* i cada PAUSE_* amb un RESUME_*. Els BEGIN_FUNCTION/END_FUNCTION han d'anar aniuats i dins de begin/end
-		void AddProfileMark(MarkerType reason, const void* identifier = nullptr, const char* functionName = nullptr, int threadId = 0, int systemID = -1);
+		// emparellar cada BEGIN_* amb un END_* i cada PAUSE_* amb un RESUME_*. Els BEGIN_FUNCTION/END_FUNCTION han d'anar aniuats i dins de begin/end.
+		// dels identificadors noms es guarden els 32 bits baixos i del systemID els 16
+		void AddProfileMark(MarkerType reason, const void* identifier, ZoneId zone, int threadId = 0, int systemID = -1);
+		void AddProfileMark(MarkerType reason, const void* identifier = nullptr, const char* functionName = nullptr, int threadId = 0, int systemID = -1)
+		{
+			AddProfileMark(reason, identifier, InternZone(functionName), threadId, systemID);
+		}
 
 		// crea un "BEGIN_FUNCTION" i quan l'objecte creat es destrueix, un "END_FUNCTION"
 		struct MarkGuard;
+		MarkGuard CreateProfileMarkGuard(ZoneId zone, int threadId = 0, int systemID = -1);
 		MarkGuard CreateProfileMarkGuard(const char* functionName, int threadId = 0, int systemID = -1);
 
-		// dibuixa una finestra ImGUI amb la info del darrer frame
+		// dibuixa una finestra ImGUI amb la info del darrer frame. numThreads: quants buffers es llegeixen, un per cada threadId que
+		// escriu marcadors (els workers i, si n'escriu, el thread principal amb el seu ndex)
 		void DrawProfilerToImGUI(int numThreads);
 
+		// quan no es dibuixa el profiler (sense finestra): passa el frame a les estadstiques i a la captura, si n'hi ha, i el dna per llegit
+		void EndFrame(int numThreads);
+
+		// captura els frames a un fitxer "trace event" JSON de Chrome, per obrir-lo amb chrome://tracing o https://ui.perfetto.dev.
+		// cada BEGIN/RESUME..END/PAUSE s una franja del thread, els BEGIN_FUNCTION/END_FUNCTION franges aniuades a dins i els IDLE franges "Idle".
+		// a ms cada fibra t la seva pista (esdeveniments asncrons) amb la vida de la tasca i les pauses, encara que canvi de thread.
+		// els frames s'hi afegeixen a DrawProfilerToImGUI o EndFrame.
+		bool StartTraceCapture(const char* path);
+		void StopTraceCapture();
+		bool IsCapturingTrace() const { return traceCapture != nullptr; }
+
+		// Captura contnua a un fitxer binari compacte (veure ProfilerStream.hh), per a proves de moltes hores: cada frame consumit
+		// per DrawProfilerToImGUI o EndFrame hi afegeix els seus marcadors tal com sn, 16 bytes cadascun. Escriu un thread propi i
+		// com a molt hi ha maxPendingBytes esperant el disc; si no dona l'abast es perden frames sencers, que es compten.
+		bool StartStreamCapture(const char* path, size_t maxPendingBytes = 64 * 1024 * 1024);
+		void StopStreamCapture();
+		bool IsStreamingCapture() const { return streamWriter != nullptr; }
+		// passa els frames [firstFrame, lastFrame] d'una captura contnua a un "trace event" JSON com el de StartTraceCapture.
+		// Els frames anteriors es llegeixen igualment, per saber qu estava obert
+		static bool ConvertStreamToTrace(const char* streamPath, const char* tracePath, uint64_t firstFrame = 0, uint64_t lastFrame = UINT64_MAX);
+
+		// Rellotge dels marcadors: el comptador de cicles (rdtsc) a x86 si el TSC s invariant, cntvct_el0 a ARM64 i si no
+		// std::chrono::high_resolution_clock en nanosegons. Llegir-lo costa pocs cicles; els tics noms es passen a temps real
+		// en dibuixar o exportar, amb la freqncia calibrada en crear el profiler.
+		uint64_t ReadClock() const;
+		double GetTicksPerSecond() const { return ticksPerSecond; }
+		std::chrono::high_resolution_clock::time_point ToTimePoint(uint64_t ticks) const;
+
+		// atura o reprn la gravaci de marcadors (el "Record" de la finestra)
+		void SetRecording(bool record);
+
+		// Comptadors de hardware (cicles, instruccions, fallades de LLC, errors de predicci) a cada marcador de tasca i funci, veure
+		// HardwareCounters. Cada thread obre els seus en el primer marcador desprs d'activar-los, aix que cada threadId ha de ser
+		// sempre el mateix thread del sistema. Llegir-los s una crida al sistema (~100-200ns) per marcador; desactivats no costen res
+		// ms que comprovar un bool. Els marcadors d'idle no en llegeixen.
+		void EnableHardwareCounters(bool enable);
+		bool AreHardwareCountersEnabled() const { return countersEnabled.load(std::memory_order_relaxed); }
+
+		// Mostreig de piles (veure StackSampler) dels threads que criden SetRunningJob, el scheduler cada cop que entra o surt d'una
+		// fibra: cada mostra va a la tasca que s'hi executava. En aturar-lo s'escriuen les piles en format "folded" per a un flame graph.
+		// Desactivat, SetRunningJob noms comprova un bool.
+		bool StartSampling(const StackSampler::Settings& settings = StackSampler::Settings());
+		bool StopSampling(const char* foldedPath); // nullptr: noms l'atura
+		bool IsSampling() const { return samplingEnabled.load(std::memory_order_relaxed); }
+		void SetRunningJob(int threadId, const char* jobName)
+		{
+			// acquire: si s actiu, sampler ja existeix
+			if (samplingEnabled.load(std::memory_order_acquire))
+			{
+				sampler->SetRunningJob(threadId, jobName);
+			}
+		}
+
+		// Estadstiques de cada tasca i funci, per nom, dels darrers StatisticsWindowFrames frames (els consumits per DrawProfilerToImGUI o EndFrame).
+		// Els noms es comparen per punter, han de ser literals. "inclusive" va del BEGIN a l'END, pauses incloses; "exclusive" s el temps que
+		// s'ha executat ella mateixa, sense pauses ni les funcions aniuades. Els percentils surten d'histogrames logartmics, amb un error de ~3%.
+		static constexpr int StatisticsWindowFrames = 256;
+		struct Percentiles
+		{
+			double mean, p50, p95, p99, max; // ms
+		};
+		struct ZoneStatistics
+		{
+			const char* name;
+			bool isJob; // si no, s una funci (BEGIN_FUNCTION/END_FUNCTION)
+			uint32_t count;
+			Percentiles inclusive, exclusive;
+			bool hasCounters; // les crides de la finestra que tenien comptadors al principi i al final de cada tram
+			double counters[HardwareCounters::NumCounters]; // mitjana per crida, mentre s'executava (sense pauses, amb les funcions aniuades)
+			double criticalPath; // ms per frame que ha estat al cam crtic (veure FrameAnalysis), noms les tasques
+		};
+		std::vector<ZoneStatistics> GetStatistics() const;
+		void ResetStatistics();
+
+		Profiler();
+		~Profiler();
+
 		// GUARDA. S'aprofita del sistema RAII (Resource acquisition is initialization) de C++
 		// i de "move semantics" de C++11 per assegurar-se que es crida el END_FUNCTION 1 vegada.
 		struct MarkGuard
@@ -47,23 +167,57 @@ namespace Utilities
 			{
 				if (profiler != nullptr)
 				{
-					profiler->AddProfileMark(MarkerType::END_FUNCTION, identifier, (const char*)nullptr, threadIndex);
+					profiler->AddProfileMark(MarkerType::END_FUNCTION, identifier, ZoneId{ 0 }, threadIndex);
 				}
 			}
 		};
 
-		static constexpr int ProfilerMarkerBufferSize = 16 * 1024;
+		static constexpr int ProfilerMarkerBufferSize = 32 * 1024; // potncia de 2, els comptadors de 32 bits poden donar la volta
 		static constexpr int MaxNumThreads = 8; // 8
+		static_assert((ProfilerMarkerBufferSize & (ProfilerMarkerBufferSize - 1)) == 0, "ProfilerMarkerBufferSize must be a power of 2");
+
+		// Anlisi de cada frame consumit per DrawProfilerToImGUI o EndFrame, amb els BEGIN/END/PAUSE/RESUME que posa el scheduler.
+		// Els marcadors no diuen de qui depn cada tasca: la cadena es ref cap enrere des del tram que acaba ms tard, passant cada
+		// cop al que ha arribat l'ltim. Un RESUME l'ha desbloquejat l'ltim END d'abans o el seu thread en quedar lliure; un BEGIN,
+		// el seu thread en quedar lliure o la tasca que l'ha afegit: la d'un altre thread que s'executava en aquell moment o acabava
+		// de parar, i que desprs es pausa (Do i Wait). Els threads sn els ndexs de 0 a numThreads - 1
+		// que s'han passat a DrawProfilerToImGUI o EndFrame, el thread principal incls si hi escriu.
+		struct FrameAnalysis
+		{
+			struct Step
+			{
+				const char* name;
+				int threadId;
+				double begin, end; // ms des del principi del frame
+			};
+			int numThreads = 0; // 0 fins que hi ha dos frames seguits
+			double frameTime = 0; // ms des del frame anterior
+			double criticalPath = 0; // ms del principi del primer pas al final de l'ltim
+			double criticalPathWait = 0; // ms entre passos: el segent ja podia comenar per el scheduler encara no l'havia agafat
+			double parallelEfficiency = 0; // temps executant tasques / (numThreads * frameTime)
+			double busy[MaxNumThreads] = {}; // ms de cada thread executant tasques
+			double idle[MaxNumThreads] = {}; // ms de cada thread adormit a WaitForNotification. La resta, el scheduler buscant feina
+			std::vector<Step> criticalSteps; // per ordre de temps
+		};
+		const FrameAnalysis& GetLastFrameAnalysis() const { return lastFrameAnalysis; }
 
 	private:
 
+		// 16 bytes: 4 per lnia de cache
 		struct ProfileMarker
 		{
-			std::chrono::high_resolution_clock::time_point timePoint;
-			const void* identifier;
-			const char* jobName;
-			int systemID;
+			// 48 bits baixos: ReadClock() - calibrationTicks, dona la volta al cap d'unes 26h amb un TSC de 3GHz. 16 alts: ZoneId.
+			// Es munta sencer en un registre, un camp de bits obligaria a llegir la posici abans d'escriure-la
+			uint64_t ticksAndZone;
+			uint32_t identifier;
+			int16_t systemID;
 			MarkerType type;
+			bool hasCounters; // a counterData, a la mateixa posici
+
+			static constexpr uint64_t TicksMask = (uint64_t(1) << 48) - 1;
+			uint64_t GetTicks() const { return ticksAndZone & TicksMask; }
+			const char* GetName() const { return GetZoneName(ZoneId{ (uint16_t)(ticksAndZone >> 48) }); }
+			const void* GetIdentifier() const { return reinterpret_cast<const void*>(uintptr_t(identifier)); }
 
 			bool IsBeginMark() const { return (type == MarkerType::BEGIN || type == MarkerType::RESUME_FROM_PAUSE || type == MarkerType::BEGIN_IDLE); }
 			bool IsEndMark() const { return (type == MarkerType::END || type == MarkerType::PAUSE_WAIT_FOR_JOB || type == MarkerType::PAUSE_WAIT_FOR_QUEUE_SPACE || type == MarkerType::END_IDLE); }
@@ -71,10 +225,123 @@ namespace Utilities
 			bool IsFunctionMark() const { return (type == MarkerType::BEGIN_FUNCTION || type == MarkerType::END_FUNCTION); }
 
 		} profilerData[MaxNumThreads][ProfilerMarkerBufferSize];
+		static_assert(sizeof(ProfileMarker) == 16, "ProfileMarker must stay packed");
+
+		// Cada thread noms escriu al seu buffer (un productor) i noms el thread que dibuixa o crida EndFrame els llegeix (un consumidor).
+		// El productor publica cada marcador amb "release" a "written" i el consumidor allibera les posicions llegides amb "release" a "read",
+		// aix cap dels dos toca mai una posici que l'altre est fent servir. Si el buffer s ple el marcador es perd i es compta a "dropped":
+		// els workers no s'esperen mai.
+		struct alignas(ThreadsafeStructures::CacheLineSize) MarkerRing
+		{
+			std::atomic<uint32_t> written{ 0 }; // marcadors escrits des del principi, noms el modifica el productor
+			std::atomic<uint32_t> dropped{ 0 };
+			alignas(ThreadsafeStructures::CacheLineSize) std::atomic<uint32_t> read{ 0 }; // marcadors llegits, noms el modifica el consumidor
+		} markerRings[MaxNumThreads];
+
+		// el que llegir el consumidor aquest frame: els marcadors publicats en el moment de fer-la, de "begin" a "end" (ndexs a profilerData).
+		// Els workers poden continuar escrivint darrere "end" mentre es llegeix.
+		struct Snapshot
+		{
+			int begin[MaxNumThreads];
+			int end[MaxNumThreads];
+			uint32_t written[MaxNumThreads];
+			uint64_t ticks; // quan s'ha fet, relatius com els dels marcadors: cap marcador de la snapshot s posterior
+		};
+		Snapshot TakeSnapshot(int numThreads) const;
+		// torna les posicions llegides als productors
+		void ReleaseSnapshot(const Snapshot& snapshot, int numThreads);
 
-		int profilerNextWriteIndex[MaxNumThreads] = {}; // TODO do this atomic?
-		int profilerNextReadIndex[MaxNumThreads] = {};
-		bool recordNewFrame = true;
+		std::atomic<bool> recordNewFrame{ true };
+
+		// es creen el primer cop que s'activen i no s'alliberen fins al final: un worker pot estar escrivint-hi mentre es desactiven
+		std::atomic<bool> countersEnabled{ false };
+		std::unique_ptr<HardwareCounters::Values[]> counterData; // MaxNumThreads * ProfilerMarkerBufferSize, com profilerData
+		struct ThreadCounters
+		{
+			HardwareCounters counters;
+			bool opened = false; // encara que no n'hi hagi cap de disponible, noms ho provem un cop
+		};
+		std::unique_ptr<ThreadCounters[]> threadCounters; // MaxNumThreads, cadascun noms el fa servir el seu thread
+		bool ReadCounters(int threadId, uint32_t index); // false si aquest thread no en t cap
+
+		std::atomic<bool> samplingEnabled{ false };
+		std::unique_ptr<StackSampler> sampler; // com els comptadors, es crea el primer cop i viu fins al final
+		StackSampler::Settings samplingSettings; // els de la finestra
+		const HardwareCounters::Values* GetCounters(const ProfileMarker& marker) const;
 		float millisecondLength = 130.0f;
+
+		bool useCycleCounter;
+		double ticksPerSecond;
+		uint64_t calibrationTicks;
+		std::chrono::high_resolution_clock::time_point calibrationTimePoint;
+
+		struct Timeline;
+		struct TraceCapture;
+		struct Statistics;
+		struct FrameAnalyzer;
+		struct TimelineView;
+		std::unique_ptr<Timeline> timeline;
+		std::unique_ptr<TraceCapture> traceCapture;
+		std::unique_ptr<Statistics> statistics;
+		std::unique_ptr<FrameAnalyzer> frameAnalyzer;
+		FrameAnalysis lastFrameAnalysis;
+		std::unique_ptr<TimelineView> timelineView; // el darrer frame que ha dibuixat DrawProfilerToImGUI
+
+		// passa els marcadors de la snapshot per ordre de temps a les estadstiques i a la captura, i amb "draw" al timeline de la finestra
+		void ConsumeSnapshot(const Snapshot& snapshot, int numThreads, bool draw);
+
+		std::unique_ptr<ProfilerStream::Writer> streamWriter;
+		uint64_t streamFrames = 0;
+		int streamZones = 0; // zones que ja sn al fitxer
+		void WriteFrameToStream(const Snapshot& snapshot, int numThreads);
+
+		void DrawStatisticsToImGUI();
 	};
+
+	inline uint64_t Profiler::ReadClock() const
+	{
+		if (useCycleCounter)
+		{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+			return __rdtsc();
+#elif defined(__aarch64__)
+			uint64_t ticks;
+			__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+			return ticks;
+#endif
+		}
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+	}
+
+	// Cridar aquesta funci cada cop que volguem registrar una marca al profiler.
+	// emparellar cada BEGIN_* amb un END_* i cada PAUSE_* amb un RESUME_*. Els BEGIN_FUNCTION/END_FUNCTION han d'anar aniuats i dins de begin/end
+	inline void Profiler::AddProfileMark(MarkerType reason, const void* identifier, ZoneId zone, int threadId, int systemID)
+	{
+		if (recordNewFrame.load(std::memory_order_relaxed))
+		{
+			MarkerRing& ring = markerRings[threadId];
+			uint32_t written = ring.written.load(std::memory_order_relaxed);
+
+			// deixem una posici lliure perqu "begin == end" vulgui dir buit
+			if (written - ring.read.load(std::memory_order_acquire) >= ProfilerMarkerBufferSize - 1)
+			{
+				ring.dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			// acquire: si sn actius, counterData ja existeix
+			bool hasCounters = countersEnabled.load(std::memory_order_acquire) && reason != MarkerType::BEGIN_IDLE && reason != MarkerType::END_IDLE
+				&& ReadCounters(threadId, written % ProfilerMarkerBufferSize);
+
+			ProfileMarker mark;
+			mark.ticksAndZone = ((ReadClock() - calibrationTicks) & ProfileMarker::TicksMask) | (uint64_t(zone.index) << 48);
+			mark.identifier = (uint32_t)reinterpret_cast<uintptr_t>(identifier);
+			mark.systemID = (int16_t)systemID;
+			mark.type = reason;
+			mark.hasCounters = hasCounters;
+
+			profilerData[threadId][written % ProfilerMarkerBufferSize] = mark;
+			ring.written.store(written + 1, std::memory_order_release);
+		}
+	}
 }
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "ProfilerStream.hh"
+
+#include <cstring>
+
+namespace Utilities
+{
+	namespace ProfilerStream
+	{
+		static constexpr size_t MaxFreeBuffers = 4;
+
+		uint8_t* AppendRecord(std::vector<uint8_t>& buffer, RecordType type, uint32_t bytes)
+		{
+			RecordHeader record = { type, bytes };
+			size_t begin = buffer.size();
+			buffer.resize(begin + sizeof(record) + bytes);
+			memcpy(&buffer[begin], &record, sizeof(record));
+			return &buffer[begin + sizeof(record)];
+		}
+
+		Writer::Writer(FILE* _file, double ticksPerSecond, size_t _maxPendingBytes)
+			: file(_file)
+			, maxPendingBytes(_maxPendingBytes)
+		{
+			FileHeader fileHeader = {};
+			memcpy(fileHeader.magic, Magic, sizeof(Magic));
+			fileHeader.version = Version;
+			fileHeader.markerSize = MarkerSize;
+			fileHeader.ticksPerSecond = ticksPerSecond;
+			buffer.resize(sizeof(fileHeader));
+			memcpy(buffer.data(), &fileHeader, sizeof(fileHeader));
+
+			thread = std::thread([this] { Run(); });
+			Submit(buffer.size());
+		}
+
+		Writer::~Writer()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				finish = true;
+			}
+			wakeUp.notify_one();
+			thread.join();
+			fclose(file);
+		}
+
+		void Writer::Submit(size_t frameBegin)
+		{
+			std::vector<uint8_t> next;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (pendingBytes + buffer.size() > maxPendingBytes && frameBegin < buffer.size())
+				{
+					buffer.resize(frameBegin);
+					++droppedFrames;
+				}
+				if (buffer.empty())
+				{
+					return;
+				}
+				pendingBytes += buffer.size();
+				pending.push_back(std::move(buffer));
+				if (!freeBuffers.empty())
+				{
+					next = std::move(freeBuffers.back());
+					freeBuffers.pop_back();
+				}
+			}
+			wakeUp.notify_one();
+			buffer = std::move(next);
+			buffer.clear();
+		}
+
+		void Writer::Run()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (;;)
+			{
+				wakeUp.wait(lock, [this] { return finish || !pending.empty(); });
+				if (pending.empty())
+				{
+					break;
+				}
+				std::vector<uint8_t> data = std::move(pending.front());
+				pending.pop_front();
+				bool caughtUp = pending.empty();
+				lock.unlock();
+
+				if (!failed.load(std::memory_order_relaxed))
+				{
+					if (fwrite(data.data(), 1, data.size(), file) == data.size())
+						writtenBytes.fetch_add(data.size(), std::memory_order_relaxed);
+					else
+						failed.store(true, std::memory_order_relaxed); // disc ple: la resta es descarta
+				}
+				// quan no queda res per escriure, que arribi al sistema: si el procés peta el fitxer es pot llegir fins aquí
+				if (caughtUp)
+				{
+					fflush(file);
+				}
+
+				size_t bytes = data.size();
+				data.clear();
+				lock.lock();
+				pendingBytes -= bytes;
+				if (freeBuffers.size() < MaxFreeBuffers)
+				{
+					freeBuffers.push_back(std::move(data));
+				}
+			}
+		}
+
+		Reader::~Reader()
+		{
+			if (file != nullptr)
+			{
+				fclose(file);
+			}
+		}
+
+		bool Reader::Open(const char* path)
+		{
+			if (fopen_s(&file, path, "rb") != 0 || file == nullptr)
+			{
+				file = nullptr;
+				return false;
+			}
+			return fread(&header, sizeof(header), 1, file) == 1
+				&& memcmp(header.magic, Magic, sizeof(Magic)) == 0
+				&& header.version == Version
+				&& header.markerSize == MarkerSize;
+		}
+
+		bool Reader::Next(RecordHeader& record, std::vector<uint8_t>& data)
+		{
+			if (file == nullptr || fread(&record, sizeof(record), 1, file) != 1)
+			{
+				return false;
+			}
+			data.resize(record.bytes);
+			return record.bytes == 0 || fread(data.data(), 1, record.bytes, file) == record.bytes;
+		}
+	}
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Utilities
+{
+	// Captura contínua del profiler a disc (fitxers .pgprof), per a proves de moltes hores.
+	// Format, tot en l'ordre de bytes de la màquina que l'ha escrit:
+	//   FileHeader
+	//   registres, cadascun un RecordHeader seguit de "bytes" bytes:
+	//     Zone:  uint16_t índex de la zona i el nom, sense '\0'. Sempre abans del primer frame que la fa servir
+	//     Frame: FrameHeader, uint32_t nombre de marcadors de cada thread i els marcadors de cada thread seguits,
+	//            tal com són a la memòria del profiler (MarkerSize bytes)
+	// Un procés que peta pot deixar l'últim registre a mitges; el Reader s'atura al darrer registre sencer.
+	namespace ProfilerStream
+	{
+		static constexpr char Magic[8] = { 'P', 'G', 'P', 'R', 'O', 'F', '\0', '\0' };
+		static constexpr uint32_t Version = 1;
+		static constexpr uint32_t MarkerSize = 16;
+
+		struct FileHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t markerSize;
+			double ticksPerSecond;
+		};
+
+		enum class RecordType : uint32_t
+		{
+			Zone = 1,
+			Frame = 2,
+		};
+
+		struct RecordHeader
+		{
+			RecordType type;
+			uint32_t bytes;
+		};
+
+		struct FrameHeader
+		{
+			uint64_t frame; // des del principi de la captura
+			uint64_t ticks; // quan s'ha consumit, en tics relatius com els dels marcadors
+			uint32_t numThreads;
+			uint32_t droppedMarkers; // perduts perquè els buffers del profiler eren plens, des del principi
+		};
+
+		// afegeix un registre al final de "buffer" i torna on s'han d'escriure les seves dades
+		uint8_t* AppendRecord(std::vector<uint8_t>& buffer, RecordType type, uint32_t bytes);
+
+		// Escriu els registres des d'un thread propi: qui consumeix el profiler munta els registres del frame a GetBuffer() i
+		// els passa amb Submit(), sense esperar mai el disc. Si hi ha més de maxPendingBytes per escriure (el disc no dona l'abast)
+		// el frame es descarta sencer i es compta; els registres de zones no es descarten mai.
+		class Writer
+		{
+		public:
+			Writer(FILE* file, double ticksPerSecond, size_t maxPendingBytes);
+			Writer(const Writer&) = delete;
+			Writer& operator=(const Writer&) = delete;
+			~Writer(); // escriu el que quedi pendent i tanca el fitxer
+
+			std::vector<uint8_t>& GetBuffer() { return buffer; }
+			// passa el buffer al thread d'escriptura. Des de "frameBegin" fins al final hi ha el registre del frame, l'únic que es pot descartar
+			void Submit(size_t frameBegin);
+
+			uint64_t GetWrittenBytes() const { return writtenBytes.load(std::memory_order_relaxed); }
+			uint64_t GetDroppedFrames() const { return droppedFrames; }
+			bool HasFailed() const { return failed.load(std::memory_order_relaxed); }
+
+		private:
+			void Run();
+
+			FILE* file;
+			size_t maxPendingBytes;
+			std::vector<uint8_t> buffer;
+			uint64_t droppedFrames = 0;
+
+			std::thread thread;
+			std::mutex mutex;
+			std::condition_variable wakeUp;
+			std::deque<std::vector<uint8_t>> pending;
+			std::vector<std::vector<uint8_t>> freeBuffers; // es reaprofiten, així la memòria no creix
+			size_t pendingBytes = 0;
+			bool finish = false;
+
+			std::atomic<uint64_t> writtenBytes{ 0 };
+			std::atomic<bool> failed{ false };
+		};
+
+		class Reader
+		{
+		public:
+			Reader() = default;
+			Reader(const Reader&) = delete;
+			Reader& operator=(const Reader&) = delete;
+			~Reader();
+
+			// false si no es pot obrir o no és un fitxer .pgprof d'aquesta versió
+			bool Open(const char* path);
+			const FileHeader& GetHeader() const { return header; }
+
+			// el registre següent; false al final del fitxer
+			bool Next(RecordHeader& record, std::vector<uint8_t>& data);
+
+		private:
+			FILE* file = nullptr;
+			FileHeader header = {};
+		};
+	}
+}
@@ -1,37 +1,75 @@
 #pragma once
 
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <tuple>
+#include <utility>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define UTILITIES_HASHMAP_SSE2 1
+#endif
 
 namespace Utilities
 {
+	// a structure on a linear allocator couldn't get the memory to grow. Stop with a message instead of writing through null,
+	// in release builds too. Allocators that know how much they have in use (FrameArena::ThreadAllocator) report it before this.
+	[[noreturn]] inline void LinearAllocatorExhausted(const char* structure, size_t requestedBytes)
+	{
+		fprintf(stderr, "%s: out of memory, %zu bytes requested\n", structure, requestedBytes);
+		fflush(stderr);
+		assert(false);
+		std::abort();
+	}
+
 	template<typename T>
 	struct PassThroughHasher
 	{
 		T operator()(const T& t) { return t; }
 	};
 
+	// Open addressing hash map in the style of the "Swiss tables": one control byte per slot (empty, deleted or 7 bits of the hash)
+	// and lookups that compare a whole group of 16 control bytes at once, so most of the slots that don't match never touch the keys.
+	// Groups are aligned and probed one after the other. Delete only leaves a tombstone if its group is full, and when the
+	// tombstones eat the free space the table is rehashed in place. The storage comes from HashMap (fixed size) or ResizableHashMap (grows).
 	template<typename K, typename T, typename KeyHasher = PassThroughHasher<K>>
 	struct HashMapBase
 	{
 	public:
-		static constexpr size_t ComputeActiveElementsSize(size_t numElements)
+		static constexpr size_t GroupSize = 16;
+		static constexpr size_t NotFound = ~(size_t)0;
+
+		// slots for "numElements": a power of two, at least one group
+		static constexpr size_t ComputeCapacity(size_t numElements)
+		{
+			return numElements <= GroupSize ? GroupSize : 2 * ComputeCapacity((numElements + 1) / 2);
+		}
+
+		// elements that fit before Reserve needs to rehash or grow (7/8 of the slots)
+		static constexpr size_t ComputeMaxElements(size_t capacity)
 		{
-			return (((numElements * 2) - 1) / 64) + 1;
+			return capacity - capacity / 8;
 		}
 
-		int GetNumActiveElements() const { return numActiveElements; }
+		size_t GetNumActiveElements() const { return numActiveElements; }
+		size_t GetCapacity() const { return capacity; }
 
 		void Set(K name, const T& data)
 		{
-			size_t index = GetHashIndex(name);
-			if (!IsActive(index))
+			Payload element = Get(name);
+			if (element == nullptr)
 			{
-				++numActiveElements;
-				SetActive(index);
+				element = Reserve(name);
+			}
+			if (element != nullptr)
+			{
+				*element = data;
 			}
-			namesTable[index] = name;
-			payload[index] = data;
 		}
 
 		struct ConstIterator
@@ -41,7 +79,7 @@ namespace Utilities
 				do
 				{
 					++index;
-				} while (index < (int)hashMap->tableSize && !hashMap->IsActive(index));
+				} while (index < hashMap->capacity && !IsFull(hashMap->control[index]));
 				return *this;
 			}
 
@@ -54,14 +92,14 @@ namespace Utilities
 			bool operator!=(const ConstIterator& other) { return index != other.index || hashMap != other.hashMap; }
 
 			const HashMapBase *hashMap;
-			int index;
-			ConstIterator(const HashMapBase *_hashMap, int _index) : hashMap(_hashMap), index(_index) {};
+			size_t index;
+			ConstIterator(const HashMapBase *_hashMap, size_t _index) : hashMap(_hashMap), index(_index) {};
 		};
 
 		ConstIterator begin() const
 		{
-			int index = 0;
-			while (index < (int)tableSize && !IsActive(index))
+			size_t index = 0;
+			while (index < capacity && !IsFull(control[index]))
 			{
 				++index;
 			}
@@ -69,7 +107,7 @@ namespace Utilities
 		}
 		ConstIterator end() const
 		{
-			return ConstIterator(this, tableSize);
+			return ConstIterator(this, capacity);
 		}
 
 		struct Payload
@@ -83,91 +121,275 @@ namespace Utilities
 			bool operator!=(nullptr_t) { return data != nullptr; }
 		};
 
+		// "name" must not be in the map. Returns nullptr if it is full (only a ResizableHashMap can grow)
 		Payload Reserve(K name)
 		{
-			assert(numActiveElements < tableSize * 4 / 5);
-			size_t index = GetHashIndex(name);
-			assert(!IsActive(index));
-			++numActiveElements;
-			SetActive(index);
-			namesTable[index] = name;
-			return{ &payload[index], index };
+			uint64_t hash = Hash(name);
+			assert(Find(name, hash) == NotFound);
+
+			size_t index = FindInsertSlot(hash);
+			if (index == NotFound || (control[index] == Empty && growthLeft == 0))
+			{
+				if (GetNumTombstones() > 0)
+				{
+					RehashInPlace();
+				}
+				if (growthLeft == 0)
+				{
+					assert(false); // full!
+					return{ nullptr, NotFound };
+				}
+				index = FindInsertSlot(hash);
+			}
+			return Insert(name, hash, index);
 		}
 
 		const Payload Get(K name) const
 		{
-			size_t index = GetHashIndex(name);
-			return{ IsActive(index) ? &payload[index] : nullptr, index };
+			size_t index = Find(name, Hash(name));
+			return{ index != NotFound ? &payload[index] : nullptr, index };
 		}
 		Payload Get(K name)
 		{
-			size_t index = GetHashIndex(name);
-			return{ IsActive(index) ? &payload[index] : nullptr, index };
+			size_t index = Find(name, Hash(name));
+			return{ index != NotFound ? &payload[index] : nullptr, index };
 		}
 
 		void Delete(K name)
 		{
-			size_t index = GetHashIndex(name);
-			assert(isActive(index));
-			SetDeleted(index);
+			size_t index = Find(name, Hash(name));
+			assert(index != NotFound);
+			if (index == NotFound)
+			{
+				return;
+			}
+
+			--numActiveElements;
+			// lookups only go past a group if it has no empty slots, so if this one has any nobody needs a tombstone here
+			if (Group(&control[index & ~(GroupSize - 1)]).MatchEmpty() != 0)
+			{
+				control[index] = Empty;
+				++growthLeft;
+			}
+			else
+			{
+				control[index] = Deleted;
+			}
 		}
 
 		float Occupancy() const
 		{
-			return (float)numActiveElements / (float)tableSize;
+			return capacity > 0 ? (float)numActiveElements / (float)capacity : 1.0f;
 		}
 
 	protected:
-		HashMapBase(K *_namesTable, T *_payload, uint64_t *_activeElements, uint32_t _tableSize)
-			: namesTable(_namesTable)
-			, payload(_payload)
-			, activeElements(_activeElements)
-			, tableSize(_tableSize)
-			, numActiveElements(0)
-		{ 
-			memset(activeElements, 0, ComputeActiveElementsSize(tableSize) * sizeof(uint64_t));
+		static constexpr int8_t Empty = -128; // 0b10000000
+		static constexpr int8_t Deleted = -2; // 0b11111110
+		// full slots hold the 7 low bits of the hash, the sign bit is only set on empty/deleted
+
+		HashMapBase(K *_namesTable, T *_payload, int8_t *_control, size_t _capacity)
+		{
+			SetStorage(_namesTable, _payload, _control, _capacity);
 		}
 
-	private:
+		void SetStorage(K *_namesTable, T *_payload, int8_t *_control, size_t _capacity)
+		{
+			assert(_capacity % GroupSize == 0 && (_capacity & (_capacity - 1)) == 0);
+			namesTable = _namesTable;
+			payload = _payload;
+			control = _control;
+			capacity = _capacity;
+			groupMask = _capacity / GroupSize - 1;
+			numActiveElements = 0;
+			growthLeft = ComputeMaxElements(_capacity);
+			if (capacity > 0)
+			{
+				memset(control, Empty, capacity);
+			}
+		}
 
-		bool IsActive(size_t index) const
+		size_t GetNumTombstones() const
 		{
-			return (activeElements[(index * 2) / 64] & (1ULL << ((index * 2) % 64))) != 0;
+			return capacity > 0 ? ComputeMaxElements(capacity) - numActiveElements - growthLeft : 0;
 		}
-		bool IsDeleted(size_t index) const
+
+		// moves the elements of the old storage to the current one (must have room for all of them)
+		void InsertAll(K *oldNamesTable, T *oldPayload, const int8_t *oldControl, size_t oldCapacity)
 		{
-			return (activeElements[(index * 2 + 1) / 64] & (1ULL << ((index * 2 + 1) % 64))) != 0;
+			for (size_t i = 0; i < oldCapacity; ++i)
+			{
+				if (IsFull(oldControl[i]))
+				{
+					uint64_t hash = Hash(oldNamesTable[i]);
+					Payload element = Insert(oldNamesTable[i], hash, FindInsertSlot(hash));
+					*element = std::move(oldPayload[i]);
+				}
+			}
 		}
-		void SetActive(size_t index) const
+
+		uint64_t Hash(const K& name) const
 		{
-			assert(!IsActive(index));
-			activeElements[(index * 2) / 64] |= (1ULL << ((index * 2) % 64));
-			activeElements[(index * 2 + 1) / 64] &= ~(1ULL << ((index * 2 + 1) % 64));
+			KeyHasher hasher;
+			uint64_t hash = (uint64_t)hasher(name) * 0x9E3779B97F4A7C15ull; // the hashers may be pass through, mix the bits
+			return hash ^ (hash >> 32);
 		}
-		void SetDeleted(size_t index) const
+
+		size_t FindInsertSlot(uint64_t hash) const
 		{
-			assert(!IsActive(index));
-			activeElements[(index * 2) / 64] &= ~(1ULL << ((index * 2) % 64));
-			activeElements[(index * 2 + 1) / 64] |= (1ULL << ((index * 2 + 1) % 64));
+			for (size_t group = (hash >> 7) & groupMask, probes = 0; capacity > 0 && probes <= groupMask; group = (group + 1) & groupMask, ++probes)
+			{
+				uint32_t available = Group(&control[group * GroupSize]).MatchEmptyOrDeleted();
+				if (available != 0)
+				{
+					return group * GroupSize + LowestBit(available);
+				}
+			}
+			return NotFound;
 		}
 
-		size_t GetHashIndex(K name) const
+		Payload Insert(K name, uint64_t hash, size_t index)
 		{
-			KeyHasher hasher;
-			uint_fast16_t index = (uint_fast16_t)(hasher(name) % tableSize);
+			if (control[index] == Empty)
+			{
+				assert(growthLeft > 0);
+				--growthLeft;
+			}
+			control[index] = H2(hash);
+			++numActiveElements;
+			namesTable[index] = name;
+			return{ &payload[index], index };
+		}
+
+		bool NeedsGrowth(uint64_t hash) const
+		{
+			size_t index = FindInsertSlot(hash);
+			return index == NotFound || (control[index] == Empty && growthLeft == 0);
+		}
 
-			while ((IsActive(index) && namesTable[index] != name) || IsDeleted(index))
+		// gets rid of the tombstones without more memory (the same algorithm as absl's DropDeletesWithoutResize):
+		// every element is marked as "deleted" and then moved to the first free slot of its probe sequence,
+		// swapping with the still unplaced elements it finds there.
+		void RehashInPlace()
+		{
+			for (size_t i = 0; i < capacity; ++i)
 			{
-				index = (uint_fast16_t)((index + 1) % tableSize);
+				control[i] = IsFull(control[i]) ? Deleted : Empty;
 			}
-			return (size_t)index;
+
+			for (size_t i = 0; i < capacity; )
+			{
+				if (control[i] != Deleted)
+				{
+					++i;
+					continue;
+				}
+
+				uint64_t hash = Hash(namesTable[i]);
+				size_t target = FindInsertSlot(hash);
+				size_t firstGroup = (hash >> 7) & groupMask;
+				if ((((target / GroupSize) - firstGroup) & groupMask) == (((i / GroupSize) - firstGroup) & groupMask))
+				{
+					control[i] = H2(hash); // already in the first group with room, stays
+					++i;
+				}
+				else if (control[target] == Empty)
+				{
+					control[target] = H2(hash);
+					namesTable[target] = std::move(namesTable[i]);
+					payload[target] = std::move(payload[i]);
+					control[i] = Empty;
+					++i;
+				}
+				else
+				{
+					// another unplaced element, swap them and place the one that ends up in "i" without moving on
+					control[target] = H2(hash);
+					std::swap(namesTable[target], namesTable[i]);
+					std::swap(payload[target], payload[i]);
+				}
+			}
+			growthLeft = ComputeMaxElements(capacity) - numActiveElements;
 		}
 
 		K *namesTable;
 		T *payload;
-		uint64_t *activeElements;
-		uint32_t tableSize;
-		uint32_t numActiveElements;
+		int8_t *control;
+		size_t capacity;
+		size_t groupMask;
+		size_t numActiveElements;
+		size_t growthLeft; // empty slots we can still fill, tombstones don't give it back
+
+	private:
+
+		static bool IsFull(int8_t c) { return c >= 0; }
+		static int8_t H2(uint64_t hash) { return (int8_t)(hash & 0x7F); }
+
+		static int LowestBit(uint32_t mask)
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return (int)index;
+#else
+			return __builtin_ctz(mask);
+#endif
+		}
+
+		// the 16 control bytes of a group, every Match returns a bit per slot
+		struct Group
+		{
+#if defined(UTILITIES_HASHMAP_SSE2)
+			__m128i bytes;
+
+			explicit Group(const int8_t* control) : bytes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(control))) {}
+
+			uint32_t Match(int8_t h2) const { return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), bytes)); }
+			uint32_t MatchEmpty() const { return Match(Empty); }
+			uint32_t MatchEmptyOrDeleted() const { return (uint32_t)_mm_movemask_epi8(bytes); } // the sign bit
+#else
+			const int8_t* bytes;
+
+			explicit Group(const int8_t* control) : bytes(control) {}
+
+			uint32_t Match(int8_t h2) const
+			{
+				uint32_t mask = 0;
+				for (size_t i = 0; i < GroupSize; ++i)
+					mask |= (uint32_t)(bytes[i] == h2) << i;
+				return mask;
+			}
+			uint32_t MatchEmpty() const { return Match(Empty); }
+			uint32_t MatchEmptyOrDeleted() const
+			{
+				uint32_t mask = 0;
+				for (size_t i = 0; i < GroupSize; ++i)
+					mask |= (uint32_t)(bytes[i] < 0) << i;
+				return mask;
+			}
+#endif
+		};
+
+		size_t Find(const K& name, uint64_t hash) const
+		{
+			const int8_t h2 = H2(hash);
+			for (size_t group = (hash >> 7) & groupMask, probes = 0; capacity > 0 && probes <= groupMask; group = (group + 1) & groupMask, ++probes)
+			{
+				Group controlGroup(&control[group * GroupSize]);
+				for (uint32_t match = controlGroup.Match(h2); match != 0; match &= match - 1)
+				{
+					size_t index = group * GroupSize + LowestBit(match);
+					if (namesTable[index] == name)
+					{
+						return index;
+					}
+				}
+				if (controlGroup.MatchEmpty() != 0)
+				{
+					return NotFound;
+				}
+			}
+			return NotFound;
+		}
 	};
 
 
@@ -175,12 +397,91 @@ namespace Utilities
 	struct HashMap : HashMapBase<K, T, KeyHasher>
 	{
 	public:
-		HashMap() : HashMapBase<K, T, KeyHasher>(namesTable, payload, activeElements, Size) {}
+		HashMap() : HashMapBase<K, T, KeyHasher>(namesTable, payload, control, Capacity) {}
 
 	private:
-		K namesTable[Size];
-		T payload[Size];
-		uint64_t activeElements[ComputeActiveElementsSize(Size)];
+		static constexpr size_t Capacity = HashMapBase<K, T, KeyHasher>::ComputeCapacity(Size);
+
+		K namesTable[Capacity];
+		T payload[Capacity];
+		int8_t control[Capacity];
+	};
+
+	// hash map for linear allocators (anything with "alloc<T>(N)"), grows to twice the slots when it is full.
+	// Like ResizableArray growing doesn't free the old storage, it is reclaimed when the allocator is reset.
+	template<typename K, typename T, typename KeyHasher = PassThroughHasher<K>>
+	struct ResizableHashMap : HashMapBase<K, T, KeyHasher>
+	{
+	private:
+		using Base = HashMapBase<K, T, KeyHasher>;
+
+	public:
+		using Base::Reserve;
+		using Base::Set;
+		using typename Base::Payload;
+
+		ResizableHashMap()
+			: Base(nullptr, nullptr, nullptr, 0)
+		{}
+
+		template<typename Allocator>
+		ResizableHashMap(size_t initialElements, Allocator& allocator)
+			: Base(nullptr, nullptr, nullptr, 0)
+		{
+			Resize(initialElements, allocator);
+		}
+
+		// room for "numElements" without growing again
+		template<typename Allocator>
+		void Resize(size_t numElements, Allocator& allocator)
+		{
+			size_t newCapacity = Base::ComputeCapacity(numElements);
+			while (Base::ComputeMaxElements(newCapacity) < numElements)
+				newCapacity *= 2;
+			if (newCapacity <= this->capacity)
+			{
+				return;
+			}
+
+			K* oldNamesTable = this->namesTable;
+			T* oldPayload = this->payload;
+			int8_t* oldControl = this->control;
+			size_t oldCapacity = this->capacity;
+
+			K* newNamesTable = allocator.template alloc<K>(newCapacity);
+			T* newPayload = allocator.template alloc<T>(newCapacity);
+			int8_t* newControl = allocator.template alloc<int8_t>(newCapacity);
+			if (newNamesTable == nullptr || newPayload == nullptr || newControl == nullptr)
+				LinearAllocatorExhausted("ResizableHashMap", newCapacity * (sizeof(K) + sizeof(T) + sizeof(int8_t)));
+
+			this->SetStorage(newNamesTable, newPayload, newControl, newCapacity);
+			this->InsertAll(oldNamesTable, oldPayload, oldControl, oldCapacity);
+		}
+
+		template<typename Allocator>
+		Payload Reserve(K name, Allocator& allocator)
+		{
+			if (this->NeedsGrowth(this->Hash(name)))
+			{
+				// mostly tombstones: clean them up, else twice the slots
+				if (this->numActiveElements * 32 <= this->capacity * 25 && this->GetNumTombstones() > 0)
+					this->RehashInPlace();
+				else
+					Resize(this->capacity > 0 ? Base::ComputeMaxElements(this->capacity) * 2 : Base::GroupSize, allocator);
+			}
+			return Reserve(name);
+		}
+
+		template<typename Allocator>
+		void Set(K name, const T& data, Allocator& allocator)
+		{
+			Payload element = this->Get(name);
+			if (element == nullptr)
+			{
+				element = Reserve(name, allocator);
+			}
+			*element = data;
+		}
 	};
 
 	// struct HashedStringHasher {
@@ -194,28 +495,46 @@ namespace Utilities
 
 	// ------------------------------------------------------------------------------------------------
 
-	struct StackAllocator;
-
+	// growable array for linear allocators (StackAllocator, FrameArena::ThreadAllocator, ...): anything with "alloc<T>(N)".
+	// growing doesn't free the old storage, it is reclaimed when the allocator is reset.
 	template<typename T>
 	struct ResizableArray
 	{
 		T* ptr;
 		size_t capacity, size;
 
-		ResizableArray(size_t initialCapacity, StackAllocator& allocator)
-			: ptr(allocator.alloc<T>(initialCapacity))
-			, capacity(initialCapacity)
+		ResizableArray()
+			: ptr(nullptr)
+			, capacity(0)
 			, size(0)
 		{}
 
+		template<typename Allocator>
+		ResizableArray(size_t initialCapacity, Allocator& allocator)
+			: ptr(allocator.template alloc<T>(initialCapacity))
+			, capacity(initialCapacity)
+			, size(0)
+		{
+			if (ptr == nullptr && initialCapacity > 0)
+				LinearAllocatorExhausted("ResizableArray", initialCapacity * sizeof(T));
+		}
+
 		T& operator[](size_t index) { return ptr[index]; }
 		const T& operator[](size_t index) const { return ptr[index]; }
 
-		void Resize(size_t newCapacity, StackAllocator& allocator)
+		T* begin() { return ptr; }
+		T* end() { return ptr + size; }
+		const T* begin() const { return ptr; }
+		const T* end() const { return ptr + size; }
+
+		template<typename Allocator>
+		void Resize(size_t newCapacity, Allocator& allocator)
 		{
 			if (newCapacity > capacity)
 			{
-				T* aux = allocator.alloc<T>(newCapacity);
+				T* aux = allocator.template alloc<T>(newCapacity);
+				if (aux == nullptr)
+					LinearAllocatorExhausted("ResizableArray", newCapacity * sizeof(T));
 				for (int i = 0; i < (int)size; ++i)
 					aux[i] = ptr[i];
 				ptr = aux;
@@ -223,15 +542,18 @@ namespace Utilities
 			capacity = newCapacity;
 		}
 
-		void Push(const T& element, StackAllocator& allocator)
+		template<typename Allocator>
+		void Push(const T& element, Allocator& allocator)
 		{
 			if (size == capacity)
 			{
-				Resize(capacity * 2, allocator);
+				Resize(capacity > 0 ? capacity * 2 : 4, allocator);
 			}
 			assert(size < capacity);
 			ptr[size] = element;
 			++size;
 		}
+
+		void Clear() { size = 0; }
 	};
 }
@@ -0,0 +1,141 @@
+#include "SchedulerTelemetry.hh"
+
+#include "imgui/imgui.h"
+
+namespace Utilities
+{
+	static constexpr double NanosecondsPerMs = 1e6;
+
+	bool SchedulerReport::Open(const char* path, int _numThreads)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (file != nullptr)
+		{
+			fclose(file);
+			file = nullptr;
+		}
+		if (fopen_s(&file, path, "w") != 0 || file == nullptr)
+		{
+			file = nullptr;
+			return false;
+		}
+		numThreads = _numThreads;
+		numFrames = 0;
+
+		fputs("frame,tasks,resumes,waits_for_job,waits_for_queue_space,steals,sleeps,sleep_ms,queue_high_peak,queue_medium_peak,queue_low_peak,small_stack_fibers_peak,large_stack_fibers_peak,waiting_fibers_peak", file);
+		for (int t = 0; t < numThreads; ++t)
+		{
+			fprintf(file, ",tasks_%d,sleep_ms_%d", t, t);
+		}
+		fputc('\n', file);
+		return true;
+	}
+
+	void SchedulerReport::Close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (file != nullptr)
+		{
+			fclose(file);
+			file = nullptr;
+		}
+	}
+
+	bool SchedulerReport::IsOpen() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return file != nullptr;
+	}
+
+	uint64_t SchedulerReport::GetNumFrames() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return numFrames;
+	}
+
+	void SchedulerReport::WriteFrame(const TaskManager::JobScheduler& scheduler)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (file == nullptr)
+		{
+			return;
+		}
+
+		const TaskManager::SchedulerFrameStats& stats = scheduler.GetLastFrameStats();
+		const TaskManager::SchedulerStats& counters = stats.counters;
+		fprintf(file, "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.3f,%d,%d,%d,%d,%d,%d", (unsigned long long)scheduler.GetFrame(),
+			(unsigned long long)counters.tasksRun, (unsigned long long)counters.resumes, (unsigned long long)counters.waitsForJob,
+			(unsigned long long)counters.waitsForQueueSpace, (unsigned long long)counters.steals, (unsigned long long)counters.sleeps, counters.sleepNanoseconds / NanosecondsPerMs,
+			stats.queuePeak[0], stats.queuePeak[1], stats.queuePeak[2], stats.smallStackFibersPeak, stats.largeStackFibersPeak, stats.waitingFibersPeak);
+		for (int t = 0; t < numThreads; ++t)
+		{
+			fprintf(file, ",%llu,%.3f", (unsigned long long)stats.threads[t].tasksRun, stats.threads[t].sleepNanoseconds / NanosecondsPerMs);
+		}
+		fputc('\n', file);
+		++numFrames;
+	}
+
+	void DrawSchedulerTelemetryToImGUI(const TaskManager::JobScheduler& scheduler, SchedulerReport* report)
+	{
+		if (ImGui::Begin("Scheduler"))
+		{
+			if (report != nullptr)
+			{
+				if (!report->IsOpen())
+				{
+					if (ImGui::Button("Write per-frame report"))
+						report->Open("scheduler_report.csv", scheduler.GetNumThreads());
+				}
+				else
+				{
+					char label[64];
+					snprintf(label, sizeof(label), "Stop report (%llu frames)", (unsigned long long)report->GetNumFrames());
+					if (ImGui::Button(label))
+						report->Close();
+				}
+			}
+
+			auto printFrame = [](const char* name, const TaskManager::SchedulerFrameStats& stats)
+			{
+				const TaskManager::SchedulerStats& counters = stats.counters;
+				ImGui::Text("%s: %llu tasks, %llu resumes, %llu waits for jobs, %llu waits for queue space, %llu steals, %llu sleeps (%.3f ms)", name,
+					(unsigned long long)counters.tasksRun, (unsigned long long)counters.resumes, (unsigned long long)counters.waitsForJob,
+					(unsigned long long)counters.waitsForQueueSpace, (unsigned long long)counters.steals, (unsigned long long)counters.sleeps, counters.sleepNanoseconds / NanosecondsPerMs);
+				ImGui::Text("    queues (high/medium/low) %d/%d/%d of %d, fibers %d/%d small %d/%d large, %d waiting", stats.queuePeak[0], stats.queuePeak[1], stats.queuePeak[2], TaskManager::JobQueueCapacity,
+					stats.smallStackFibersPeak, TaskManager::NumSmallStackFibers, stats.largeStackFibersPeak, TaskManager::NumLargeStackFibers, stats.waitingFibersPeak);
+			};
+			ImGui::Text("Frame %llu", (unsigned long long)scheduler.GetFrame());
+			printFrame("Last frame", scheduler.GetLastFrameStats());
+			printFrame("Peak frame", scheduler.GetPeakFrameStats());
+
+			if (ImGui::CollapsingHeader("Workers (last frame)"))
+			{
+				const TaskManager::SchedulerFrameStats& stats = scheduler.GetLastFrameStats();
+				ImGui::Columns(8, "workers");
+				ImGui::Text("Thread"); ImGui::NextColumn();
+				ImGui::Text("Tasks"); ImGui::NextColumn();
+				ImGui::Text("Resumes"); ImGui::NextColumn();
+				ImGui::Text("Waits job"); ImGui::NextColumn();
+				ImGui::Text("Waits queue"); ImGui::NextColumn();
+				ImGui::Text("Steals"); ImGui::NextColumn();
+				ImGui::Text("Sleeps"); ImGui::NextColumn();
+				ImGui::Text("Sleep ms"); ImGui::NextColumn();
+				ImGui::Separator();
+				for (int t = 0; t < scheduler.GetNumThreads(); ++t)
+				{
+					const TaskManager::SchedulerStats& thread = stats.threads[t];
+					ImGui::Text("%d", t); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)thread.tasksRun); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)thread.resumes); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)thread.waitsForJob); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)thread.waitsForQueueSpace); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)thread.steals); ImGui::NextColumn();
+					ImGui::Text("%llu", (unsigned long long)thread.sleeps); ImGui::NextColumn();
+					ImGui::Text("%.3f", thread.sleepNanoseconds / NanosecondsPerMs); ImGui::NextColumn();
+				}
+				ImGui::Columns(1);
+			}
+		}
+		ImGui::End();
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+#include "TaskManager.hh"
+
+namespace Utilities
+{
+	// informe per frame en CSV: una línia per JobScheduler::NextFrame amb els comptadors del frame i les tasques i el temps adormit
+	// de cada worker, per mirar-lo amb un full de càlcul o un script després d'una partida
+	class SchedulerReport
+	{
+	public:
+		SchedulerReport() = default;
+		SchedulerReport(const SchedulerReport&) = delete;
+		SchedulerReport& operator=(const SchedulerReport&) = delete;
+		~SchedulerReport() { Close(); }
+
+		bool Open(const char* path, int numThreads);
+		void Close();
+		bool IsOpen() const;
+		uint64_t GetNumFrames() const;
+
+		// després de cada NextFrame. No fa res si no està obert
+		void WriteFrame(const TaskManager::JobScheduler& scheduler);
+
+	private:
+		mutable std::mutex mutex; // la UI l'obre i el tanca, i escriu qui crida NextFrame
+		FILE* file = nullptr;
+		int numThreads = 0;
+		uint64_t numFrames = 0;
+	};
+
+	// finestra ImGui amb la telemetria del scheduler: el darrer frame, el pitjor i cada worker. Amb "report", el botó per gravar-lo
+	void DrawSchedulerTelemetryToImGUI(const TaskManager::JobScheduler& scheduler, SchedulerReport* report = nullptr);
+}
@@ -0,0 +1,555 @@
+#include "StackSampler.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#elif defined(_WIN32)
+#include <Windows.h>
+#include <DbgHelp.h>
+#pragma comment (lib, "Dbghelp.lib")
+#pragma comment (lib, "Winmm.lib")
+#endif
+
+namespace Utilities
+{
+	StackSampler::StackSampler(int _maxThreads)
+		: maxThreads(_maxThreads)
+		, threads(new ThreadData[_maxThreads])
+	{
+	}
+
+	StackSampler::~StackSampler()
+	{
+		Stop();
+	}
+
+	static uint64_t HashStack(const char* jobName, void* const* addresses, int depth)
+	{
+		uint64_t hash = 14695981039346656037ull ^ (uint64_t)(uintptr_t)jobName;
+		for (int i = 0; i < depth; ++i)
+		{
+			hash = (hash ^ (uint64_t)(uintptr_t)addresses[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	// des del handler del senyal (Linux) o del thread de mostreig (Windows): sense reservar memòria ni agafar cap lock
+	void StackSampler::AddSample(ThreadData& thread, void* const* addresses, int depth)
+	{
+		const char* jobName = thread.jobName.load(std::memory_order_relaxed);
+		uint64_t hash = HashStack(jobName, addresses, depth);
+		// la taula té el doble de posicions que maxStacks, sempre n'hi ha de lliures
+		for (uint32_t slot = (uint32_t)hash & tableMask; ; slot = (slot + 1) & tableMask)
+		{
+			StackEntry& entry = thread.stacks[slot];
+			void** frames = &thread.frames[(size_t)slot * settings.maxDepth];
+			if (entry.count == 0)
+			{
+				if (thread.numStacks >= (uint32_t)settings.maxStacks)
+				{
+					thread.dropped.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+				entry.hash = hash;
+				entry.jobName = jobName;
+				entry.depth = (uint16_t)depth;
+				memcpy(frames, addresses, depth * sizeof(void*));
+				entry.count = 1;
+				++thread.numStacks;
+				break;
+			}
+			if (entry.hash == hash && entry.jobName == jobName && entry.depth == depth && memcmp(frames, addresses, depth * sizeof(void*)) == 0)
+			{
+				++entry.count;
+				break;
+			}
+		}
+		thread.samples.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint64_t StackSampler::GetNumSamples() const
+	{
+		uint64_t samples = 0;
+		for (int i = 0; i < maxThreads; ++i)
+		{
+			samples += threads[i].samples.load(std::memory_order_relaxed);
+		}
+		return samples;
+	}
+
+	uint64_t StackSampler::GetDroppedSamples() const
+	{
+		uint64_t dropped = 0;
+		for (int i = 0; i < maxThreads; ++i)
+		{
+			dropped += threads[i].dropped.load(std::memory_order_relaxed);
+		}
+		return dropped;
+	}
+
+	double StackSampler::GetMeanSampleCost() const
+	{
+		uint64_t nanoseconds = 0;
+		for (int i = 0; i < maxThreads; ++i)
+		{
+			nanoseconds += threads[i].costNanoseconds.load(std::memory_order_relaxed);
+		}
+		uint64_t samples = GetNumSamples() + GetDroppedSamples();
+		return (samples > 0) ? nanoseconds / 1000.0 / samples : 0.0;
+	}
+
+	static uint64_t ElapsedNanoseconds(std::chrono::steady_clock::time_point begin)
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+	}
+
+#if defined(__linux__)
+
+	// el handler no es treu mai: un SIGPROF que arribés tard amb l'acció per defecte tancaria el procés
+	static std::atomic<StackSampler*> s_ActiveSampler{ nullptr };
+	static std::atomic<int> s_HandlersRunning{ 0 };
+	static bool s_HandlerInstalled = false;
+
+	void StackSampler::SignalHandler(int, siginfo_t* info, void*)
+	{
+		int savedErrno = errno;
+		// Stop primer treu s_ActiveSampler i després espera que no hi hagi cap handler a dins
+		s_HandlersRunning.fetch_add(1);
+		StackSampler* sampler = s_ActiveSampler.load();
+		int threadId = info->si_value.sival_int;
+		if (sampler != nullptr && info->si_code == SI_TIMER && threadId >= 0 && threadId < sampler->maxThreads)
+		{
+			auto begin = std::chrono::steady_clock::now();
+			// les dues primeres són aquest handler i el trampolí del senyal; la tercera, on s'ha interromput el thread
+			void* addresses[MaxDepth + 2];
+			int depth = backtrace(addresses, sampler->settings.maxDepth + 2);
+			ThreadData& thread = sampler->threads[threadId];
+			if (depth > 2)
+			{
+				sampler->AddSample(thread, addresses + 2, depth - 2);
+			}
+			thread.costNanoseconds.fetch_add(ElapsedNanoseconds(begin), std::memory_order_relaxed);
+		}
+		s_HandlersRunning.fetch_sub(1);
+		errno = savedErrno;
+	}
+
+	bool StackSampler::StartPlatform()
+	{
+		StackSampler* expected = nullptr;
+		if (!s_ActiveSampler.compare_exchange_strong(expected, this))
+		{
+			return false;
+		}
+		if (!s_HandlerInstalled)
+		{
+			// el primer backtrace carrega libgcc_s, que no es pot fer dins d'un handler
+			void* address;
+			backtrace(&address, 1);
+
+			struct sigaction action = {};
+			action.sa_sigaction = SignalHandler;
+			action.sa_flags = SA_SIGINFO | SA_RESTART;
+			sigemptyset(&action.sa_mask);
+			if (sigaction(SIGPROF, &action, nullptr) != 0)
+			{
+				s_ActiveSampler.store(nullptr);
+				return false;
+			}
+			s_HandlerInstalled = true;
+		}
+		return true;
+	}
+
+	void StackSampler::RegisterThread(int threadId)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ThreadData& thread = threads[threadId];
+		if (running && !thread.hasTimer)
+		{
+			// el timer compta el temps de CPU del thread que el crea i li envia el senyal només a ell
+			sigevent event = {};
+			event.sigev_notify = SIGEV_THREAD_ID;
+			event.sigev_signo = SIGPROF;
+			event.sigev_value.sival_int = threadId;
+			event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+			if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &thread.timer) == 0)
+			{
+				long period = 1000000000L / settings.samplesPerSecond;
+				itimerspec interval = {};
+				interval.it_interval.tv_sec = period / 1000000000L;
+				interval.it_interval.tv_nsec = period % 1000000000L;
+				interval.it_value = interval.it_interval;
+				timer_settime(thread.timer, 0, &interval, nullptr);
+				thread.hasTimer = true;
+			}
+		}
+		thread.registeredGeneration.store(generation.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
+	void StackSampler::Stop()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!running)
+		{
+			return;
+		}
+		running = false;
+		generation.fetch_add(1, std::memory_order_release);
+
+		s_ActiveSampler.store(nullptr);
+		for (int i = 0; i < maxThreads; ++i)
+		{
+			if (threads[i].hasTimer)
+			{
+				timer_delete(threads[i].timer);
+				threads[i].hasTimer = false;
+			}
+		}
+		// un handler que ja havia vist aquest sampler encara pot estar escrivint a les taules
+		while (s_HandlersRunning.load() != 0)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	static std::string Symbolize(void* address)
+	{
+		char buffer[512];
+		Dl_info info;
+		if (dladdr(address, &info) != 0)
+		{
+			if (info.dli_sname != nullptr)
+			{
+				int status;
+				char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+				std::string name = (status == 0 && demangled != nullptr) ? demangled : info.dli_sname;
+				free(demangled);
+				return name;
+			}
+			if (info.dli_fname != nullptr)
+			{
+				// sense símbol exportat (l'executable sense -rdynamic): mòdul+desplaçament, per a addr2line
+				const char* module = strrchr(info.dli_fname, '/');
+				snprintf(buffer, sizeof(buffer), "%s+0x%llx", (module != nullptr) ? module + 1 : info.dli_fname, (unsigned long long)((uintptr_t)address - (uintptr_t)info.dli_fbase));
+				return buffer;
+			}
+		}
+		snprintf(buffer, sizeof(buffer), "0x%llx", (unsigned long long)(uintptr_t)address);
+		return buffer;
+	}
+
+	struct SymbolScope
+	{
+	};
+
+#elif defined(_WIN32)
+
+	void StackSampler::RegisterThread(int threadId)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ThreadData& thread = threads[threadId];
+		if (running && thread.handle == nullptr)
+		{
+			// un handle real, GetCurrentThread és un pseudo handle que val per a qualsevol thread
+			HANDLE handle;
+			if (DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &handle, THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, 0))
+			{
+				thread.handle = handle;
+				thread.lastCycles = 0;
+			}
+		}
+		thread.registeredGeneration.store(generation.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
+	void StackSampler::RunSampler()
+	{
+		const auto period = std::chrono::microseconds(1000000 / settings.samplesPerSecond);
+		timeBeginPeriod(1);
+		while (!stopSampling.load(std::memory_order_relaxed))
+		{
+			std::this_thread::sleep_for(period);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int i = 0; i < maxThreads; ++i)
+			{
+				ThreadData& thread = threads[i];
+				ULONG64 cycles;
+				if (thread.handle == nullptr || !QueryThreadCycleTime(thread.handle, &cycles) || cycles == thread.lastCycles)
+				{
+					continue; // adormit des de l'última mostra
+				}
+				thread.lastCycles = cycles;
+
+				// amb el thread suspès no es pot reservar memòria ni agafar locks: podria tenir-los ell
+				auto begin = std::chrono::steady_clock::now();
+				if (SuspendThread(thread.handle) == (DWORD)-1)
+				{
+					continue;
+				}
+				void* addresses[MaxDepth];
+				int depth = 0;
+				CONTEXT context = {};
+				context.ContextFlags = CONTEXT_FULL;
+				if (GetThreadContext(thread.handle, &context))
+				{
+					while (depth < settings.maxDepth && context.Rip != 0)
+					{
+						addresses[depth++] = reinterpret_cast<void*>(context.Rip);
+						DWORD64 imageBase;
+						PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(context.Rip, &imageBase, nullptr);
+						if (function == nullptr)
+						{
+							// funció fulla sense pròleg: l'adreça de retorn és al cim de la pila
+							context.Rip = *reinterpret_cast<DWORD64*>(context.Rsp);
+							context.Rsp += 8;
+						}
+						else
+						{
+							void* handlerData;
+							DWORD64 establisherFrame;
+							RtlVirtualUnwind(UNW_FLAG_NHANDLER, imageBase, context.Rip, function, &context, &handlerData, &establisherFrame, nullptr);
+						}
+					}
+				}
+				ResumeThread(thread.handle);
+
+				if (depth > 0)
+				{
+					AddSample(thread, addresses, depth);
+				}
+				thread.costNanoseconds.fetch_add(ElapsedNanoseconds(begin), std::memory_order_relaxed);
+			}
+		}
+		timeEndPeriod(1);
+	}
+
+	bool StackSampler::StartPlatform()
+	{
+#if defined(_M_X64)
+		settings.samplesPerSecond = std::min(settings.samplesPerSecond, 1000);
+		stopSampling.store(false, std::memory_order_relaxed);
+		samplerThread = std::thread([this] { RunSampler(); });
+		return true;
+#else
+		return false; // només sabem desenrotllar les piles de x64
+#endif
+	}
+
+	void StackSampler::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!running)
+			{
+				return;
+			}
+			running = false;
+			generation.fetch_add(1, std::memory_order_release);
+		}
+
+		// cada volta del thread de mostreig agafa el mutex
+		stopSampling.store(true, std::memory_order_relaxed);
+		samplerThread.join();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < maxThreads; ++i)
+		{
+			if (threads[i].handle != nullptr)
+			{
+				CloseHandle(threads[i].handle);
+				threads[i].handle = nullptr;
+			}
+		}
+	}
+
+	static std::string Symbolize(void* address)
+	{
+		char buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME];
+		SYMBOL_INFO* symbol = reinterpret_cast<SYMBOL_INFO*>(buffer);
+		symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+		symbol->MaxNameLen = MAX_SYM_NAME;
+		DWORD64 displacement;
+		if (SymFromAddr(GetCurrentProcess(), (DWORD64)address, &displacement, symbol))
+		{
+			return std::string(symbol->Name, symbol->NameLen);
+		}
+
+		// sense PDB: mòdul+desplaçament
+		HMODULE module;
+		char path[MAX_PATH];
+		if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCSTR)address, &module)
+			&& GetModuleFileNameA(module, path, MAX_PATH) != 0)
+		{
+			const char* name = strrchr(path, '\\');
+			snprintf(buffer, sizeof(buffer), "%s+0x%llx", (name != nullptr) ? name + 1 : path, (unsigned long long)((uintptr_t)address - (uintptr_t)module));
+			return buffer;
+		}
+		snprintf(buffer, sizeof(buffer), "0x%llx", (unsigned long long)(uintptr_t)address);
+		return buffer;
+	}
+
+	// carrega els símbols del procés mentre s'escriu el fitxer
+	struct SymbolScope
+	{
+		SymbolScope()
+		{
+			SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+			initialized = SymInitialize(GetCurrentProcess(), nullptr, TRUE) != FALSE;
+		}
+		~SymbolScope()
+		{
+			if (initialized)
+			{
+				SymCleanup(GetCurrentProcess());
+			}
+		}
+		bool initialized;
+	};
+
+#else
+
+	void StackSampler::RegisterThread(int threadId)
+	{
+		threads[threadId].registeredGeneration.store(generation.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
+	bool StackSampler::StartPlatform()
+	{
+		return false;
+	}
+
+	void StackSampler::Stop()
+	{
+	}
+
+	static std::string Symbolize(void* address)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "0x%llx", (unsigned long long)(uintptr_t)address);
+		return buffer;
+	}
+
+	struct SymbolScope
+	{
+	};
+
+#endif
+
+	bool StackSampler::Start(const Settings& _settings)
+	{
+		Stop();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		settings = _settings;
+		settings.samplesPerSecond = std::max(settings.samplesPerSecond, 1);
+		settings.maxDepth = std::min(std::max(settings.maxDepth, 1), (int)MaxDepth);
+		settings.maxStacks = std::max(settings.maxStacks, 1);
+
+		uint32_t tableSize = 2;
+		while (tableSize < 2 * (uint32_t)settings.maxStacks)
+		{
+			tableSize *= 2;
+		}
+		tableMask = tableSize - 1;
+		for (int i = 0; i < maxThreads; ++i)
+		{
+			ThreadData& thread = threads[i];
+			thread.stacks.reset(new StackEntry[tableSize]());
+			thread.frames.reset(new void*[(size_t)tableSize * settings.maxDepth]);
+			thread.numStacks = 0;
+			thread.samples.store(0, std::memory_order_relaxed);
+			thread.dropped.store(0, std::memory_order_relaxed);
+			thread.costNanoseconds.store(0, std::memory_order_relaxed);
+		}
+
+		if (!StartPlatform())
+		{
+			return false;
+		}
+		running = true;
+		generation.fetch_add(1, std::memory_order_release);
+		return true;
+	}
+
+	// al format folded el ';' separa les funcions
+	static std::string FoldedName(std::string name)
+	{
+		std::replace(name.begin(), name.end(), ';', ':');
+		return name;
+	}
+
+	bool StackSampler::WriteFoldedStacks(const char* path) const
+	{
+		if (running)
+		{
+			return false;
+		}
+
+		// només és viu mentre es resolen els noms: a Windows carrega els símbols (SymInitialize) i els allibera en sortir
+		[[maybe_unused]] SymbolScope symbols;
+		std::unordered_map<void*, std::string> names;
+		std::map<std::string, uint64_t> folded; // la mateixa pila a diferents threads és una sola línia
+		for (int i = 0; i < maxThreads; ++i)
+		{
+			const ThreadData& thread = threads[i];
+			if (thread.stacks == nullptr)
+			{
+				continue;
+			}
+			for (uint32_t slot = 0; slot <= tableMask; ++slot)
+			{
+				const StackEntry& entry = thread.stacks[slot];
+				if (entry.count == 0)
+				{
+					continue;
+				}
+				// de la base a la fulla, amb la tasca com a arrel
+				std::string line = (entry.jobName != nullptr) ? FoldedName(entry.jobName) : "[scheduler]";
+				void* const* frames = &thread.frames[(size_t)slot * settings.maxDepth];
+				for (int frame = entry.depth - 1; frame >= 0; --frame)
+				{
+					// totes menys la primera són adreces de retorn: la crida és just abans
+					void* address = (frame == 0) ? frames[frame] : reinterpret_cast<void*>((uintptr_t)frames[frame] - 1);
+					auto name = names.find(address);
+					if (name == names.end())
+					{
+						name = names.emplace(address, FoldedName(Symbolize(address))).first;
+					}
+					line += ';';
+					line += name->second;
+				}
+				folded[line] += entry.count;
+			}
+		}
+
+		FILE* file = nullptr;
+		if (fopen_s(&file, path, "w") != 0 || file == nullptr)
+		{
+			return false;
+		}
+		for (const auto& stack : folded)
+		{
+			fprintf(file, "%s %llu\n", stack.first.c_str(), (unsigned long long)stack.second);
+		}
+		bool written = ferror(file) == 0;
+		fclose(file);
+		return written;
+	}
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#if defined(__linux__)
+#include <signal.h>
+#include <time.h>
+#endif
+
+namespace Utilities
+{
+	// Perfilador per mostreig: cada cert temps de CPU de cada thread registrat se'n guarda la pila, amb el nom de la tasca que
+	// hi corria, i en acabar s'escriu en format "folded" (una línia "tasca;funció;...;fulla N" per pila) per fer-ne un flame graph
+	// (flamegraph.pl, https://www.speedscope.app, ...). Cobreix el codi que no té marcadors.
+	// La pila és la de la fibra que s'executa: les tasques es veuen des del seu WorkerFiber, sense el scheduler a sota.
+	//  - Linux: un timer de temps de CPU per thread (timer_create + SIGEV_THREAD_ID) que envia SIGPROF al mateix thread, i la pila
+	//    surt de backtrace() dins del handler.
+	//  - Windows (x64): un thread de mostreig que suspèn cada thread, en desenrotlla la pila amb RtlVirtualUnwind i el reprèn. Els
+	//    threads que no han gastat cicles des de la mostra anterior (adormits) no es mostregen.
+	// En els dos casos desenrotllar pot bloquejar-se si el thread mostrejat tenia el lock del loader (carregant una DLL o llançant
+	// una excepció); el joc no en fa durant els frames.
+	class StackSampler
+	{
+	public:
+		static constexpr int MaxDepth = 64;
+
+		// el cost és proporcional a samplesPerSecond * maxDepth; GetMeanSampleCost diu quant costa cada mostra
+		struct Settings
+		{
+			// de temps de CPU de cada thread. A Windows com a molt ~1000, el període mínim del sistema; a Linux els timers de CPU
+			// van amb el tic del kernel (CONFIG_HZ, sovint 250)
+			int samplesPerSecond = 1000;
+			int maxDepth = 32; // funcions per mostra, com a molt MaxDepth. Les piles més fondes perden les de la base
+			int maxStacks = 4096; // piles diferents per thread; quan s'omple les mostres noves es perden i es compten
+		};
+
+		explicit StackSampler(int maxThreads);
+		StackSampler(const StackSampler&) = delete;
+		StackSampler& operator=(const StackSampler&) = delete;
+		~StackSampler();
+
+		// comença una mostra nova i descarta l'anterior. Només un StackSampler pot mostrejar alhora
+		bool Start(const Settings& settings);
+		void Stop();
+		bool IsRunning() const { return running; }
+
+		// des del thread "threadId", cada cop que hi canvia la tasca (nullptr: el scheduler). El primer cop després d'un Start hi
+		// registra el thread, així que cada threadId ha de ser sempre el mateix thread del sistema
+		void SetRunningJob(int threadId, const char* jobName)
+		{
+			ThreadData& thread = threads[threadId];
+			thread.jobName.store(jobName, std::memory_order_relaxed);
+			if (thread.registeredGeneration.load(std::memory_order_relaxed) != generation.load(std::memory_order_acquire))
+			{
+				RegisterThread(threadId);
+			}
+		}
+
+		uint64_t GetNumSamples() const;
+		uint64_t GetDroppedSamples() const;
+		double GetMeanSampleCost() const; // microsegons que el thread mostrejat ha estat aturat per cada mostra
+
+		// les piles de l'últim Start, sumades per a tots els threads. Només amb el mostreig aturat
+		bool WriteFoldedStacks(const char* path) const;
+
+	private:
+		// una pila diferent: tasca i adreces, de la fulla cap a la base. Les adreces són a "frames", maxDepth per pila
+		struct StackEntry
+		{
+			uint64_t hash;
+			const char* jobName;
+			uint32_t count; // 0: posició lliure
+			uint16_t depth;
+		};
+
+		struct alignas(64) ThreadData
+		{
+			std::atomic<const char*> jobName{ nullptr };
+			std::atomic<uint32_t> registeredGeneration{ 0 };
+
+			// taula de hash oberta, l'escriu només qui mostreja aquest thread i es llegeix amb el mostreig aturat
+			std::unique_ptr<StackEntry[]> stacks;
+			std::unique_ptr<void*[]> frames;
+			uint32_t numStacks = 0;
+
+			std::atomic<uint64_t> samples{ 0 };
+			std::atomic<uint64_t> dropped{ 0 };
+			std::atomic<uint64_t> costNanoseconds{ 0 };
+
+#if defined(__linux__)
+			timer_t timer = {};
+			bool hasTimer = false;
+#elif defined(_WIN32)
+			void* handle = nullptr;
+			uint64_t lastCycles = 0;
+#endif
+		};
+
+		bool StartPlatform(); // amb el mutex i les taules ja preparades
+		void RegisterThread(int threadId);
+		void AddSample(ThreadData& thread, void* const* addresses, int depth);
+
+		int maxThreads;
+		std::unique_ptr<ThreadData[]> threads;
+		Settings settings;
+		uint32_t tableMask = 0;
+		bool running = false;
+		std::atomic<uint32_t> generation{ 0 }; // canvia a cada Start i Stop: els threads s'han de tornar a registrar
+		std::mutex mutex; // registres, Start i Stop
+
+#if defined(__linux__)
+		static void SignalHandler(int signal, siginfo_t* info, void* context);
+#elif defined(_WIN32)
+		std::thread samplerThread;
+		std::atomic<bool> stopSampling{ false };
+		void RunSampler();
+#endif
+	};
+}
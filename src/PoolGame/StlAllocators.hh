@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include "Allocators.hpp"
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>) && ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+#include <memory_resource>
+#define UTILITIES_HAS_MEMORY_RESOURCE 1
+#endif
+#endif
+
+namespace Utilities
+{
+	// Standard allocator over our linear allocators, so std containers can use arena memory without changing the code that uses them.
+	// "Source" is a small handle copied into every container: a StackAllocator*, a DefaultFrameArena::ThreadAllocator
+	// or a DefaultAllocator::ThreadAllocator (anything with "alloc<T>(N)" returning a MemoryBlock<T>, or a pointer to one).
+	//
+	// deallocate does nothing: like ResizableArray, the memory of every growth stays in the source until it is reset
+	// (StackAllocator::Pop, FrameArena::NextFrame, DefaultAllocator::Free(label)). Good for containers that are filled and
+	// thrown away, bad for ones that keep growing and shrinking for a long time.
+	// The thread views must only be used from their thread, so don't grow a container from another one.
+	// Running out of memory throws std::bad_alloc, except with the frame arena view, which stops the program (FrameArena::allocOrAbort).
+	template<typename T, typename Source>
+	struct StlAllocator
+	{
+		using value_type = T;
+
+		Source source;
+
+		explicit StlAllocator(Source source) noexcept : source(source) {}
+
+		template<typename U>
+		StlAllocator(const StlAllocator<U, Source>& other) noexcept : source(other.source) {}
+
+		template<typename U>
+		struct rebind
+		{
+			using other = StlAllocator<U, Source>;
+		};
+
+		T* allocate(size_t n)
+		{
+			MemoryBlock<T> block = Get(source).template alloc<T>(n);
+			if (block.ptr == nullptr)
+			{
+				assert(false); // Not enough memory!
+				throw std::bad_alloc();
+			}
+			return block.ptr;
+		}
+
+		void deallocate(T*, size_t) noexcept {}
+
+		template<typename U>
+		bool operator==(const StlAllocator<U, Source>& other) const { return source == other.source; }
+		template<typename U>
+		bool operator!=(const StlAllocator<U, Source>& other) const { return !(source == other.source); }
+
+	private:
+		template<typename S>
+		static S& Get(S& source) { return source; }
+		template<typename S>
+		static S& Get(S* source) { return *source; }
+	};
+
+	template<typename T>
+	using StackStlAllocator = StlAllocator<T, StackAllocator*>;
+	template<typename T>
+	using FrameStlAllocator = StlAllocator<T, DefaultFrameArena::ThreadAllocator>;
+	template<typename T>
+	using LabelStlAllocator = StlAllocator<T, DefaultAllocator::ThreadAllocator>;
+
+	template<typename T>
+	using FrameVector = std::vector<T, FrameStlAllocator<T>>;
+	template<typename T>
+	using LabelVector = std::vector<T, LabelStlAllocator<T>>;
+
+	template<typename T>
+	StackStlAllocator<T> MakeStlAllocator(StackAllocator& allocator) { return StackStlAllocator<T>(&allocator); }
+	template<typename T>
+	FrameStlAllocator<T> MakeStlAllocator(DefaultFrameArena::ThreadAllocator allocator) { return FrameStlAllocator<T>(allocator); }
+	template<typename T>
+	LabelStlAllocator<T> MakeStlAllocator(DefaultAllocator::ThreadAllocator allocator) { return LabelStlAllocator<T>(allocator); }
+
+#if defined(UTILITIES_HAS_MEMORY_RESOURCE)
+	// The same for std::pmr containers (C++17 only). One resource can be shared by containers of different types,
+	// it must outlive them. Two resources are only equal if they are the same object.
+	template<typename Source>
+	class LinearMemoryResource : public std::pmr::memory_resource
+	{
+	public:
+		explicit LinearMemoryResource(Source source) : source(source) {}
+
+	private:
+		Source source;
+
+		template<typename S>
+		static S& Get(S& source) { return source; }
+		template<typename S>
+		static S& Get(S* source) { return *source; }
+
+		void* do_allocate(size_t bytes, size_t alignment) override
+		{
+			void* ptr;
+			if (alignment <= alignof(std::max_align_t))
+			{
+				ptr = Get(source).template alloc<std::max_align_t>((bytes + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t)).ptr;
+			}
+			else
+			{
+				// over-aligned: take enough bytes to align by hand
+				uint8_t* unaligned = Get(source).template alloc<uint8_t>(bytes + alignment - 1).ptr;
+				ptr = unaligned == nullptr ? nullptr : reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(unaligned) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+			}
+
+			if (ptr == nullptr)
+			{
+				assert(false); // Not enough memory!
+				throw std::bad_alloc();
+			}
+			return ptr;
+		}
+
+		void do_deallocate(void*, size_t, size_t) override {}
+
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+	};
+
+	using StackMemoryResource = LinearMemoryResource<StackAllocator*>;
+	using FrameMemoryResource = LinearMemoryResource<DefaultFrameArena::ThreadAllocator>;
+	using LabelMemoryResource = LinearMemoryResource<DefaultAllocator::ThreadAllocator>;
+#endif
+}
@@ -4,6 +4,7 @@
 #undef max
 #endif
 
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <mutex>
@@ -24,6 +25,7 @@ namespace Utilities
 		static constexpr int NumLargeStackFibers = 32;
 		static constexpr int NumFibers = NumSmallStackFibers + NumLargeStackFibers;
 		static constexpr int AllThreadsMask = 0xffff;
+		static constexpr int JobQueueCapacity = 1024; // tasques pendents a cada cua, amb la cua plena Do pausa la tasca
 
 		class Job;
 		class JobScheduler;
@@ -36,6 +38,7 @@ namespace Utilities
 			JobScheduler *scheduler;
 			Profiler *profiler;
 			DefaultAllocator *allocator;
+			DefaultFrameArena *frameArena;
 			int threadIndex;
 			int fiberIndex;
 
@@ -51,11 +54,21 @@ namespace Utilities
 				return profiler->CreateProfileMarkGuard(functionName, threadIndex, systemID);
 			}
 
+			Profiler::MarkGuard CreateProfileMarkGuard(Profiler::ZoneId zone, int systemID = -1) const
+			{
+				return profiler->CreateProfileMarkGuard(zone, threadIndex, systemID);
+			}
+
 			inline void AddProfileMark(Profiler::MarkerType reason, const void* identifier = nullptr, const char* functionName = nullptr, int threadId = 0, int systemID = -1) const
 			{
 				return profiler->AddProfileMark(reason, identifier, functionName, threadIndex, systemID);
 			}
 
+			inline void AddProfileMark(Profiler::MarkerType reason, const void* identifier, Profiler::ZoneId zone, int threadId = 0, int systemID = -1) const
+			{
+				return profiler->AddProfileMark(reason, identifier, zone, threadIndex, systemID);
+			}
+
 			template<typename T, size_t N>
 			Utilities::MemoryBlock<T> alloc(Utilities::DefaultAllocatorLabel label) const
 			{
@@ -99,6 +112,26 @@ namespace Utilities
 				return allocator->GetUnusedLabelWithGuard(systemName);
 			}
 
+			// memòria temporal del frame. No cal alliberar-la: és vàlida fins al final del frame següent.
+			// Si l'arena s'acaba el programa s'atura amb la mida demanada i l'usada (el frame no pot continuar sense les dades).
+			template<typename T>
+			Utilities::MemoryBlock<T> frameAlloc(size_t N = 1) const
+			{
+				return frameArena->allocOrAbort<T>(threadIndex, N);
+			}
+
+			// per a estructures que reben l'allocator (p.e. ResizableArray). Només s'ha de fer servir des del thread actual.
+			Utilities::DefaultFrameArena::ThreadAllocator GetFrameAllocator() const
+			{
+				return frameArena->GetThreadAllocator(threadIndex);
+			}
+
+			// el mateix per a memòria d'un label, viu fins que es fa Free del label. Només des del thread actual.
+			Utilities::DefaultAllocator::ThreadAllocator GetLabelAllocator(Utilities::DefaultAllocatorLabel label) const
+			{
+				return allocator->GetThreadAllocator(label, threadIndex);
+			}
+
 			/*JobAllocator CreateJobAllocator(const char* labelName) const
 			{
 				return JobAllocator(allocator, threadIndex, labelName);
@@ -122,9 +155,10 @@ namespace Utilities
 			const bool needsLargeStack;
 			const int systemID;
 			const char* jobName;
+			const Profiler::ZoneId zone; // el nom internat un cop, els marcadors del scheduler no l'han de buscar
 
-			Job(const Job& other) : numPendingTasks(other.numPendingTasks.load()), priority(other.priority), needsLargeStack(other.needsLargeStack), systemID(other.systemID), jobName(other.jobName) {};
-			Job(Job&& other) : numPendingTasks(other.numPendingTasks.load()), priority(other.priority), needsLargeStack(other.needsLargeStack), systemID(other.systemID), jobName(other.jobName) {};
+			Job(const Job& other) : numPendingTasks(other.numPendingTasks.load()), priority(other.priority), needsLargeStack(other.needsLargeStack), systemID(other.systemID), jobName(other.jobName), zone(other.zone) {};
+			Job(Job&& other) : numPendingTasks(other.numPendingTasks.load()), priority(other.priority), needsLargeStack(other.needsLargeStack), systemID(other.systemID), jobName(other.jobName), zone(other.zone) {};
 			Job& operator=(Job& other) = delete;
 			Job& operator=(Job&& other) = delete;
 
@@ -142,11 +176,60 @@ namespace Utilities
 				, needsLargeStack(_needsLargeStack)
 				, systemID(_systemID)
 				, jobName(_jobName)
+				, zone(Profiler::InternZone(_jobName))
 			{}
 		};
 
 		void __stdcall WorkerFiber(void* param);
 
+		// el que ha fet el scheduler, sumat per thread, per frame o des del principi
+		struct SchedulerStats
+		{
+			uint64_t tasksRun = 0; // tasques començades (BEGIN)
+			uint64_t resumes = 0; // RESUME_FROM_PAUSE
+			uint64_t waitsForJob = 0; // pauses esperant una altra tasca (PAUSE_WAIT_FOR_JOB)
+			uint64_t waitsForQueueSpace = 0; // pauses amb la cua plena a Do (PAUSE_WAIT_FOR_QUEUE_SPACE)
+			uint64_t steals = 0; // rangs robats per les LambdaBatchedJob
+			uint64_t sleeps = 0; // cops que el thread s'ha adormit a WaitForNotification
+			uint64_t sleepNanoseconds = 0;
+
+			SchedulerStats& operator+=(const SchedulerStats& other)
+			{
+				tasksRun += other.tasksRun;
+				resumes += other.resumes;
+				waitsForJob += other.waitsForJob;
+				waitsForQueueSpace += other.waitsForQueueSpace;
+				steals += other.steals;
+				sleeps += other.sleeps;
+				sleepNanoseconds += other.sleepNanoseconds;
+				return *this;
+			}
+
+			SchedulerStats operator-(const SchedulerStats& other) const
+			{
+				SchedulerStats result;
+				result.tasksRun = tasksRun - other.tasksRun;
+				result.resumes = resumes - other.resumes;
+				result.waitsForJob = waitsForJob - other.waitsForJob;
+				result.waitsForQueueSpace = waitsForQueueSpace - other.waitsForQueueSpace;
+				result.steals = steals - other.steals;
+				result.sleeps = sleeps - other.sleeps;
+				result.sleepNanoseconds = sleepNanoseconds - other.sleepNanoseconds;
+				return result;
+			}
+		};
+
+		// un frame: els comptadors i els màxims que han vist els workers
+		struct SchedulerFrameStats
+		{
+			SchedulerStats counters;
+			SchedulerStats threads[Profiler::MaxNumThreads]; // per worker, no al màxim de GetPeakFrameStats
+			int queuePeak[3] = {}; // tasques a cada cua (per prioritat) quan un worker n'ha tret una
+			int smallStackFibersPeak = 0; // fibers en ús, de NumSmallStackFibers
+			int largeStackFibersPeak = 0; // i de NumLargeStackFibers
+			int waitingFibersPeak = 0; // fibers pausades: la suma del màxim de cada worker, cadascun té les seves
+		};
+
 		// classe que s'encarrega de gestionar la feina entre diferents threads i tasques.
 		class JobScheduler
 		{
@@ -160,7 +243,7 @@ namespace Utilities
 			{}
 
 			// funció que inicialitza totes les dades dels Fibers
-			void Init(int _numThreads, Profiler *profiler, DefaultAllocator* allocator)
+			void Init(int _numThreads, Profiler *profiler, DefaultAllocator* allocator, DefaultFrameArena* frameArena = nullptr)
 			{
 				numThreads = _numThreads;
 				// creem els Fibers que farem servir per a les tasques.
@@ -183,6 +266,7 @@ namespace Utilities
 					fiberContexts[i].scheduler = this;
 					fiberContexts[i].profiler = profiler;
 					fiberContexts[i].allocator = allocator;
+					fiberContexts[i].frameArena = frameArena;
 					fiberContexts[i].threadIndex = -1;
 					fiberContexts[i].fiberIndex = i;
 					// dades per al scheduler
@@ -260,6 +344,34 @@ namespace Utilities
 
 			void SetRootFiber(void* fiberId, int idx) { rootFibers[idx] = fiberId; }
 
+			int GetNumThreads() const { return numThreads; }
+
+			// TELEMETRIA: cada worker escriu els seus comptadors sense sincronitzar-se amb ningú, i es poden llegir des de qualsevol thread
+
+			SchedulerStats GetThreadStats(int threadId) const { return telemetry[threadId].Get(); }
+			SchedulerStats GetTotalStats() const
+			{
+				SchedulerStats result;
+				for (int t = 0; t < Profiler::MaxNumThreads; ++t)
+					result += GetThreadStats(t);
+				return result;
+			}
+
+			// el frame que ha acabat amb l'últim NextFrame, i el màxim de cada valor en un frame
+			const SchedulerFrameStats& GetLastFrameStats() const { return lastFrameStats; }
+			const SchedulerFrameStats& GetPeakFrameStats() const { return peakFrameStats; }
+			uint64_t GetFrame() const { return frame; }
+
+			// un cop per frame, des d'un sol thread. Els màxims que es mesurin mentre es fa poden anar al frame següent
+			void NextFrame();
+
+			// des de la tasca que ha robat, "threadId" el del seu JobContext
+			void AddSteal(int threadId)
+			{
+				if (threadId >= 0 && threadId < Profiler::MaxNumThreads)
+					WorkerTelemetry::Add(telemetry[threadId].steals, 1);
+			}
+
 		protected:
 
 			// funcions a implementar per plataforma sobre Fibers
@@ -277,7 +389,7 @@ namespace Utilities
 					Job *job;
 					int taskIndex;
 				};
-				ThreadsafeStructures::SpinlockQueue<Task, 1024> innerQueue;
+				ThreadsafeStructures::MPMCQueue<Task, JobQueueCapacity> innerQueue;
 
 				// afegeix tasques des de "begin" a "end". Retorna aquella tasca on s'ha quedat per no poder-la afegir.
 				int AddJob(Job *job, int begin, int end)
@@ -303,6 +415,8 @@ namespace Utilities
 					}
 					return false;
 				}
+
+				int GetApproximateSize() const { return (int)innerQueue.GetApproximateSize(); }
 			};
 
 			// ampliació del contexte de feines per incloure dades rellevants per al Scheduler
@@ -321,9 +435,9 @@ namespace Utilities
 			// fibers
 			void* fibers[NumFibers];
 			// fibers amb stack petit lliures
-			ThreadsafeStructures::LockfreeStack<short, NumSmallStackFibers> smallStackFiberIndexs;
+			ThreadsafeStructures::PaddedLockfreeStack<short, NumSmallStackFibers> smallStackFiberIndexs;
 			// fibers amb stack gros lliures
-			ThreadsafeStructures::LockfreeStack<short, NumLargeStackFibers> largeStackFiberIndexs;
+			ThreadsafeStructures::PaddedLockfreeStack<short, NumLargeStackFibers> largeStackFiberIndexs;
 
 			// contextes
 			FiberContext fiberContexts[NumFibers];
@@ -334,6 +448,42 @@ namespace Utilities
 			// quants threads tenim disponibles
 			int numThreads;
 
+			// comptadors de cada worker. Només els escriu el seu thread, així que n'hi ha prou amb un load i un store relaxed
+			// (sense add atòmic). Els màxims són des de l'últim NextFrame, que els torna a 0
+			struct alignas(64) WorkerTelemetry
+			{
+				std::atomic<uint64_t> tasksRun{ 0 }, resumes{ 0 }, waitsForJob{ 0 }, waitsForQueueSpace{ 0 }, steals{ 0 }, sleeps{ 0 }, sleepNanoseconds{ 0 };
+				std::atomic<int> queuePeak[3] = {}, smallStackFibersPeak{ 0 }, largeStackFibersPeak{ 0 }, waitingFibersPeak{ 0 };
+
+				static void Add(std::atomic<uint64_t>& counter, uint64_t value)
+				{
+					counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+				}
+
+				static void UpdatePeak(std::atomic<int>& peak, int value)
+				{
+					if (value > peak.load(std::memory_order_relaxed))
+						peak.store(value, std::memory_order_relaxed);
+				}
+
+				SchedulerStats Get() const
+				{
+					SchedulerStats result;
+					result.tasksRun = tasksRun.load(std::memory_order_relaxed);
+					result.resumes = resumes.load(std::memory_order_relaxed);
+					result.waitsForJob = waitsForJob.load(std::memory_order_relaxed);
+					result.waitsForQueueSpace = waitsForQueueSpace.load(std::memory_order_relaxed);
+					result.steals = steals.load(std::memory_order_relaxed);
+					result.sleeps = sleeps.load(std::memory_order_relaxed);
+					result.sleepNanoseconds = sleepNanoseconds.load(std::memory_order_relaxed);
+					return result;
+				}
+			};
+			WorkerTelemetry telemetry[Profiler::MaxNumThreads];
+			SchedulerStats frameStartStats[Profiler::MaxNumThreads];
+			SchedulerFrameStats lastFrameStats, peakFrameStats;
+			uint64_t frame = 0;
+
 			// variables de sincronització
 			std::mutex noWorkMutex;
 			std::condition_variable noWorkCV;
@@ -27,11 +27,47 @@ namespace Utilities
 		}
 
 
+		inline void JobScheduler::NextFrame()
+		{
+			SchedulerFrameStats stats;
+			for (int t = 0; t < Profiler::MaxNumThreads; ++t)
+			{
+				WorkerTelemetry& thread = telemetry[t];
+				SchedulerStats total = thread.Get();
+				stats.threads[t] = total - frameStartStats[t];
+				stats.counters += stats.threads[t];
+				frameStartStats[t] = total;
+
+				for (int q = 0; q < 3; ++q)
+					stats.queuePeak[q] = std::max(stats.queuePeak[q], thread.queuePeak[q].exchange(0, std::memory_order_relaxed));
+				stats.smallStackFibersPeak = std::max(stats.smallStackFibersPeak, thread.smallStackFibersPeak.exchange(0, std::memory_order_relaxed));
+				stats.largeStackFibersPeak = std::max(stats.largeStackFibersPeak, thread.largeStackFibersPeak.exchange(0, std::memory_order_relaxed));
+				stats.waitingFibersPeak += thread.waitingFibersPeak.exchange(0, std::memory_order_relaxed);
+			}
+			lastFrameStats = stats;
+
+			SchedulerStats& peak = peakFrameStats.counters;
+			peak.tasksRun = std::max(peak.tasksRun, stats.counters.tasksRun);
+			peak.resumes = std::max(peak.resumes, stats.counters.resumes);
+			peak.waitsForJob = std::max(peak.waitsForJob, stats.counters.waitsForJob);
+			peak.waitsForQueueSpace = std::max(peak.waitsForQueueSpace, stats.counters.waitsForQueueSpace);
+			peak.steals = std::max(peak.steals, stats.counters.steals);
+			peak.sleeps = std::max(peak.sleeps, stats.counters.sleeps);
+			peak.sleepNanoseconds = std::max(peak.sleepNanoseconds, stats.counters.sleepNanoseconds);
+			for (int q = 0; q < 3; ++q)
+				peakFrameStats.queuePeak[q] = std::max(peakFrameStats.queuePeak[q], stats.queuePeak[q]);
+			peakFrameStats.smallStackFibersPeak = std::max(peakFrameStats.smallStackFibersPeak, stats.smallStackFibersPeak);
+			peakFrameStats.largeStackFibersPeak = std::max(peakFrameStats.largeStackFibersPeak, stats.largeStackFibersPeak);
+			peakFrameStats.waitingFibersPeak = std::max(peakFrameStats.waitingFibersPeak, stats.waitingFibersPeak);
+			++frame;
+		}
+
 		// funció principal que assigna la feina per cada thread
 		inline void JobScheduler::RunScheduler(int idx, Profiler &profiler)
 		{
 			short fibersOnWait[NumFibers]; // stack de fibers que estan esperant a altres per a continuar
 			int numFibersOnWait = 0; // 
+			WorkerTelemetry &threadTelemetry = telemetry[idx];
 
 			// ens guardem quan va acabar l'última tasca que vam poder executar per a dormir si no en trobem cap més en prou temps
 			std::chrono::high_resolution_clock::time_point lastJobCompletedTime = std::chrono::high_resolution_clock::now();
@@ -50,16 +86,19 @@ namespace Utilities
 						fiberContext.fiberWaitingForJobCompletion = nullptr; // marquem que la tasca no espera a ningú
 
 																			 // marquem al profiler que la tasca continua la seva feina
-						profiler.AddProfileMark(Profiler::MarkerType::RESUME_FROM_PAUSE, (void*)fiberIndex, fiberContext.job->jobName, idx, fiberContext.job->systemID);
+						profiler.AddProfileMark(Profiler::MarkerType::RESUME_FROM_PAUSE, (void*)fiberIndex, fiberContext.job->zone, idx, fiberContext.job->systemID);
+						WorkerTelemetry::Add(threadTelemetry.resumes, 1);
 
 						// entrem a la Fiber en qüestió
+						profiler.SetRunningJob(idx, fiberContext.job->jobName);
 						SwitchToFiber(fibers[fiberIndex]);
+						profiler.SetRunningJob(idx, nullptr);
 						lastJobCompletedTime = std::chrono::high_resolution_clock::now(); // marquem que hem acabat una tasca
 
 																						  // mirem si la tasca ha completat o està esperant alguna cosa
 						if (fiberContext.fiberWaitingForJobCompletion == nullptr)
 						{
-							profiler.AddProfileMark(Profiler::MarkerType::END, (void*)fiberIndex, fiberContext.job->jobName, idx, fiberContext.job->systemID);
+							profiler.AddProfileMark(Profiler::MarkerType::END, (void*)fiberIndex, fiberContext.job->zone, idx, fiberContext.job->systemID);
 
 							// wake up any thread that may be idle, as a prerequisite may be finished
 							NotifyWaitingThreads();
@@ -85,7 +124,8 @@ namespace Utilities
 								(fiberContext.fiberWaitingForJobCompletion == fiberContext.job)
 								? Profiler::MarkerType::PAUSE_WAIT_FOR_QUEUE_SPACE
 								: Profiler::MarkerType::PAUSE_WAIT_FOR_JOB,
-								(void*)fiberIndex, fiberContext.job->jobName, idx, fiberContext.job->systemID);
+								(void*)fiberIndex, fiberContext.job->zone, idx, fiberContext.job->systemID);
+							WorkerTelemetry::Add((fiberContext.fiberWaitingForJobCompletion == fiberContext.job) ? threadTelemetry.waitsForQueueSpace : threadTelemetry.waitsForJob, 1);
 						}
 					}
 				}
@@ -97,8 +137,20 @@ namespace Utilities
 					int taskIndex;
 					if (queues[i].GetPendingTask(job, taskIndex)) // si la cua actual té alguna cosa...
 					{
+						WorkerTelemetry::UpdatePeak(threadTelemetry.queuePeak[i], queues[i].GetApproximateSize() + 1);
+
 						// agafem la tasca del stack corresponent
-						short fiberIndex = job->needsLargeStack ? largeStackFiberIndexs.Pop() : smallStackFiberIndexs.Pop();
+						short fiberIndex;
+						if (job->needsLargeStack)
+						{
+							fiberIndex = largeStackFiberIndexs.Pop();
+							WorkerTelemetry::UpdatePeak(threadTelemetry.largeStackFibersPeak, NumLargeStackFibers - largeStackFiberIndexs.GetSize());
+						}
+						else
+						{
+							fiberIndex = smallStackFiberIndexs.Pop();
+							WorkerTelemetry::UpdatePeak(threadTelemetry.smallStackFibersPeak, NumSmallStackFibers - smallStackFiberIndexs.GetSize());
+						}
 						FiberContext &fiberContext = fiberContexts[fiberIndex];
 
 						// completem la info del contexte per que el Fiber sàpiga què ha de fer
@@ -107,16 +159,19 @@ namespace Utilities
 						fiberContext.threadIndex = idx;
 						fiberContext.fiberWaitingForJobCompletion = nullptr;
 
-						profiler.AddProfileMark(Profiler::MarkerType::BEGIN, (void*)fiberIndex, fiberContext.job->jobName, idx, fiberContext.job->systemID);
+						profiler.AddProfileMark(Profiler::MarkerType::BEGIN, (void*)fiberIndex, fiberContext.job->zone, idx, fiberContext.job->systemID);
+						WorkerTelemetry::Add(threadTelemetry.tasksRun, 1);
 
 						// entrem a la Fiber en qüestió
+						profiler.SetRunningJob(idx, fiberContext.job->jobName);
 						SwitchToFiber(fibers[fiberIndex]);
+						profiler.SetRunningJob(idx, nullptr);
 						lastJobCompletedTime = std::chrono::high_resolution_clock::now(); // marquem que hem acabat una tasca
 
 																						  // mirem si la tasca ha completat o està esperant alguna cosa
 						if (fiberContext.fiberWaitingForJobCompletion == nullptr)
 						{
-							profiler.AddProfileMark(Profiler::MarkerType::END, (void*)fiberIndex, fiberContext.job->jobName, idx, fiberContext.job->systemID);
+							profiler.AddProfileMark(Profiler::MarkerType::END, (void*)fiberIndex, fiberContext.job->zone, idx, fiberContext.job->systemID);
 
 							// wake up any thread that may be idle, as a prerequisite may be finished
 							NotifyWaitingThreads();
@@ -135,11 +190,13 @@ namespace Utilities
 								(fiberContext.fiberWaitingForJobCompletion == fiberContext.job)
 								? Profiler::MarkerType::PAUSE_WAIT_FOR_QUEUE_SPACE
 								: Profiler::MarkerType::PAUSE_WAIT_FOR_JOB,
-								(void*)fiberIndex, fiberContext.job->jobName, idx, fiberContext.job->systemID);
+								(void*)fiberIndex, fiberContext.job->zone, idx, fiberContext.job->systemID);
+							WorkerTelemetry::Add((fiberContext.fiberWaitingForJobCompletion == fiberContext.job) ? threadTelemetry.waitsForQueueSpace : threadTelemetry.waitsForJob, 1);
 
 							// ens guardem aquesta fiber com a que està esperant quelcom
 							fibersOnWait[numFibersOnWait] = fiberIndex;
 							++numFibersOnWait;
+							WorkerTelemetry::UpdatePeak(threadTelemetry.waitingFibersPeak, numFibersOnWait);
 						}
 
 						break;
@@ -152,10 +209,13 @@ namespace Utilities
 				if (usSinceLastCompletedJob > 500us)
 				{
 					profiler.AddProfileMark(Profiler::MarkerType::BEGIN_IDLE, nullptr, "Idle", idx);
+					std::chrono::high_resolution_clock::time_point sleepBegin = std::chrono::high_resolution_clock::now();
 					WaitForNotification(idx);
 					profiler.AddProfileMark(Profiler::MarkerType::END_IDLE, nullptr, nullptr, idx);
 
 					lastJobCompletedTime = std::chrono::high_resolution_clock::now();
+					WorkerTelemetry::Add(threadTelemetry.sleeps, 1);
+					WorkerTelemetry::Add(threadTelemetry.sleepNanoseconds, std::chrono::duration_cast<std::chrono::nanoseconds>(lastJobCompletedTime - sleepBegin).count());
 				}
 			}
 		}
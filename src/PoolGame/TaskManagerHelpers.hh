@@ -53,30 +53,148 @@ namespace Utilities
 			}
 		};
 
+		// tasca "batched" amb particionat automàtic: no cal escollir la mida dels grups.
+		// Es crea una tasca per worker, cadascuna amb un rang inicial gran [begin, end).
+		// Cada tasca consumeix el seu rang pel davant a trossos cada cop més petits, i quan
+		// s'acaba roba la meitat posterior del rang més gran que quedi a una altra tasca.
+		// Així els workers que queden lliures parteixen la feina pendent sota demanda.
 		template<typename Lambda>
 		class LambdaBatchedJob : public Job
 		{
+			static constexpr int MaxRanges = Profiler::MaxNumThreads - 1; // una per worker
+			static constexpr uint32_t GrainDivisor = 8; // cada tros que agafa el propietari és 1/8 del que li queda
+			static constexpr uint32_t MinGrainsPerRange = 64;
+
+			// rang empaquetat en 64 bits (begin als bits alts, end als baixos) perquè el propietari
+			// (que avança begin) i els lladres (que retallen end) es puguin sincronitzar amb un sol CAS.
+			struct alignas(64) Range
+			{
+				std::atomic<uint64_t> packed;
+			};
+
 			Lambda lambda;
-			const int batchSize;
-			const int totalTasks;
+			const uint32_t totalTasks;
+			const uint32_t minGrain;
+			const int numRanges;
+			Range ranges[MaxRanges];
+
+			static constexpr uint64_t Pack(uint32_t begin, uint32_t end) { return (uint64_t(begin) << 32) | end; }
+			static constexpr uint32_t Begin(uint64_t packed) { return uint32_t(packed >> 32); }
+			static constexpr uint32_t End(uint64_t packed) { return uint32_t(packed); }
+
+			static int ComputeNumRanges(int numTasks) { return numTasks < MaxRanges ? numTasks : MaxRanges; }
+
+			void InitRanges()
+			{
+				for (int r = 0; r < numRanges; ++r)
+				{
+					uint32_t begin = uint32_t((uint64_t(totalTasks) * r) / numRanges);
+					uint32_t end = uint32_t((uint64_t(totalTasks) * (r + 1)) / numRanges);
+					ranges[r].packed.store(Pack(begin, end), std::memory_order_relaxed);
+				}
+			}
+
+			// agafa un tros del principi del rang propi
+			bool ClaimFromOwnRange(int rangeIndex, uint32_t &begin_, uint32_t &end_)
+			{
+				std::atomic<uint64_t> &range = ranges[rangeIndex].packed;
+				uint64_t packed = range.load(std::memory_order_acquire);
+				uint32_t grain;
+				do
+				{
+					uint32_t begin = Begin(packed), end = End(packed);
+					if (begin >= end)
+						return false;
+
+					grain = (end - begin) / GrainDivisor;
+					if (grain < minGrain)
+						grain = minGrain;
+					if (grain > end - begin)
+						grain = end - begin;
+
+					begin_ = begin;
+				} while (!range.compare_exchange_weak(packed, Pack(begin_ + grain, End(packed)), std::memory_order_acq_rel, std::memory_order_acquire));
+
+				end_ = begin_ + grain;
+				return true;
+			}
+
+			// roba la meitat final del rang amb més feina pendent i la deixa al rang propi, perquè
+			// altres lladres la puguin tornar a partir.
+			bool StealRange(int rangeIndex)
+			{
+				for (;;)
+				{
+					int victim = -1;
+					uint32_t mostRemaining = minGrain; // no val la pena partir res més petit que un tros
+					uint64_t victimPacked = 0;
+					for (int r = 0; r < numRanges; ++r)
+					{
+						if (r == rangeIndex)
+							continue;
+						uint64_t packed = ranges[r].packed.load(std::memory_order_acquire);
+						uint32_t begin = Begin(packed), end = End(packed);
+						if (begin < end && end - begin > mostRemaining)
+						{
+							mostRemaining = end - begin;
+							victim = r;
+							victimPacked = packed;
+						}
+					}
+
+					if (victim < 0)
+						return false;
+
+					uint32_t begin = Begin(victimPacked), end = End(victimPacked);
+					uint32_t middle = begin + (end - begin) / 2;
+					if (ranges[victim].packed.compare_exchange_strong(victimPacked, Pack(begin, middle), std::memory_order_acq_rel, std::memory_order_acquire))
+					{
+						// el nostre rang està buit, així que cap lladre el toca: n'hi ha prou amb un store.
+						ranges[rangeIndex].packed.store(Pack(middle, end), std::memory_order_release);
+						return true;
+					}
+				}
+			}
 
 		public:
 
-			LambdaBatchedJob(const Lambda& _lambda, const char* _jobName, int _batchSize, int _numTasks, int _systemID = -1, Job::Priority _priority = Job::Priority::MEDIUM, bool _needsLargeStack = false)
-				: Job(_jobName, short((_numTasks - 1) / _batchSize) + 1, _systemID, _priority, _needsLargeStack)
+			LambdaBatchedJob(const Lambda& _lambda, const char* _jobName, int _numTasks, int _systemID = -1, Job::Priority _priority = Job::Priority::MEDIUM, bool _needsLargeStack = false)
+				: Job(_jobName, short(ComputeNumRanges(_numTasks)), _systemID, _priority, _needsLargeStack)
 				, lambda(_lambda)
-				, batchSize(_batchSize)
-				, totalTasks(_numTasks)
+				, totalTasks(uint32_t(_numTasks))
+				, minGrain(uint32_t(_numTasks) / (uint32_t(ComputeNumRanges(_numTasks) > 0 ? ComputeNumRanges(_numTasks) : 1) * MinGrainsPerRange) + 1)
+				, numRanges(ComputeNumRanges(_numTasks))
 			{
-				#undef max
-				assert(((_numTasks - 1) / _batchSize) + 1 <= std::numeric_limits<short>::max());
+				assert(_numTasks >= 0);
+				InitRanges();
 			}
 
-			constexpr void DoTask(int taskIndex, const JobContext& context) override
+			LambdaBatchedJob(const LambdaBatchedJob& other)
+				: Job(other)
+				, lambda(other.lambda)
+				, totalTasks(other.totalTasks)
+				, minGrain(other.minGrain)
+				, numRanges(other.numRanges)
+			{
+				for (int r = 0; r < numRanges; ++r)
+					ranges[r].packed.store(other.ranges[r].packed.load());
+			}
+
+			void DoTask(int taskIndex, const JobContext& context) override
 			{
-				int max = totalTasks < (taskIndex + 1) * batchSize ? totalTasks : (taskIndex + 1) * batchSize;
-				for (int i = taskIndex * batchSize; i < max; ++i)
-					LambdaCaller<Lambda, std::is_convertible<Lambda, std::function<void(int, const JobContext&)>>::value>(lambda, i, context);
+				uint32_t begin, end;
+				for (;;)
+				{
+					while (ClaimFromOwnRange(taskIndex, begin, end))
+					{
+						for (uint32_t i = begin; i < end; ++i)
+							LambdaCaller<Lambda, std::is_convertible<Lambda, std::function<void(int, const JobContext&)>>::value>(lambda, int(i), context);
+					}
+					if (!StealRange(taskIndex))
+						break;
+					if (context.scheduler != nullptr)
+						context.scheduler->AddSteal(context.threadIndex);
+				}
 			}
 		};
 
@@ -115,11 +233,11 @@ namespace Utilities
 			return LambdaJob<Lambda>(_lambda, _jobName, _numTasks, _systemID, _priority, _needsLargeStack);
 		}
 
-		// crea una tasca "batched". Que serà cridada per grups dins dels fibers
+		// crea una tasca "batched". Que serà cridada per grups dins dels fibers; la mida dels grups es decideix sola.
 		template<typename Lambda>
-		LambdaBatchedJob<Lambda> CreateLambdaBatchedJob(const Lambda& _lambda, const char* _jobName, int _batchSize, int _numTasks, int _systemID = -1, Job::Priority _priority = Job::Priority::MEDIUM, bool _needsLargeStack = false)
+		LambdaBatchedJob<Lambda> CreateLambdaBatchedJob(const Lambda& _lambda, const char* _jobName, int _numTasks, int _systemID = -1, Job::Priority _priority = Job::Priority::MEDIUM, bool _needsLargeStack = false)
 		{
-			return LambdaBatchedJob<Lambda>(_lambda, _jobName, _batchSize, _numTasks, _systemID, _priority, _needsLargeStack);
+			return LambdaBatchedJob<Lambda>(_lambda, _jobName, _numTasks, _systemID, _priority, _needsLargeStack);
 		}
 
 		/*template<typename Lambda>
@@ -146,8 +264,7 @@ namespace Utilities
 //		printf("%d\n", taskIndex);
 //	},
 //		"batched printer",
-//		20, // grups de 20 execucions
-//		100 // nº TOTAL de vegades que es farà la tasca.
+//		100 // nº TOTAL de vegades que es farà la tasca. Els grups es parteixen automàticament.
 //		);
 //
 //
@@ -3,10 +3,15 @@
 #include <atomic>
 #include <limits>
 #include <cassert>
+#include <cstddef>
 
 namespace ThreadsafeStructures
 {
-	template<typename T, int Capacity>
+	static constexpr size_t CacheLineSize = 64;
+
+	// "Padded" puts "head", "free", "size" and the node array each on their own cache line,
+	// so pushers/poppers don't false-share with each other or with the nodes.
+	template<typename T, int Capacity, bool Padded = false>
 	class LockfreeStack
 	{
 		static_assert(Capacity > 0, "Capacity must be positive");
@@ -18,40 +23,45 @@ namespace ThreadsafeStructures
 			short next;
 		};
 
-		struct alignas(int)Head // TODO align to cache line size. 64B?
+		struct alignas(int)Head
 		{
 			unsigned short aba;
 			short node;
 		};
 
-		std::atomic<Head> head, free;
-		std::atomic_int size;
+		static constexpr size_t HeadAlignment = Padded ? CacheLineSize : alignof(std::atomic<Head>);
+		static constexpr size_t SizeAlignment = Padded ? CacheLineSize : alignof(std::atomic_int);
+		static constexpr size_t NodesAlignment = Padded ? CacheLineSize : alignof(Node);
+
+		alignas(HeadAlignment) std::atomic<Head> head;
+		alignas(HeadAlignment) std::atomic<Head> free;
+		alignas(SizeAlignment) std::atomic_int size;
 
-		Node allocatedNodes[Capacity];
+		alignas(NodesAlignment) Node allocatedNodes[Capacity];
 
 
 		short Pop(std::atomic<Head> &head)
 		{
-			Head next, orig = head.load();
+			Head next, orig = head.load(std::memory_order_acquire);
 			do {
 				if (orig.node < 0)
 					return -1;  // empty stack
 				next.aba = orig.aba + 1;
 				next.node = allocatedNodes[orig.node].next;
-			} while (!head.compare_exchange_weak(orig, next));
+			} while (!head.compare_exchange_weak(orig, next, std::memory_order_acquire, std::memory_order_acquire));
 			return orig.node;
 		}
 
 		void Push(std::atomic<Head> &head, Node *node)
 		{
-			Head next, orig = head.load();
+			Head next, orig = head.load(std::memory_order_relaxed);
 			do {
 				node->next = orig.node;
 				next.aba = orig.aba + 1;
 				next.node = static_cast<short>(node - &allocatedNodes[0]);
 				assert(next.node >= 0);
 				assert(next.node < Capacity);
-			} while (!head.compare_exchange_weak(orig, next));
+			} while (!head.compare_exchange_weak(orig, next, std::memory_order_release, std::memory_order_relaxed));
 		}
 
 	public:
@@ -75,7 +85,7 @@ namespace ThreadsafeStructures
 			Node *node = &allocatedNodes[nodeIndex];
 			node->value = value;
 			Push(head, node);
-			size++;
+			size.fetch_add(1, std::memory_order_relaxed);
 		}
 
 		T Pop()
@@ -83,13 +93,22 @@ namespace ThreadsafeStructures
 			short nodeIndex = Pop(head);
 			assert(nodeIndex >= 0);
 			Node *node = &allocatedNodes[nodeIndex];
-			--size;
+			size.fetch_sub(1, std::memory_order_relaxed);
 			T value = node->value;
 			Push(free, node);
 			return value;
 		}
+
+		// for telemetry: other threads may push or pop while it is read
+		int GetSize() const
+		{
+			return size.load(std::memory_order_relaxed);
+		}
 	};
 
+	template<typename T, int Capacity>
+	using PaddedLockfreeStack = LockfreeStack<T, Capacity, true>;
+
 
 	template<typename T, int Capacity>
 	class SpinlockQueue
@@ -184,4 +203,106 @@ namespace ThreadsafeStructures
 			return true;
 		}
 	};
+
+	// bounded multi-producer/multi-consumer queue (D. Vyukov). Every slot carries a sequence number that tells
+	// whether it is ready to be written (sequence == position) or read (sequence == position + 1), so producers
+	// and consumers only contend on their own counter, never on a lock. Same Add/Remove interface as SpinlockQueue.
+	template<typename T, int Capacity>
+	class MPMCQueue
+	{
+		static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+		static constexpr size_t Mask = Capacity - 1;
+
+		struct Slot
+		{
+			std::atomic<size_t> sequence;
+			T payload;
+		};
+
+		alignas(CacheLineSize) std::atomic<size_t> enqueuePosition;
+		alignas(CacheLineSize) std::atomic<size_t> dequeuePosition;
+
+		alignas(CacheLineSize) Slot slots[Capacity];
+
+	public:
+
+		MPMCQueue()
+			: enqueuePosition(0)
+			, dequeuePosition(0)
+		{
+			for (size_t i = 0; i < (size_t)Capacity; i++)
+			{
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		bool Add(const T &value)
+		{
+			Slot* slot;
+			size_t position = enqueuePosition.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				slot = &slots[position & Mask];
+				size_t sequence = slot->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+				if (diff == 0)
+				{
+					if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+				{
+					return false; // full
+				}
+				else
+				{
+					position = enqueuePosition.load(std::memory_order_relaxed);
+				}
+			}
+
+			slot->payload = value;
+			slot->sequence.store(position + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool Remove(T &value)
+		{
+			Slot* slot;
+			size_t position = dequeuePosition.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				slot = &slots[position & Mask];
+				size_t sequence = slot->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)sequence - (intptr_t)(position + 1);
+				if (diff == 0)
+				{
+					if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+				{
+					return false; // empty
+				}
+				else
+				{
+					position = dequeuePosition.load(std::memory_order_relaxed);
+				}
+			}
+
+			value = slot->payload;
+			slot->sequence.store(position + Mask + 1, std::memory_order_release);
+			return true;
+		}
+
+		// for telemetry: elements added and not yet removed, only approximate while other threads add and remove. Reading the
+		// dequeue position first keeps it from going negative, except for the adds and removes in between
+		size_t GetApproximateSize() const
+		{
+			size_t dequeued = dequeuePosition.load(std::memory_order_relaxed);
+			size_t enqueued = enqueuePosition.load(std::memory_order_relaxed);
+			size_t queued = (enqueued > dequeued) ? enqueued - dequeued : 0;
+			return (queued < (size_t)Capacity) ? queued : (size_t)Capacity;
+		}
+	};
 }
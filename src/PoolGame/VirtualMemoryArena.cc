@@ -0,0 +1,267 @@
+#include "VirtualMemoryArena.hh"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstring>
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+namespace Utilities
+{
+	static uint8_t* AlignUp(void* ptr, size_t alignment)
+	{
+		return reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(ptr) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	}
+
+	VirtualMemoryArena::VirtualMemoryArena(size_t size, size_t commitGranularity, HugePages hugePages, void* preferredAddress)
+		: commitGranularity(commitGranularity)
+		, hugePages(hugePages)
+	{
+		assert(commitGranularity % HugePageSize == 0);
+		this->size = (size + commitGranularity - 1) / commitGranularity * commitGranularity;
+
+		// Explicit -> Transparent -> None until one works
+		for (int mode = (int)hugePages; mode >= (int)HugePages::None; --mode)
+		{
+			if (Reserve(preferredAddress, (HugePages)mode))
+			{
+				this->hugePages = (HugePages)mode;
+				break;
+			}
+		}
+		assert(base != nullptr); // out of address space?
+
+		size_t numGranules = this->size / commitGranularity;
+		committedBitmap.reset(new std::atomic<uint64_t>[(numGranules + 63) / 64]());
+	}
+
+	VirtualMemoryArena::~VirtualMemoryArena()
+	{
+		Release();
+	}
+
+	void VirtualMemoryArena::Commit(void* ptr, size_t size)
+	{
+		assert(reinterpret_cast<uint8_t*>(ptr) >= base && reinterpret_cast<uint8_t*>(ptr) + size <= base + this->size);
+		if (size == 0)
+		{
+			return;
+		}
+
+		size_t offset = reinterpret_cast<uint8_t*>(ptr) - base;
+		size_t first = offset / commitGranularity;
+		size_t last = (offset + size - 1) / commitGranularity;
+		for (size_t granule = first; granule <= last; ++granule)
+		{
+			std::atomic<uint64_t>& word = committedBitmap[granule / 64];
+			uint64_t bit = uint64_t(1) << (granule % 64);
+			if ((word.load(std::memory_order_acquire) & bit) != 0)
+			{
+				continue;
+			}
+
+			// two threads may commit the same granule at the same time, committing twice is harmless. Only one of them counts it.
+			if (!CommitGranule(base + granule * commitGranularity))
+			{
+				assert(false); // out of memory
+				continue;
+			}
+			if ((word.fetch_or(bit) & bit) == 0)
+			{
+				committedBytes.fetch_add(commitGranularity, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	const char* VirtualMemoryArena::GetHugePagesName(HugePages hugePages)
+	{
+		switch (hugePages)
+		{
+		case HugePages::None:
+			return "none";
+		case HugePages::Transparent:
+			return "transparent";
+		case HugePages::Explicit:
+			return "explicit";
+		default:
+			return "?";
+		}
+	}
+
+#if defined(_WIN32)
+
+	// large pages need the "Lock pages in memory" right (secpol.msc) and the privilege enabled in the process token
+	static bool EnableLockMemoryPrivilege()
+	{
+		HANDLE token;
+		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		{
+			return false;
+		}
+
+		TOKEN_PRIVILEGES privileges = {};
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		bool enabled = LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+			&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+			&& GetLastError() == ERROR_SUCCESS; // ERROR_NOT_ALL_ASSIGNED if the user doesn't have the right
+		CloseHandle(token);
+		return enabled;
+	}
+
+	bool VirtualMemoryArena::Reserve(void* preferredAddress, HugePages mode)
+	{
+		if (mode == HugePages::Transparent)
+		{
+			return false;
+		}
+
+		if (mode == HugePages::Explicit)
+		{
+			size_t largePageSize = GetLargePageMinimum();
+			if (largePageSize == 0 || commitGranularity % largePageSize != 0 || !EnableLockMemoryPrivilege())
+			{
+				return false;
+			}
+
+			// large pages can't be committed lazily
+			void* memory = VirtualAlloc(preferredAddress, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (memory == nullptr && preferredAddress != nullptr)
+			{
+				memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			}
+			if (memory == nullptr)
+			{
+				return false;
+			}
+			if (AlignUp(memory, commitGranularity) != memory)
+			{
+				VirtualFree(memory, 0, MEM_RELEASE);
+				return false;
+			}
+
+			reservation = base = reinterpret_cast<uint8_t*>(memory);
+			reservationSize = size;
+			return true;
+		}
+
+		void* memory = VirtualAlloc(preferredAddress, size, MEM_RESERVE, PAGE_READWRITE);
+		if (memory != nullptr && AlignUp(memory, commitGranularity) == memory)
+		{
+			reservation = base = reinterpret_cast<uint8_t*>(memory);
+			reservationSize = size;
+			return true;
+		}
+		if (memory != nullptr)
+		{
+			VirtualFree(memory, 0, MEM_RELEASE);
+		}
+
+		// reservations are only 64KB aligned, reserve a granule more and start at the first aligned address
+		memory = VirtualAlloc(nullptr, size + commitGranularity, MEM_RESERVE, PAGE_READWRITE);
+		if (memory == nullptr)
+		{
+			return false;
+		}
+		reservation = memory;
+		reservationSize = size + commitGranularity;
+		base = AlignUp(memory, commitGranularity);
+		return true;
+	}
+
+	bool VirtualMemoryArena::CommitGranule(uint8_t* granule)
+	{
+		if (hugePages == HugePages::Explicit)
+		{
+			return true; // already committed by Reserve
+		}
+		return VirtualAlloc(granule, commitGranularity, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+	}
+
+	void VirtualMemoryArena::Release()
+	{
+		if (reservation != nullptr)
+		{
+			VirtualFree(reservation, 0, MEM_RELEASE);
+		}
+	}
+
+#else
+
+	// madvise(MADV_HUGEPAGE) is accepted even when THP is disabled system wide, so ask sysfs
+	static bool IsTransparentHugePagesEnabled()
+	{
+		FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+		if (file == nullptr)
+		{
+			return false;
+		}
+		char mode[128] = {};
+		bool enabled = fgets(mode, sizeof(mode), file) != nullptr && strstr(mode, "[never]") == nullptr;
+		fclose(file);
+		return enabled;
+	}
+
+	// The whole range is mapped PROT_NONE and Commit makes granules read/write, so touching memory
+	// the allocator hasn't handed out crashes like on Windows. Physical pages still come on the first touch.
+	bool VirtualMemoryArena::Reserve(void* preferredAddress, HugePages mode)
+	{
+		if (mode == HugePages::Transparent && !IsTransparentHugePagesEnabled())
+		{
+			return false;
+		}
+
+		// explicit huge pages are reserved from the pool at mmap time (no MAP_NORESERVE), so an empty pool fails here and not with a SIGBUS later
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS | (mode == HugePages::Explicit ? MAP_HUGETLB | MAP_HUGE_2MB : MAP_NORESERVE);
+		size_t mappedSize = size + commitGranularity;
+		void* memory = mmap(preferredAddress, mappedSize, PROT_NONE, flags, -1, 0);
+		if (memory == MAP_FAILED)
+		{
+			return false;
+		}
+
+		// keep the aligned part only
+		uint8_t* aligned = AlignUp(memory, commitGranularity);
+		size_t head = aligned - reinterpret_cast<uint8_t*>(memory);
+		if (head > 0)
+		{
+			munmap(memory, head);
+		}
+		if (mappedSize - head > size)
+		{
+			munmap(aligned + size, mappedSize - head - size);
+		}
+
+		if (mode != HugePages::Explicit)
+		{
+			madvise(aligned, size, mode == HugePages::Transparent ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+		}
+
+		reservation = base = aligned;
+		reservationSize = size;
+		return true;
+	}
+
+	bool VirtualMemoryArena::CommitGranule(uint8_t* granule)
+	{
+		return mprotect(granule, commitGranularity, PROT_READ | PROT_WRITE) == 0;
+	}
+
+	void VirtualMemoryArena::Release()
+	{
+		if (reservation != nullptr)
+		{
+			munmap(reservation, reservationSize);
+		}
+	}
+
+#endif
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+#include "Allocators.hpp"
+
+namespace Utilities
+{
+	// Reserves a big range of address space and commits it in "commitGranularity" pieces the first time
+	// the block allocator hands them out, so a 1GB arena only costs the memory the game really touches.
+	// Huge pages cut the TLB misses of walking the bodies / contacts spread over many blocks:
+	//  - Transparent: the kernel backs the range with 2MB pages when it can (Linux THP). Windows has no equivalent, falls back to None.
+	//  - Explicit: pages from the huge page pool (MAP_HUGETLB / MEM_LARGE_PAGES). Windows needs SeLockMemoryPrivilege and commits everything up front.
+	// If the requested mode is not available it falls back to the next one, GetHugePages tells what we got.
+	class VirtualMemoryArena : public MemoryCommitter
+	{
+	public:
+		enum class HugePages { None, Transparent, Explicit };
+
+		static constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+		VirtualMemoryArena() = delete;
+		VirtualMemoryArena(const VirtualMemoryArena& original) = delete;
+		VirtualMemoryArena& operator=(const VirtualMemoryArena& original) = delete;
+
+		// "size" is rounded up to "commitGranularity" (the allocator block size, a multiple of HugePageSize) and the base is aligned to it.
+		// "preferredAddress" is only a hint, handy to get the same addresses between runs while debugging.
+		VirtualMemoryArena(size_t size, size_t commitGranularity, HugePages hugePages, void* preferredAddress = nullptr);
+		~VirtualMemoryArena();
+
+		uint8_t* GetBase() const { return base; }
+		size_t GetSize() const { return size; }
+		HugePages GetHugePages() const { return hugePages; }
+		size_t GetCommittedBytes() const { return committedBytes.load(std::memory_order_relaxed); }
+
+		void Commit(void* ptr, size_t size) override;
+
+		static const char* GetHugePagesName(HugePages hugePages);
+
+	private:
+		uint8_t* base = nullptr;
+		size_t size = 0;
+		size_t commitGranularity;
+		HugePages hugePages;
+
+		void* reservation = nullptr; // what we have to give back to the OS, may start before "base"
+		size_t reservationSize = 0;
+
+		std::unique_ptr<std::atomic<uint64_t>[]> committedBitmap; // one bit per granule
+		std::atomic<size_t> committedBytes{ 0 };
+
+		bool Reserve(void* preferredAddress, HugePages mode);
+		bool CommitGranule(uint8_t* granule);
+		void Release();
+	};
+}
@@ -2,6 +2,9 @@
 #include <map>
 #include <string>
 #include "Allocators.hpp"
+#include "AllocatorTelemetry.hh"
+#include "SchedulerTelemetry.hh"
+#include "VirtualMemoryArena.hh"
 #include "TaskManagerHelpers.hh"
 
 // global static vars
@@ -13,6 +16,97 @@ static GLsizei s_screenWidth				 { 1920 }; // 900
 static GLsizei s_screenHeight				 { 1080 }; // 600
 static GLsizei s_windowResized				 { false };
 
+// HEAP ALLOCATION COUNTER
+// every operator new (plain, array, nothrow and aligned) goes through here so we can check which systems still allocate from the heap
+// (see Utilities::GetHeapAllocationCount). Direct calls to malloc/calloc aren't seen.
+static std::atomic<uint64_t> s_HeapAllocationCount{ 0 };
+
+uint64_t Utilities::GetHeapAllocationCount()
+{
+	return s_HeapAllocationCount.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t size)
+{
+	s_HeapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+	void* ptr = malloc(size > 0 ? size : 1);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	s_HeapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+// the aligned ones need their own free, so the aligned deletes are replaced too
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	s_HeapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+	void* ptr = _aligned_malloc(size > 0 ? size : 1, static_cast<size_t>(alignment));
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	s_HeapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+	return _aligned_malloc(size > 0 ? size : 1, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, alignment, tag);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	_aligned_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment) noexcept
+{
+	operator delete(ptr, alignment);
+}
+
 #define GET_X_LPARAM(lp) ((int)(short)LOWORD(lp))
 #define GET_Y_LPARAM(lp) ((int)(short)HIWORD(lp))
 
@@ -639,8 +733,24 @@ WinMain(__in HINSTANCE hInstance, __in_opt HINSTANCE hPrevInstance, __in_opt LPS
 									  static_cast<float>(inputData.windowHalfSize.y), // top
 									  -5.0f, 5.0f); // near // far
 
+	// MEMORY
+	// 1 GB of address space, committed one block at a time when the allocator hands it out. Fixed address to get the same pointers between runs
+	size_t totalMemory2 = 1 * 1024 * 1024 * 1024;
+	void* baseAddress2 = reinterpret_cast<void*>(0x30000000000);
+	Utilities::VirtualMemoryArena gameMemoryArena(totalMemory2, Utilities::DefaultAllocator::GetBlockSize(), Utilities::VirtualMemoryArena::HugePages::Transparent, baseAddress2);
+
+	// the allocators must outlive the worker threads, so they live in WinMain's scope
+	Utilities::DefaultAllocator blockAllocator(gameMemoryArena.GetBase(), gameMemoryArena.GetSize(), &gameMemoryArena);
+
+	// per-frame scratch memory (2 x 64MB), taken once from the block allocator and never returned
+	constexpr size_t FrameArenaSize = 2 * 64 * 1024 * 1024;
+	Utilities::DefaultAllocatorLabel frameArenaLabel = blockAllocator.GetUnusedLabel("Frame Arena");
+	Utilities::MemoryBlock<uint8_t> frameArenaMemory = blockAllocator.alloc<uint8_t>(frameArenaLabel, 0, FrameArenaSize);
+	Utilities::DefaultFrameArena frameArena(frameArenaMemory.ptr, FrameArenaSize);
+
 	// TASK MANAGER
 	int numThreads;
+	Utilities::TaskManager::JobContext mainThreadContext;// {nullptr, &blockAllocator, numThreads, -1};
 	{
 		// init worker threads
 		unsigned int numHardwareCores = std::thread::hardware_concurrency();
@@ -648,23 +758,14 @@ WinMain(__in HINSTANCE hInstance, __in_opt HINSTANCE hPrevInstance, __in_opt LPS
 		numThreads = (numHardwareCores < Utilities::Profiler::MaxNumThreads - 1) ? numHardwareCores : Utilities::Profiler::MaxNumThreads - 1;
 		std::thread *workerThread = (std::thread*)alloca(sizeof(std::thread) * numThreads);
 
-		size_t totalMemory2 = 1 * 1024 * 1024 * 1024; // 1 GB :DDDDDDDDDDD
-		void* baseAddress2 = reinterpret_cast<void*>(0x30000000000);
-		uint8_t* gameMemoryBlock2 = reinterpret_cast<uint8_t*>(VirtualAlloc(baseAddress2,
-															   totalMemory2,
-															   MEM_RESERVE | MEM_COMMIT,
-															   PAGE_READWRITE));
-
-		Utilities::DefaultAllocator blockAllocator(gameMemoryBlock2, totalMemory2);
-
-		Utilities::TaskManager::JobContext mainThreadContext;// {nullptr, &blockAllocator, numThreads, -1};
 		mainThreadContext.scheduler = nullptr;
 		mainThreadContext.profiler = &Win32::s_Profiler;
 		mainThreadContext.allocator = &blockAllocator;
+		mainThreadContext.frameArena = &frameArena;
 		mainThreadContext.threadIndex = numThreads;
 		mainThreadContext.fiberIndex = -1;
 
-		Win32::s_JobScheduler.Init(numThreads, &Win32::s_Profiler, &blockAllocator);
+		Win32::s_JobScheduler.Init(numThreads, &Win32::s_Profiler, &blockAllocator, &frameArena);
 
 		for (int i = 0; i < numThreads; ++i)
 		{
@@ -673,6 +774,7 @@ WinMain(__in HINSTANCE hInstance, __in_opt HINSTANCE hPrevInstance, __in_opt LPS
 	}
 	std::mutex frameLockMutex;
 	std::condition_variable frameLockConditionVariable;
+	Utilities::SchedulerReport schedulerReport;
 
 	// INIT TIME
 	QueryPerformanceCounter(&l_LastFrameTime);
@@ -804,6 +906,12 @@ WinMain(__in HINSTANCE hInstance, __in_opt HINSTANCE hPrevInstance, __in_opt LPS
 				// UPDATE
 				Update(renderData, gameData, inputData, context);
 
+				// all the jobs of this update have finished, nobody is allocating from the arena
+				frameArena.NextFrame();
+				blockAllocator.NextFrame();
+				Win32::s_JobScheduler.NextFrame();
+				schedulerReport.WriteFrame(Win32::s_JobScheduler);
+
 				LARGE_INTEGER l_UpdateTime;
 				QueryPerformanceCounter(&l_UpdateTime);
 				int64_t updateTicks = l_UpdateTime.QuadPart - l_CurrentTime.QuadPart;
@@ -845,7 +953,9 @@ WinMain(__in HINSTANCE hInstance, __in_opt HINSTANCE hPrevInstance, __in_opt LPS
 		glUseProgram(renderer.programs[Win32::Renderer::GameScene]);
 		glActiveTexture(GL_TEXTURE0 + 0);
 
-		Win32::s_Profiler.AddProfileMark(Utilities::Profiler::MarkerType::BEGIN, nullptr, "Instanced Rendering");
+		// el thread principal t el seu buffer al profiler (threadIndex = numThreads) i un identificador que no s cap ndex de fiber
+		const void* renderIdentifier = reinterpret_cast<const void*>(uintptr_t(Utilities::TaskManager::NumFibers));
+		mainThreadContext.AddProfileMark(Utilities::Profiler::MarkerType::BEGIN, renderIdentifier, "Instanced Rendering");
 		{
 			glBindTexture(GL_TEXTURE_2D, renderer.textures[static_cast<int>(Game::RenderData::TextureID::BALL_WHITE)]);
 
@@ -865,7 +975,7 @@ WinMain(__in HINSTANCE hInstance, __in_opt HINSTANCE hPrevInstance, __in_opt LPS
 									GL_UNSIGNED_SHORT, nullptr, Game::MaxGameObjects);
 			glBindVertexArray(0);
 		}
-		Win32::s_Profiler.AddProfileMark(Utilities::Profiler::MarkerType::END, nullptr, "Instanced Rendering");
+		mainThreadContext.AddProfileMark(Utilities::Profiler::MarkerType::END, renderIdentifier, "Instanced Rendering");
 		//-----------------------------------------------------------------------------------------------------------------------------------
 		//for (int i = 0; i < Game::MaxGameObjects; ++i)
 		//{
@@ -892,7 +1002,20 @@ WinMain(__in HINSTANCE hInstance, __in_opt HINSTANCE hPrevInstance, __in_opt LPS
 		//	glDrawElements(GL_TRIANGLES, renderer.vaos[0].numIndices, GL_UNSIGNED_SHORT, nullptr);
 		//}
 
-		Win32::s_Profiler.DrawProfilerToImGUI(numThreads);
+		Win32::s_Profiler.DrawProfilerToImGUI(numThreads + 1); // els workers i el thread principal
+
+		if (ImGui::Begin("Memory"))
+		{
+			ImGui::Text("Frame arena: %.2f MB used, %.2f MB peak, %.2f MB capacity",
+				frameArena.GetLastFrameUsedBytes() / (1024.0 * 1024.0),
+				frameArena.GetPeakUsedBytes() / (1024.0 * 1024.0),
+				frameArena.GetCapacity() / (1024.0 * 1024.0));
+			ImGui::Text("operator new calls during physics: %llu", (unsigned long long)Game::GetPhysicsHeapAllocations(gameData));
+		}
+		ImGui::End();
+
+		Utilities::DrawAllocatorTelemetryToImGUI(blockAllocator, numThreads);
+		Utilities::DrawSchedulerTelemetryToImGUI(Win32::s_JobScheduler, &schedulerReport);
 
 		// RENDER IMGUI
 		ImGui::SetNextWindowPos(ImVec2(inputData.windowHalfSize.x, inputData.windowHalfSize.y), ImGuiSetCond_FirstUseEver);
@@ -907,5 +1030,7 @@ WinMain(__in HINSTANCE hInstance, __in_opt HINSTANCE hPrevInstance, __in_opt LPS
 
 	Game::FinalizeGameData(gameData);
 
+	Utilities::DumpAllocatorTelemetry(blockAllocator, frameArena, numThreads, "allocator_telemetry.txt");
+
 	return 0;
 }
\ No newline at end of file
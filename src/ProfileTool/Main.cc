@@ -0,0 +1,160 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "Profiler.hh"
+#include "ProfilerStream.hh"
+
+using namespace Utilities;
+
+// calls "onRecord" for every record in file order, with the frame header when it is a frame, until it returns false
+static bool ForEachRecord(ProfilerStream::Reader& reader, const std::function<bool(const ProfilerStream::RecordHeader&, const std::vector<uint8_t>&, const ProfilerStream::FrameHeader*)>& onRecord)
+{
+	ProfilerStream::RecordHeader record;
+	std::vector<uint8_t> data;
+	while (reader.Next(record, data))
+	{
+		ProfilerStream::FrameHeader frame;
+		bool isFrame = record.type == ProfilerStream::RecordType::Frame && record.bytes >= sizeof(frame);
+		if (isFrame)
+			memcpy(&frame, data.data(), sizeof(frame));
+		if (!onRecord(record, data, isFrame ? &frame : nullptr))
+			return false;
+	}
+	return true;
+}
+
+// frames, markers and the slowest frames: the time between a frame and the previous one, which is the frame time of the game
+// because the profiler is drained once per frame
+static int Info(const char* path, int worst)
+{
+	ProfilerStream::Reader reader;
+	if (!reader.Open(path))
+	{
+		fprintf(stderr, "%s is not a profiler capture\n", path);
+		return 1;
+	}
+	const double msPerTick = 1000.0 / reader.GetHeader().ticksPerSecond;
+
+	typedef std::pair<uint64_t, uint64_t> FrameTime; // ticks, frame
+	std::priority_queue<FrameTime, std::vector<FrameTime>, std::greater<FrameTime>> slowest;
+	uint64_t frames = 0, markers = 0, zones = 0, bytes = sizeof(ProfilerStream::FileHeader);
+	uint64_t firstFrame = 0, lastFrame = 0, firstTicks = 0, previousTicks = 0;
+	uint32_t droppedMarkers = 0;
+	ForEachRecord(reader, [&](const ProfilerStream::RecordHeader& record, const std::vector<uint8_t>& data, const ProfilerStream::FrameHeader* frame)
+	{
+		bytes += sizeof(record) + record.bytes;
+		if (record.type == ProfilerStream::RecordType::Zone)
+		{
+			++zones;
+		}
+		else if (frame != nullptr)
+		{
+			markers += (record.bytes - sizeof(*frame) - frame->numThreads * sizeof(uint32_t)) / ProfilerStream::MarkerSize;
+			droppedMarkers = frame->droppedMarkers;
+			if (frames == 0)
+			{
+				firstFrame = frame->frame;
+				firstTicks = frame->ticks;
+			}
+			else
+			{
+				slowest.push(FrameTime(frame->ticks - previousTicks, frame->frame));
+				if ((int)slowest.size() > worst)
+					slowest.pop();
+			}
+			lastFrame = frame->frame;
+			previousTicks = frame->ticks;
+			++frames;
+		}
+		return true;
+	});
+
+	printf("%s: %.1f MB\n", path, bytes / (1024.0 * 1024.0));
+	printf("frames %llu..%llu (%llu), %.1f s\n", (unsigned long long)firstFrame, (unsigned long long)lastFrame, (unsigned long long)frames, (previousTicks - firstTicks) * msPerTick / 1000.0);
+	printf("markers %llu, zones %llu, markers lost in full buffers %u\n", (unsigned long long)markers, (unsigned long long)zones, droppedMarkers);
+
+	std::vector<FrameTime> sorted;
+	for (; !slowest.empty(); slowest.pop())
+		sorted.push_back(slowest.top());
+	printf("slowest frames:\n");
+	for (auto frame = sorted.rbegin(); frame != sorted.rend(); ++frame)
+		printf("  frame %llu: %.3f ms\n", (unsigned long long)frame->second, frame->first * msPerTick);
+	return 0;
+}
+
+// keeps the frames [first, last] and every zone record, so the slice reads on its own
+static int Slice(const char* inPath, const char* outPath, uint64_t first, uint64_t last)
+{
+	ProfilerStream::Reader reader;
+	if (!reader.Open(inPath))
+	{
+		fprintf(stderr, "%s is not a profiler capture\n", inPath);
+		return 1;
+	}
+	FILE* out = nullptr;
+	if (fopen_s(&out, outPath, "wb") != 0 || out == nullptr)
+	{
+		fprintf(stderr, "can't write %s\n", outPath);
+		return 1;
+	}
+
+	fwrite(&reader.GetHeader(), sizeof(ProfilerStream::FileHeader), 1, out);
+	uint64_t frames = 0;
+	ForEachRecord(reader, [&](const ProfilerStream::RecordHeader& record, const std::vector<uint8_t>& data, const ProfilerStream::FrameHeader* frame)
+	{
+		if (frame != nullptr && frame->frame > last)
+			return false;
+		if (frame == nullptr || frame->frame >= first)
+		{
+			fwrite(&record, sizeof(record), 1, out);
+			fwrite(data.data(), 1, data.size(), out);
+			if (frame != nullptr)
+				++frames;
+		}
+		return true;
+	});
+	bool written = ferror(out) == 0;
+	fclose(out);
+
+	printf("%llu frames written to %s\n", (unsigned long long)frames, outPath);
+	return written ? 0 : 1;
+}
+
+// usage:
+//   ProfileTool info <capture.pgprof> [worst]                   frames, markers, lost data and the "worst" slowest frames (10)
+//   ProfileTool slice <in.pgprof> <out.pgprof> <first> <last>   keeps the frames [first, last]
+//   ProfileTool convert <in.pgprof> <out.json> [first last]     Chrome trace-event JSON, for chrome://tracing or https://ui.perfetto.dev
+// the frame numbers are the ones "info" prints. A capture from a process that crashed reads up to its last complete frame.
+int main(int argc, char** argv)
+{
+	if (argc >= 3 && strcmp(argv[1], "info") == 0)
+	{
+		return Info(argv[2], argc >= 4 ? atoi(argv[3]) : 10);
+	}
+	if (argc == 6 && strcmp(argv[1], "slice") == 0)
+	{
+		return Slice(argv[2], argv[3], strtoull(argv[4], nullptr, 10), strtoull(argv[5], nullptr, 10));
+	}
+	if ((argc == 4 || argc == 6) && strcmp(argv[1], "convert") == 0)
+	{
+		uint64_t first = (argc == 6) ? strtoull(argv[4], nullptr, 10) : 0;
+		uint64_t last = (argc == 6) ? strtoull(argv[5], nullptr, 10) : UINT64_MAX;
+		if (!Profiler::ConvertStreamToTrace(argv[2], argv[3], first, last))
+		{
+			fprintf(stderr, "can't convert %s to %s\n", argv[2], argv[3]);
+			return 1;
+		}
+		return 0;
+	}
+
+	fprintf(stderr,
+		"usage:\n"
+		"  ProfileTool info <capture.pgprof> [worst]\n"
+		"  ProfileTool slice <in.pgprof> <out.pgprof> <first> <last>\n"
+		"  ProfileTool convert <in.pgprof> <out.json> [first last]\n");
+	return 1;
+}